@@ -105,19 +105,32 @@ function(rdma_library DEST VERSION_SCRIPT SOVERSION VERSION)
   install(TARGETS ${DEST} DESTINATION "${CMAKE_INSTALL_LIBDIR}")
 endfunction()
 
+# Write the installed and uninstalled libibverbs.d files for a provider. Unless
+# cross compiling, the files are written once the provider has been linked and
+# list its match table, so that libibverbs only loads it for devices that it
+# supports.
+function(rdma_driver_file DEST TARGET)
+  file(MAKE_DIRECTORY "${BUILD_ETC}/libibverbs.d/")
+  if (CMAKE_CROSSCOMPILING)
+    file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n")
+    file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n")
+  else()
+    add_custom_command(TARGET ${TARGET} POST_BUILD
+      COMMAND ibv_gen_driver_file "$<TARGET_FILE:${TARGET}>" "${DEST}"
+        "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver"
+      COMMAND ibv_gen_driver_file "$<TARGET_FILE:${TARGET}>" "${BUILD_LIB}/lib${DEST}"
+        "${BUILD_ETC}/libibverbs.d/${DEST}.driver"
+      VERBATIM)
+    add_dependencies(${TARGET} ibv_gen_driver_file)
+  endif()
+  install(FILES "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" DESTINATION "${CONFIG_DIR}")
+endfunction()
+
 # Create a special provider with exported symbols in it The shared provider
 # exists as a normal system library with the normal shared library SONAME and
 # other convections. The system library is symlinked into the
 # VERBS_PROVIDER_DIR so it can be dlopened as a provider as well.
 function(rdma_shared_provider DEST VERSION_SCRIPT SOVERSION VERSION)
-  # Installed driver file
-  file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n")
-  install(FILES "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" DESTINATION "${CONFIG_DIR}")
-
-  # Uninstalled driver file
-  file(MAKE_DIRECTORY "${BUILD_ETC}/libibverbs.d/")
-  file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n")
-
   # Create a static provider library
   if (ENABLE_STATIC)
     add_library(${DEST}-static STATIC ${ARGN})
@@ -133,6 +146,7 @@ function(rdma_shared_provider DEST VERSION_SCRIPT SOVERSION VERSION)
   # Create the plugin shared library
   add_library(${DEST} SHARED ${ARGN})
   rdma_set_library_map(${DEST} ${VERSION_SCRIPT})
+  rdma_driver_file(${DEST} ${DEST})
 
   target_link_libraries(${DEST} LINK_PRIVATE ${COMMON_LIBS_PIC})
   target_link_libraries(${DEST} LINK_PRIVATE ibverbs)
@@ -159,14 +173,6 @@ endfunction()
 
 # Create a provider shared library for libibverbs
 function(rdma_provider DEST)
-  # Installed driver file
-  file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" "driver ${DEST}\n")
-  install(FILES "${CMAKE_CURRENT_BINARY_DIR}/${DEST}.driver" DESTINATION "${CONFIG_DIR}")
-
-  # Uninstalled driver file
-  file(MAKE_DIRECTORY "${BUILD_ETC}/libibverbs.d/")
-  file(WRITE "${BUILD_ETC}/libibverbs.d/${DEST}.driver" "driver ${BUILD_LIB}/lib${DEST}\n")
-
   # Create a static provider library
   # FIXME: This is probably pointless, the provider library has no symbols so
   # what good is it? Presumably it should be used with -Wl,--whole-archive,
@@ -182,8 +188,9 @@ function(rdma_provider DEST)
   endif()
 
   # Create the plugin shared library
+  add_library(${DEST}-rdmav${IBVERBS_PABI_VERSION} MODULE ${ARGN})
+  rdma_driver_file(${DEST} ${DEST}-rdmav${IBVERBS_PABI_VERSION})
   set(DEST "${DEST}-rdmav${IBVERBS_PABI_VERSION}")
-  add_library(${DEST} MODULE ${ARGN})
   # Even though these are modules we still want to use Wl,--no-undefined
   set_target_properties(${DEST} PROPERTIES LINK_FLAGS ${CMAKE_SHARED_LINKER_FLAGS})
   rdma_set_library_map(${DEST} ${BUILDLIB}/provider.map)
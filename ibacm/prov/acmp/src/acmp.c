@@ -68,6 +68,7 @@
 
 #define MAX_EP_ADDR 4
 #define MAX_EP_MC   2
+#define MAX_CQ_EVENTS 16
 
 enum acmp_state {
 	ACMP_INIT,
@@ -1297,10 +1298,11 @@ static void acmp_process_comp(struct acmp_ep *ep, struct ibv_wc *wc)
 static void *acmp_comp_handler(void *context)
 {
 	struct acmp_device *dev = (struct acmp_device *) context;
+	struct ibv_cq_event events[MAX_CQ_EVENTS];
 	struct acmp_ep *ep;
 	struct ibv_cq *cq;
 	struct ibv_wc wc;
-	int cnt;
+	int i, n;
 
 	acm_log(1, "started\n");
 
@@ -1317,21 +1319,22 @@ static void *acmp_comp_handler(void *context)
 	}
 	while (1) {
 		pthread_testcancel();
-		ibv_get_cq_event(dev->channel, &cq, (void *) &ep);
+		n = ibv_get_cq_events(dev->channel, events, MAX_CQ_EVENTS);
 
-		cnt = 0;
-		while (ibv_poll_cq(cq, 1, &wc) > 0) {
-			cnt++;
-			acmp_process_comp(ep, &wc);
-		}
+		/* The channel is shared by the CQs of all endpoints */
+		for (i = 0; i < n; i++) {
+			cq = events[i].cq;
+			ep = events[i].cq_context;
 
-		ibv_req_notify_cq(cq, 0);
-		while (ibv_poll_cq(cq, 1, &wc) > 0) {
-			cnt++;
-			acmp_process_comp(ep, &wc);
-		}
+			while (ibv_poll_cq(cq, 1, &wc) > 0)
+				acmp_process_comp(ep, &wc);
 
-		ibv_ack_cq_events(cq, cnt);
+			ibv_req_notify_cq(cq, 0);
+			while (ibv_poll_cq(cq, 1, &wc) > 0)
+				acmp_process_comp(ep, &wc);
+
+			ibv_ack_cq_events(cq, 1);
+		}
 	}
 
 	return NULL;
@@ -1032,7 +1032,9 @@ int ibv_cmd_create_qp_ex(struct ibv_context *context,
 
 	IBV_INIT_CMD_RESP(cmd, cmd_size, CREATE_QP, resp, resp_size);
 
-	if (attr_ex->comp_mask > (IBV_QP_INIT_ATTR_XRCD | IBV_QP_INIT_ATTR_PD))
+	/* The send ops are implemented by the provider alone */
+	if (attr_ex->comp_mask & ~(IBV_QP_INIT_ATTR_XRCD | IBV_QP_INIT_ATTR_PD |
+				   IBV_QP_INIT_ATTR_SEND_OPS_FLAGS))
 		return ENOSYS;
 
 	err = create_qp_ex_common(qp, attr_ex, vxrcd,
@@ -1399,6 +1401,43 @@ int ibv_cmd_modify_qp_ex(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 	return 0;
 }
 
+/* Copies all of wr but its SGEs to the kernel layout */
+static void copy_send_wr(struct ibv_qp *ibqp, struct ibv_kern_send_wr *tmp,
+			 struct ibv_send_wr *i)
+{
+	tmp->wr_id 	= i->wr_id;
+	tmp->num_sge 	= i->num_sge;
+	tmp->opcode 	= i->opcode;
+	tmp->send_flags = i->send_flags;
+	tmp->imm_data 	= i->imm_data;
+	if (ibqp->qp_type == IBV_QPT_UD) {
+		tmp->wr.ud.ah 	       = i->wr.ud.ah->handle;
+		tmp->wr.ud.remote_qpn  = i->wr.ud.remote_qpn;
+		tmp->wr.ud.remote_qkey = i->wr.ud.remote_qkey;
+	} else {
+		switch (i->opcode) {
+		case IBV_WR_RDMA_WRITE:
+		case IBV_WR_RDMA_WRITE_WITH_IMM:
+		case IBV_WR_RDMA_READ:
+			tmp->wr.rdma.remote_addr =
+				i->wr.rdma.remote_addr;
+			tmp->wr.rdma.rkey = i->wr.rdma.rkey;
+			break;
+		case IBV_WR_ATOMIC_CMP_AND_SWP:
+		case IBV_WR_ATOMIC_FETCH_AND_ADD:
+			tmp->wr.atomic.remote_addr =
+				i->wr.atomic.remote_addr;
+			tmp->wr.atomic.compare_add =
+				i->wr.atomic.compare_add;
+			tmp->wr.atomic.swap = i->wr.atomic.swap;
+			tmp->wr.atomic.rkey = i->wr.atomic.rkey;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 int ibv_cmd_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		      struct ibv_send_wr **bad_wr)
 {
@@ -1431,37 +1470,7 @@ int ibv_cmd_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 
 	tmp = n;
 	for (i = wr; i; i = i->next) {
-		tmp->wr_id 	= i->wr_id;
-		tmp->num_sge 	= i->num_sge;
-		tmp->opcode 	= i->opcode;
-		tmp->send_flags = i->send_flags;
-		tmp->imm_data 	= i->imm_data;
-		if (ibqp->qp_type == IBV_QPT_UD) {
-			tmp->wr.ud.ah 	       = i->wr.ud.ah->handle;
-			tmp->wr.ud.remote_qpn  = i->wr.ud.remote_qpn;
-			tmp->wr.ud.remote_qkey = i->wr.ud.remote_qkey;
-		} else {
-			switch (i->opcode) {
-			case IBV_WR_RDMA_WRITE:
-			case IBV_WR_RDMA_WRITE_WITH_IMM:
-			case IBV_WR_RDMA_READ:
-				tmp->wr.rdma.remote_addr =
-					i->wr.rdma.remote_addr;
-				tmp->wr.rdma.rkey = i->wr.rdma.rkey;
-				break;
-			case IBV_WR_ATOMIC_CMP_AND_SWP:
-			case IBV_WR_ATOMIC_FETCH_AND_ADD:
-				tmp->wr.atomic.remote_addr =
-					i->wr.atomic.remote_addr;
-				tmp->wr.atomic.compare_add =
-					i->wr.atomic.compare_add;
-				tmp->wr.atomic.swap = i->wr.atomic.swap;
-				tmp->wr.atomic.rkey = i->wr.atomic.rkey;
-				break;
-			default:
-				break;
-			}
-		}
+		copy_send_wr(ibqp, tmp, i);
 
 		if (tmp->num_sge) {
 			memcpy(s, i->sg_list, tmp->num_sge * sizeof *s);
@@ -1489,6 +1498,119 @@ int ibv_cmd_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	return ret;
 }
 
+int ibv_cmd_init_send_batch(struct ibv_cmd_send_batch *batch,
+			    struct ibv_qp *qp, unsigned int max_wr,
+			    unsigned int max_sge)
+{
+	batch->cmd = malloc(sizeof *batch->cmd + max_wr * sizeof *batch->wr +
+			    max_sge * sizeof *batch->sge);
+	if (!batch->cmd)
+		return ENOMEM;
+
+	batch->qp	 = qp;
+	batch->wr	 = (struct ibv_kern_send_wr *) (batch->cmd + 1);
+	batch->sge	 = (struct ibv_sge *) (batch->wr + max_wr);
+	batch->max_wr	 = max_wr;
+	batch->max_sge	 = max_sge;
+	batch->wr_count	 = 0;
+	batch->sge_count = 0;
+	batch->posted	 = 0;
+	return 0;
+}
+
+void ibv_cmd_free_send_batch(struct ibv_cmd_send_batch *batch)
+{
+	free(batch->cmd);
+}
+
+/*
+ * Adds the WRs to the batch, flushing it first if they do not fit.  A list
+ * that is larger than the batch is posted on its own.  If the flush fails,
+ * *bad_wr is wr and batch->posted tells what became of the earlier WRs.
+ */
+int ibv_cmd_post_send_batch(struct ibv_cmd_send_batch *batch,
+			    struct ibv_send_wr *wr,
+			    struct ibv_send_wr **bad_wr)
+{
+	struct ibv_send_wr *i;
+	unsigned wr_count = 0;
+	unsigned sge_count = 0;
+	int ret;
+
+	for (i = wr; i; i = i->next) {
+		wr_count++;
+		sge_count += i->num_sge;
+	}
+
+	if (batch->wr_count + wr_count > batch->max_wr ||
+	    batch->sge_count + sge_count > batch->max_sge) {
+		ret = ibv_cmd_flush_send_batch(batch);
+		if (ret) {
+			*bad_wr = wr;
+			return ret;
+		}
+		if (wr_count > batch->max_wr || sge_count > batch->max_sge)
+			return ibv_cmd_post_send(batch->qp, wr, bad_wr);
+	}
+
+	for (i = wr; i; i = i->next) {
+		copy_send_wr(batch->qp, &batch->wr[batch->wr_count++], i);
+		if (i->num_sge) {
+			memcpy(&batch->sge[batch->sge_count], i->sg_list,
+			       i->num_sge * sizeof *batch->sge);
+			batch->sge_count += i->num_sge;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the WRs gathered so far as one command.  On failure the WRs from
+ * the one at batch->posted on were not posted, and are dropped.
+ */
+int ibv_cmd_flush_send_batch(struct ibv_cmd_send_batch *batch)
+{
+	struct ibv_post_send     *cmd = batch->cmd;
+	struct ibv_post_send_resp resp;
+	struct ibv_sge           *s;
+	int                       cmd_size;
+	int                       ret = 0;
+
+	batch->posted = 0;
+	if (!batch->wr_count)
+		return 0;
+
+	/* The SGEs follow the last WR in the command */
+	s = (struct ibv_sge *) (batch->wr + batch->wr_count);
+	if (s != batch->sge)
+		memmove(s, batch->sge, batch->sge_count * sizeof *s);
+
+	cmd_size = sizeof *cmd + batch->wr_count * sizeof *batch->wr +
+		   batch->sge_count * sizeof *s;
+
+	IBV_INIT_CMD_RESP(cmd, cmd_size, POST_SEND, &resp, sizeof resp);
+	cmd->qp_handle = batch->qp->handle;
+	cmd->wr_count  = batch->wr_count;
+	cmd->sge_count = batch->sge_count;
+	cmd->wqe_size  = sizeof *batch->wr;
+
+	resp.bad_wr = 0;
+	if (write(batch->qp->context->cmd_fd, cmd, cmd_size) != cmd_size)
+		ret = errno;
+
+	(void) VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
+
+	if (resp.bad_wr)
+		batch->posted = resp.bad_wr - 1;
+	else if (!ret)
+		batch->posted = batch->wr_count;
+
+	batch->wr_count	 = 0;
+	batch->sge_count = 0;
+	return ret;
+}
+
 int ibv_cmd_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 		      struct ibv_recv_wr **bad_wr)
 {
@@ -179,18 +179,13 @@ __lib_ibv_create_cq_ex(struct ibv_context *context,
 	return cq;
 }
 
-LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
-		   struct ibv_context *,
-		   struct ibv_device *device)
+static int open_cmd_fd(struct ibv_device *device)
 {
-	struct verbs_device *verbs_device = verbs_get_device(device);
 	char *devpath;
-	int cmd_fd, ret;
-	struct ibv_context *context;
-	struct verbs_context *context_ex;
+	int cmd_fd;
 
 	if (asprintf(&devpath, "/dev/infiniband/%s", device->dev_name) < 0)
-		return NULL;
+		return -1;
 
 	/*
 	 * We'll only be doing writes, but we need O_RDWR in case the
@@ -199,8 +194,25 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 	cmd_fd = open(devpath, O_RDWR | O_CLOEXEC);
 	free(devpath);
 
-	if (cmd_fd < 0)
-		return NULL;
+	return cmd_fd;
+}
+
+LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
+		   struct ibv_context *,
+		   struct ibv_device *device)
+{
+	struct verbs_device *verbs_device = verbs_get_device(device);
+	int cmd_fd, ret;
+	struct ibv_context *context;
+	struct verbs_context *context_ex;
+
+	if (verbs_device->ops->no_cmd_fd)
+		cmd_fd = -1;
+	else {
+		cmd_fd = open_cmd_fd(device);
+		if (cmd_fd < 0)
+			return NULL;
+	}
 
 	if (!verbs_device->ops->init_context) {
 		context = verbs_device->ops->alloc_context(device, cmd_fd);
@@ -224,6 +236,7 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 			goto err;
 		}
 
+		ibverbs_init_cache(priv);
 		context_ex->priv = priv;
 		context_ex->context.abi_compat  = __VERBS_ABI_IS_EXTENDED;
 		context_ex->sz = sizeof(*context_ex);
@@ -262,10 +275,12 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 	return context;
 
 verbs_err:
+	ibverbs_free_cache(context_ex->priv);
 	free(context_ex->priv);
 	free(context_ex);
 err:
-	close(cmd_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	return NULL;
 }
 
@@ -283,6 +298,7 @@ LATEST_SYMVER_FUNC(ibv_close_device, 1_1, "IBVERBS_1.1",
 	context_ex = verbs_get_ctx(context);
 	if (context_ex) {
 		verbs_device->ops->uninit_context(verbs_device, context);
+		ibverbs_free_cache(context_ex->priv);
 		free(context_ex->priv);
 		free(context_ex);
 	} else {
@@ -290,7 +306,8 @@ LATEST_SYMVER_FUNC(ibv_close_device, 1_1, "IBVERBS_1.1",
 	}
 
 	close(async_fd);
-	close(cmd_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	if (abi_ver <= 2)
 		close(cq_fd);
 	ibverbs_device_put(device);
@@ -304,6 +321,14 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 		   struct ibv_async_event *event)
 {
 	struct ibv_kern_async_event ev;
+	struct verbs_context *vctx = verbs_get_ctx(context);
+
+	/*
+	 * Once the application is handling async events, cached GID and
+	 * P_Key tables are kept current by the events below.
+	 */
+	if (vctx)
+		atomic_store(&vctx->priv->cache_trusted, true);
 
 	if (read(context->async_fd, &ev, sizeof ev) != sizeof ev)
 		return -1;
@@ -339,6 +364,16 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 		break;
 	}
 
+	switch (event->event_type) {
+	case IBV_EVENT_GID_CHANGE:
+	case IBV_EVENT_PKEY_CHANGE:
+	case IBV_EVENT_PORT_ACTIVE:
+		ibverbs_invalidate_cache(context, event->element.port_num);
+		break;
+	default:
+		break;
+	}
+
 	if (context->ops.async_event)
 		context->ops.async_event(event);
 
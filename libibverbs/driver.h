@@ -82,7 +82,8 @@ struct verbs_srq {
 
 enum verbs_qp_mask {
 	VERBS_QP_XRCD		= 1 << 0,
-	VERBS_QP_RESERVED	= 1 << 1
+	VERBS_QP_EX		= 1 << 1,
+	VERBS_QP_RESERVED	= 1 << 2
 };
 
 enum ibv_gid_type {
@@ -91,7 +92,10 @@ enum ibv_gid_type {
 };
 
 struct verbs_qp {
-	struct ibv_qp		qp;
+	union {
+		struct ibv_qp		qp;
+		struct ibv_qp_ex	qp_ex;
+	};
 	uint32_t		comp_mask;
 	struct verbs_xrcd       *xrcd;
 };
@@ -148,6 +152,9 @@ struct verbs_sysfs_dev {
 	char modalias[512];
 	int abi_ver;
 	struct timespec time_created;
+	/* Decoded from a PCI modalias, pci_vendor is UINT32_MAX otherwise */
+	uint32_t pci_vendor;
+	uint32_t pci_device;
 };
 
 /* Must change the PRIVATE IBVERBS_PRIVATE_ symbol if this is changed */
@@ -173,6 +180,11 @@ struct verbs_device_ops {
 
 	struct verbs_device *(*alloc_device)(struct verbs_sysfs_dev *sysfs_dev);
 	void (*uninit_device)(struct verbs_device *device);
+
+	/* The device is implemented entirely in userspace and has no uverbs
+	 * character device, contexts are opened with a cmd_fd of -1.
+	 */
+	bool no_cmd_fd;
 };
 
 /* Must change the PRIVATE IBVERBS_PRIVATE_ symbol if this is changed */
@@ -345,6 +357,35 @@ int ibv_cmd_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		      struct ibv_send_wr **bad_wr);
 int ibv_cmd_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 		      struct ibv_recv_wr **bad_wr);
+
+/*
+ * Gathers the send WRs of several ibv_cmd_post_send_batch() calls on one QP
+ * into a single POST_SEND command, which ibv_cmd_flush_send_batch() writes
+ * to the kernel.  A provider that has an explicit doorbell, such as
+ * ibv_wr_complete(), flushes there; ibv_post_send() itself must flush before
+ * it returns.  The caller serializes the calls on a batch.
+ */
+struct ibv_cmd_send_batch {
+	struct ibv_qp		*qp;
+	struct ibv_post_send	*cmd;
+	struct ibv_kern_send_wr	*wr;	/* max_wr entries after cmd */
+	struct ibv_sge		*sge;	/* max_sge entries after wr */
+	unsigned int		max_wr;
+	unsigned int		max_sge;
+	unsigned int		wr_count;
+	unsigned int		sge_count;
+	/* WRs of the last flush that were posted, all of them on success */
+	unsigned int		posted;
+};
+
+int ibv_cmd_init_send_batch(struct ibv_cmd_send_batch *batch,
+			    struct ibv_qp *qp, unsigned int max_wr,
+			    unsigned int max_sge);
+void ibv_cmd_free_send_batch(struct ibv_cmd_send_batch *batch);
+int ibv_cmd_post_send_batch(struct ibv_cmd_send_batch *batch,
+			    struct ibv_send_wr *wr,
+			    struct ibv_send_wr **bad_wr);
+int ibv_cmd_flush_send_batch(struct ibv_cmd_send_batch *batch);
 int ibv_cmd_post_srq_recv(struct ibv_srq *srq, struct ibv_recv_wr *wr,
 			  struct ibv_recv_wr **bad_wr);
 int ibv_cmd_create_ah(struct ibv_pd *pd, struct ibv_ah *ah,
@@ -30,18 +30,248 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <config.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <link.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <endian.h>
 
 #include <infiniband/verbs.h>
 
+/* A ConnectX-4 virtual function, as found on hosts with many SR-IOV VFs */
+#define BENCH_MODALIAS "pci:v000015B3d00001014sv000015B3sd00000000bc02sc00i00"
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s             list RDMA devices\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -b, --bench=<num>      time device discovery against a synthetic sysfs\n"
+	       "                         tree holding <num> devices\n");
+	printf("  -m, --modalias=<str>   modalias of the synthetic devices\n"
+	       "                         (default " BENCH_MODALIAS ")\n");
+	printf("  -n, --iters=<iters>    number of rescans to time (default 100)\n");
+}
+
+static __attribute__((format(printf, 1, 2)))
+int make_dir(const char *fmt, ...)
+{
+	char *path;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&path, fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		return -1;
+
+	ret = mkdir(path, 0755);
+	if (ret)
+		perror(path);
+	free(path);
+	return ret;
+}
+
+static __attribute__((format(printf, 2, 3)))
+int write_file(const char *value, const char *fmt, ...)
+{
+	char *path;
+	va_list ap;
+	FILE *f;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&path, fmt, ap);
+	va_end(ap);
+	if (ret < 0)
+		return -1;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+	fprintf(f, "%s\n", value);
+	free(path);
+	return fclose(f);
+}
+
+/* Lay out the sysfs files that libibverbs reads for num devices */
+static int build_sysfs(const char *root, int num, const char *modalias)
+{
+	char name[32], guid[32];
+	int i;
+
+	if (make_dir("%s/class", root) ||
+	    make_dir("%s/class/infiniband", root) ||
+	    make_dir("%s/class/infiniband_verbs", root) ||
+	    write_file("6", "%s/class/infiniband_verbs/abi_version", root))
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		snprintf(name, sizeof(name), "bench_%d", i);
+		snprintf(guid, sizeof(guid), "0000:0000:0000:%04x", i);
+
+		if (make_dir("%s/class/infiniband_verbs/uverbs%d", root, i) ||
+		    make_dir("%s/class/infiniband_verbs/uverbs%d/device",
+			     root, i) ||
+		    write_file(name, "%s/class/infiniband_verbs/uverbs%d/ibdev",
+			       root, i) ||
+		    write_file("1", "%s/class/infiniband_verbs/uverbs%d/abi_version",
+			       root, i) ||
+		    write_file(modalias,
+			       "%s/class/infiniband_verbs/uverbs%d/device/modalias",
+			       root, i) ||
+		    make_dir("%s/class/infiniband/%s", root, name) ||
+		    write_file("1", "%s/class/infiniband/%s/node_type", root,
+			       name) ||
+		    write_file(guid, "%s/class/infiniband/%s/node_guid", root,
+			       name))
+			return -1;
+	}
+	return 0;
+}
+
+static int remove_file(const char *path, const struct stat *sb, int flag,
+		       struct FTW *ftwbuf)
+{
+	return remove(path);
+}
+
+static int count_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(*(int *)data)++;
+	return 0;
+}
+
+static int count_objects(void)
+{
+	int num = 0;
+
+	dl_iterate_phdr(count_object, &num);
+	return num;
+}
+
+static double elapsed_usec(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+	       (end->tv_usec - start->tv_usec);
+}
+
+static int run_bench(int num, const char *modalias, int iters)
+{
+	char root[] = "/tmp/ibv_devices.XXXXXX";
+	struct ibv_device **dev_list;
+	struct timeval start, end;
+	int num_devices, objects, i;
+	int ret = 1;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	if (build_sysfs(root, num, modalias))
+		goto out;
+
+	setenv("SYSFS_PATH", root, 1);
+	objects = count_objects();
+
+	gettimeofday(&start, NULL);
+	dev_list = ibv_get_device_list(&num_devices);
+	gettimeofday(&end, NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		goto out;
+	}
+	ibv_free_device_list(dev_list);
+
+	printf("%d of %d devices found in %.1f usec, %d shared objects loaded\n",
+	       num_devices, num, elapsed_usec(&start, &end),
+	       count_objects() - objects);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iters; i++) {
+		dev_list = ibv_get_device_list(NULL);
+		if (!dev_list) {
+			perror("Failed to get IB devices list");
+			goto out;
+		}
+		ibv_free_device_list(dev_list);
+	}
+	gettimeofday(&end, NULL);
+
+	if (iters)
+		printf("%d rescans in %.1f usec, %.1f usec/rescan\n", iters,
+		       elapsed_usec(&start, &end),
+		       elapsed_usec(&start, &end) / iters);
+	ret = 0;
+out:
+	nftw(root, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct ibv_device **dev_list;
+	const char *modalias = BENCH_MODALIAS;
 	int num_devices, i;
+	int bench = 0;
+	int iters = 100;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{ .name = "bench",    .has_arg = 1, .val = 'b' },
+			{ .name = "modalias", .has_arg = 1, .val = 'm' },
+			{ .name = "iters",    .has_arg = 1, .val = 'n' },
+			{ }
+		};
+
+		c = getopt_long(argc, argv, "b:m:n:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			bench = strtol(optarg, NULL, 0);
+			if (bench <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'm':
+			modalias = optarg;
+			break;
+
+		case 'n':
+			iters = strtol(optarg, NULL, 0);
+			if (iters < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (bench)
+		return run_bench(bench, modalias, iters);
 
 	dev_list = ibv_get_device_list(&num_devices);
 	if (!dev_list) {
@@ -0,0 +1,300 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <util/compiler.h>
+#include <infiniband/verbs.h>
+
+struct bench_thread {
+	pthread_t		thread;
+	struct ibv_pd		*pd;
+	char			*buf;
+	struct ibv_mr		**mr;
+	unsigned int		seed;
+	int			err;
+};
+
+static unsigned int iters = 10000;
+static unsigned int regions = 1;
+static unsigned int pool;
+static size_t size = 65536;
+static struct ibv_mr_cache *cache;
+static pthread_barrier_t barrier;
+
+/*
+ * With a pool larger than the regions of an iteration, buffers are picked
+ * at random, nine times out of ten from the first tenth of the pool, the
+ * way a few hot buffers are reused by most transfers.
+ */
+static char *pick_buf(struct bench_thread *t, unsigned int j)
+{
+	unsigned int hot = pool / 10 ? pool / 10 : 1;
+	unsigned int r;
+
+	if (pool == regions)
+		return t->buf + j * size;
+
+	r = rand_r(&t->seed);
+	if (r % 10)
+		return t->buf + (rand_r(&t->seed) % hot) * size;
+	return t->buf + (rand_r(&t->seed) % pool) * size;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	unsigned int i, j;
+	char *buf;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < iters; i++) {
+		for (j = 0; j < regions; j++) {
+			buf = pick_buf(t, j);
+			if (cache)
+				t->mr[j] = ibv_mr_cache_get(cache, buf, size);
+			else
+				t->mr[j] = ibv_reg_mr(t->pd, buf, size,
+						      IBV_ACCESS_LOCAL_WRITE);
+			if (!t->mr[j]) {
+				perror("Couldn't register MR");
+				t->err = 1;
+				return NULL;
+			}
+		}
+
+		for (j = 0; j < regions; j++) {
+			if (cache) {
+				ibv_mr_cache_put(cache, t->mr[j]);
+			} else if (ibv_dereg_mr(t->mr[j])) {
+				perror("Couldn't deregister MR");
+				t->err = 1;
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            register and deregister memory from many threads\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -t, --threads=<num>    number of threads (default 1)\n");
+	printf("  -s, --size=<size>      size of each region (default 65536)\n");
+	printf("  -r, --regions=<num>    adjacent regions registered per iteration (default 1)\n");
+	printf("  -p, --pool=<num>       pick the regions at random from <num> buffers\n");
+	printf("  -c, --cache=<bytes>    get regions from an MR cache evicting above <bytes>\n");
+	printf("  -a, --auto-invalidate  let the MR cache watch for unmapped memory\n");
+	printf("  -n, --iters=<iters>    number of iterations (default 10000)\n");
+	printf("  -f, --fork-safe        call ibv_fork_init() first\n");
+	printf("  -h, --help             print a help text and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device **dev_list;
+	struct ibv_context *context;
+	struct ibv_pd *pd;
+	struct ibv_mr_cache_init_attr cache_attr = {};
+	int use_cache = 0;
+	struct bench_thread *threads;
+	struct timespec start, end;
+	char   *ib_devname = NULL;
+	unsigned int num_threads = 1;
+	int fork_safe = 0;
+	double usec;
+	int page_size;
+	int i = 0, ret;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{ .name = "ib-dev",    .has_arg = 1, .val = 'd' },
+			{ .name = "threads",   .has_arg = 1, .val = 't' },
+			{ .name = "size",      .has_arg = 1, .val = 's' },
+			{ .name = "regions",   .has_arg = 1, .val = 'r' },
+			{ .name = "pool",      .has_arg = 1, .val = 'p' },
+			{ .name = "cache",     .has_arg = 1, .val = 'c' },
+			{ .name = "auto-invalidate", .has_arg = 0, .val = 'a' },
+			{ .name = "iters",     .has_arg = 1, .val = 'n' },
+			{ .name = "fork-safe", .has_arg = 0, .val = 'f' },
+			{ .name = "help",      .has_arg = 0, .val = 'h' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "d:t:s:r:p:c:an:fh", long_options, NULL);
+		if (c == -1)
+			break;
+
+		ret = 1;
+		switch (c) {
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+		case 't':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			regions = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			pool = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cache_attr.max_bytes = strtoul(optarg, NULL, 0);
+			use_cache = 1;
+			break;
+		case 'a':
+			cache_attr.comp_mask |= IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS;
+			cache_attr.flags |= IBV_MR_CACHE_AUTO_INVALIDATE;
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fork_safe = 1;
+			break;
+		case 'h':
+			ret = 0;
+			SWITCH_FALLTHROUGH;
+		default:
+			usage(argv[0]);
+			return ret;
+		}
+	}
+
+	if (!pool)
+		pool = regions;
+
+	if (!num_threads || !regions || !size || pool < regions) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (fork_safe && ibv_fork_init()) {
+		fprintf(stderr, "Couldn't initialize fork support\n");
+		return 1;
+	}
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+	if (ib_devname) {
+		for (; dev_list[i]; ++i) {
+			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+				break;
+		}
+	}
+
+	if (!dev_list[i]) {
+		fprintf(stderr, "IB device %s not found\n",
+			ib_devname ? ib_devname : "");
+		return 1;
+	}
+
+	context = ibv_open_device(dev_list[i]);
+	if (!context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(dev_list[i]));
+		return 1;
+	}
+
+	pd = ibv_alloc_pd(context);
+	if (!pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		return 1;
+	}
+
+	if (use_cache) {
+		cache_attr.access = IBV_ACCESS_LOCAL_WRITE;
+		cache = ibv_mr_cache_create(pd, &cache_attr);
+		if (!cache) {
+			perror("Couldn't create MR cache");
+			return 1;
+		}
+	}
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		return 1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < num_threads; i++) {
+		threads[i].pd = pd;
+		threads[i].seed = i + 1;
+		threads[i].mr = calloc(regions, sizeof(*threads[i].mr));
+		if (!threads[i].mr ||
+		    posix_memalign((void **)&threads[i].buf, page_size,
+				   pool * size)) {
+			fprintf(stderr, "Couldn't allocate buffers\n");
+			return 1;
+		}
+		memset(threads[i].buf, 0, pool * size);
+	}
+
+	pthread_barrier_init(&barrier, NULL, num_threads + 1);
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, bench_thread,
+				   &threads[i])) {
+			fprintf(stderr, "Couldn't create thread\n");
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&barrier);
+
+	ret = 0;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ret |= threads[i].err;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (!ret) {
+		unsigned long long pairs =
+			(unsigned long long)num_threads * iters * regions;
+
+		usec = (end.tv_sec - start.tv_sec) * 1000000.0 +
+		       (end.tv_nsec - start.tv_nsec) / 1000.0;
+		printf("%u threads: %llu registrations of %zu bytes in %.2f seconds = %.0f/sec\n",
+		       num_threads, pairs, size, usec / 1000000, pairs * 1000000 / usec);
+		printf("%.2f usec/registration\n", usec / pairs);
+	}
+
+	if (cache)
+		ibv_mr_cache_destroy(cache);
+
+	for (i = 0; i < num_threads; i++) {
+		free(threads[i].buf);
+		free(threads[i].mr);
+	}
+	free(threads);
+
+	pthread_barrier_destroy(&barrier);
+	ibv_dealloc_pd(pd);
+	ibv_close_device(context);
+	ibv_free_device_list(dev_list);
+
+	return ret;
+}
@@ -45,6 +45,7 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "pingpong.h"
 
@@ -53,45 +54,86 @@
 enum {
 	PINGPONG_RECV_WRID = 1,
 	PINGPONG_SEND_WRID = 2,
+	/* the rest of a wr_id is the index of the QP in its thread */
+	PINGPONG_WRID_SHIFT = 2,
 };
 
 static int page_size;
 static int use_odp;
 static int use_ts;
+static int use_new_send;
+static int use_td;
+static int num_threads = 1;
+static int qps_per_thread = 1;
 
-struct pingpong_context {
-	struct ibv_context	*context;
+struct pingpong_dest {
+	int lid;
+	int qpn;
+	int psn;
+	union ibv_gid gid;
+};
+
+struct ts_params {
+	uint64_t		 comp_recv_max_time_delta;
+	uint64_t		 comp_recv_min_time_delta;
+	uint64_t		 comp_recv_total_time_delta;
+	uint64_t		 comp_recv_prev_time;
+	int			 last_comp_with_ts;
+	unsigned int		 comp_with_time_iters;
+};
+
+struct pingpong_qp {
+	struct ibv_qp		*qp;
+	struct ibv_qp_ex	*qpx;
+	void			*buf;
+	int			 index;
+	int			 send_flags;
+	int			 pending;
+	int			 routs;
+	unsigned int		 rcnt, scnt;
+};
+
+/* The CQ and QPs used by one thread, in a thread domain of their own */
+struct pingpong_thread {
+	struct pingpong_context *ctx;
+	pthread_t		 thread;
 	struct ibv_comp_channel *channel;
-	struct ibv_pd		*pd;
-	struct ibv_mr		*mr;
+	struct ibv_td		*td;
+	struct ibv_pd		*pad;	/* parent domain of pd and td */
 	union {
 		struct ibv_cq		*cq;
 		struct ibv_cq_ex	*cq_ex;
 	} cq_s;
-	struct ibv_qp		*qp;
+	struct pingpong_qp	*qps;
+	int			 done;
+	int			 num_cq_events;
+	struct ts_params	 ts;
+	int			 ret;
+};
+
+struct pingpong_context {
+	struct ibv_context	*context;
+	struct ibv_pd		*pd;
+	struct ibv_mr		*mr;
 	void			*buf;
 	int			 size;
-	int			 send_flags;
 	int			 rx_depth;
-	int			 pending;
+	unsigned int		 iters;
+	int			 use_event;
 	struct ibv_port_attr     portinfo;
 	uint64_t		 completion_timestamp_mask;
+	struct pingpong_thread	*threads;
+	struct pingpong_qp	*qps;
+	int			 num_qps;
 };
 
-static struct ibv_cq *pp_cq(struct pingpong_context *ctx)
+static struct ibv_cq *pp_cq(struct pingpong_thread *t)
 {
-	return use_ts ? ibv_cq_ex_to_cq(ctx->cq_s.cq_ex) :
-		ctx->cq_s.cq;
+	return use_ts || use_td ? ibv_cq_ex_to_cq(t->cq_s.cq_ex) :
+		t->cq_s.cq;
 }
 
-struct pingpong_dest {
-	int lid;
-	int qpn;
-	int psn;
-	union ibv_gid gid;
-};
-
-static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
+static int pp_connect_ctx(struct ibv_qp *qp, int port, int my_psn,
 			  enum ibv_mtu mtu, int sl,
 			  struct pingpong_dest *dest, int sgid_idx)
 {
@@ -117,7 +159,7 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 		attr.ah_attr.grh.dgid = dest->gid;
 		attr.ah_attr.grh.sgid_index = sgid_idx;
 	}
-	if (ibv_modify_qp(ctx->qp, &attr,
+	if (ibv_modify_qp(qp, &attr,
 			  IBV_QP_STATE              |
 			  IBV_QP_AV                 |
 			  IBV_QP_PATH_MTU           |
@@ -135,7 +177,7 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 	attr.rnr_retry	    = 7;
 	attr.sq_psn	    = my_psn;
 	attr.max_rd_atomic  = 1;
-	if (ibv_modify_qp(ctx->qp, &attr,
+	if (ibv_modify_qp(qp, &attr,
 			  IBV_QP_STATE              |
 			  IBV_QP_TIMEOUT            |
 			  IBV_QP_RETRY_CNT          |
@@ -149,8 +191,25 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 	return 0;
 }
 
+/* One address per QP is exchanged, so the messages may span TCP segments */
+static int pp_read_msg(int sockfd, char *msg, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = read(sockfd, msg + got, len - got);
+		if (n <= 0)
+			return 1;
+		got += n;
+	}
+
+	return 0;
+}
+
 static struct pingpong_dest *pp_client_exch_dest(const char *servername, int port,
-						 const struct pingpong_dest *my_dest)
+						 const struct pingpong_dest *my_dest,
+						 int num_dest)
 {
 	struct addrinfo *res, *t;
 	struct addrinfo hints = {
@@ -159,7 +218,7 @@ static struct pingpong_dest *pp_client_exch_dest(const char *servername, int por
 	};
 	char *service;
 	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
-	int n;
+	int n, i;
 	int sockfd = -1;
 	struct pingpong_dest *rem_dest = NULL;
 	char gid[33];
@@ -193,32 +252,46 @@ static struct pingpong_dest *pp_client_exch_dest(const char *servername, int por
 		return NULL;
 	}
 
-	gid_to_wire_gid(&my_dest->gid, gid);
-	sprintf(msg, "%04x:%06x:%06x:%s", my_dest->lid, my_dest->qpn,
-							my_dest->psn, gid);
-	if (write(sockfd, msg, sizeof msg) != sizeof msg) {
-		fprintf(stderr, "Couldn't send local address\n");
-		goto out;
-	}
-
-	if (read(sockfd, msg, sizeof msg) != sizeof msg ||
-	    write(sockfd, "done", sizeof "done") != sizeof "done") {
-		perror("client read/write");
-		fprintf(stderr, "Couldn't read/write remote address\n");
-		goto out;
+	for (i = 0; i < num_dest; ++i) {
+		gid_to_wire_gid(&my_dest[i].gid, gid);
+		sprintf(msg, "%04x:%06x:%06x:%s", my_dest[i].lid,
+			my_dest[i].qpn, my_dest[i].psn, gid);
+		if (write(sockfd, msg, sizeof msg) != sizeof msg) {
+			fprintf(stderr, "Couldn't send local address\n");
+			goto out;
+		}
 	}
 
-	rem_dest = malloc(sizeof *rem_dest);
+	rem_dest = calloc(num_dest, sizeof *rem_dest);
 	if (!rem_dest)
 		goto out;
 
-	sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn,
-						&rem_dest->psn, gid);
-	wire_gid_to_gid(gid, &rem_dest->gid);
+	for (i = 0; i < num_dest; ++i) {
+		if (pp_read_msg(sockfd, msg, sizeof msg)) {
+			perror("client read");
+			fprintf(stderr, "Couldn't read remote address\n");
+			goto err;
+		}
+
+		sscanf(msg, "%x:%x:%x:%s", &rem_dest[i].lid, &rem_dest[i].qpn,
+							&rem_dest[i].psn, gid);
+		wire_gid_to_gid(gid, &rem_dest[i].gid);
+	}
+
+	if (write(sockfd, "done", sizeof "done") != sizeof "done") {
+		perror("client write");
+		fprintf(stderr, "Couldn't read/write remote address\n");
+		goto err;
+	}
 
 out:
 	close(sockfd);
 	return rem_dest;
+
+err:
+	free(rem_dest);
+	rem_dest = NULL;
+	goto out;
 }
 
 static struct pingpong_dest *pp_server_exch_dest(struct pingpong_context *ctx,
@@ -235,7 +308,7 @@ static struct pingpong_dest *pp_server_exch_dest(struct pingpong_context *ctx,
 	};
 	char *service;
 	char msg[sizeof "0000:000000:000000:00000000000000000000000000000000"];
-	int n;
+	int n, i;
 	int sockfd = -1, connfd;
 	struct pingpong_dest *rem_dest = NULL;
 	char gid[33];
@@ -281,45 +354,242 @@ static struct pingpong_dest *pp_server_exch_dest(struct pingpong_context *ctx,
 		return NULL;
 	}
 
-	n = read(connfd, msg, sizeof msg);
-	if (n != sizeof msg) {
-		perror("server read");
-		fprintf(stderr, "%d/%d: Couldn't read remote address\n", n, (int) sizeof msg);
-		goto out;
-	}
-
-	rem_dest = malloc(sizeof *rem_dest);
+	rem_dest = calloc(ctx->num_qps, sizeof *rem_dest);
 	if (!rem_dest)
 		goto out;
 
-	sscanf(msg, "%x:%x:%x:%s", &rem_dest->lid, &rem_dest->qpn,
-							&rem_dest->psn, gid);
-	wire_gid_to_gid(gid, &rem_dest->gid);
+	for (i = 0; i < ctx->num_qps; ++i) {
+		if (pp_read_msg(connfd, msg, sizeof msg)) {
+			perror("server read");
+			fprintf(stderr, "%d/%d: Couldn't read remote address\n",
+				i, ctx->num_qps);
+			goto err;
+		}
 
-	if (pp_connect_ctx(ctx, ib_port, my_dest->psn, mtu, sl, rem_dest,
-								sgid_idx)) {
-		fprintf(stderr, "Couldn't connect to remote QP\n");
-		free(rem_dest);
-		rem_dest = NULL;
-		goto out;
+		sscanf(msg, "%x:%x:%x:%s", &rem_dest[i].lid, &rem_dest[i].qpn,
+							&rem_dest[i].psn, gid);
+		wire_gid_to_gid(gid, &rem_dest[i].gid);
+
+		if (pp_connect_ctx(ctx->qps[i].qp, ib_port, my_dest[i].psn,
+				   mtu, sl, &rem_dest[i], sgid_idx)) {
+			fprintf(stderr, "Couldn't connect to remote QP\n");
+			goto err;
+		}
 	}
 
+	for (i = 0; i < ctx->num_qps; ++i) {
+		gid_to_wire_gid(&my_dest[i].gid, gid);
+		sprintf(msg, "%04x:%06x:%06x:%s", my_dest[i].lid,
+			my_dest[i].qpn, my_dest[i].psn, gid);
+		if (write(connfd, msg, sizeof msg) != sizeof msg) {
+			fprintf(stderr, "Couldn't send/recv local address\n");
+			goto err;
+		}
+	}
 
-	gid_to_wire_gid(&my_dest->gid, gid);
-	sprintf(msg, "%04x:%06x:%06x:%s", my_dest->lid, my_dest->qpn,
-							my_dest->psn, gid);
-	if (write(connfd, msg, sizeof msg) != sizeof msg ||
-	    read(connfd, msg, sizeof msg) != sizeof "done") {
+	if (read(connfd, msg, sizeof msg) != sizeof "done") {
 		fprintf(stderr, "Couldn't send/recv local address\n");
-		free(rem_dest);
-		rem_dest = NULL;
-		goto out;
+		goto err;
 	}
 
-
 out:
 	close(connfd);
 	return rem_dest;
+
+err:
+	free(rem_dest);
+	rem_dest = NULL;
+	goto out;
+}
+
+static int pp_init_qp(struct pingpong_context *ctx, struct pingpong_thread *t,
+		      struct pingpong_qp *qp, int port)
+{
+	struct ibv_qp_attr attr;
+	struct ibv_qp_init_attr init_attr = {
+		.send_cq = pp_cq(t),
+		.recv_cq = pp_cq(t),
+		.cap     = {
+			.max_send_wr  = 1,
+			.max_recv_wr  = ctx->rx_depth,
+			.max_send_sge = 1,
+			.max_recv_sge = 1
+		},
+		.qp_type = IBV_QPT_RC
+	};
+
+	qp->send_flags = IBV_SEND_SIGNALED;
+
+	if (use_new_send) {
+		struct ibv_qp_init_attr_ex init_attr_ex = {
+			.send_cq = init_attr.send_cq,
+			.recv_cq = init_attr.recv_cq,
+			.cap     = init_attr.cap,
+			.qp_type = IBV_QPT_RC,
+			.comp_mask = IBV_QP_INIT_ATTR_PD |
+				     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+			.pd = t->pad ? t->pad : ctx->pd,
+			.send_ops_flags = IBV_QP_EX_WITH_SEND,
+		};
+
+		qp->qp = ibv_create_qp_ex(ctx->context, &init_attr_ex);
+		if (qp->qp)
+			qp->qpx = ibv_qp_to_qp_ex(qp->qp);
+	} else {
+		qp->qp = ibv_create_qp(t->pad ? t->pad : ctx->pd, &init_attr);
+	}
+
+	if (!qp->qp)  {
+		fprintf(stderr, "Couldn't create QP\n");
+		return 1;
+	}
+
+	ibv_query_qp(qp->qp, &attr, IBV_QP_CAP, &init_attr);
+	if (init_attr.cap.max_inline_data >= ctx->size) {
+		qp->send_flags |= IBV_SEND_INLINE;
+	}
+
+	attr = (struct ibv_qp_attr) {
+		.qp_state        = IBV_QPS_INIT,
+		.pkey_index      = 0,
+		.port_num        = port,
+		.qp_access_flags = 0
+	};
+
+	if (ibv_modify_qp(qp->qp, &attr,
+			  IBV_QP_STATE              |
+			  IBV_QP_PKEY_INDEX         |
+			  IBV_QP_PORT               |
+			  IBV_QP_ACCESS_FLAGS)) {
+		fprintf(stderr, "Failed to modify QP to INIT\n");
+		ibv_destroy_qp(qp->qp);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int pp_init_thread(struct pingpong_context *ctx,
+			  struct pingpong_thread *t, int port)
+{
+	int cqe = qps_per_thread * (ctx->rx_depth + 1);
+	int i;
+
+	if (ctx->use_event) {
+		t->channel = ibv_create_comp_channel(ctx->context);
+		if (!t->channel) {
+			fprintf(stderr, "Couldn't create completion channel\n");
+			return 1;
+		}
+	}
+
+	if (use_td) {
+		struct ibv_td_init_attr td_attr = {};
+		struct ibv_parent_domain_init_attr pad_attr = {};
+
+		t->td = ibv_alloc_td(ctx->context, &td_attr);
+		if (!t->td) {
+			fprintf(stderr, "Couldn't allocate thread domain\n");
+			goto clean_comp_channel;
+		}
+
+		pad_attr.pd = ctx->pd;
+		pad_attr.td = t->td;
+		t->pad = ibv_alloc_parent_domain(ctx->context, &pad_attr);
+		if (!t->pad) {
+			fprintf(stderr, "Couldn't allocate parent domain\n");
+			goto clean_td;
+		}
+	}
+
+	if (use_ts || use_td) {
+		struct ibv_cq_init_attr_ex attr_ex = {
+			.cqe = cqe,
+			.cq_context = NULL,
+			.channel = t->channel,
+			.comp_vector = 0,
+		};
+
+		if (use_ts)
+			attr_ex.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+		if (use_td) {
+			attr_ex.comp_mask = IBV_CQ_INIT_ATTR_MASK_PD;
+			attr_ex.parent_domain = t->pad;
+		}
+
+		t->cq_s.cq_ex = ibv_create_cq_ex(ctx->context, &attr_ex);
+	} else {
+		t->cq_s.cq = ibv_create_cq(ctx->context, cqe, NULL,
+					   t->channel, 0);
+	}
+
+	if (!pp_cq(t)) {
+		fprintf(stderr, "Couldn't create CQ\n");
+		goto clean_pad;
+	}
+
+	for (i = 0; i < qps_per_thread; ++i)
+		if (pp_init_qp(ctx, t, &t->qps[i], port))
+			goto clean_qps;
+
+	return 0;
+
+clean_qps:
+	while (i--)
+		ibv_destroy_qp(t->qps[i].qp);
+
+	ibv_destroy_cq(pp_cq(t));
+
+clean_pad:
+	if (t->pad)
+		ibv_dealloc_pd(t->pad);
+
+clean_td:
+	if (t->td)
+		ibv_dealloc_td(t->td);
+
+clean_comp_channel:
+	if (t->channel)
+		ibv_destroy_comp_channel(t->channel);
+
+	return 1;
+}
+
+static int pp_close_thread(struct pingpong_thread *t)
+{
+	int i;
+
+	for (i = 0; i < qps_per_thread; ++i)
+		if (ibv_destroy_qp(t->qps[i].qp)) {
+			fprintf(stderr, "Couldn't destroy QP\n");
+			return 1;
+		}
+
+	ibv_ack_cq_events(pp_cq(t), t->num_cq_events);
+
+	if (ibv_destroy_cq(pp_cq(t))) {
+		fprintf(stderr, "Couldn't destroy CQ\n");
+		return 1;
+	}
+
+	if (t->pad && ibv_dealloc_pd(t->pad)) {
+		fprintf(stderr, "Couldn't deallocate parent domain\n");
+		return 1;
+	}
+
+	if (t->td && ibv_dealloc_td(t->td)) {
+		fprintf(stderr, "Couldn't deallocate thread domain\n");
+		return 1;
+	}
+
+	if (t->channel) {
+		if (ibv_destroy_comp_channel(t->channel)) {
+			fprintf(stderr, "Couldn't destroy completion channel\n");
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
 static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
@@ -328,23 +598,33 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 {
 	struct pingpong_context *ctx;
 	int access_flags = IBV_ACCESS_LOCAL_WRITE;
+	int i;
 
 	ctx = calloc(1, sizeof *ctx);
 	if (!ctx)
 		return NULL;
 
 	ctx->size       = size;
-	ctx->send_flags = IBV_SEND_SIGNALED;
 	ctx->rx_depth   = rx_depth;
+	ctx->use_event  = use_event;
+	ctx->num_qps    = num_threads * qps_per_thread;
+
+	ctx->threads = calloc(num_threads, sizeof *ctx->threads);
+	ctx->qps = calloc(ctx->num_qps, sizeof *ctx->qps);
+	if (!ctx->threads || !ctx->qps) {
+		fprintf(stderr, "Couldn't allocate threads.\n");
+		goto clean_threads;
+	}
 
-	ctx->buf = memalign(page_size, size);
+	/* Each QP sends from and receives into its own slice of buf */
+	ctx->buf = memalign(page_size, (size_t)size * ctx->num_qps);
 	if (!ctx->buf) {
 		fprintf(stderr, "Couldn't allocate work buf.\n");
-		goto clean_ctx;
+		goto clean_threads;
 	}
 
 	/* FIXME memset(ctx->buf, 0, size); */
-	memset(ctx->buf, 0x7b, size);
+	memset(ctx->buf, 0x7b, (size_t)size * ctx->num_qps);
 
 	ctx->context = ibv_open_device(ib_dev);
 	if (!ctx->context) {
@@ -353,19 +633,10 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		goto clean_buffer;
 	}
 
-	if (use_event) {
-		ctx->channel = ibv_create_comp_channel(ctx->context);
-		if (!ctx->channel) {
-			fprintf(stderr, "Couldn't create completion channel\n");
-			goto clean_device;
-		}
-	} else
-		ctx->channel = NULL;
-
 	ctx->pd = ibv_alloc_pd(ctx->context);
 	if (!ctx->pd) {
 		fprintf(stderr, "Couldn't allocate PD\n");
-		goto clean_comp_channel;
+		goto clean_device;
 	}
 
 	if (use_odp || use_ts) {
@@ -375,14 +646,14 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 
 		if (ibv_query_device_ex(ctx->context, NULL, &attrx)) {
 			fprintf(stderr, "Couldn't query device for its features\n");
-			goto clean_comp_channel;
+			goto clean_pd;
 		}
 
 		if (use_odp) {
 			if (!(attrx.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
 			    (attrx.odp_caps.per_transport_caps.rc_odp_caps & rc_caps_mask) != rc_caps_mask) {
 				fprintf(stderr, "The device isn't ODP capable or does not support RC send and receive with ODP\n");
-				goto clean_comp_channel;
+				goto clean_pd;
 			}
 			access_flags |= IBV_ACCESS_ON_DEMAND;
 		}
@@ -390,107 +661,51 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		if (use_ts) {
 			if (!attrx.completion_timestamp_mask) {
 				fprintf(stderr, "The device isn't completion timestamp capable\n");
-				goto clean_comp_channel;
+				goto clean_pd;
 			}
 			ctx->completion_timestamp_mask = attrx.completion_timestamp_mask;
 		}
 	}
-	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size, access_flags);
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, (size_t)size * ctx->num_qps,
+			     access_flags);
 
 	if (!ctx->mr) {
 		fprintf(stderr, "Couldn't register MR\n");
 		goto clean_pd;
 	}
 
-	if (use_ts) {
-		struct ibv_cq_init_attr_ex attr_ex = {
-			.cqe = rx_depth + 1,
-			.cq_context = NULL,
-			.channel = ctx->channel,
-			.comp_vector = 0,
-			.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP
-		};
-
-		ctx->cq_s.cq_ex = ibv_create_cq_ex(ctx->context, &attr_ex);
-	} else {
-		ctx->cq_s.cq = ibv_create_cq(ctx->context, rx_depth + 1, NULL,
-					     ctx->channel, 0);
-	}
-
-	if (!pp_cq(ctx)) {
-		fprintf(stderr, "Couldn't create CQ\n");
-		goto clean_mr;
+	for (i = 0; i < ctx->num_qps; ++i) {
+		ctx->qps[i].buf = (char *)ctx->buf + (size_t)size * i;
+		ctx->qps[i].index = i % qps_per_thread;
 	}
 
-	{
-		struct ibv_qp_attr attr;
-		struct ibv_qp_init_attr init_attr = {
-			.send_cq = pp_cq(ctx),
-			.recv_cq = pp_cq(ctx),
-			.cap     = {
-				.max_send_wr  = 1,
-				.max_recv_wr  = rx_depth,
-				.max_send_sge = 1,
-				.max_recv_sge = 1
-			},
-			.qp_type = IBV_QPT_RC
-		};
-
-		ctx->qp = ibv_create_qp(ctx->pd, &init_attr);
-		if (!ctx->qp)  {
-			fprintf(stderr, "Couldn't create QP\n");
-			goto clean_cq;
-		}
-
-		ibv_query_qp(ctx->qp, &attr, IBV_QP_CAP, &init_attr);
-		if (init_attr.cap.max_inline_data >= size) {
-			ctx->send_flags |= IBV_SEND_INLINE;
-		}
-	}
-
-	{
-		struct ibv_qp_attr attr = {
-			.qp_state        = IBV_QPS_INIT,
-			.pkey_index      = 0,
-			.port_num        = port,
-			.qp_access_flags = 0
-		};
-
-		if (ibv_modify_qp(ctx->qp, &attr,
-				  IBV_QP_STATE              |
-				  IBV_QP_PKEY_INDEX         |
-				  IBV_QP_PORT               |
-				  IBV_QP_ACCESS_FLAGS)) {
-			fprintf(stderr, "Failed to modify QP to INIT\n");
-			goto clean_qp;
-		}
+	for (i = 0; i < num_threads; ++i) {
+		ctx->threads[i].ctx = ctx;
+		ctx->threads[i].qps = &ctx->qps[i * qps_per_thread];
+		if (pp_init_thread(ctx, &ctx->threads[i], port))
+			goto clean_init_threads;
 	}
 
 	return ctx;
 
-clean_qp:
-	ibv_destroy_qp(ctx->qp);
-
-clean_cq:
-	ibv_destroy_cq(pp_cq(ctx));
+clean_init_threads:
+	while (i--)
+		pp_close_thread(&ctx->threads[i]);
 
-clean_mr:
 	ibv_dereg_mr(ctx->mr);
 
 clean_pd:
 	ibv_dealloc_pd(ctx->pd);
 
-clean_comp_channel:
-	if (ctx->channel)
-		ibv_destroy_comp_channel(ctx->channel);
-
 clean_device:
 	ibv_close_device(ctx->context);
 
 clean_buffer:
 	free(ctx->buf);
 
-clean_ctx:
+clean_threads:
+	free(ctx->qps);
+	free(ctx->threads);
 	free(ctx);
 
 	return NULL;
@@ -498,15 +713,11 @@ clean_ctx:
 
 static int pp_close_ctx(struct pingpong_context *ctx)
 {
-	if (ibv_destroy_qp(ctx->qp)) {
-		fprintf(stderr, "Couldn't destroy QP\n");
-		return 1;
-	}
+	int i;
 
-	if (ibv_destroy_cq(pp_cq(ctx))) {
-		fprintf(stderr, "Couldn't destroy CQ\n");
-		return 1;
-	}
+	for (i = 0; i < num_threads; ++i)
+		if (pp_close_thread(&ctx->threads[i]))
+			return 1;
 
 	if (ibv_dereg_mr(ctx->mr)) {
 		fprintf(stderr, "Couldn't deregister MR\n");
@@ -518,33 +729,30 @@ static int pp_close_ctx(struct pingpong_context *ctx)
 		return 1;
 	}
 
-	if (ctx->channel) {
-		if (ibv_destroy_comp_channel(ctx->channel)) {
-			fprintf(stderr, "Couldn't destroy completion channel\n");
-			return 1;
-		}
-	}
-
 	if (ibv_close_device(ctx->context)) {
 		fprintf(stderr, "Couldn't release context\n");
 		return 1;
 	}
 
 	free(ctx->buf);
+	free(ctx->qps);
+	free(ctx->threads);
 	free(ctx);
 
 	return 0;
 }
 
-static int pp_post_recv(struct pingpong_context *ctx, int n)
+static int pp_post_recv(struct pingpong_context *ctx, struct pingpong_qp *qp,
+			int n)
 {
 	struct ibv_sge list = {
-		.addr	= (uintptr_t) ctx->buf,
+		.addr	= (uintptr_t) qp->buf,
 		.length = ctx->size,
 		.lkey	= ctx->mr->lkey
 	};
 	struct ibv_recv_wr wr = {
-		.wr_id	    = PINGPONG_RECV_WRID,
+		.wr_id	    = (uint64_t)qp->index << PINGPONG_WRID_SHIFT |
+			      PINGPONG_RECV_WRID,
 		.sg_list    = &list,
 		.num_sge    = 1,
 	};
@@ -552,46 +760,56 @@ static int pp_post_recv(struct pingpong_context *ctx, int n)
 	int i;
 
 	for (i = 0; i < n; ++i)
-		if (ibv_post_recv(ctx->qp, &wr, &bad_wr))
+		if (ibv_post_recv(qp->qp, &wr, &bad_wr))
 			break;
 
 	return i;
 }
 
-static int pp_post_send(struct pingpong_context *ctx)
+static int pp_post_send(struct pingpong_context *ctx, struct pingpong_qp *qp)
 {
 	struct ibv_sge list = {
-		.addr	= (uintptr_t) ctx->buf,
+		.addr	= (uintptr_t) qp->buf,
 		.length = ctx->size,
 		.lkey	= ctx->mr->lkey
 	};
 	struct ibv_send_wr wr = {
-		.wr_id	    = PINGPONG_SEND_WRID,
+		.wr_id	    = (uint64_t)qp->index << PINGPONG_WRID_SHIFT |
+			      PINGPONG_SEND_WRID,
 		.sg_list    = &list,
 		.num_sge    = 1,
 		.opcode     = IBV_WR_SEND,
-		.send_flags = ctx->send_flags,
+		.send_flags = qp->send_flags,
 	};
 	struct ibv_send_wr *bad_wr;
 
-	return ibv_post_send(ctx->qp, &wr, &bad_wr);
-}
+	if (use_new_send) {
+		ibv_wr_start(qp->qpx);
 
-struct ts_params {
-	uint64_t		 comp_recv_max_time_delta;
-	uint64_t		 comp_recv_min_time_delta;
-	uint64_t		 comp_recv_total_time_delta;
-	uint64_t		 comp_recv_prev_time;
-	int			 last_comp_with_ts;
-	unsigned int		 comp_with_time_iters;
-};
+		qp->qpx->wr_id = wr.wr_id;
+		qp->qpx->wr_flags = IBV_SEND_SIGNALED;
+		ibv_wr_send(qp->qpx);
+		if (qp->send_flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(qp->qpx, qp->buf, ctx->size);
+		else
+			ibv_wr_set_sge(qp->qpx, list.lkey, list.addr,
+				       list.length);
+
+		return ibv_wr_complete(qp->qpx);
+	}
+
+	return ibv_post_send(qp->qp, &wr, &bad_wr);
+}
 
-static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
-				  int *rcnt, int *routs, int iters,
+static inline int parse_single_wc(struct pingpong_thread *t,
 				  uint64_t wr_id, enum ibv_wc_status status,
-				  uint64_t completion_timestamp,
-				  struct ts_params *ts)
+				  uint64_t completion_timestamp)
 {
+	struct pingpong_context *ctx = t->ctx;
+	struct ts_params *ts = &t->ts;
+	int kind = wr_id & (PINGPONG_RECV_WRID | PINGPONG_SEND_WRID);
+	struct pingpong_qp *qp;
+
 	if (status != IBV_WC_SUCCESS) {
 		fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
 			ibv_wc_status_str(status),
@@ -599,23 +817,31 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 		return 1;
 	}
 
-	switch ((int)wr_id) {
+	if ((wr_id >> PINGPONG_WRID_SHIFT) >= (uint64_t)qps_per_thread) {
+		fprintf(stderr, "Completion for unknown wr_id %d\n",
+			(int)wr_id);
+		return 1;
+	}
+	qp = &t->qps[wr_id >> PINGPONG_WRID_SHIFT];
+
+	switch (kind) {
 	case PINGPONG_SEND_WRID:
-		++(*scnt);
+		++qp->scnt;
 		break;
 
 	case PINGPONG_RECV_WRID:
-		if (--(*routs) <= 1) {
-			*routs += pp_post_recv(ctx, ctx->rx_depth - *routs);
-			if (*routs < ctx->rx_depth) {
+		if (--qp->routs <= 1) {
+			qp->routs += pp_post_recv(ctx, qp,
+						  ctx->rx_depth - qp->routs);
+			if (qp->routs < ctx->rx_depth) {
 				fprintf(stderr,
 					"Couldn't post receive (%d)\n",
-					*routs);
+					qp->routs);
 				return 1;
 			}
 		}
 
-		++(*rcnt);
+		++qp->rcnt;
 		if (use_ts) {
 			if (ts->last_comp_with_ts) {
 				uint64_t delta;
@@ -647,19 +873,112 @@ static inline int parse_single_wc(struct pingpong_context *ctx, int *scnt,
 		return 1;
 	}
 
-	ctx->pending &= ~(int)wr_id;
-	if (*scnt < iters && !ctx->pending) {
-		if (pp_post_send(ctx)) {
+	qp->pending &= ~kind;
+	if (qp->scnt < ctx->iters && !qp->pending) {
+		if (pp_post_send(ctx, qp)) {
 			fprintf(stderr, "Couldn't post send\n");
 			return 1;
 		}
-		ctx->pending = PINGPONG_RECV_WRID |
+		qp->pending = PINGPONG_RECV_WRID |
 			PINGPONG_SEND_WRID;
 	}
 
+	/* The last completion of a QP is the only one that sees both done */
+	if (qp->scnt == ctx->iters && qp->rcnt == ctx->iters)
+		++t->done;
+
+	return 0;
+}
+
+static int pp_poll_thread(struct pingpong_thread *t)
+{
+	int ret;
+
+	while (t->done < qps_per_thread) {
+		if (t->ctx->use_event) {
+			struct ibv_cq *ev_cq;
+			void          *ev_ctx;
+
+			if (ibv_get_cq_event(t->channel, &ev_cq, &ev_ctx)) {
+				fprintf(stderr, "Failed to get cq_event\n");
+				return 1;
+			}
+
+			++t->num_cq_events;
+
+			if (ev_cq != pp_cq(t)) {
+				fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
+				return 1;
+			}
+
+			if (ibv_req_notify_cq(pp_cq(t), 0)) {
+				fprintf(stderr, "Couldn't request CQ notification\n");
+				return 1;
+			}
+		}
+
+		if (use_ts) {
+			struct ibv_poll_cq_attr attr = {};
+
+			do {
+				ret = ibv_start_poll(t->cq_s.cq_ex, &attr);
+			} while (!t->ctx->use_event && ret == ENOENT);
+
+			if (ret) {
+				fprintf(stderr, "poll CQ failed %d\n", ret);
+				return ret;
+			}
+			ret = parse_single_wc(t, t->cq_s.cq_ex->wr_id,
+					      t->cq_s.cq_ex->status,
+					      ibv_wc_read_completion_ts(t->cq_s.cq_ex));
+			if (ret) {
+				ibv_end_poll(t->cq_s.cq_ex);
+				return ret;
+			}
+			ret = ibv_next_poll(t->cq_s.cq_ex);
+			if (!ret)
+				ret = parse_single_wc(t, t->cq_s.cq_ex->wr_id,
+						      t->cq_s.cq_ex->status,
+						      ibv_wc_read_completion_ts(t->cq_s.cq_ex));
+			ibv_end_poll(t->cq_s.cq_ex);
+			if (ret && ret != ENOENT) {
+				fprintf(stderr, "poll CQ failed %d\n", ret);
+				return ret;
+			}
+		} else {
+			int ne, i;
+			struct ibv_wc wc[2];
+
+			do {
+				ne = ibv_poll_cq(pp_cq(t), 2, wc);
+				if (ne < 0) {
+					fprintf(stderr, "poll CQ failed %d\n", ne);
+					return 1;
+				}
+			} while (!t->ctx->use_event && ne < 1);
+
+			for (i = 0; i < ne; ++i) {
+				ret = parse_single_wc(t, wc[i].wr_id,
+						      wc[i].status, 0);
+				if (ret) {
+					fprintf(stderr, "parse WC failed %d\n", ne);
+					return 1;
+				}
+			}
+		}
+	}
+
 	return 0;
 }
 
+static void *pp_thread(void *arg)
+{
+	struct pingpong_thread *t = arg;
+
+	t->ret = pp_poll_thread(t);
+	return NULL;
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -679,6 +998,10 @@ static void usage(const char *argv0)
 	printf("  -g, --gid-idx=<gid index> local port gid index\n");
 	printf("  -o, --odp		    use on demand paging\n");
 	printf("  -t, --ts	            get CQE with timestamp\n");
+	printf("  -N, --new_send            use new post send WR API\n");
+	printf("  -D, --thread-domain       use a thread domain for the QPs and CQ of each thread\n");
+	printf("  -T, --threads=<threads>   number of threads (default 1)\n");
+	printf("  -q, --qps=<qps>           number of QPs of each thread (default 1)\n");
 }
 
 int main(int argc, char *argv[])
@@ -686,7 +1009,7 @@ int main(int argc, char *argv[])
 	struct ibv_device      **dev_list;
 	struct ibv_device	*ib_dev;
 	struct pingpong_context *ctx;
-	struct pingpong_dest     my_dest;
+	struct pingpong_dest    *my_dest;
 	struct pingpong_dest    *rem_dest;
 	struct timeval           start, end;
 	char                    *ib_devname = NULL;
@@ -698,13 +1021,11 @@ int main(int argc, char *argv[])
 	unsigned int             rx_depth = 500;
 	unsigned int             iters = 1000;
 	int                      use_event = 0;
-	int                      routs;
-	int                      rcnt, scnt;
-	int                      num_cq_events = 0;
 	int                      sl = 0;
 	int			 gidx = -1;
 	char			 gid[33];
 	struct ts_params	 ts;
+	int			 i;
 
 	srand48(getpid() * time(NULL));
 
@@ -724,10 +1045,14 @@ int main(int argc, char *argv[])
 			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
 			{ .name = "odp",      .has_arg = 0, .val = 'o' },
 			{ .name = "ts",       .has_arg = 0, .val = 't' },
+			{ .name = "new_send", .has_arg = 0, .val = 'N' },
+			{ .name = "thread-domain", .has_arg = 0, .val = 'D' },
+			{ .name = "threads",  .has_arg = 1, .val = 'T' },
+			{ .name = "qps",      .has_arg = 1, .val = 'q' },
 			{}
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:ot",
+		c = getopt_long(argc, argv, "p:d:i:s:m:r:n:l:eg:otNDT:q:",
 				long_options, NULL);
 
 		if (c == -1)
@@ -793,6 +1118,30 @@ int main(int argc, char *argv[])
 			use_ts = 1;
 			break;
 
+		case 'N':
+			use_new_send = 1;
+			break;
+
+		case 'D':
+			use_td = 1;
+			break;
+
+		case 'T':
+			num_threads = strtol(optarg, NULL, 0);
+			if (num_threads < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'q':
+			qps_per_thread = strtol(optarg, NULL, 0);
+			if (qps_per_thread < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -806,15 +1155,6 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (use_ts) {
-		ts.comp_recv_max_time_delta = 0;
-		ts.comp_recv_min_time_delta = 0xffffffff;
-		ts.comp_recv_total_time_delta = 0;
-		ts.comp_recv_prev_time = 0;
-		ts.last_comp_with_ts = 0;
-		ts.comp_with_time_iters = 0;
-	}
-
 	page_size = sysconf(_SC_PAGESIZE);
 
 	dev_list = ibv_get_device_list(NULL);
@@ -830,7 +1170,6 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 	} else {
-		int i;
 		for (i = 0; dev_list[i]; ++i)
 			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
 				break;
@@ -844,73 +1183,99 @@ int main(int argc, char *argv[])
 	ctx = pp_init_ctx(ib_dev, size, rx_depth, ib_port, use_event);
 	if (!ctx)
 		return 1;
+	ctx->iters = iters;
 
-	routs = pp_post_recv(ctx, ctx->rx_depth);
-	if (routs < ctx->rx_depth) {
-		fprintf(stderr, "Couldn't post receive (%d)\n", routs);
-		return 1;
+	for (i = 0; i < num_threads; ++i) {
+		struct ts_params *t_ts = &ctx->threads[i].ts;
+
+		t_ts->comp_recv_min_time_delta = 0xffffffff;
+
+		if (use_event)
+			if (ibv_req_notify_cq(pp_cq(&ctx->threads[i]), 0)) {
+				fprintf(stderr, "Couldn't request CQ notification\n");
+				return 1;
+			}
 	}
 
-	if (use_event)
-		if (ibv_req_notify_cq(pp_cq(ctx), 0)) {
-			fprintf(stderr, "Couldn't request CQ notification\n");
+	for (i = 0; i < ctx->num_qps; ++i) {
+		ctx->qps[i].routs = pp_post_recv(ctx, &ctx->qps[i],
+						 ctx->rx_depth);
+		if (ctx->qps[i].routs < ctx->rx_depth) {
+			fprintf(stderr, "Couldn't post receive (%d)\n",
+				ctx->qps[i].routs);
 			return 1;
 		}
-
+	}
 
 	if (pp_get_port_info(ctx->context, ib_port, &ctx->portinfo)) {
 		fprintf(stderr, "Couldn't get port info\n");
 		return 1;
 	}
 
-	my_dest.lid = ctx->portinfo.lid;
+	my_dest = calloc(ctx->num_qps, sizeof *my_dest);
+	if (!my_dest) {
+		fprintf(stderr, "Couldn't allocate local addresses\n");
+		return 1;
+	}
+
+	my_dest[0].lid = ctx->portinfo.lid;
 	if (ctx->portinfo.link_layer != IBV_LINK_LAYER_ETHERNET &&
-							!my_dest.lid) {
+							!my_dest[0].lid) {
 		fprintf(stderr, "Couldn't get local LID\n");
 		return 1;
 	}
 
 	if (gidx >= 0) {
-		if (ibv_query_gid(ctx->context, ib_port, gidx, &my_dest.gid)) {
+		if (ibv_query_gid(ctx->context, ib_port, gidx, &my_dest[0].gid)) {
 			fprintf(stderr, "can't read sgid of index %d\n", gidx);
 			return 1;
 		}
 	} else
-		memset(&my_dest.gid, 0, sizeof my_dest.gid);
-
-	my_dest.qpn = ctx->qp->qp_num;
-	my_dest.psn = lrand48() & 0xffffff;
-	inet_ntop(AF_INET6, &my_dest.gid, gid, sizeof gid);
-	printf("  local address:  LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
-	       my_dest.lid, my_dest.qpn, my_dest.psn, gid);
+		memset(&my_dest[0].gid, 0, sizeof my_dest[0].gid);
+
+	inet_ntop(AF_INET6, &my_dest[0].gid, gid, sizeof gid);
+	for (i = 0; i < ctx->num_qps; ++i) {
+		my_dest[i].lid = my_dest[0].lid;
+		my_dest[i].gid = my_dest[0].gid;
+		my_dest[i].qpn = ctx->qps[i].qp->qp_num;
+		my_dest[i].psn = lrand48() & 0xffffff;
+		printf("  local address:  LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
+		       my_dest[i].lid, my_dest[i].qpn, my_dest[i].psn, gid);
+	}
 
 
 	if (servername)
-		rem_dest = pp_client_exch_dest(servername, port, &my_dest);
+		rem_dest = pp_client_exch_dest(servername, port, my_dest,
+					       ctx->num_qps);
 	else
 		rem_dest = pp_server_exch_dest(ctx, ib_port, mtu, port, sl,
-								&my_dest, gidx);
+								my_dest, gidx);
 
 	if (!rem_dest)
 		return 1;
 
-	inet_ntop(AF_INET6, &rem_dest->gid, gid, sizeof gid);
-	printf("  remote address: LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
-	       rem_dest->lid, rem_dest->qpn, rem_dest->psn, gid);
+	for (i = 0; i < ctx->num_qps; ++i) {
+		inet_ntop(AF_INET6, &rem_dest[i].gid, gid, sizeof gid);
+		printf("  remote address: LID 0x%04x, QPN 0x%06x, PSN 0x%06x, GID %s\n",
+		       rem_dest[i].lid, rem_dest[i].qpn, rem_dest[i].psn, gid);
 
-	if (servername)
-		if (pp_connect_ctx(ctx, ib_port, my_dest.psn, mtu, sl, rem_dest,
-					gidx))
-			return 1;
+		if (servername)
+			if (pp_connect_ctx(ctx->qps[i].qp, ib_port,
+					   my_dest[i].psn, mtu, sl,
+					   &rem_dest[i], gidx))
+				return 1;
+	}
 
-	ctx->pending = PINGPONG_RECV_WRID;
+	for (i = 0; i < ctx->num_qps; ++i) {
+		ctx->qps[i].pending = PINGPONG_RECV_WRID;
 
-	if (servername) {
-		if (pp_post_send(ctx)) {
-			fprintf(stderr, "Couldn't post send\n");
-			return 1;
+		if (servername) {
+			if (pp_post_send(ctx, &ctx->qps[i])) {
+				fprintf(stderr, "Couldn't post send\n");
+				return 1;
+			}
+			ctx->qps[i].pending |= PINGPONG_SEND_WRID;
 		}
-		ctx->pending |= PINGPONG_SEND_WRID;
 	}
 
 	if (gettimeofday(&start, NULL)) {
@@ -918,107 +1283,57 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	rcnt = scnt = 0;
-	while (rcnt < iters || scnt < iters) {
-		int ret;
-
-		if (use_event) {
-			struct ibv_cq *ev_cq;
-			void          *ev_ctx;
-
-			if (ibv_get_cq_event(ctx->channel, &ev_cq, &ev_ctx)) {
-				fprintf(stderr, "Failed to get cq_event\n");
-				return 1;
-			}
-
-			++num_cq_events;
-
-			if (ev_cq != pp_cq(ctx)) {
-				fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
-				return 1;
-			}
-
-			if (ibv_req_notify_cq(pp_cq(ctx), 0)) {
-				fprintf(stderr, "Couldn't request CQ notification\n");
-				return 1;
-			}
+	/* The first thread runs on the main thread */
+	for (i = 1; i < num_threads; ++i)
+		if (pthread_create(&ctx->threads[i].thread, NULL, pp_thread,
+				   &ctx->threads[i])) {
+			fprintf(stderr, "Couldn't create thread\n");
+			return 1;
 		}
 
-		if (use_ts) {
-			struct ibv_poll_cq_attr attr = {};
+	pp_thread(&ctx->threads[0]);
 
-			do {
-				ret = ibv_start_poll(ctx->cq_s.cq_ex, &attr);
-			} while (!use_event && ret == ENOENT);
+	for (i = 1; i < num_threads; ++i)
+		pthread_join(ctx->threads[i].thread, NULL);
 
-			if (ret) {
-				fprintf(stderr, "poll CQ failed %d\n", ret);
-				return ret;
-			}
-			ret = parse_single_wc(ctx, &scnt, &rcnt, &routs,
-					      iters,
-					      ctx->cq_s.cq_ex->wr_id,
-					      ctx->cq_s.cq_ex->status,
-					      ibv_wc_read_completion_ts(ctx->cq_s.cq_ex),
-					      &ts);
-			if (ret) {
-				ibv_end_poll(ctx->cq_s.cq_ex);
-				return ret;
-			}
-			ret = ibv_next_poll(ctx->cq_s.cq_ex);
-			if (!ret)
-				ret = parse_single_wc(ctx, &scnt, &rcnt, &routs,
-						      iters,
-						      ctx->cq_s.cq_ex->wr_id,
-						      ctx->cq_s.cq_ex->status,
-						      ibv_wc_read_completion_ts(ctx->cq_s.cq_ex),
-						      &ts);
-			ibv_end_poll(ctx->cq_s.cq_ex);
-			if (ret && ret != ENOENT) {
-				fprintf(stderr, "poll CQ failed %d\n", ret);
-				return ret;
-			}
-		} else {
-			int ne, i;
-			struct ibv_wc wc[2];
-
-			do {
-				ne = ibv_poll_cq(pp_cq(ctx), 2, wc);
-				if (ne < 0) {
-					fprintf(stderr, "poll CQ failed %d\n", ne);
-					return 1;
-				}
-			} while (!use_event && ne < 1);
-
-			for (i = 0; i < ne; ++i) {
-				ret = parse_single_wc(ctx, &scnt, &rcnt, &routs,
-						      iters,
-						      wc[i].wr_id,
-						      wc[i].status,
-						      0, &ts);
-				if (ret) {
-					fprintf(stderr, "parse WC failed %d\n", ne);
-					return 1;
-				}
-			}
-		}
-	}
+	for (i = 0; i < num_threads; ++i)
+		if (ctx->threads[i].ret)
+			return ctx->threads[i].ret;
 
 	if (gettimeofday(&end, NULL)) {
 		perror("gettimeofday");
 		return 1;
 	}
 
+	memset(&ts, 0, sizeof ts);
+	ts.comp_recv_min_time_delta = 0xffffffff;
+	for (i = 0; i < num_threads; ++i) {
+		struct ts_params *t_ts = &ctx->threads[i].ts;
+
+		ts.comp_recv_max_time_delta = max(ts.comp_recv_max_time_delta,
+						  t_ts->comp_recv_max_time_delta);
+		ts.comp_recv_min_time_delta = min(ts.comp_recv_min_time_delta,
+						  t_ts->comp_recv_min_time_delta);
+		ts.comp_recv_total_time_delta += t_ts->comp_recv_total_time_delta;
+		ts.comp_with_time_iters += t_ts->comp_with_time_iters;
+	}
+
 	{
 		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
 			(end.tv_usec - start.tv_usec);
-		long long bytes = (long long) size * iters * 2;
+		long long bytes = (long long) size * iters * 2 * ctx->num_qps;
 
 		printf("%lld bytes in %.2f seconds = %.2f Mbit/sec\n",
 		       bytes, usec / 1000000., bytes * 8. / usec);
 		printf("%d iters in %.2f seconds = %.2f usec/iter\n",
 		       iters, usec / 1000000., usec / iters);
 
+		/* Messages in both directions, on all QPs of all threads */
+		if (ctx->num_qps > 1)
+			printf("%d QPs on %d threads: %.3f million messages/sec\n",
+			       ctx->num_qps, num_threads,
+			       2. * iters * ctx->num_qps / usec);
+
 		if (use_ts && ts.comp_with_time_iters) {
 			printf("Max receive completion clock cycles = %" PRIu64 "\n",
 			       ts.comp_recv_max_time_delta);
@@ -1029,13 +1344,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ibv_ack_cq_events(pp_cq(ctx), num_cq_events);
-
 	if (pp_close_ctx(ctx))
 		return 1;
 
 	ibv_free_device_list(dev_list);
 	free(rem_dest);
+	free(my_dest);
 
 	return 0;
 }
@@ -0,0 +1,765 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <infiniband/verbs.h>
+
+#include "pingpong.h"
+
+struct rate_dest {
+	int		lid;
+	int		qpn;
+	int		psn;
+	union ibv_gid	gid;
+	uint32_t	rkey;
+	uint64_t	addr;
+};
+
+#define RATE_MSG "0000:000000:000000:00000000000000000000000000000000:00000000:0000000000000000"
+
+struct rate_qp {
+	struct ibv_qp		*qp;
+	struct ibv_qp_ex	*qpx;	/* with -N */
+	struct ibv_cq		*cq;
+	struct rate_dest	rem;
+};
+
+struct rate_thread {
+	pthread_t		thread;
+	int			index;
+	struct ibv_td		*td;
+	struct ibv_pd		*pad;	/* parent domain of pd and td */
+	struct rate_qp		**qps;
+	int			num_qps;
+	char			*buf;
+	/* WRs posted by the thread and not completed yet, on any CQ */
+	atomic_uint		outstanding;
+	int			err;
+};
+
+static struct ibv_context *context;
+static struct ibv_pd *pd;
+static struct ibv_mr *mr;
+static char *buf;
+static struct rate_qp *qps;
+static struct rate_thread *threads;
+static pthread_barrier_t barrier;
+
+static unsigned int size = 8;
+static unsigned int iters = 1000000;
+static unsigned int window = 64;
+static unsigned int batch = 1;
+static int num_threads = 1;
+static int qps_per_thread = 1;
+static int num_qps;
+static int shared_qps;
+static int use_td;
+static int use_new_send;
+static int send_flags = IBV_SEND_SIGNALED;
+
+static int rate_connect(struct ibv_qp *qp, int port, int my_psn,
+			enum ibv_mtu mtu, int sl, struct rate_dest *dest,
+			int sgid_idx)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state		= IBV_QPS_RTR,
+		.path_mtu		= mtu,
+		.dest_qp_num		= dest->qpn,
+		.rq_psn			= dest->psn,
+		.max_dest_rd_atomic	= 1,
+		.min_rnr_timer		= 12,
+		.ah_attr		= {
+			.dlid		= dest->lid,
+			.sl		= sl,
+			.port_num	= port
+		}
+	};
+
+	if (dest->gid.global.interface_id) {
+		attr.ah_attr.is_global = 1;
+		attr.ah_attr.grh.hop_limit = 1;
+		attr.ah_attr.grh.dgid = dest->gid;
+		attr.ah_attr.grh.sgid_index = sgid_idx;
+	}
+	if (ibv_modify_qp(qp, &attr,
+			  IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+			  IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+			  IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
+		fprintf(stderr, "Failed to modify QP to RTR\n");
+		return 1;
+	}
+
+	attr.qp_state	    = IBV_QPS_RTS;
+	attr.timeout	    = 14;
+	attr.retry_cnt	    = 7;
+	attr.rnr_retry	    = 7;
+	attr.sq_psn	    = my_psn;
+	attr.max_rd_atomic  = 1;
+	if (ibv_modify_qp(qp, &attr,
+			  IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+			  IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+			  IBV_QP_MAX_QP_RD_ATOMIC)) {
+		fprintf(stderr, "Failed to modify QP to RTS\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int write_dests(int fd, const struct rate_dest *dest)
+{
+	char msg[sizeof RATE_MSG];
+	char gid[33];
+	int i;
+
+	for (i = 0; i < num_qps; i++) {
+		gid_to_wire_gid(&dest[i].gid, gid);
+		sprintf(msg, "%04x:%06x:%06x:%s:%08x:%016" PRIx64,
+			dest[i].lid, dest[i].qpn, dest[i].psn, gid,
+			dest[i].rkey, dest[i].addr);
+		if (write(fd, msg, sizeof msg) != sizeof msg)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int read_dests(int fd, struct rate_dest *dest)
+{
+	char msg[sizeof RATE_MSG];
+	char gid[33];
+	size_t got;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < num_qps; i++) {
+		for (got = 0; got < sizeof msg; got += n) {
+			n = read(fd, msg + got, sizeof msg - got);
+			if (n <= 0)
+				return 1;
+		}
+		gid[32] = 0;
+		sscanf(msg, "%x:%x:%x:%32c:%x:%" SCNx64, &dest[i].lid,
+		       &dest[i].qpn, &dest[i].psn, gid, &dest[i].rkey,
+		       &dest[i].addr);
+		wire_gid_to_gid(gid, &dest[i].gid);
+	}
+
+	return 0;
+}
+
+/* Returns a connected TCP socket, the server accepts a single client */
+static int exch_socket(const char *servername, int port)
+{
+	struct addrinfo *res, *t;
+	struct addrinfo hints = {
+		.ai_flags    = servername ? 0 : AI_PASSIVE,
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	char *service;
+	int n, sockfd = -1, connfd;
+
+	if (asprintf(&service, "%d", port) < 0)
+		return -1;
+
+	n = getaddrinfo(servername, service, &hints, &res);
+	free(service);
+	if (n) {
+		fprintf(stderr, "%s for port %d\n", gai_strerror(n), port);
+		return -1;
+	}
+
+	for (t = res; t; t = t->ai_next) {
+		sockfd = socket(t->ai_family, t->ai_socktype, t->ai_protocol);
+		if (sockfd < 0)
+			continue;
+		if (servername) {
+			if (!connect(sockfd, t->ai_addr, t->ai_addrlen))
+				break;
+		} else {
+			n = 1;
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &n,
+				   sizeof n);
+			if (!bind(sockfd, t->ai_addr, t->ai_addrlen))
+				break;
+		}
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sockfd < 0) {
+		fprintf(stderr, "Couldn't %s port %d\n",
+			servername ? "connect to" : "listen to", port);
+		return -1;
+	}
+	if (servername)
+		return sockfd;
+
+	listen(sockfd, 1);
+	connfd = accept(sockfd, NULL, NULL);
+	close(sockfd);
+	if (connfd < 0)
+		fprintf(stderr, "accept() failed\n");
+	return connfd;
+}
+
+static struct ibv_qp *rate_create_qp(struct ibv_pd *qp_pd,
+				     struct ibv_qp_init_attr *init_attr)
+{
+	struct ibv_qp_init_attr_ex init_attr_ex = {
+		.send_cq = init_attr->send_cq,
+		.recv_cq = init_attr->recv_cq,
+		.cap	 = init_attr->cap,
+		.qp_type = init_attr->qp_type,
+		.comp_mask = IBV_QP_INIT_ATTR_PD |
+			     IBV_QP_INIT_ATTR_SEND_OPS_FLAGS,
+		.pd = qp_pd,
+		.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE,
+	};
+
+	if (!use_new_send)
+		return ibv_create_qp(qp_pd, init_attr);
+
+	return ibv_create_qp_ex(context, &init_attr_ex);
+}
+
+static int create_qp(struct rate_qp *rqp, struct rate_thread *t, int port)
+{
+	unsigned int depth = shared_qps ? window * num_threads : window;
+	struct ibv_qp_init_attr init_attr = {
+		.cap     = {
+			.max_send_wr  = depth,
+			.max_recv_wr  = 1,
+			.max_send_sge = 1,
+			.max_recv_sge = 1,
+			.max_inline_data = size,
+		},
+		.qp_type = IBV_QPT_RC
+	};
+	struct ibv_qp_attr attr = {
+		.qp_state        = IBV_QPS_INIT,
+		.port_num        = port,
+		.qp_access_flags = IBV_ACCESS_REMOTE_WRITE,
+	};
+
+	if (t && t->pad) {
+		struct ibv_cq_init_attr_ex cq_attr = {
+			.cqe = depth,
+			.comp_mask = IBV_CQ_INIT_ATTR_MASK_PD,
+			.parent_domain = t->pad,
+		};
+		struct ibv_cq_ex *cq_ex;
+
+		cq_ex = ibv_create_cq_ex(context, &cq_attr);
+		rqp->cq = cq_ex ? ibv_cq_ex_to_cq(cq_ex) : NULL;
+	} else {
+		rqp->cq = ibv_create_cq(context, depth, NULL, NULL, 0);
+	}
+	if (!rqp->cq) {
+		fprintf(stderr, "Couldn't create CQ\n");
+		return 1;
+	}
+
+	init_attr.send_cq = rqp->cq;
+	init_attr.recv_cq = rqp->cq;
+	rqp->qp = rate_create_qp(t && t->pad ? t->pad : pd, &init_attr);
+	if (!rqp->qp) {
+		/* Retry without inline data, for devices that have none */
+		init_attr.cap.max_inline_data = 0;
+		rqp->qp = rate_create_qp(t && t->pad ? t->pad : pd, &init_attr);
+		send_flags &= ~IBV_SEND_INLINE;
+	}
+	if (rqp->qp && use_new_send)
+		rqp->qpx = ibv_qp_to_qp_ex(rqp->qp);
+	if (!rqp->qp) {
+		fprintf(stderr, "Couldn't create QP\n");
+		return 1;
+	}
+
+	if (ibv_modify_qp(rqp->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			  IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+		fprintf(stderr, "Failed to modify QP to INIT\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int poll_qp(struct rate_qp *rqp)
+{
+	struct ibv_wc wc[16];
+	int ne, i;
+
+	ne = ibv_poll_cq(rqp->cq, 16, wc);
+	if (ne < 0) {
+		fprintf(stderr, "poll CQ failed %d\n", ne);
+		return 1;
+	}
+
+	for (i = 0; i < ne; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "Failed status %s (%d)\n",
+				ibv_wc_status_str(wc[i].status),
+				wc[i].status);
+			return 1;
+		}
+		/* The wr_id is the index of the posting thread */
+		atomic_fetch_sub(&threads[wc[i].wr_id].outstanding, 1);
+	}
+
+	return 0;
+}
+
+/* Posts n writes from the buffer of t with the work request builder API */
+static int post_writes_ex(struct rate_thread *t, struct rate_qp *rqp,
+			  unsigned int n)
+{
+	struct ibv_qp_ex *qpx = rqp->qpx;
+	unsigned int i;
+
+	ibv_wr_start(qpx);
+	for (i = 0; i < n; i++) {
+		qpx->wr_id = t->index;
+		qpx->wr_flags = send_flags;
+		ibv_wr_rdma_write(qpx, rqp->rem.rkey, rqp->rem.addr);
+		if (send_flags & IBV_SEND_INLINE)
+			ibv_wr_set_inline_data(qpx, t->buf, size);
+		else
+			ibv_wr_set_sge(qpx, mr->lkey, (uintptr_t)t->buf, size);
+	}
+
+	return ibv_wr_complete(qpx);
+}
+
+/* Posts n writes from the buffer of t as a list of work requests */
+static int post_writes(struct rate_thread *t, struct rate_qp *rqp,
+		       unsigned int n)
+{
+	struct ibv_send_wr wr[batch], *bad_wr;
+	struct ibv_sge sge = {
+		.addr	= (uintptr_t)t->buf,
+		.length = size,
+		.lkey	= mr->lkey
+	};
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		wr[i] = (struct ibv_send_wr) {
+			.wr_id	    = t->index,
+			.next	    = i + 1 < n ? &wr[i + 1] : NULL,
+			.sg_list    = &sge,
+			.num_sge    = 1,
+			.opcode     = IBV_WR_RDMA_WRITE,
+			.send_flags = send_flags,
+			.wr.rdma.remote_addr = rqp->rem.addr,
+			.wr.rdma.rkey = rqp->rem.rkey,
+		};
+	}
+
+	return ibv_post_send(rqp->qp, wr, &bad_wr);
+}
+
+static void *rate_thread(void *arg)
+{
+	struct rate_thread *t = arg;
+	unsigned int posted = 0, n;
+	struct rate_qp *rqp;
+	int next = t->index;
+
+	pthread_barrier_wait(&barrier);
+
+	while (posted < iters || atomic_load(&t->outstanding)) {
+		rqp = t->qps[next++ % t->num_qps];
+
+		n = iters - posted < batch ? iters - posted : batch;
+		if (n && atomic_load(&t->outstanding) + n <= window) {
+			atomic_fetch_add(&t->outstanding, n);
+			if (use_new_send ? post_writes_ex(t, rqp, n) :
+					   post_writes(t, rqp, n)) {
+				fprintf(stderr, "Couldn't post send\n");
+				t->err = 1;
+				break;
+			}
+			posted += n;
+			continue;
+		}
+
+		if (poll_qp(rqp)) {
+			t->err = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage:\n");
+	printf("  %s            start a server and wait for connection\n", argv0);
+	printf("  %s <host>     connect to server at <host>\n", argv0);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -p, --port=<port>      listen on/connect to port <port> (default 18515)\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+	printf("  -g, --gid-idx=<gid index> local port gid index\n");
+	printf("  -m, --mtu=<size>       path MTU (default 1024)\n");
+	printf("  -l, --sl=<sl>          service level value\n");
+	printf("  -s, --size=<size>      size of the RDMA writes (default 8)\n");
+	printf("  -n, --iters=<iters>    number of writes of each thread (default 1000000)\n");
+	printf("  -w, --window=<wrs>     writes outstanding in each thread (default 64)\n");
+	printf("  -b, --batch=<wrs>      writes posted by each ibv_post_send (default 1)\n");
+	printf("  -T, --threads=<num>    number of threads (default 1)\n");
+	printf("  -q, --qps=<num>        number of QPs of each thread (default 1)\n");
+	printf("  -S, --shared           all threads post to the same QPs\n");
+	printf("  -D, --thread-domain    use a thread domain for the QPs of each thread\n");
+	printf("  -N, --new_send         post with the work request builder API (ibv_wr_*)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device **dev_list;
+	struct ibv_device *ib_dev;
+	struct ibv_port_attr portinfo;
+	struct rate_dest *my_dest, *rem_dest;
+	struct timespec start, end;
+	char *ib_devname = NULL;
+	char *servername = NULL;
+	unsigned int port = 18515;
+	int ib_port = 1;
+	enum ibv_mtu mtu = IBV_MTU_1024;
+	int sl = 0;
+	int gidx = -1;
+	int sockfd, access, i, j, err = 0;
+	size_t buf_size;
+	double usec;
+
+	srand48(getpid() * time(NULL));
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "port",     .has_arg = 1, .val = 'p' },
+			{ .name = "ib-dev",   .has_arg = 1, .val = 'd' },
+			{ .name = "ib-port",  .has_arg = 1, .val = 'i' },
+			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
+			{ .name = "mtu",      .has_arg = 1, .val = 'm' },
+			{ .name = "sl",       .has_arg = 1, .val = 'l' },
+			{ .name = "size",     .has_arg = 1, .val = 's' },
+			{ .name = "iters",    .has_arg = 1, .val = 'n' },
+			{ .name = "window",   .has_arg = 1, .val = 'w' },
+			{ .name = "batch",    .has_arg = 1, .val = 'b' },
+			{ .name = "threads",  .has_arg = 1, .val = 'T' },
+			{ .name = "qps",      .has_arg = 1, .val = 'q' },
+			{ .name = "shared",   .has_arg = 0, .val = 'S' },
+			{ .name = "thread-domain", .has_arg = 0, .val = 'D' },
+			{ .name = "new_send", .has_arg = 0, .val = 'N' },
+			{}
+		};
+
+		c = getopt_long(argc, argv, "p:d:i:g:m:l:s:n:w:b:T:q:SDN",
+				long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+		case 'i':
+			ib_port = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			gidx = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			mtu = pp_mtu_to_enum(strtol(optarg, NULL, 0));
+			break;
+		case 'l':
+			sl = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			num_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'q':
+			qps_per_thread = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			shared_qps = 1;
+			break;
+		case 'D':
+			use_td = 1;
+			break;
+		case 'N':
+			use_new_send = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind == argc - 1)
+		servername = strdupa(argv[optind]);
+	else if (optind < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* A thread domain promises a single thread per QP */
+	if (port > 65535 || ib_port < 1 || !mtu || !size || !window ||
+	    !batch || batch > window || num_threads < 1 ||
+	    qps_per_thread < 1 || (shared_qps && use_td)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	num_qps = shared_qps ? qps_per_thread : num_threads * qps_per_thread;
+
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		perror("Failed to get IB devices list");
+		return 1;
+	}
+
+	for (i = 0; (ib_dev = dev_list[i]); ++i)
+		if (!ib_devname ||
+		    !strcmp(ibv_get_device_name(ib_dev), ib_devname))
+			break;
+	if (!ib_dev) {
+		fprintf(stderr, "IB device %s not found\n",
+			ib_devname ? ib_devname : "");
+		return 1;
+	}
+
+	context = ibv_open_device(ib_dev);
+	if (!context) {
+		fprintf(stderr, "Couldn't get context for %s\n",
+			ibv_get_device_name(ib_dev));
+		return 1;
+	}
+
+	pd = ibv_alloc_pd(context);
+	if (!pd) {
+		fprintf(stderr, "Couldn't allocate PD\n");
+		return 1;
+	}
+
+	/* The server is written to in one slot per QP, the client sends
+	 * from one slot per thread.
+	 */
+	buf_size = (size_t)size * (servername ? num_threads : num_qps);
+	access = IBV_ACCESS_LOCAL_WRITE;
+	if (!servername)
+		access |= IBV_ACCESS_REMOTE_WRITE;
+	if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), buf_size)) {
+		fprintf(stderr, "Couldn't allocate work buf.\n");
+		return 1;
+	}
+	memset(buf, 0x7b, buf_size);
+	mr = ibv_reg_mr(pd, buf, buf_size, access);
+	if (!mr) {
+		fprintf(stderr, "Couldn't register MR\n");
+		return 1;
+	}
+
+	threads = calloc(num_threads, sizeof(*threads));
+	qps = calloc(num_qps, sizeof(*qps));
+	my_dest = calloc(num_qps, sizeof(*my_dest));
+	rem_dest = calloc(num_qps, sizeof(*rem_dest));
+	if (!threads || !qps || !my_dest || !rem_dest)
+		return 1;
+
+	if (servername && size <= 64)
+		send_flags |= IBV_SEND_INLINE;
+
+	for (i = 0; i < num_threads; i++) {
+		struct rate_thread *t = &threads[i];
+
+		t->index = i;
+		t->buf = buf + (size_t)size * i;
+		t->num_qps = servername ? (shared_qps ? num_qps :
+					   qps_per_thread) : 0;
+		t->qps = calloc(qps_per_thread, sizeof(*t->qps));
+		if (!t->qps)
+			return 1;
+
+		if (use_td) {
+			struct ibv_td_init_attr td_attr = {};
+			struct ibv_parent_domain_init_attr pad_attr = {};
+
+			t->td = ibv_alloc_td(context, &td_attr);
+			if (!t->td) {
+				fprintf(stderr, "Couldn't allocate thread domain\n");
+				return 1;
+			}
+			pad_attr.pd = pd;
+			pad_attr.td = t->td;
+			t->pad = ibv_alloc_parent_domain(context, &pad_attr);
+			if (!t->pad) {
+				fprintf(stderr, "Couldn't allocate parent domain\n");
+				return 1;
+			}
+		}
+	}
+
+	for (i = 0; i < num_qps; i++) {
+		struct rate_thread *t = shared_qps ? NULL :
+					&threads[i / qps_per_thread];
+
+		if (create_qp(&qps[i], t, ib_port))
+			return 1;
+		if (t)
+			t->qps[i % qps_per_thread] = &qps[i];
+		else
+			for (j = 0; j < num_threads; j++)
+				threads[j].qps[i] = &qps[i];
+	}
+
+	if (pp_get_port_info(context, ib_port, &portinfo)) {
+		fprintf(stderr, "Couldn't get port info\n");
+		return 1;
+	}
+	if (gidx >= 0 && ibv_query_gid(context, ib_port, gidx,
+				       &my_dest[0].gid)) {
+		fprintf(stderr, "can't read sgid of index %d\n", gidx);
+		return 1;
+	}
+	for (i = 0; i < num_qps; i++) {
+		my_dest[i].lid = portinfo.lid;
+		my_dest[i].gid = my_dest[0].gid;
+		my_dest[i].qpn = qps[i].qp->qp_num;
+		my_dest[i].psn = lrand48() & 0xffffff;
+		my_dest[i].rkey = mr->rkey;
+		my_dest[i].addr = (uintptr_t)buf +
+			(servername ? 0 : (size_t)size * i);
+	}
+
+	sockfd = exch_socket(servername, port);
+	if (sockfd < 0)
+		return 1;
+
+	if (servername ? write_dests(sockfd, my_dest) ||
+			 read_dests(sockfd, rem_dest) :
+			 read_dests(sockfd, rem_dest) ||
+			 write_dests(sockfd, my_dest)) {
+		fprintf(stderr, "Couldn't exchange addresses\n");
+		return 1;
+	}
+
+	for (i = 0; i < num_qps; i++) {
+		qps[i].rem = rem_dest[i];
+		if (rate_connect(qps[i].qp, ib_port, my_dest[i].psn, mtu, sl,
+				 &rem_dest[i], gidx))
+			return 1;
+	}
+
+	if (!servername) {
+		char done[sizeof "done"];
+
+		/* The client writes until it tells that it is done */
+		if (write(sockfd, "ready", sizeof "ready") != sizeof "ready" ||
+		    read(sockfd, done, sizeof done) != sizeof done) {
+			fprintf(stderr, "Couldn't wait for the client\n");
+			return 1;
+		}
+		close(sockfd);
+		goto out;
+	}
+
+	{
+		char ready[sizeof "ready"];
+
+		if (read(sockfd, ready, sizeof ready) != sizeof ready) {
+			fprintf(stderr, "Couldn't sync with the server\n");
+			return 1;
+		}
+	}
+
+	pthread_barrier_init(&barrier, NULL, num_threads + 1);
+	for (i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL, rate_thread,
+				   &threads[i])) {
+			fprintf(stderr, "Couldn't create thread\n");
+			return 1;
+		}
+
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		err |= threads[i].err;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (write(sockfd, "done", sizeof "done") != sizeof "done")
+		fprintf(stderr, "Couldn't tell the server that the client is done\n");
+	close(sockfd);
+	if (err)
+		return 1;
+
+	usec = (end.tv_sec - start.tv_sec) * 1e6 +
+	       (end.tv_nsec - start.tv_nsec) / 1e3;
+	printf("%d threads, %d %sQPs, %s: %llu writes of %u bytes in %.2f seconds = %.3f million writes/sec\n",
+	       num_threads, num_qps, shared_qps ? "shared " : "",
+	       use_new_send ? "ibv_wr_*" : "ibv_post_send",
+	       (unsigned long long)iters * num_threads, size, usec / 1e6,
+	       (double)iters * num_threads / usec);
+
+out:
+	for (i = 0; i < num_qps; i++) {
+		ibv_destroy_qp(qps[i].qp);
+		ibv_destroy_cq(qps[i].cq);
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (threads[i].pad)
+			ibv_dealloc_pd(threads[i].pad);
+		if (threads[i].td)
+			ibv_dealloc_td(threads[i].td);
+		free(threads[i].qps);
+	}
+	ibv_dereg_mr(mr);
+	ibv_dealloc_pd(pd);
+	ibv_close_device(context);
+	ibv_free_device_list(dev_list);
+	free(buf);
+	free(threads);
+	free(qps);
+	free(my_dest);
+	free(rem_dest);
+
+	return 0;
+}
@@ -36,6 +36,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -77,16 +79,26 @@ struct pingpong_dest {
 	union ibv_gid gid;
 };
 
+static void pp_init_ah_attr(struct ibv_ah_attr *ah_attr, int port, int sl,
+			    struct pingpong_dest *dest, int sgid_idx)
+{
+	memset(ah_attr, 0, sizeof *ah_attr);
+	ah_attr->dlid = dest->lid;
+	ah_attr->sl = sl;
+	ah_attr->port_num = port;
+
+	if (dest->gid.global.interface_id) {
+		ah_attr->is_global = 1;
+		ah_attr->grh.hop_limit = 1;
+		ah_attr->grh.dgid = dest->gid;
+		ah_attr->grh.sgid_index = sgid_idx;
+	}
+}
+
 static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 			  int sl, struct pingpong_dest *dest, int sgid_idx)
 {
-	struct ibv_ah_attr ah_attr = {
-		.is_global     = 0,
-		.dlid          = dest->lid,
-		.sl            = sl,
-		.src_path_bits = 0,
-		.port_num      = port
-	};
+	struct ibv_ah_attr ah_attr;
 	struct ibv_qp_attr attr = {
 		.qp_state		= IBV_QPS_RTR
 	};
@@ -106,13 +118,7 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 		return 1;
 	}
 
-	if (dest->gid.global.interface_id) {
-		ah_attr.is_global = 1;
-		ah_attr.grh.hop_limit = 1;
-		ah_attr.grh.dgid = dest->gid;
-		ah_attr.grh.sgid_index = sgid_idx;
-	}
-
+	pp_init_ah_attr(&ah_attr, port, sl, dest, sgid_idx);
 	ctx->ah = ibv_create_ah(ctx->pd, &ah_attr);
 	if (!ctx->ah) {
 		fprintf(stderr, "Failed to create AH\n");
@@ -531,6 +537,66 @@ static int pp_post_send(struct pingpong_context *ctx, uint32_t qpn)
 	return ibv_post_send(ctx->qp, &wr, &bad_wr);
 }
 
+static double pp_time_ah(struct pingpong_context *ctx,
+			 struct ibv_ah_attr *ah_attr, int iters)
+{
+	struct timeval start, end;
+	struct ibv_ah *ah;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iters; i++) {
+		ah = ibv_create_ah(ctx->pd, ah_attr);
+		if (!ah) {
+			fprintf(stderr, "Failed to create AH\n");
+			return -1;
+		}
+		ibv_destroy_ah(ah);
+	}
+	gettimeofday(&end, NULL);
+
+	return ((end.tv_sec - start.tv_sec) * 1000000. +
+		(end.tv_usec - start.tv_usec)) / iters;
+}
+
+/*
+ * libibverbs only serves GIDs from its cache once the application reads
+ * async events, which keep the cache current.  Time AH creation before
+ * and after polling for an event.
+ */
+static int pp_bench_ah(struct pingpong_context *ctx, int port, int sl,
+		       struct pingpong_dest *dest, int sgid_idx, int iters)
+{
+	struct ibv_async_event event;
+	struct ibv_ah_attr ah_attr;
+	double before, after;
+	int flags;
+
+	pp_init_ah_attr(&ah_attr, port, sl, dest, sgid_idx);
+	before = pp_time_ah(ctx, &ah_attr, iters);
+	if (before < 0)
+		return 1;
+
+	flags = fcntl(ctx->context->async_fd, F_GETFL);
+	if (fcntl(ctx->context->async_fd, F_SETFL, flags | O_NONBLOCK)) {
+		perror("fcntl");
+		return 1;
+	}
+	if (!ibv_get_async_event(ctx->context, &event))
+		ibv_ack_async_event(&event);
+	else if (errno != EAGAIN)
+		perror("ibv_get_async_event");
+	fcntl(ctx->context->async_fd, F_SETFL, flags);
+
+	after = pp_time_ah(ctx, &ah_attr, iters);
+	if (after < 0)
+		return 1;
+
+	printf("%d AHs: %.2f usec/AH uncached, %.2f usec/AH cached\n",
+	       iters, before, after);
+	return 0;
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -547,6 +613,7 @@ static void usage(const char *argv0)
         printf("  -l, --sl=<SL>          send messages with service level <SL> (default 0)\n");
 	printf("  -e, --events           sleep on CQ events (default poll)\n");
 	printf("  -g, --gid-idx=<gid index> local port gid index\n");
+	printf("  -A, --ah-iters=<iters> time creating <iters> AHs before the test\n");
 }
 
 int main(int argc, char *argv[])
@@ -570,6 +637,7 @@ int main(int argc, char *argv[])
 	int                      num_cq_events = 0;
 	int                      sl = 0;
 	int			 gidx = -1;
+	int			 ah_iters = 0;
 	char			 gid[33];
 
 	srand48(getpid() * time(NULL));
@@ -587,10 +655,11 @@ int main(int argc, char *argv[])
 			{ .name = "sl",       .has_arg = 1, .val = 'l' },
 			{ .name = "events",   .has_arg = 0, .val = 'e' },
 			{ .name = "gid-idx",  .has_arg = 1, .val = 'g' },
+			{ .name = "ah-iters", .has_arg = 1, .val = 'A' },
 			{}
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:s:r:n:l:eg:",
+		c = getopt_long(argc, argv, "p:d:i:s:r:n:l:eg:A:",
 							long_options, NULL);
 		if (c == -1)
 			break;
@@ -640,6 +709,10 @@ int main(int argc, char *argv[])
 			gidx = strtol(optarg, NULL, 0);
 			break;
 
+		case 'A':
+			ah_iters = strtol(optarg, NULL, 0);
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -735,6 +808,10 @@ int main(int argc, char *argv[])
 									gidx))
 			return 1;
 
+	if (ah_iters > 0)
+		if (pp_bench_ah(ctx, ib_port, sl, rem_dest, gidx, ah_iters))
+			return 1;
+
 	ctx->pending = PINGPONG_RECV_WRID;
 
 	if (servername) {
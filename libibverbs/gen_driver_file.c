@@ -0,0 +1,89 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/* Build time helper that writes the libibverbs.d configuration file for a
+ * provider.  The provider is dlopened and the verbs_device_ops it registers
+ * are captured by the verbs_register_driver defined below, which the dynamic
+ * linker prefers over the one in libibverbs since this executable exports
+ * it.  Each entry in the match table of the provider is written out as a
+ * 'match' line, allowing libibverbs to only load the provider when a device
+ * it supports is present.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include <infiniband/driver.h>
+
+#define MAX_OPS 8
+
+static const struct verbs_device_ops *ops_list[MAX_OPS];
+static unsigned int num_ops;
+
+void verbs_register_driver(const struct verbs_device_ops *ops)
+{
+	if (num_ops < MAX_OPS)
+		ops_list[num_ops++] = ops;
+}
+
+static void write_match(FILE *out, const struct verbs_match_ent *ent)
+{
+	switch (ent->kind) {
+	case VERBS_MATCH_MODALIAS:
+		fprintf(out, "match %s\n", ent->modalias);
+		break;
+	case VERBS_MATCH_PCI:
+		fprintf(out, "match pci:v%08Xd%08Xsv*\n", ent->vendor,
+			ent->device);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const struct verbs_match_ent *ent;
+	unsigned int i;
+	void *dlhandle;
+	FILE *out;
+
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s PROVIDER DRIVER OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	dlhandle = dlopen(argv[1], RTLD_NOW);
+	if (!dlhandle) {
+		fprintf(stderr, "%s: couldn't load '%s': %s\n", argv[0],
+			argv[1], dlerror());
+		return 1;
+	}
+
+	out = fopen(argv[3], "w");
+	if (!out) {
+		perror(argv[3]);
+		return 1;
+	}
+
+	fprintf(out, "driver %s\n", argv[2]);
+
+	/* A provider without a match table, or one that could not be
+	 * captured, is written without match lines and is always loaded.
+	 */
+	for (i = 0; i < num_ops; i++)
+		if (!ops_list[i]->match_table)
+			num_ops = 0;
+
+	for (i = 0; i < num_ops; i++)
+		for (ent = ops_list[i]->match_table;
+		     ent->kind != VERBS_MATCH_SENTINEL; ent++)
+			write_match(out, ent);
+
+	if (fclose(out)) {
+		perror(argv[3]);
+		return 1;
+	}
+	return 0;
+}
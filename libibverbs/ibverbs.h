@@ -44,8 +44,14 @@
 
 #define PFX		"libibverbs: "
 
-struct ibv_abi_compat_v2 {
+struct verbs_comp_channel {
 	struct ibv_comp_channel	channel;
+	/* O_NONBLOCK of the fd, -1 until ibv_get_cq_events() looks it up */
+	int			nonblock;
+};
+
+struct ibv_abi_compat_v2 {
+	struct verbs_comp_channel channel;
 	pthread_mutex_t		in_use;
 };
 
@@ -56,11 +62,45 @@ int ibverbs_init(void);
 void ibverbs_device_put(struct ibv_device *dev);
 void ibverbs_device_hold(struct ibv_device *dev);
 
+struct ibv_gid_cache_entry {
+	union ibv_gid		gid;
+	enum ibv_gid_type	type;
+	int			gid_err;	/* errno from sysfs, or 0 */
+	int			type_err;
+};
+
+struct ibv_pkey_cache_entry {
+	__be16			pkey;
+	int			err;
+};
+
+/*
+ * The GID and P_Key tables of a port, read from sysfs.  The tables are
+ * valid while seq is odd.  Readers do not take a lock, but retry if seq
+ * changes while they read.  Updates are serialized by cache_lock.
+ */
+struct ibv_port_cache {
+	atomic_uint			seq;
+	int				gid_tbl_len;
+	int				pkey_tbl_len;
+	struct ibv_gid_cache_entry	*gid;
+	struct ibv_pkey_cache_entry	*pkey;
+};
+
 struct verbs_ex_private {
 	struct ibv_cq_ex *(*create_cq_ex)(struct ibv_context *context,
 					  struct ibv_cq_init_attr_ex *init_attr);
+	pthread_mutex_t			cache_lock;
+	_Atomic(struct ibv_port_cache *) port_cache;
+	int				num_ports;
+	/* set once the application reads async events for the context */
+	atomic_bool			cache_trusted;
 };
 
+void ibverbs_init_cache(struct verbs_ex_private *priv);
+void ibverbs_free_cache(struct verbs_ex_private *priv);
+void ibverbs_invalidate_cache(struct ibv_context *context, uint8_t port_num);
+
 #define IBV_INIT_CMD(cmd, size, opcode)					\
 	do {								\
 		if (abi_ver > 2)					\
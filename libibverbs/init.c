@@ -47,6 +47,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <fnmatch.h>
+#include <inttypes.h>
+#include <endian.h>
 
 #include <util/util.h>
 #include "ibverbs.h"
@@ -56,6 +58,9 @@ int abi_ver;
 struct ibv_driver_name {
 	struct list_node	entry;
 	char		       *name;
+	/* From the match lines of the config file, NULL if there are none */
+	struct verbs_match_ent *match_table;
+	unsigned int		num_match;
 };
 
 struct ibv_driver {
@@ -66,12 +71,56 @@ struct ibv_driver {
 static LIST_HEAD(driver_name_list);
 static LIST_HEAD(driver_list);
 
-static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
+/* Decode the vendor and device IDs from a modalias of the form
+ * pci:vXXXXXXXXdXXXXXXXX..., returning the remainder of the string or NULL.
+ */
+static const char *parse_pci_modalias(const char *value, uint32_t *vendor,
+				      uint32_t *device)
+{
+	int len = 0;
+
+	if (sscanf(value, "pci:v%8" SCNx32 "d%8" SCNx32 "%n", vendor, device,
+		   &len) != 2 || len != 22)
+		return NULL;
+	return value + len;
+}
+
+static int same_sysfs_dev(struct verbs_sysfs_dev *sysfs1,
+			  struct verbs_sysfs_dev *sysfs2)
+{
+	if (!strcmp(sysfs1->sysfs_name, sysfs2->sysfs_name) &&
+	    ts_cmp(&sysfs1->time_created,
+		   &sysfs2->time_created, ==))
+		return 1;
+	return 0;
+}
+
+static struct verbs_device *find_old_dev(struct list_head *old_list,
+					 struct verbs_sysfs_dev *sysfs_dev)
+{
+	struct verbs_device *vdev;
+
+	list_for_each(old_list, vdev, entry)
+		if (same_sysfs_dev(vdev->sysfs, sysfs_dev))
+			return vdev;
+	return NULL;
+}
+
+/* Devices in old_list that are still present in sysfs are moved back to
+ * device_list without reading the rest of their attributes, the others are
+ * returned in tmp_sysfs_dev_list.
+ */
+static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list,
+			   struct list_head *old_list,
+			   struct list_head *device_list,
+			   unsigned int *num_devices)
 {
 	char class_path[IBV_SYSFS_PATH_MAX];
 	DIR *class_dir;
 	struct dirent *dent;
 	struct verbs_sysfs_dev *sysfs_dev = NULL;
+	struct verbs_device *vdev;
+	const char *tail;
 	char value[8];
 	int ret = 0;
 
@@ -135,6 +184,14 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 
 		sysfs_dev->time_created = buf.st_mtim;
 
+		vdev = find_old_dev(old_list, sysfs_dev);
+		if (vdev) {
+			list_del(&vdev->entry);
+			list_add(device_list, &vdev->entry);
+			(*num_devices)++;
+			continue;
+		}
+
 		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path, "abi_version",
 					value, sizeof value) > 0)
 			sysfs_dev->abi_ver = strtol(value, NULL, 10);
@@ -144,6 +201,12 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 					sizeof(sysfs_dev->modalias)) <= 0)
 			sysfs_dev->modalias[0] = 0;
 
+		tail = parse_pci_modalias(sysfs_dev->modalias,
+					  &sysfs_dev->pci_vendor,
+					  &sysfs_dev->pci_device);
+		if (!tail || strncmp(tail, "sv", 2))
+			sysfs_dev->pci_vendor = UINT32_MAX;
+
 		list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
 		sysfs_dev      = NULL;
 	}
@@ -222,9 +285,40 @@ out_dlopen:
 	return;
 }
 
-static void load_drivers(void)
+static const struct verbs_match_ent *
+match_modalias_device(const struct verbs_match_ent *table,
+		      struct verbs_sysfs_dev *sysfs_dev);
+static const struct verbs_match_ent *
+match_name(const struct verbs_match_ent *table,
+	   struct verbs_sysfs_dev *sysfs_dev);
+
+/* True if a device in sysfs_list matches the config file match lines */
+static bool driver_needed(struct ibv_driver_name *name,
+			  struct list_head *sysfs_list)
+{
+	struct verbs_sysfs_dev *sysfs_dev;
+
+	if (!name->match_table)
+		return true;
+
+	list_for_each(sysfs_list, sysfs_dev, entry)
+		if (match_name(name->match_table, sysfs_dev) ||
+		    match_modalias_device(name->match_table, sysfs_dev))
+			return true;
+
+	return false;
+}
+
+/* Load the drivers that may support the devices in sysfs_list.  Drivers
+ * named by the config files are only loaded when one of their match lines
+ * matches a device, so the remaining ones are kept for devices that are
+ * added later.  Returns the number of drivers loaded.
+ */
+static unsigned int load_drivers(struct list_head *sysfs_list)
 {
 	struct ibv_driver_name *name, *next_name;
+	static bool env_loaded;
+	unsigned int loaded = 0;
 	const char *env;
 	char *list, *env_name;
 
@@ -232,27 +326,81 @@ static void load_drivers(void)
 	 * Only use drivers passed in through the calling user's
 	 * environment if we're not running setuid.
 	 */
-	if (getuid() == geteuid()) {
+	if (!env_loaded && getuid() == geteuid()) {
 		if ((env = getenv("RDMAV_DRIVERS"))) {
 			list = strdupa(env);
-			while ((env_name = strsep(&list, ":;")))
+			while ((env_name = strsep(&list, ":;"))) {
 				load_driver(env_name);
+				loaded++;
+			}
 		} else if ((env = getenv("IBV_DRIVERS"))) {
 			list = strdupa(env);
-			while ((env_name = strsep(&list, ":;")))
+			while ((env_name = strsep(&list, ":;"))) {
 				load_driver(env_name);
+				loaded++;
+			}
 		}
 	}
+	env_loaded = true;
 
 	list_for_each_safe(&driver_name_list, name, next_name, entry) {
+		if (!driver_needed(name, sysfs_list))
+			continue;
+
 		load_driver(name->name);
+		loaded++;
+		list_del(&name->entry);
+		free(name->match_table);
 		free(name->name);
 		free(name);
 	}
+
+	return loaded;
+}
+
+/* Add a match line of a config file to the match table of a driver.  PCI
+ * matches in the form written by rdma_driver_file() are decoded so they can
+ * be compared without fnmatch().
+ */
+static void add_driver_match(struct ibv_driver_name *name, const char *value)
+{
+	struct verbs_match_ent *table, *ent;
+	const char *tail;
+	uint32_t vendor, device;
+
+	table = realloc(name->match_table,
+			(name->num_match + 2) * sizeof(*table));
+	if (!table) {
+		fprintf(stderr, PFX "Warning: couldn't allocate match for "
+			"driver '%s'.\n", name->name);
+		return;
+	}
+	name->match_table = table;
+
+	ent = &table[name->num_match];
+	memset(ent, 0, 2 * sizeof(*ent));
+
+	tail = parse_pci_modalias(value, &vendor, &device);
+	if (tail && !strcmp(tail, "sv*") && vendor <= UINT16_MAX &&
+	    device <= UINT16_MAX) {
+		ent->kind = VERBS_MATCH_PCI;
+		ent->vendor = vendor;
+		ent->device = device;
+	} else {
+		ent->modalias = strdup(value);
+		if (!ent->modalias) {
+			fprintf(stderr, PFX "Warning: couldn't allocate match "
+				"for driver '%s'.\n", name->name);
+			return;
+		}
+		ent->kind = VERBS_MATCH_MODALIAS;
+	}
+	name->num_match++;
 }
 
 static void read_config_file(const char *path)
 {
+	struct ibv_driver_name *last_driver = NULL;
 	FILE *conf;
 	char *line = NULL;
 	char *config;
@@ -277,10 +425,12 @@ static void read_config_file(const char *path)
 		if (strcmp(field, "driver") == 0 && config != NULL) {
 			struct ibv_driver_name *driver_name;
 
+			last_driver = NULL;
+
 			config += strspn(config, "\t ");
 			field = strsep(&config, "\n\t ");
 
-			driver_name = malloc(sizeof *driver_name);
+			driver_name = calloc(1, sizeof *driver_name);
 			if (!driver_name) {
 				fprintf(stderr, PFX "Warning: couldn't allocate "
 					"driver name '%s'.\n", field);
@@ -296,6 +446,12 @@ static void read_config_file(const char *path)
 			}
 
 			list_add(&driver_name_list, &driver_name->entry);
+			last_driver = driver_name;
+		} else if (strcmp(field, "match") == 0 && config != NULL &&
+			   last_driver) {
+			config += strspn(config, "\t ");
+			field = strsep(&config, "\n\t ");
+			add_driver_match(last_driver, field);
 		} else
 			fprintf(stderr, PFX "Warning: ignoring bad config directive "
 				"'%s' in file '%s'.\n", field, path);
@@ -364,25 +520,32 @@ static bool match_modalias(const struct verbs_match_ent *ent, const char *value)
 }
 
 /* Search a null terminated table of verbs_match_ent's and return the one
- * that matches the device the verbs sysfs device is bound to or NULL.
+ * that matches the device the verbs sysfs device is bound to or NULL.  PCI
+ * entries are compared with the IDs decoded from the modalias when the
+ * device was found.
  */
 static const struct verbs_match_ent *
-match_modalias_device(const struct verbs_device_ops *ops,
+match_modalias_device(const struct verbs_match_ent *table,
 		      struct verbs_sysfs_dev *sysfs_dev)
 {
 	const struct verbs_match_ent *i;
 
-	for (i = ops->match_table; i->kind != VERBS_MATCH_SENTINEL; i++)
-		if (match_modalias(i, sysfs_dev->modalias))
+	for (i = table; i->kind != VERBS_MATCH_SENTINEL; i++) {
+		if (i->kind == VERBS_MATCH_PCI) {
+			if (i->vendor == sysfs_dev->pci_vendor &&
+			    i->device == sysfs_dev->pci_device)
+				return i;
+		} else if (match_modalias(i, sysfs_dev->modalias))
 			return i;
+	}
 
 	return NULL;
 }
 
 /* Match the device name itself */
 static const struct verbs_match_ent *
-match_name(const struct verbs_device_ops *ops,
-		      struct verbs_sysfs_dev *sysfs_dev)
+match_name(const struct verbs_match_ent *table,
+	   struct verbs_sysfs_dev *sysfs_dev)
 {
 	char name_ma[100];
 	const struct verbs_match_ent *i;
@@ -391,8 +554,8 @@ match_name(const struct verbs_device_ops *ops,
 			    "rdma_device:N%s", sysfs_dev->ibdev_name))
 		return NULL;
 
-	for (i = ops->match_table; i->kind != VERBS_MATCH_SENTINEL; i++)
-		if (match_modalias(i, name_ma))
+	for (i = table; i->kind != VERBS_MATCH_SENTINEL; i++)
+		if (i->kind != VERBS_MATCH_PCI && match_modalias(i, name_ma))
 			return i;
 
 	return NULL;
@@ -407,10 +570,10 @@ static bool match_device(const struct verbs_device_ops *ops,
 		 * devices like rxe can attach to a random modalias, including
 		 * ones that match other providers.
 		 */
-		sysfs_dev->match = match_name(ops, sysfs_dev);
+		sysfs_dev->match = match_name(ops->match_table, sysfs_dev);
 		if (!sysfs_dev->match)
 			sysfs_dev->match =
-			    match_modalias_device(ops, sysfs_dev);
+			    match_modalias_device(ops->match_table, sysfs_dev);
 	}
 
 	if (ops->match_device) {
@@ -557,16 +720,6 @@ static void check_memlock_limit(void)
 			rlim.rlim_cur);
 }
 
-static int same_sysfs_dev(struct verbs_sysfs_dev *sysfs1,
-			  struct verbs_sysfs_dev *sysfs2)
-{
-	if (!strcmp(sysfs1->sysfs_name, sysfs2->sysfs_name) &&
-	    ts_cmp(&sysfs1->time_created,
-		   &sysfs2->time_created, ==))
-		return 1;
-	return 0;
-}
-
 /* Match every ibv_sysfs_dev in the sysfs_list to a driver and add a new entry
  * to device_list. Once matched to a driver the entry in sysfs_list is
  * removed.
@@ -593,44 +746,36 @@ static void try_all_drivers(struct list_head *sysfs_list,
 int ibverbs_get_device_list(struct list_head *device_list)
 {
 	LIST_HEAD(sysfs_list);
+	LIST_HEAD(old_list);
 	struct verbs_sysfs_dev *sysfs_dev, *next_dev;
 	struct verbs_device *vdev, *tmp;
 	static int drivers_loaded;
+	static int statically_linked;
 	unsigned int num_devices = 0;
-	int statically_linked = 0;
 	int ret;
 
-	ret = find_sysfs_devs(&sysfs_list);
-	if (ret)
-		return -ret;
-
-	/* Remove entries from the sysfs_list that are already preset in the
-	 * device_list, and remove entries from the device_list that are not
-	 * present in the sysfs_list.
+	/* Entries of the device_list that are still present in sysfs are
+	 * moved back by find_sysfs_devs(), and are not returned in the
+	 * sysfs_list.  Anything left in old_list has been removed.
 	 */
-	list_for_each_safe(device_list, vdev, tmp, entry) {
-		struct verbs_sysfs_dev *old_sysfs = NULL;
-
-		list_for_each(&sysfs_list, sysfs_dev, entry) {
-			if (same_sysfs_dev(vdev->sysfs, sysfs_dev)) {
-				old_sysfs = sysfs_dev;
-				break;
-			}
-		}
+	list_append_list(&old_list, device_list);
+	ret = find_sysfs_devs(&sysfs_list, &old_list, device_list,
+			      &num_devices);
+	if (ret) {
+		list_append_list(device_list, &old_list);
+		list_for_each_safe(&sysfs_list, sysfs_dev, next_dev, entry)
+			free(sysfs_dev);
+		return -ret;
+	}
 
-		if (old_sysfs) {
-			list_del(&old_sysfs->entry);
-			free(old_sysfs);
-			num_devices++;
-		} else {
-			list_del(&vdev->entry);
-			ibverbs_device_put(&vdev->device);
-		}
+	list_for_each_safe(&old_list, vdev, tmp, entry) {
+		list_del(&vdev->entry);
+		ibverbs_device_put(&vdev->device);
 	}
 
 	try_all_drivers(&sysfs_list, device_list, &num_devices);
 
-	if (list_empty(&sysfs_list) || drivers_loaded)
+	if (list_empty(&sysfs_list) || statically_linked)
 		goto out;
 
 	/*
@@ -642,7 +787,7 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	 * libdl to go along with the static copies the executable
 	 * has, which quickly leads to a crash.
 	 */
-	{
+	if (!drivers_loaded) {
 		void *hand = dlopen(NULL, RTLD_NOW);
 		if (!hand) {
 			fprintf(stderr, PFX "Warning: dlopen(NULL) failed, "
@@ -651,12 +796,12 @@ int ibverbs_get_device_list(struct list_head *device_list)
 			goto out;
 		}
 		dlclose(hand);
+		drivers_loaded = 1;
 	}
 
-	load_drivers();
-	drivers_loaded = 1;
-
-	try_all_drivers(&sysfs_list, device_list, &num_devices);
+	/* Drivers are loaded as devices that they match are found */
+	if (load_drivers(&sysfs_list))
+		try_all_drivers(&sysfs_list, device_list, &num_devices);
 
 out:
 	/* Anything left in sysfs_list was not assoicated with a
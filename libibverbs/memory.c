@@ -43,6 +43,7 @@
 #include <dirent.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 #include "ibverbs.h"
 
@@ -63,6 +64,57 @@ static int page_size;
 static int huge_page_enabled;
 static int too_late;
 
+/*
+ * Nodes are taken from a free list under mm_mutex.  They are not given
+ * back to malloc, since registrations tend to come back to the same ranges.
+ */
+#define MM_NODE_CHUNK	64
+
+static struct ibv_mem_node *mm_free_nodes;
+
+/*
+ * With RDMAV_HUGEPAGES_SAFE the page size of every range is needed.  The
+ * mappings of the process are read from smaps once and kept sorted, so that
+ * a lookup is a binary search under the read lock.  The map is read again
+ * when an address is not found in it, or when madvise() fails with a page
+ * size that may be stale.
+ */
+struct ibv_vma {
+	uintptr_t		start, end;
+	unsigned long		page_size;
+};
+
+static struct ibv_vma *vma_map;
+static size_t vma_count;
+static pthread_rwlock_t vma_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct ibv_mem_node *mm_node_alloc(void)
+{
+	struct ibv_mem_node *node;
+	int i;
+
+	if (!mm_free_nodes) {
+		node = malloc(MM_NODE_CHUNK * sizeof(*node));
+		if (!node)
+			return NULL;
+
+		for (i = 0; i < MM_NODE_CHUNK - 1; i++)
+			node[i].right = &node[i + 1];
+		node[i].right = NULL;
+		mm_free_nodes = node;
+	}
+
+	node = mm_free_nodes;
+	mm_free_nodes = node->right;
+	return node;
+}
+
+static void mm_node_free(struct ibv_mem_node *node)
+{
+	node->right = mm_free_nodes;
+	mm_free_nodes = node;
+}
+
 static unsigned long smaps_page_size(FILE *file)
 {
 	int n;
@@ -86,9 +138,10 @@ static unsigned long smaps_page_size(FILE *file)
 	return size;
 }
 
-static unsigned long get_page_size(void *base)
+static void read_vma_map(void)
 {
-	unsigned long ret = page_size;
+	struct ibv_vma *map = NULL, *tmp;
+	size_t count = 0, max = 0;
 	pid_t pid;
 	FILE *file;
 	char buf[1024];
@@ -98,7 +151,7 @@ static unsigned long get_page_size(void *base)
 
 	file = fopen(buf, "r" STREAM_CLOEXEC);
 	if (!file)
-		goto out;
+		return;
 
 	while (fgets(buf, sizeof(buf), file) != NULL) {
 		int n;
@@ -109,15 +162,69 @@ static unsigned long get_page_size(void *base)
 		if (n < 2)
 			continue;
 
-		if ((uintptr_t) base >= range_start && (uintptr_t) base < range_end) {
-			ret = smaps_page_size(file);
-			break;
+		if (count == max) {
+			max = max ? max * 2 : 64;
+			tmp = realloc(map, max * sizeof(*map));
+			if (!tmp)
+				goto err;
+			map = tmp;
 		}
+
+		/* smaps lists the mappings in address order */
+		map[count].start = range_start;
+		map[count].end = range_end;
+		map[count].page_size = smaps_page_size(file);
+		count++;
 	}
 
 	fclose(file);
 
-out:
+	free(vma_map);
+	vma_map = map;
+	vma_count = count;
+	return;
+
+err:
+	fclose(file);
+	free(map);
+}
+
+static bool find_vma_page_size(uintptr_t addr, unsigned long *size)
+{
+	size_t lo = 0, hi = vma_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (addr < vma_map[mid].start)
+			hi = mid;
+		else if (addr >= vma_map[mid].end)
+			lo = mid + 1;
+		else {
+			*size = vma_map[mid].page_size;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static unsigned long get_page_size(void *base, bool reread)
+{
+	unsigned long ret = page_size;
+
+	if (!reread) {
+		pthread_rwlock_rdlock(&vma_lock);
+		reread = !find_vma_page_size((uintptr_t) base, &ret);
+		pthread_rwlock_unlock(&vma_lock);
+		if (!reread)
+			return ret;
+	}
+
+	pthread_rwlock_wrlock(&vma_lock);
+	read_vma_map();
+	find_vma_page_size((uintptr_t) base, &ret);
+	pthread_rwlock_unlock(&vma_lock);
+
 	return ret;
 }
 
@@ -144,7 +251,7 @@ int ibv_fork_init(void)
 		return ENOMEM;
 
 	if (huge_page_enabled) {
-		size = get_page_size(tmp);
+		size = get_page_size(tmp, true);
 		tmp_aligned = (void *) ((uintptr_t) tmp & ~(size - 1));
 	} else {
 		size = page_size;
@@ -159,7 +266,7 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
+	mm_root = mm_node_alloc();
 	if (!mm_root)
 		return ENOMEM;
 
@@ -417,7 +524,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			mm_root = child;
 	}
 
-	free(node);
+	mm_node_free(node);
 
 	if (nodecol == IBV_RED)
 		return;
@@ -526,7 +633,7 @@ static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
 {
 	struct ibv_mem_node *new_node = NULL;
 
-	new_node = malloc(sizeof *new_node);
+	new_node = mm_node_alloc();
 	if (!new_node)
 		return NULL;
 	new_node->start  = cut_line;
@@ -587,28 +694,60 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 	return node;
 }
 
-static int ibv_madvise_range(void *base, size_t size, int advice)
+/*
+ * MADV_DONTFORK may be given again to pages that already have it, so when a
+ * range covers several ranges that are not yet marked they are all marked
+ * by one madvise(), from the first to the last, instead of one call each.
+ * Returns 1 if that was done, 0 if there is at most one such range.
+ */
+static int dontfork_coalesced(uintptr_t start, uintptr_t end)
+{
+	struct ibv_mem_node *node;
+	uintptr_t first = 0, last = 0;
+	int n = 0;
+
+	for (node = __mm_find_start(start, end); node && node->start <= end;
+	     node = __mm_next(node)) {
+		if (node->refcnt)
+			continue;
+
+		if (!n++)
+			first = node->start > start ? node->start : start;
+		last = node->end < end ? node->end : end;
+	}
+
+	if (n < 2)
+		return 0;
+
+	if (madvise((void *) first, last - first + 1, MADV_DONTFORK))
+		return -1;
+
+	return 1;
+}
+
+static int __madvise_range(void *base, size_t size, int advice,
+			   unsigned long range_page_size)
 {
 	uintptr_t start, end;
 	struct ibv_mem_node *node, *tmp;
 	int inc;
 	int rolling_back = 0;
+	int coalesced = 0;
 	int ret = 0;
-	unsigned long range_page_size;
-
-	if (!size)
-		return 0;
-
-	if (huge_page_enabled)
-		range_page_size = get_page_size(base);
-	else
-		range_page_size = page_size;
 
 	start = (uintptr_t) base & ~(range_page_size - 1);
 	end   = ((uintptr_t) (base + size + range_page_size - 1) &
 		 ~(range_page_size - 1)) - 1;
 
 	pthread_mutex_lock(&mm_mutex);
+
+	if (advice == MADV_DONTFORK) {
+		coalesced = dontfork_coalesced(start, end);
+		if (coalesced < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
 again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
@@ -626,8 +765,9 @@ again:
 			}
 		}
 
-		if ((inc == -1 && node->refcnt == 1) ||
-		    (inc ==  1 && node->refcnt == 0)) {
+		if (!coalesced &&
+		    ((inc == -1 && node->refcnt == 1) ||
+		     (inc ==  1 && node->refcnt == 0))) {
 			/*
 			 * If this is the first time through the loop,
 			 * and we merged this node with the previous
@@ -683,6 +823,30 @@ out:
 	return ret;
 }
 
+static int ibv_madvise_range(void *base, size_t size, int advice)
+{
+	unsigned long range_page_size, cur_page_size;
+	int ret;
+
+	if (!size)
+		return 0;
+
+	if (!huge_page_enabled)
+		return __madvise_range(base, size, advice, page_size);
+
+	range_page_size = get_page_size(base, false);
+	ret = __madvise_range(base, size, advice, range_page_size);
+	if (!ret)
+		return 0;
+
+	/* The range may have been remapped since the map was read */
+	cur_page_size = get_page_size(base, true);
+	if (cur_page_size == range_page_size)
+		return ret;
+
+	return __madvise_range(base, size, advice, cur_page_size);
+}
+
 int ibv_dontfork_range(void *base, size_t size)
 {
 	if (mm_root)
@@ -0,0 +1,628 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <search.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef HAVE_UFFD_EVENT_REMOVE
+#include <linux/userfaultfd.h>
+#endif
+
+#include <ccan/list.h>
+
+#include "ibverbs.h"
+
+/*
+ * The regions of a cache never overlap: a range that overlaps cached
+ * regions without being covered by one of them is registered as the union
+ * of all of them, and the regions it replaces are retired.  So regions are
+ * kept in a binary tree ordered by address, in which a range compares equal
+ * to the region that it overlaps.  Regions not in use are kept in LRU
+ * order, and deregistered once the cache holds more than max_bytes.
+ * Retired regions that are still in use are deregistered when put.
+ */
+struct mr_cache_ent {
+	struct ibv_mr		*mr;
+	uintptr_t		start, end;	/* end excluded */
+	unsigned int		refcnt;
+	bool			retired;
+	struct list_node	entry;		/* lru or retired, when listed */
+	struct mr_cache_ent	*next_merged;	/* replaced by the same union */
+};
+
+/* Ranges unmapped or remapped, queued by the userfaultfd thread */
+#define MR_CACHE_INVAL_RING	64
+
+struct mr_cache_inval {
+	uintptr_t		start, end;
+};
+
+struct ibv_mr_cache {
+	struct ibv_pd		*pd;
+	int			access;
+	size_t			max_bytes;
+	uintptr_t		page_mask;
+	/* page_mask, or 0 when remote access must not reach past a range */
+	uintptr_t		align_mask;
+	pthread_mutex_t		lock;
+	void			*root;
+	size_t			bytes;
+	unsigned int		in_use;
+	struct list_head	lru;
+	struct list_head	retired;
+
+	/* With IBV_MR_CACHE_AUTO_INVALIDATE, otherwise uffd is -1 */
+	int			uffd;
+	int			stop_fd;
+	pthread_t		uffd_thread;
+	atomic_bool		uffd_busy;
+	pthread_spinlock_t	inval_lock;
+	unsigned int		inval_head, inval_tail;
+	bool			inval_all;
+	struct mr_cache_inval	inval[MR_CACHE_INVAL_RING];
+};
+
+static int ent_cmp(const void *a, const void *b)
+{
+	const struct mr_cache_ent *x = a, *y = b;
+
+	if (x->end <= y->start)
+		return -1;
+	if (x->start >= y->end)
+		return 1;
+	return 0;
+}
+
+static struct mr_cache_ent *find_ent(struct ibv_mr_cache *cache,
+				     const struct mr_cache_ent *key)
+{
+	void **node = tfind(key, &cache->root, ent_cmp);
+
+	return node ? *node : NULL;
+}
+
+static struct mr_cache_ent *find_retired(struct ibv_mr_cache *cache,
+					 struct ibv_mr *mr)
+{
+	struct mr_cache_ent *ent;
+
+	list_for_each(&cache->retired, ent, entry)
+		if (ent->mr == mr)
+			return ent;
+
+	return NULL;
+}
+
+static void free_ent(struct ibv_mr_cache *cache, struct mr_cache_ent *ent)
+{
+	cache->bytes -= ent->end - ent->start;
+	ibv_dereg_mr(ent->mr);
+	free(ent);
+}
+
+/* An entry out of the tree is gone once it is no longer in use */
+static void retire_detached(struct ibv_mr_cache *cache,
+			    struct mr_cache_ent *ent)
+{
+	if (!ent->refcnt) {
+		list_del(&ent->entry);
+		free_ent(cache, ent);
+	} else {
+		ent->retired = true;
+		list_add_tail(&cache->retired, &ent->entry);
+	}
+}
+
+static void retire_ent(struct ibv_mr_cache *cache, struct mr_cache_ent *ent)
+{
+	tdelete(ent, &cache->root, ent_cmp);
+	retire_detached(cache, ent);
+}
+
+static void retire_range(struct ibv_mr_cache *cache, uintptr_t start,
+			 uintptr_t end)
+{
+	struct mr_cache_ent key, *ent;
+
+	key.start = start;
+	key.end = end;
+	while ((ent = find_ent(cache, &key)))
+		retire_ent(cache, ent);
+}
+
+/* Put back the regions of a union that could not be registered */
+static void restore_merged(struct ibv_mr_cache *cache,
+			   struct mr_cache_ent *merged)
+{
+	struct mr_cache_ent *next;
+
+	for (; merged; merged = next) {
+		next = merged->next_merged;
+		if (!tsearch(merged, &cache->root, ent_cmp))
+			retire_detached(cache, merged);
+	}
+}
+
+static void evict(struct ibv_mr_cache *cache)
+{
+	struct mr_cache_ent *ent;
+
+	if (!cache->max_bytes)
+		return;
+
+	while (cache->bytes > cache->max_bytes &&
+	       (ent = list_top(&cache->lru, struct mr_cache_ent, entry)))
+		retire_ent(cache, ent);
+}
+
+#ifdef HAVE_UFFD_EVENT_REMOVE
+/*
+ * With IBV_MR_CACHE_AUTO_INVALIDATE the pages of cached regions are
+ * registered with a userfaultfd, which reports their removal by munmap(),
+ * mremap() and madvise(MADV_DONTNEED/MADV_REMOVE).  A thread of the cache
+ * reads the events and queues the ranges, and ibv_mr_cache_get() retires
+ * the regions overlapping them before it looks up a range.
+ *
+ * The thread that removes the pages is held by the kernel until the event
+ * is read, and uffd_busy is set before the read; so once that thread goes
+ * on, the range is queued or uffd_busy is still set, and
+ * ibv_mr_cache_get() waits for it to be cleared.  The userfaultfd thread
+ * never takes the cache lock, as the memory of the cache itself may be
+ * unmapped while it is held.
+ */
+static void uffd_unwatch(struct ibv_mr_cache *cache, uintptr_t start,
+			 uintptr_t end)
+{
+	struct uffdio_range range = {
+		.start = start,
+		.len = end - start,
+	};
+
+	ioctl(cache->uffd, UFFDIO_UNREGISTER, &range);
+}
+
+static int uffd_watch(struct ibv_mr_cache *cache, uintptr_t start,
+		      uintptr_t end)
+{
+	struct uffdio_register reg = {
+		.range.start = start & ~cache->page_mask,
+		.range.len = ((end + cache->page_mask) & ~cache->page_mask) -
+			     (start & ~cache->page_mask),
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+
+	if (ioctl(cache->uffd, UFFDIO_REGISTER, &reg))
+		return errno;
+	return 0;
+}
+
+/*
+ * Pages of a watched range that are not populated yet are filled the way
+ * the kernel would, with zeroes.  Where that is not possible the page is
+ * no longer watched, which is safe as it can not be in use by a region.
+ */
+static void uffd_fault(struct ibv_mr_cache *cache, uintptr_t addr)
+{
+	struct uffdio_zeropage zero = {
+		.range.start = addr & ~cache->page_mask,
+		.range.len = cache->page_mask + 1,
+	};
+
+	if (!ioctl(cache->uffd, UFFDIO_ZEROPAGE, &zero))
+		return;
+	if (errno == EEXIST) {
+		ioctl(cache->uffd, UFFDIO_WAKE, &zero.range);
+		return;
+	}
+	uffd_unwatch(cache, zero.range.start,
+		     zero.range.start + zero.range.len);
+}
+
+static void queue_inval(struct ibv_mr_cache *cache, uintptr_t start,
+			uintptr_t end)
+{
+	struct mr_cache_inval *inval;
+
+	pthread_spin_lock(&cache->inval_lock);
+	if (cache->inval_tail - cache->inval_head == MR_CACHE_INVAL_RING) {
+		cache->inval_all = true;
+	} else {
+		inval = &cache->inval[cache->inval_tail++ %
+				      MR_CACHE_INVAL_RING];
+		inval->start = start;
+		inval->end = end;
+	}
+	pthread_spin_unlock(&cache->inval_lock);
+}
+
+static void uffd_event(struct ibv_mr_cache *cache, struct uffd_msg *msg)
+{
+	switch (msg->event) {
+	case UFFD_EVENT_PAGEFAULT:
+		uffd_fault(cache, msg->arg.pagefault.address);
+		break;
+	case UFFD_EVENT_REMOVE:
+		/* The pages are gone, faults on them are not ours to fill */
+		uffd_unwatch(cache, msg->arg.remove.start,
+			     msg->arg.remove.end);
+		queue_inval(cache, msg->arg.remove.start, msg->arg.remove.end);
+		break;
+	case UFFD_EVENT_UNMAP:
+		queue_inval(cache, msg->arg.remove.start, msg->arg.remove.end);
+		break;
+	case UFFD_EVENT_REMAP:
+		uffd_unwatch(cache, msg->arg.remap.to,
+			     msg->arg.remap.to + msg->arg.remap.len);
+		queue_inval(cache, msg->arg.remap.from,
+			    msg->arg.remap.from + msg->arg.remap.len);
+		break;
+	}
+}
+
+static void *uffd_thread(void *arg)
+{
+	struct ibv_mr_cache *cache = arg;
+	struct pollfd fds[2] = {
+		{ .fd = cache->uffd, .events = POLLIN },
+		{ .fd = cache->stop_fd, .events = POLLIN },
+	};
+	struct uffd_msg msg[16];
+	ssize_t len;
+	size_t i;
+
+	while (true) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		atomic_store(&cache->uffd_busy, true);
+		while ((len = read(cache->uffd, msg, sizeof(msg))) > 0)
+			for (i = 0; i < len / sizeof(*msg); i++)
+				uffd_event(cache, &msg[i]);
+		atomic_store(&cache->uffd_busy, false);
+	}
+
+	return NULL;
+}
+
+static int uffd_start(struct ibv_mr_cache *cache)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_EVENT_REMOVE |
+			    UFFD_FEATURE_EVENT_UNMAP |
+			    UFFD_FEATURE_EVENT_REMAP,
+	};
+	int ret;
+
+	cache->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (cache->uffd < 0)
+		return errno;
+
+	if (ioctl(cache->uffd, UFFDIO_API, &api)) {
+		ret = errno == EINVAL ? EOPNOTSUPP : errno;
+		goto err_uffd;
+	}
+
+	cache->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (cache->stop_fd < 0) {
+		ret = errno;
+		goto err_uffd;
+	}
+
+	pthread_spin_init(&cache->inval_lock, PTHREAD_PROCESS_PRIVATE);
+	ret = pthread_create(&cache->uffd_thread, NULL, uffd_thread, cache);
+	if (ret)
+		goto err_stop;
+
+	return 0;
+
+err_stop:
+	pthread_spin_destroy(&cache->inval_lock);
+	close(cache->stop_fd);
+err_uffd:
+	close(cache->uffd);
+	cache->uffd = -1;
+	return ret;
+}
+
+static void uffd_stop(struct ibv_mr_cache *cache)
+{
+	uint64_t one = 1;
+
+	if (write(cache->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(cache->uffd_thread, NULL);
+	pthread_spin_destroy(&cache->inval_lock);
+	close(cache->stop_fd);
+	/* Closing the userfaultfd unregisters all of its ranges */
+	close(cache->uffd);
+}
+
+/* Retire the regions of the ranges queued by the userfaultfd thread */
+static void apply_invals(struct ibv_mr_cache *cache)
+{
+	struct mr_cache_inval inval[MR_CACHE_INVAL_RING];
+	unsigned int i, n = 0;
+	bool all;
+
+	while (atomic_load(&cache->uffd_busy))
+		sched_yield();
+
+	/* Regions are not freed under inval_lock, free() may unmap memory */
+	pthread_spin_lock(&cache->inval_lock);
+	all = cache->inval_all;
+	for (; cache->inval_head != cache->inval_tail; cache->inval_head++)
+		inval[n++] = cache->inval[cache->inval_head %
+					  MR_CACHE_INVAL_RING];
+	cache->inval_all = false;
+	pthread_spin_unlock(&cache->inval_lock);
+
+	if (all) {
+		retire_range(cache, 0, UINTPTR_MAX);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		retire_range(cache, inval[i].start, inval[i].end);
+}
+#else
+static int uffd_start(struct ibv_mr_cache *cache)
+{
+	return EOPNOTSUPP;
+}
+
+static int uffd_watch(struct ibv_mr_cache *cache, uintptr_t start,
+		      uintptr_t end)
+{
+	return EOPNOTSUPP;
+}
+
+static void uffd_stop(struct ibv_mr_cache *cache)
+{
+}
+
+static void apply_invals(struct ibv_mr_cache *cache)
+{
+}
+#endif
+
+struct ibv_mr_cache *ibv_mr_cache_create(struct ibv_pd *pd,
+					 struct ibv_mr_cache_init_attr *attr)
+{
+	struct ibv_mr_cache *cache;
+	uint32_t flags = 0;
+	int ret;
+
+	if (attr->comp_mask & ~IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (attr->comp_mask & IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS)
+		flags = attr->flags;
+	if (flags & ~IBV_MR_CACHE_AUTO_INVALIDATE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cache->pd = pd;
+	cache->access = attr->access;
+	cache->max_bytes = attr->max_bytes;
+	cache->page_mask = sysconf(_SC_PAGESIZE) - 1;
+	/* Rounding to pages would let the rkey reach memory not asked for */
+	if (attr->access & (IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+			    IBV_ACCESS_REMOTE_ATOMIC))
+		cache->align_mask = 0;
+	else
+		cache->align_mask = cache->page_mask;
+	pthread_mutex_init(&cache->lock, NULL);
+	list_head_init(&cache->lru);
+	list_head_init(&cache->retired);
+
+	cache->uffd = -1;
+	if (flags & IBV_MR_CACHE_AUTO_INVALIDATE) {
+		ret = uffd_start(cache);
+		if (ret) {
+			pthread_mutex_destroy(&cache->lock);
+			free(cache);
+			errno = ret;
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+static void destroy_ent(void *ptr)
+{
+	struct mr_cache_ent *ent = ptr;
+
+	ibv_dereg_mr(ent->mr);
+	free(ent);
+}
+
+int ibv_mr_cache_destroy(struct ibv_mr_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (cache->in_use) {
+		pthread_mutex_unlock(&cache->lock);
+		return EBUSY;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (cache->uffd >= 0)
+		uffd_stop(cache);
+	tdestroy(cache->root, destroy_ent);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	return 0;
+}
+
+struct ibv_mr *ibv_mr_cache_get(struct ibv_mr_cache *cache, void *addr,
+				size_t length)
+{
+	struct mr_cache_ent key, *ent, *merged = NULL, *next;
+	struct ibv_mr *mr;
+	uintptr_t start, end;
+	int ret;
+
+	if (!length) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	start = (uintptr_t)addr & ~cache->align_mask;
+	end = ((uintptr_t)addr + length + cache->align_mask) &
+	      ~cache->align_mask;
+	key.start = start;
+	key.end = end;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (cache->uffd >= 0)
+		apply_invals(cache);
+
+	ent = find_ent(cache, &key);
+	if (ent && ent->start <= start && ent->end >= end) {
+		if (!ent->refcnt++) {
+			list_del(&ent->entry);
+			cache->in_use++;
+		}
+		mr = ent->mr;
+		goto out;
+	}
+
+	/*
+	 * Take the regions that the range overlaps out of the tree, and
+	 * register their union; they are only retired once it is registered,
+	 * and put back if it can not be.
+	 */
+	while ((ent = find_ent(cache, &key))) {
+		if (ent->start < key.start)
+			key.start = ent->start;
+		if (ent->end > key.end)
+			key.end = ent->end;
+		tdelete(ent, &cache->root, ent_cmp);
+		ent->next_merged = merged;
+		merged = ent;
+	}
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent) {
+		errno = ENOMEM;
+		goto err_merged;
+	}
+
+	mr = ibv_reg_mr(cache->pd, (void *)key.start, key.end - key.start,
+			cache->access);
+	if (!mr)
+		goto err_ent;
+
+	if (cache->uffd >= 0) {
+		ret = uffd_watch(cache, key.start, key.end);
+		if (ret) {
+			errno = ret;
+			goto err_mr;
+		}
+	}
+
+	ent->mr = mr;
+	ent->start = key.start;
+	ent->end = key.end;
+	ent->refcnt = 1;
+	if (!tsearch(ent, &cache->root, ent_cmp)) {
+		errno = ENOMEM;
+		goto err_mr;
+	}
+
+	for (; merged; merged = next) {
+		next = merged->next_merged;
+		retire_detached(cache, merged);
+	}
+
+	cache->bytes += ent->end - ent->start;
+	cache->in_use++;
+	evict(cache);
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return mr;
+
+err_mr:
+	ret = errno;
+	ibv_dereg_mr(mr);
+	errno = ret;
+err_ent:
+	free(ent);
+err_merged:
+	ret = errno;
+	restore_merged(cache, merged);
+	errno = ret;
+	mr = NULL;
+	goto out;
+}
+
+void ibv_mr_cache_put(struct ibv_mr_cache *cache, struct ibv_mr *mr)
+{
+	struct mr_cache_ent key, *ent;
+
+	key.start = (uintptr_t)mr->addr;
+	key.end = key.start + mr->length;
+
+	pthread_mutex_lock(&cache->lock);
+
+	ent = find_ent(cache, &key);
+	if (!ent || ent->mr != mr)
+		ent = find_retired(cache, mr);
+	if (!ent)
+		goto out;
+
+	if (--ent->refcnt)
+		goto out;
+
+	cache->in_use--;
+	if (ent->retired) {
+		list_del(&ent->entry);
+		free_ent(cache, ent);
+	} else {
+		list_add_tail(&cache->lru, &ent->entry);
+		evict(cache);
+	}
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			     size_t length)
+{
+	if (!length)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	retire_range(cache, (uintptr_t)addr & ~cache->page_mask,
+		     ((uintptr_t)addr + length + cache->page_mask) &
+		     ~cache->page_mask);
+	pthread_mutex_unlock(&cache->lock);
+}
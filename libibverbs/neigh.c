@@ -846,3 +846,382 @@ int process_get_neigh(struct get_neigh_handler *neigh_handler)
 
 	return err;
 }
+
+/*
+ * Process-wide cache of resolved neighbours, keyed by source and
+ * destination GID.  Entries are kept current by a thread listening for
+ * neighbour, route, address and link changes on a netlink socket.
+ * Neighbour updates refresh or remove the entries that use that next hop,
+ * and any other change flushes the cache.  Failed resolutions are cached
+ * briefly, so that repeated requests for an unreachable destination do
+ * not each wait for a timeout.  Concurrent lookups of the same entry wait
+ * for the first to complete.  If the netlink subscription cannot be made,
+ * nothing is cached.
+ */
+#define NEIGH_CACHE_SIZE	256	/* hash buckets, power of 2 */
+#define NEIGH_CACHE_MAX		4096
+#define NEIGH_CACHE_TTL_MS	60000
+#define NEIGH_CACHE_NEG_TTL_MS	1000
+#define NEIGH_MONITOR_MAX_ERRS	16
+
+enum neigh_entry_state {
+	NEIGH_RESOLVING,
+	NEIGH_VALID,
+	NEIGH_FAILED,
+};
+
+struct neigh_entry {
+	struct list_node	entry;
+	struct list_node	lru_entry;
+	uint8_t			sgid[16];
+	uint8_t			dgid[16];
+	enum neigh_entry_state	state;
+	int			err;
+	uint8_t			mac[ETHERNET_LL_SIZE];
+	uint16_t		vid;
+	int			nh_family;
+	uint8_t			nh_addr[16];
+	int			nh_len;
+	int			oif;
+	uint64_t		expires;
+};
+
+enum neigh_monitor_state {
+	NEIGH_MONITOR_NONE,
+	NEIGH_MONITOR_RUNNING,
+	NEIGH_MONITOR_FAILED,
+};
+
+static pthread_mutex_t neigh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t neigh_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head neigh_hash[NEIGH_CACHE_SIZE];
+static LIST_HEAD(neigh_lru);
+static int neigh_cnt;
+static enum neigh_monitor_state monitor_state;
+static struct nl_sock *monitor_sock;
+
+static uint64_t neigh_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static struct list_head *neigh_bucket(const uint8_t *sgid, const uint8_t *dgid)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		hash = (hash ^ sgid[i]) * 16777619U;
+	for (i = 0; i < 16; i++)
+		hash = (hash ^ dgid[i]) * 16777619U;
+
+	return &neigh_hash[hash & (NEIGH_CACHE_SIZE - 1)];
+}
+
+/* Called with neigh_lock held */
+static void neigh_remove(struct neigh_entry *ent)
+{
+	list_del(&ent->entry);
+	list_del(&ent->lru_entry);
+	neigh_cnt--;
+	free(ent);
+}
+
+/* Called with neigh_lock held.  Entries being resolved are kept. */
+static void neigh_flush(bool failed_only)
+{
+	struct neigh_entry *ent, *next;
+
+	list_for_each_safe(&neigh_lru, ent, next, lru_entry) {
+		if (ent->state == NEIGH_FAILED ||
+		    (!failed_only && ent->state == NEIGH_VALID))
+			neigh_remove(ent);
+	}
+}
+
+static void neigh_monitor_event(struct nl_object *obj, void *arg)
+{
+	struct rtnl_neigh *neigh = (struct rtnl_neigh *)obj;
+	struct nlmsghdr *hdr = arg;
+	struct neigh_entry *ent, *next;
+	struct nl_addr *dst, *lladdr;
+	int ifindex, state;
+
+	dst = rtnl_neigh_get_dst(neigh);
+	if (!dst)
+		return;
+
+	ifindex = rtnl_neigh_get_ifindex(neigh);
+	lladdr = rtnl_neigh_get_lladdr(neigh);
+	state = rtnl_neigh_get_state(neigh);
+
+	pthread_mutex_lock(&neigh_lock);
+	list_for_each_safe(&neigh_lru, ent, next, lru_entry) {
+		if (ent->state == NEIGH_FAILED) {
+			neigh_remove(ent);
+			continue;
+		}
+
+		if (ent->state != NEIGH_VALID || ent->oif != ifindex ||
+		    ent->nh_family != nl_addr_get_family(dst) ||
+		    ent->nh_len != nl_addr_get_len(dst) ||
+		    memcmp(ent->nh_addr, nl_addr_get_binary_addr(dst),
+			   ent->nh_len))
+			continue;
+
+		if (hdr->nlmsg_type == RTM_NEWNEIGH && lladdr &&
+		    nl_addr_get_len(lladdr) == ETHERNET_LL_SIZE &&
+		    !(state & (NUD_INCOMPLETE | NUD_FAILED)))
+			memcpy(ent->mac, nl_addr_get_binary_addr(lladdr),
+			       ETHERNET_LL_SIZE);
+		else
+			neigh_remove(ent);
+	}
+	pthread_mutex_unlock(&neigh_lock);
+}
+
+static int neigh_monitor_cb(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+
+	switch (hdr->nlmsg_type) {
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		nl_msg_parse(msg, &neigh_monitor_event, hdr);
+		break;
+	default:
+		pthread_mutex_lock(&neigh_lock);
+		neigh_flush(false);
+		pthread_mutex_unlock(&neigh_lock);
+		break;
+	}
+
+	return NL_OK;
+}
+
+static void *neigh_monitor_run(void *arg)
+{
+	int errs = 0;
+
+	while (errs < NEIGH_MONITOR_MAX_ERRS) {
+		if (nl_recvmsgs_default(monitor_sock) >= 0) {
+			errs = 0;
+			continue;
+		}
+
+		/* Events may have been lost, e.g. the socket overran */
+		errs++;
+		pthread_mutex_lock(&neigh_lock);
+		neigh_flush(false);
+		pthread_mutex_unlock(&neigh_lock);
+	}
+
+	pthread_mutex_lock(&neigh_lock);
+	monitor_state = NEIGH_MONITOR_FAILED;
+	neigh_flush(false);
+	pthread_mutex_unlock(&neigh_lock);
+	return NULL;
+}
+
+static void neigh_atfork_prepare(void)
+{
+	pthread_mutex_lock(&neigh_lock);
+}
+
+static void neigh_atfork_parent(void)
+{
+	pthread_mutex_unlock(&neigh_lock);
+}
+
+/* The monitor thread does not exist in the child, so start over */
+static void neigh_atfork_child(void)
+{
+	struct neigh_entry *ent, *next;
+
+	list_for_each_safe(&neigh_lru, ent, next, lru_entry)
+		neigh_remove(ent);
+
+	if (monitor_state == NEIGH_MONITOR_RUNNING) {
+		nl_socket_free(monitor_sock);
+		monitor_sock = NULL;
+		monitor_state = NEIGH_MONITOR_NONE;
+	}
+	pthread_mutex_unlock(&neigh_lock);
+}
+
+/* Called with neigh_lock held */
+static void neigh_start_monitor(void)
+{
+	static const int groups[] = {
+		RTNLGRP_NEIGH, RTNLGRP_LINK,
+		RTNLGRP_IPV4_ROUTE, RTNLGRP_IPV6_ROUTE,
+		RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR,
+	};
+	static bool atfork_set;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	monitor_state = NEIGH_MONITOR_FAILED;
+	if (!atfork_set) {
+		if (pthread_atfork(neigh_atfork_prepare, neigh_atfork_parent,
+				   neigh_atfork_child))
+			return;
+		for (i = 0; i < NEIGH_CACHE_SIZE; i++)
+			list_head_init(&neigh_hash[i]);
+		atfork_set = true;
+	}
+
+	monitor_sock = nl_socket_alloc();
+	if (!monitor_sock)
+		return;
+
+	if (nl_connect(monitor_sock, NETLINK_ROUTE) < 0)
+		goto err;
+
+	for (i = 0; i < sizeof(groups) / sizeof(groups[0]); i++)
+		if (nl_socket_add_membership(monitor_sock, groups[i]) < 0)
+			goto err;
+
+	nl_socket_disable_seq_check(monitor_sock);
+	nl_socket_modify_cb(monitor_sock, NL_CB_VALID, NL_CB_CUSTOM,
+			    &neigh_monitor_cb, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	i = pthread_create(&thread, &attr, neigh_monitor_run, NULL);
+	pthread_attr_destroy(&attr);
+	if (i)
+		goto err;
+
+	monitor_state = NEIGH_MONITOR_RUNNING;
+	return;
+
+err:
+	nl_socket_free(monitor_sock);
+	monitor_sock = NULL;
+}
+
+/*
+ * Returns 0 and the cached MAC address and VLAN ID if the destination
+ * has been resolved, or a cached error.  Returns NEIGH_CACHE_MISS if the
+ * caller should resolve the destination, in which case it must pass the
+ * result to neigh_cache_put.
+ */
+int neigh_cache_get(const uint8_t *sgid, const uint8_t *dgid,
+		    uint8_t *mac, uint16_t *vid)
+{
+	struct neigh_entry *ent;
+	struct list_head *bucket;
+	int ret;
+
+	pthread_mutex_lock(&neigh_lock);
+	if (monitor_state == NEIGH_MONITOR_NONE)
+		neigh_start_monitor();
+	if (monitor_state != NEIGH_MONITOR_RUNNING) {
+		pthread_mutex_unlock(&neigh_lock);
+		return NEIGH_CACHE_MISS;
+	}
+
+	bucket = neigh_bucket(sgid, dgid);
+again:
+	list_for_each(bucket, ent, entry) {
+		if (memcmp(ent->sgid, sgid, 16) || memcmp(ent->dgid, dgid, 16))
+			continue;
+
+		if (ent->state == NEIGH_RESOLVING) {
+			pthread_cond_wait(&neigh_cond, &neigh_lock);
+			goto again;
+		}
+
+		if (ent->expires < neigh_time_ms()) {
+			neigh_remove(ent);
+			break;
+		}
+
+		if (ent->state == NEIGH_VALID) {
+			memcpy(mac, ent->mac, ETHERNET_LL_SIZE);
+			*vid = ent->vid;
+			ret = 0;
+		} else {
+			ret = ent->err;
+		}
+		list_del(&ent->lru_entry);
+		list_add(&neigh_lru, &ent->lru_entry);
+		pthread_mutex_unlock(&neigh_lock);
+		return ret;
+	}
+
+	if (neigh_cnt >= NEIGH_CACHE_MAX) {
+		list_for_each_rev(&neigh_lru, ent, lru_entry) {
+			if (ent->state != NEIGH_RESOLVING) {
+				neigh_remove(ent);
+				break;
+			}
+		}
+	}
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent) {
+		memcpy(ent->sgid, sgid, 16);
+		memcpy(ent->dgid, dgid, 16);
+		ent->state = NEIGH_RESOLVING;
+		list_add(bucket, &ent->entry);
+		list_add(&neigh_lru, &ent->lru_entry);
+		neigh_cnt++;
+	}
+	pthread_mutex_unlock(&neigh_lock);
+	return NEIGH_CACHE_MISS;
+}
+
+/*
+ * Completes an entry created by neigh_cache_get.  Only failures to find a
+ * route or a neighbour are cached.  The next hop is taken from the handler,
+ * which may be NULL if resolution failed before it was set up.
+ */
+void neigh_cache_put(const uint8_t *sgid, const uint8_t *dgid, int ret,
+		     const uint8_t *mac, uint16_t vid,
+		     struct get_neigh_handler *neigh_handler)
+{
+	struct neigh_entry *ent;
+	struct list_head *bucket;
+	struct nl_addr *nh;
+
+	pthread_mutex_lock(&neigh_lock);
+	if (monitor_state != NEIGH_MONITOR_RUNNING)
+		goto out;
+
+	bucket = neigh_bucket(sgid, dgid);
+	list_for_each(bucket, ent, entry) {
+		if (ent->state != NEIGH_RESOLVING ||
+		    memcmp(ent->sgid, sgid, 16) || memcmp(ent->dgid, dgid, 16))
+			continue;
+
+		nh = neigh_handler ? neigh_handler->dst : NULL;
+		if (!ret && nh && nl_addr_get_len(nh) <= sizeof(ent->nh_addr)) {
+			ent->state = NEIGH_VALID;
+			memcpy(ent->mac, mac, ETHERNET_LL_SIZE);
+			ent->vid = vid;
+			ent->nh_family = nl_addr_get_family(nh);
+			ent->nh_len = nl_addr_get_len(nh);
+			memcpy(ent->nh_addr, nl_addr_get_binary_addr(nh),
+			       ent->nh_len);
+			ent->oif = neigh_handler->oif;
+			ent->expires = neigh_time_ms() + NEIGH_CACHE_TTL_MS;
+		} else if (ret == -EHOSTUNREACH || ret == -EINVAL) {
+			ent->state = NEIGH_FAILED;
+			ent->err = ret;
+			ent->expires = neigh_time_ms() + NEIGH_CACHE_NEG_TTL_MS;
+		} else {
+			neigh_remove(ent);
+		}
+		break;
+	}
+
+out:
+	pthread_cond_broadcast(&neigh_cond);
+	pthread_mutex_unlock(&neigh_lock);
+}
@@ -47,4 +47,11 @@ int neigh_get_oif_from_src(struct get_neigh_handler *neigh_handler);
 int neigh_get_ll(struct get_neigh_handler *neigh_handler, void *addr_buf,
 		 int addr_size);
 
+#define NEIGH_CACHE_MISS 1
+int neigh_cache_get(const uint8_t *sgid, const uint8_t *dgid,
+		    uint8_t *mac, uint16_t *vid);
+void neigh_cache_put(const uint8_t *sgid, const uint8_t *dgid, int ret,
+		     const uint8_t *mac, uint16_t vid,
+		     struct get_neigh_handler *neigh_handler);
+
 #endif
@@ -0,0 +1,287 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/*
+ * Measures the kernel path post commands, ibv_cmd_post_send(),
+ * ibv_cmd_post_recv() and ibv_cmd_post_srq_recv(), without a device.  The
+ * "send batched" lines post one WR per ibv_cmd_post_send_batch() call and
+ * flush the batch after every WRS PER POST of them, the way a provider would
+ * at its doorbell.
+ *
+ * The commands are first written to a SOCK_SEQPACKET socket pair, so that
+ * each write() is a packet; the packets are counted to give the write()s
+ * per work request, and checked against the WRs that were posted.  The
+ * commands are then timed with /dev/null as the command fd, which leaves
+ * only the marshalling and the write() itself.
+ *
+ * usage: cmd_post_bench [-n WRS]
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <infiniband/driver.h>
+#include <infiniband/kern-abi.h>
+
+#define MAX_BATCH	64
+#define CHECK_POSTS	64
+#define QP_HANDLE	7
+#define SRQ_HANDLE	9
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			exit(1);					\
+		}							\
+	} while (0)
+
+enum post_kind {
+	POST_SEND,
+	POST_RECV,
+	POST_SRQ_RECV,
+	POST_SEND_BATCH,
+};
+
+static const char * const kind_str[] = {
+	[POST_SEND] = "send",
+	[POST_RECV] = "recv",
+	[POST_SRQ_RECV] = "srq recv",
+	[POST_SEND_BATCH] = "send batched",
+};
+
+static struct ibv_context context;
+static struct ibv_qp qp = {
+	.context = &context,
+	.handle = QP_HANDLE,
+	.qp_type = IBV_QPT_RC,
+};
+static struct ibv_srq srq = {
+	.context = &context,
+	.handle = SRQ_HANDLE,
+};
+
+static struct ibv_cmd_send_batch send_batch;
+
+static int cur_batch;
+static struct ibv_sge sge[MAX_BATCH];
+static struct ibv_send_wr send_wr[MAX_BATCH];
+static struct ibv_send_wr single_wr[MAX_BATCH];	/* send_wr, unchained */
+static struct ibv_recv_wr recv_wr[MAX_BATCH];
+
+/* Chain batch WRs of one SGE each, RDMA WRITEs for the send queue */
+static void build_wrs(int batch)
+{
+	int i;
+
+	cur_batch = batch;
+	for (i = 0; i < batch; i++) {
+		sge[i].addr = 0x10000 + i * 64;
+		sge[i].length = 64;
+		sge[i].lkey = 0x1234;
+
+		send_wr[i] = (struct ibv_send_wr) {
+			.wr_id = i + 1,
+			.next = i + 1 < batch ? &send_wr[i + 1] : NULL,
+			.sg_list = &sge[i],
+			.num_sge = 1,
+			.opcode = IBV_WR_RDMA_WRITE,
+			.send_flags = i + 1 < batch ? 0 : IBV_SEND_SIGNALED,
+			.wr.rdma.remote_addr = 0x20000 + i * 64,
+			.wr.rdma.rkey = 0x5678,
+		};
+		single_wr[i] = send_wr[i];
+		single_wr[i].next = NULL;
+
+		recv_wr[i] = (struct ibv_recv_wr) {
+			.wr_id = i + 1,
+			.next = i + 1 < batch ? &recv_wr[i + 1] : NULL,
+			.sg_list = &sge[i],
+			.num_sge = 1,
+		};
+	}
+}
+
+static int post(enum post_kind kind)
+{
+	struct ibv_send_wr *bad_send;
+	struct ibv_recv_wr *bad_recv;
+	int i, ret;
+
+	switch (kind) {
+	case POST_SEND:
+		return ibv_cmd_post_send(&qp, send_wr, &bad_send);
+	case POST_RECV:
+		return ibv_cmd_post_recv(&qp, recv_wr, &bad_recv);
+	case POST_SRQ_RECV:
+		return ibv_cmd_post_srq_recv(&srq, recv_wr, &bad_recv);
+	case POST_SEND_BATCH:
+		for (i = 0; i < cur_batch; i++) {
+			ret = ibv_cmd_post_send_batch(&send_batch,
+						      &single_wr[i], &bad_send);
+			if (ret)
+				return ret;
+		}
+		ret = ibv_cmd_flush_send_batch(&send_batch);
+		CHECK(ret || send_batch.posted == cur_batch);
+		return ret;
+	}
+	return EINVAL;
+}
+
+static void check_send_cmd(const void *pkt, ssize_t len, int batch)
+{
+	const struct ibv_post_send *cmd = pkt;
+	const struct ibv_kern_send_wr *wr = (const void *)(cmd + 1);
+	const struct ibv_sge *s = (const void *)(wr + batch);
+	int i;
+
+	CHECK(cmd->command == IB_USER_VERBS_CMD_POST_SEND ||
+	      cmd->command == IB_USER_VERBS_CMD_POST_SEND_V2);
+	CHECK(cmd->in_words * 4 == len);
+	CHECK(cmd->qp_handle == QP_HANDLE);
+	CHECK(cmd->wr_count == batch && cmd->sge_count == batch);
+	CHECK(cmd->wqe_size == sizeof(*wr));
+	CHECK(len == sizeof(*cmd) + batch * (sizeof(*wr) + sizeof(*s)));
+
+	for (i = 0; i < batch; i++) {
+		CHECK(wr[i].wr_id == send_wr[i].wr_id);
+		CHECK(wr[i].num_sge == 1);
+		CHECK(wr[i].opcode == IBV_WR_RDMA_WRITE);
+		CHECK(wr[i].send_flags == send_wr[i].send_flags);
+		CHECK(wr[i].wr.rdma.remote_addr ==
+		      send_wr[i].wr.rdma.remote_addr);
+		CHECK(wr[i].wr.rdma.rkey == send_wr[i].wr.rdma.rkey);
+		CHECK(!memcmp(&s[i], &sge[i], sizeof(*s)));
+	}
+}
+
+/* The commands of the receive queues of QPs and SRQs have one layout */
+static void check_recv_cmd(const void *pkt, ssize_t len, int batch,
+			   enum post_kind kind)
+{
+	const struct ibv_post_recv *cmd = pkt;
+	const struct ibv_kern_recv_wr *wr = (const void *)(cmd + 1);
+	const struct ibv_sge *s = (const void *)(wr + batch);
+	int i;
+
+	if (kind == POST_RECV) {
+		CHECK(cmd->command == IB_USER_VERBS_CMD_POST_RECV ||
+		      cmd->command == IB_USER_VERBS_CMD_POST_RECV_V2);
+		CHECK(cmd->qp_handle == QP_HANDLE);
+	} else {
+		CHECK(cmd->command == IB_USER_VERBS_CMD_POST_SRQ_RECV ||
+		      cmd->command == IB_USER_VERBS_CMD_POST_SRQ_RECV_V2);
+		CHECK(cmd->qp_handle == SRQ_HANDLE);
+	}
+	CHECK(cmd->in_words * 4 == len);
+	CHECK(cmd->wr_count == batch && cmd->sge_count == batch);
+	CHECK(cmd->wqe_size == sizeof(*wr));
+	CHECK(len == sizeof(*cmd) + batch * (sizeof(*wr) + sizeof(*s)));
+
+	for (i = 0; i < batch; i++) {
+		CHECK(wr[i].wr_id == recv_wr[i].wr_id);
+		CHECK(wr[i].num_sge == 1);
+		CHECK(!memcmp(&s[i], &sge[i], sizeof(*s)));
+	}
+}
+
+/* Returns the number of write()s made for CHECK_POSTS posts */
+static unsigned int check_cmds(enum post_kind kind, int batch)
+{
+	static char pkt[sizeof(struct ibv_post_send) +
+			MAX_BATCH * (sizeof(struct ibv_kern_send_wr) +
+				     sizeof(struct ibv_sge)) + 1];
+	unsigned int writes = 0;
+	int fds[2], i;
+	ssize_t len;
+
+	CHECK(!socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+	context.cmd_fd = fds[0];
+
+	for (i = 0; i < CHECK_POSTS; i++) {
+		CHECK(!post(kind));
+		while ((len = recv(fds[1], pkt, sizeof(pkt),
+				   MSG_DONTWAIT)) > 0) {
+			if (kind == POST_SEND || kind == POST_SEND_BATCH)
+				check_send_cmd(pkt, len, batch);
+			else
+				check_recv_cmd(pkt, len, batch, kind);
+			writes++;
+		}
+		CHECK(len < 0 && errno == EAGAIN);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	return writes;
+}
+
+static double time_cmds(enum post_kind kind, unsigned int posts)
+{
+	struct timespec start, end;
+	unsigned int i;
+
+	CHECK((context.cmd_fd = open("/dev/null", O_WRONLY)) >= 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < posts; i++)
+		CHECK(!post(kind));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	close(context.cmd_fd);
+	return (end.tv_sec - start.tv_sec) * 1e9 +
+	       (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int batches[] = { 1, 4, 16, MAX_BATCH };
+	unsigned int wrs = 1000000, posts, writes;
+	enum post_kind kind;
+	double nsec;
+	int b, c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			wrs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n WRS]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	CHECK(!ibv_cmd_init_send_batch(&send_batch, &qp, MAX_BATCH,
+				       MAX_BATCH));
+
+	for (kind = POST_SEND; kind <= POST_SEND_BATCH; kind++) {
+		for (b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+			build_wrs(batches[b]);
+			writes = check_cmds(kind, batches[b]);
+
+			posts = wrs / batches[b] ? wrs / batches[b] : 1;
+			nsec = time_cmds(kind, posts);
+
+			printf("%-12s %2d WRs per post: %7.1f ns/WR, %.3f write()s/WR\n",
+			       kind_str[kind], batches[b],
+			       nsec / (posts * batches[b]),
+			       (double)writes / (CHECK_POSTS * batches[b]));
+		}
+	}
+
+	ibv_cmd_free_send_batch(&send_batch);
+	return 0;
+}
@@ -39,6 +39,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <linux/ip.h>
 #include <dirent.h>
@@ -152,10 +154,8 @@ LATEST_SYMVER_FUNC(ibv_query_port, 1_1, "IBVERBS_1.1",
 	return context->ops.query_port(context, port_num, port_attr);
 }
 
-LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_context *context, uint8_t port_num,
-		   int index, union ibv_gid *gid)
+static int query_gid_sysfs(struct ibv_context *context, uint8_t port_num,
+			   int index, union ibv_gid *gid)
 {
 	char name[24];
 	char attr[41];
@@ -178,10 +178,8 @@ LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
-LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_context *context, uint8_t port_num,
-		   int index, __be16 *pkey)
+static int query_pkey_sysfs(struct ibv_context *context, uint8_t port_num,
+			    int index, __be16 *pkey)
 {
 	char name[24];
 	char attr[8];
@@ -200,6 +198,309 @@ LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
+static int query_gid_type_sysfs(struct ibv_context *context, uint8_t port_num,
+				unsigned int index, enum ibv_gid_type *type);
+
+/*
+ * GID and P_Key tables are cached per context, for contexts created by
+ * providers using verbs_context.  Cached tables are filled when first
+ * used, and refreshed after the GID_CHANGE, PKEY_CHANGE and PORT_ACTIVE
+ * async events.  Because the library only sees those events if the
+ * application reads them, ibv_query_gid and ibv_query_pkey only return
+ * cached entries once the application has called ibv_get_async_event.
+ * Until then, GID lookups use the cache to find an index, and confirm
+ * the entry through sysfs.
+ */
+void ibverbs_init_cache(struct verbs_ex_private *priv)
+{
+	pthread_mutex_init(&priv->cache_lock, NULL);
+}
+
+void ibverbs_free_cache(struct verbs_ex_private *priv)
+{
+	struct ibv_port_cache *ports;
+	int i;
+
+	ports = atomic_load(&priv->port_cache);
+	if (ports) {
+		for (i = 0; i < priv->num_ports; i++) {
+			free(ports[i].gid);
+			free(ports[i].pkey);
+		}
+		free(ports);
+	}
+	pthread_mutex_destroy(&priv->cache_lock);
+}
+
+static bool cache_trusted(struct ibv_context *context)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+
+	return vctx && atomic_load_explicit(&vctx->priv->cache_trusted,
+					    memory_order_relaxed);
+}
+
+static struct ibv_port_cache *get_port_cache(struct ibv_context *context,
+					     uint8_t port_num)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+	struct verbs_ex_private *priv;
+	struct ibv_port_cache *ports;
+	struct ibv_device_attr attr;
+
+	if (!vctx)
+		return NULL;
+
+	priv = vctx->priv;
+	ports = atomic_load_explicit(&priv->port_cache, memory_order_acquire);
+	if (!ports) {
+		pthread_mutex_lock(&priv->cache_lock);
+		ports = atomic_load_explicit(&priv->port_cache,
+					     memory_order_relaxed);
+		if (!ports && !context->ops.query_device(context, &attr) &&
+		    attr.phys_port_cnt) {
+			ports = calloc(attr.phys_port_cnt, sizeof(*ports));
+			if (ports) {
+				priv->num_ports = attr.phys_port_cnt;
+				atomic_store_explicit(&priv->port_cache, ports,
+						      memory_order_release);
+			}
+		}
+		pthread_mutex_unlock(&priv->cache_lock);
+		if (!ports)
+			return NULL;
+	}
+
+	if (port_num < 1 || port_num > priv->num_ports)
+		return NULL;
+
+	return &ports[port_num - 1];
+}
+
+/* Not all sysfs failures set errno */
+static int cache_err(int ret)
+{
+	return !ret ? 0 : errno ? errno : EIO;
+}
+
+/* Called with cache_lock held */
+static void fill_port_cache(struct ibv_context *context, uint8_t port_num,
+			    struct ibv_port_cache *port)
+{
+	struct ibv_gid_cache_entry *gid;
+	struct ibv_pkey_cache_entry *pkey;
+	struct ibv_port_attr attr;
+	int i;
+
+	if (!port->gid) {
+		if (context->ops.query_port(context, port_num, &attr))
+			return;
+
+		gid = calloc(attr.gid_tbl_len, sizeof(*gid));
+		pkey = calloc(attr.pkey_tbl_len, sizeof(*pkey));
+		if (!gid || !pkey) {
+			free(gid);
+			free(pkey);
+			return;
+		}
+
+		port->gid = gid;
+		port->gid_tbl_len = attr.gid_tbl_len;
+		port->pkey = pkey;
+		port->pkey_tbl_len = attr.pkey_tbl_len;
+	}
+
+	for (i = 0; i < port->gid_tbl_len; i++) {
+		gid = &port->gid[i];
+		errno = 0;
+		gid->gid_err = cache_err(query_gid_sysfs(context, port_num, i,
+							 &gid->gid));
+		errno = 0;
+		gid->type_err = cache_err(query_gid_type_sysfs(context, port_num,
+							       i, &gid->type));
+	}
+
+	for (i = 0; i < port->pkey_tbl_len; i++) {
+		pkey = &port->pkey[i];
+		errno = 0;
+		pkey->err = cache_err(query_pkey_sysfs(context, port_num, i,
+						       &pkey->pkey));
+	}
+
+	atomic_fetch_add_explicit(&port->seq, 1, memory_order_release);
+}
+
+/*
+ * Returns a snapshot of seq once the port's tables are valid, or 0 if
+ * they could not be read.
+ */
+static unsigned int read_port_cache_begin(struct ibv_context *context,
+					  uint8_t port_num,
+					  struct ibv_port_cache *port)
+{
+	struct verbs_ex_private *priv = verbs_get_ctx(context)->priv;
+	unsigned int seq;
+
+	seq = atomic_load_explicit(&port->seq, memory_order_acquire);
+	if (seq & 1)
+		return seq;
+
+	pthread_mutex_lock(&priv->cache_lock);
+	seq = atomic_load_explicit(&port->seq, memory_order_relaxed);
+	if (!(seq & 1)) {
+		fill_port_cache(context, port_num, port);
+		seq = atomic_load_explicit(&port->seq, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&priv->cache_lock);
+	return (seq & 1) ? seq : 0;
+}
+
+static bool read_port_cache_retry(struct ibv_port_cache *port,
+				  unsigned int seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&port->seq, memory_order_relaxed) != seq;
+}
+
+void ibverbs_invalidate_cache(struct ibv_context *context, uint8_t port_num)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+	struct ibv_port_cache *ports, *port;
+
+	if (!vctx)
+		return;
+
+	ports = atomic_load_explicit(&vctx->priv->port_cache,
+				     memory_order_acquire);
+	if (!ports || port_num < 1 || port_num > vctx->priv->num_ports)
+		return;
+
+	port = &ports[port_num - 1];
+	pthread_mutex_lock(&vctx->priv->cache_lock);
+	if (atomic_load_explicit(&port->seq, memory_order_relaxed) & 1)
+		atomic_fetch_add_explicit(&port->seq, 1, memory_order_release);
+	pthread_mutex_unlock(&vctx->priv->cache_lock);
+}
+
+/* Returns -1 if the entry is not cached */
+static int cache_query_gid(struct ibv_context *context, uint8_t port_num,
+			   int index, struct ibv_gid_cache_entry *entry)
+{
+	struct ibv_port_cache *port;
+	unsigned int seq;
+
+	port = get_port_cache(context, port_num);
+	if (!port)
+		return -1;
+
+	do {
+		seq = read_port_cache_begin(context, port_num, port);
+		if (!seq || index < 0 || index >= port->gid_tbl_len)
+			return -1;
+
+		*entry = port->gid[index];
+	} while (read_port_cache_retry(port, seq));
+
+	return 0;
+}
+
+static int cache_query_pkey(struct ibv_context *context, uint8_t port_num,
+			    int index, struct ibv_pkey_cache_entry *entry)
+{
+	struct ibv_port_cache *port;
+	unsigned int seq;
+
+	port = get_port_cache(context, port_num);
+	if (!port)
+		return -1;
+
+	do {
+		seq = read_port_cache_begin(context, port_num, port);
+		if (!seq || index < 0 || index >= port->pkey_tbl_len)
+			return -1;
+
+		*entry = port->pkey[index];
+	} while (read_port_cache_retry(port, seq));
+
+	return 0;
+}
+
+/*
+ * Returns the index of the GID in the cached table, -1 if it was not
+ * found, or -2 if the table is not cached.
+ */
+static int cache_find_gid(struct ibv_context *context, uint8_t port_num,
+			  union ibv_gid *gid, enum ibv_gid_type gid_type)
+{
+	struct ibv_gid_cache_entry *entry;
+	struct ibv_port_cache *port;
+	unsigned int seq;
+	int i, ret;
+
+	port = get_port_cache(context, port_num);
+	if (!port)
+		return -2;
+
+	do {
+		seq = read_port_cache_begin(context, port_num, port);
+		if (!seq)
+			return -2;
+
+		ret = -1;
+		for (i = 0; i < port->gid_tbl_len; i++) {
+			entry = &port->gid[i];
+			if (!entry->gid_err && !entry->type_err &&
+			    entry->type == gid_type &&
+			    !memcmp(&entry->gid, gid, sizeof(*gid))) {
+				ret = i;
+				break;
+			}
+		}
+	} while (read_port_cache_retry(port, seq));
+
+	return ret;
+}
+
+LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_context *context, uint8_t port_num,
+		   int index, union ibv_gid *gid)
+{
+	struct ibv_gid_cache_entry entry;
+
+	if (cache_trusted(context) &&
+	    !cache_query_gid(context, port_num, index, &entry)) {
+		if (entry.gid_err) {
+			errno = entry.gid_err;
+			return -1;
+		}
+		*gid = entry.gid;
+		return 0;
+	}
+
+	return query_gid_sysfs(context, port_num, index, gid);
+}
+
+LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_context *context, uint8_t port_num,
+		   int index, __be16 *pkey)
+{
+	struct ibv_pkey_cache_entry entry;
+
+	if (cache_trusted(context) &&
+	    !cache_query_pkey(context, port_num, index, &entry)) {
+		if (entry.err) {
+			errno = entry.err;
+			return -1;
+		}
+		*pkey = entry.pkey;
+		return 0;
+	}
+
+	return query_pkey_sysfs(context, port_num, index, pkey);
+}
+
 LATEST_SYMVER_FUNC(ibv_alloc_pd, 1_1, "IBVERBS_1.1",
 		   struct ibv_pd *,
 		   struct ibv_context *context)
@@ -325,8 +626,10 @@ static struct ibv_comp_channel *ibv_create_comp_channel_v2(struct ibv_context *c
 	struct ibv_abi_compat_v2 *t = context->abi_compat;
 	static int warned;
 
-	if (!pthread_mutex_trylock(&t->in_use))
-		return &t->channel;
+	if (!pthread_mutex_trylock(&t->in_use)) {
+		t->channel.nonblock = -1;
+		return &t->channel.channel;
+	}
 
 	if (!warned) {
 		fprintf(stderr, PFX "Warning: kernel's ABI version %d limits capacity.\n"
@@ -340,6 +643,7 @@ static struct ibv_comp_channel *ibv_create_comp_channel_v2(struct ibv_context *c
 
 struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 {
+	struct verbs_comp_channel          *vchannel;
 	struct ibv_comp_channel            *channel;
 	struct ibv_create_comp_channel      cmd;
 	struct ibv_create_comp_channel_resp resp;
@@ -347,21 +651,23 @@ struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
 	if (abi_ver <= 2)
 		return ibv_create_comp_channel_v2(context);
 
-	channel = malloc(sizeof *channel);
-	if (!channel)
+	vchannel = malloc(sizeof *vchannel);
+	if (!vchannel)
 		return NULL;
 
 	IBV_INIT_CMD_RESP(&cmd, sizeof cmd, CREATE_COMP_CHANNEL, &resp, sizeof resp);
 	if (write(context->cmd_fd, &cmd, sizeof cmd) != sizeof cmd) {
-		free(channel);
+		free(vchannel);
 		return NULL;
 	}
 
 	(void) VALGRIND_MAKE_MEM_DEFINED(&resp, sizeof resp);
 
+	channel = &vchannel->channel;
 	channel->context = context;
 	channel->fd      = resp.fd;
 	channel->refcnt  = 0;
+	vchannel->nonblock = -1;
 
 	return channel;
 }
@@ -392,7 +698,7 @@ int ibv_destroy_comp_channel(struct ibv_comp_channel *channel)
 	}
 
 	close(channel->fd);
-	free(channel);
+	free(container_of(channel, struct verbs_comp_channel, channel));
 	ret = 0;
 
 out:
@@ -465,6 +771,56 @@ LATEST_SYMVER_FUNC(ibv_get_cq_event, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
+/* The kernel returns a single event per read() today, but a larger buffer
+ * lets it return all that are queued should it ever do so.
+ */
+#define CQ_EVENTS_PER_READ 16
+
+int ibv_get_cq_events(struct ibv_comp_channel *channel,
+		      struct ibv_cq_event *events, int max)
+{
+	struct verbs_comp_channel *vchannel =
+		container_of(channel, struct verbs_comp_channel, channel);
+	struct ibv_comp_event ev[CQ_EVENTS_PER_READ];
+	struct ibv_cq *cq;
+	int flags, n = 0, i;
+	ssize_t len;
+	bool nonblock;
+
+	if (max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Only the first call that may return several events looks up the
+	 * blocking mode of the fd, later ones reuse it.
+	 */
+	if (max > 1 && vchannel->nonblock < 0) {
+		flags = fcntl(channel->fd, F_GETFL);
+		vchannel->nonblock = flags != -1 && flags & O_NONBLOCK;
+	}
+	nonblock = max > 1 && vchannel->nonblock > 0;
+
+	do {
+		len = read(channel->fd, ev,
+			   (max - n < CQ_EVENTS_PER_READ ?
+			    max - n : CQ_EVENTS_PER_READ) * sizeof(*ev));
+		if (len < (ssize_t)sizeof(*ev))
+			break;
+
+		for (i = 0; i < len / sizeof(*ev); i++, n++) {
+			cq = (struct ibv_cq *)(uintptr_t)ev[i].cq_handle;
+			events[n].cq = cq;
+			events[n].cq_context = cq->cq_context;
+
+			if (cq->context->ops.cq_event)
+				cq->context->ops.cq_event(cq);
+		}
+	} while (nonblock && n < max);
+
+	return n ? n : -1;
+}
+
 LATEST_SYMVER_FUNC(ibv_ack_cq_events, 1_1, "IBVERBS_1.1",
 		   void,
 		   struct ibv_cq *cq, unsigned int nevents)
@@ -545,6 +901,15 @@ LATEST_SYMVER_FUNC(ibv_create_qp, 1_1, "IBVERBS_1.1",
 	return qp;
 }
 
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *qp)
+{
+	struct verbs_qp *vqp = (struct verbs_qp *)qp;
+
+	if (vqp->comp_mask & VERBS_QP_EX)
+		return &vqp->qp_ex;
+	return NULL;
+}
+
 LATEST_SYMVER_FUNC(ibv_query_qp, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_qp *qp, struct ibv_qp_attr *attr,
@@ -606,8 +971,8 @@ LATEST_SYMVER_FUNC(ibv_create_ah, 1_1, "IBVERBS_1.1",
  */
 #define V1_TYPE "IB/RoCE v1"
 #define V2_TYPE "RoCE v2"
-int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
-		       unsigned int index, enum ibv_gid_type *type)
+static int query_gid_type_sysfs(struct ibv_context *context, uint8_t port_num,
+				unsigned int index, enum ibv_gid_type *type)
 {
 	char name[32];
 	char buff[11];
@@ -665,18 +1030,62 @@ int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
 	return 0;
 }
 
+int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
+		       unsigned int index, enum ibv_gid_type *type)
+{
+	struct ibv_gid_cache_entry entry;
+
+	if (cache_trusted(context) &&
+	    !cache_query_gid(context, port_num, index, &entry)) {
+		if (entry.type_err) {
+			errno = entry.type_err;
+			return -1;
+		}
+		*type = entry.type;
+		return 0;
+	}
+
+	return query_gid_type_sysfs(context, port_num, index, type);
+}
+
+/* Check that a GID found in the cache is still at that index */
+static bool gid_index_matches(struct ibv_context *context, uint8_t port_num,
+			      int index, union ibv_gid *gid,
+			      enum ibv_gid_type gid_type)
+{
+	enum ibv_gid_type sgid_type;
+	union ibv_gid sgid;
+
+	return !query_gid_sysfs(context, port_num, index, &sgid) &&
+	       !query_gid_type_sysfs(context, port_num, index, &sgid_type) &&
+	       sgid_type == gid_type && !memcmp(&sgid, gid, sizeof(*gid));
+}
+
 static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
 			      union ibv_gid *gid, enum ibv_gid_type gid_type)
 {
 	enum ibv_gid_type sgid_type = 0;
 	union ibv_gid sgid;
-	int i = 0, ret;
+	int i = 0, ret, retry;
+
+	/* If the GID is not found, refresh the cache once before scanning */
+	for (retry = 0; retry < 2; retry++) {
+		ret = cache_find_gid(context, port_num, gid, gid_type);
+		if (ret == -2)
+			break;
+
+		if (ret >= 0 && (cache_trusted(context) ||
+		    gid_index_matches(context, port_num, ret, gid, gid_type)))
+			return ret;
+
+		ibverbs_invalidate_cache(context, port_num);
+	}
 
 	do {
-		ret = ibv_query_gid(context, port_num, i, &sgid);
+		ret = query_gid_sysfs(context, port_num, i, &sgid);
 		if (!ret) {
-			ret = ibv_query_gid_type(context, port_num, i,
-						 &sgid_type);
+			ret = query_gid_type_sysfs(context, port_num, i,
+						   &sgid_type);
 		}
 		i++;
 	} while (!ret && (memcmp(&sgid, gid, sizeof(*gid)) ||
@@ -929,8 +1338,8 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	int ether_len;
 	struct peer_address src;
 	struct peer_address dst;
-	uint16_t ret_vid;
-	int ret = -EINVAL;
+	uint16_t ret_vid = 0;
+	int ret;
 	int err;
 
 	err = ibv_query_gid(context, attr->port_num,
@@ -939,11 +1348,20 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	if (err)
 		return err;
 
+	ret = neigh_cache_get(sgid.raw, attr->grh.dgid.raw, eth_mac, vid);
+	if (ret != NEIGH_CACHE_MISS)
+		return ret;
+
 	err = neigh_init_resources(&neigh_handler,
 				   NEIGH_GET_DEFAULT_TIMEOUT_MS);
 
-	if (err)
+	if (err) {
+		neigh_cache_put(sgid.raw, attr->grh.dgid.raw, err, NULL, 0,
+				NULL);
 		return err;
+	}
+
+	ret = -EINVAL;
 
 	dst_family = ipv6_addr_v4mapped((struct in6_addr *)attr->grh.dgid.raw) ?
 			AF_INET : AF_INET6;
@@ -995,6 +1413,8 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	ret = 0;
 
 free_resources:
+	neigh_cache_put(sgid.raw, attr->grh.dgid.raw, ret, eth_mac, ret_vid,
+			&neigh_handler);
 	neigh_free_resources(&neigh_handler);
 
 	return ret;
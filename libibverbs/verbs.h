@@ -555,6 +555,31 @@ enum ibv_xrcd_init_attr_mask {
 	IBV_XRCD_INIT_ATTR_RESERVED = 1 << 2
 };
 
+struct ibv_td_init_attr {
+	uint32_t comp_mask;
+};
+
+/* A thread domain groups resources that are only used by one thread at a
+ * time, letting the provider drop the locks that protect them.
+ */
+struct ibv_td {
+	struct ibv_context     *context;
+};
+
+enum ibv_parent_domain_init_attr_mask {
+	IBV_PARENT_DOMAIN_INIT_ATTR_RESERVED	= 1 << 0,
+};
+
+/* A parent domain is used as a PD in the verbs that accept one, and applies
+ * the protection domain pd and the thread domain td, if any, to the
+ * resources created with it.  It is freed by ibv_dealloc_pd().
+ */
+struct ibv_parent_domain_init_attr {
+	struct ibv_pd *pd; /* reference to a protection domain object, can't be NULL */
+	struct ibv_td *td; /* reference to a thread domain object, or NULL */
+	uint32_t comp_mask;
+};
+
 struct ibv_xrcd_init_attr {
 	uint32_t comp_mask;
 	int	 fd;
@@ -833,7 +858,8 @@ enum ibv_qp_init_attr_mask {
 	IBV_QP_INIT_ATTR_MAX_TSO_HEADER = 1 << 3,
 	IBV_QP_INIT_ATTR_IND_TABLE	= 1 << 4,
 	IBV_QP_INIT_ATTR_RX_HASH	= 1 << 5,
-	IBV_QP_INIT_ATTR_RESERVED	= 1 << 6
+	IBV_QP_INIT_ATTR_SEND_OPS_FLAGS	= 1 << 6,
+	IBV_QP_INIT_ATTR_RESERVED	= 1 << 7
 };
 
 enum ibv_qp_create_flags {
@@ -843,6 +869,19 @@ enum ibv_qp_create_flags {
 	IBV_QP_CREATE_SOURCE_QPN		= 1 << 10,
 };
 
+enum ibv_qp_create_send_ops_flags {
+	IBV_QP_EX_WITH_RDMA_WRITE		= 1 << 0,
+	IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM	= 1 << 1,
+	IBV_QP_EX_WITH_SEND			= 1 << 2,
+	IBV_QP_EX_WITH_SEND_WITH_IMM		= 1 << 3,
+	IBV_QP_EX_WITH_RDMA_READ		= 1 << 4,
+	IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP	= 1 << 5,
+	IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD	= 1 << 6,
+	IBV_QP_EX_WITH_LOCAL_INV		= 1 << 7,
+	IBV_QP_EX_WITH_BIND_MW			= 1 << 8,
+	IBV_QP_EX_WITH_SEND_WITH_INV		= 1 << 9,
+};
+
 struct ibv_rx_hash_conf {
 	/* enum ibv_rx_hash_function_flags */
 	uint8_t	rx_hash_function;
@@ -869,6 +908,8 @@ struct ibv_qp_init_attr_ex {
 	struct ibv_rwq_ind_table       *rwq_ind_tbl;
 	struct ibv_rx_hash_conf	rx_hash_conf;
 	uint32_t		source_qpn;
+	/* See enum ibv_qp_create_send_ops_flags */
+	uint64_t		send_ops_flags;
 };
 
 enum ibv_qp_open_attr_mask {
@@ -993,6 +1034,11 @@ struct ibv_sge {
 	uint32_t		lkey;
 };
 
+struct ibv_data_buf {
+	void			*addr;
+	size_t			length;
+};
+
 struct ibv_send_wr {
 	uint64_t		wr_id;
 	struct ibv_send_wr     *next;
@@ -1142,6 +1188,176 @@ struct ibv_qp {
 	uint32_t		events_completed;
 };
 
+/*
+ * An extended QP posts send work requests through a builder instead of a
+ * list of struct ibv_send_wr.  ibv_wr_start() begins a batch, each work
+ * request is built by one opcode call, e.g. ibv_wr_send(), followed by the
+ * calls that set its data and address, and ibv_wr_complete() posts the
+ * batch.  wr_id and wr_flags (enum ibv_send_flags) are read by the opcode
+ * call.  Only the opcodes requested in send_ops_flags when the QP was created
+ * may be used.
+ */
+struct ibv_qp_ex {
+	struct ibv_qp		qp_base;
+	uint64_t		comp_mask;
+
+	uint64_t		wr_id;
+	unsigned int		wr_flags;
+
+	void (*wr_atomic_cmp_swp)(struct ibv_qp_ex *qp, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare,
+				  uint64_t swap);
+	void (*wr_atomic_fetch_add)(struct ibv_qp_ex *qp, uint32_t rkey,
+				    uint64_t remote_addr, uint64_t add);
+	void (*wr_bind_mw)(struct ibv_qp_ex *qp, struct ibv_mw *mw,
+			   uint32_t rkey,
+			   const struct ibv_mw_bind_info *bind_info);
+	void (*wr_local_inv)(struct ibv_qp_ex *qp, uint32_t invalidate_rkey);
+	void (*wr_rdma_read)(struct ibv_qp_ex *qp, uint32_t rkey,
+			     uint64_t remote_addr);
+	void (*wr_rdma_write)(struct ibv_qp_ex *qp, uint32_t rkey,
+			      uint64_t remote_addr);
+	void (*wr_rdma_write_imm)(struct ibv_qp_ex *qp, uint32_t rkey,
+				  uint64_t remote_addr, __be32 imm_data);
+	void (*wr_send)(struct ibv_qp_ex *qp);
+	void (*wr_send_imm)(struct ibv_qp_ex *qp, __be32 imm_data);
+	void (*wr_send_inv)(struct ibv_qp_ex *qp, uint32_t invalidate_rkey);
+
+	void (*wr_set_ud_addr)(struct ibv_qp_ex *qp, struct ibv_ah *ah,
+			       uint32_t remote_qpn, uint32_t remote_qkey);
+	void (*wr_set_xrc_srqn)(struct ibv_qp_ex *qp, uint32_t remote_srqn);
+	void (*wr_set_inline_data)(struct ibv_qp_ex *qp, void *addr,
+				   size_t length);
+	void (*wr_set_inline_data_list)(struct ibv_qp_ex *qp, size_t num_buf,
+					const struct ibv_data_buf *buf_list);
+	void (*wr_set_sge)(struct ibv_qp_ex *qp, uint32_t lkey, uint64_t addr,
+			   uint32_t length);
+	void (*wr_set_sge_list)(struct ibv_qp_ex *qp, size_t num_sge,
+				const struct ibv_sge *sg_list);
+
+	void (*wr_start)(struct ibv_qp_ex *qp);
+	int (*wr_complete)(struct ibv_qp_ex *qp);
+	void (*wr_abort)(struct ibv_qp_ex *qp);
+};
+
+/**
+ * ibv_qp_to_qp_ex - Get the extended QP of a QP created with
+ * IBV_QP_INIT_ATTR_SEND_OPS_FLAGS, or NULL for any other QP.
+ */
+struct ibv_qp_ex *ibv_qp_to_qp_ex(struct ibv_qp *qp);
+
+static inline void ibv_wr_atomic_cmp_swp(struct ibv_qp_ex *qp, uint32_t rkey,
+					 uint64_t remote_addr, uint64_t compare,
+					 uint64_t swap)
+{
+	qp->wr_atomic_cmp_swp(qp, rkey, remote_addr, compare, swap);
+}
+
+static inline void ibv_wr_atomic_fetch_add(struct ibv_qp_ex *qp, uint32_t rkey,
+					   uint64_t remote_addr, uint64_t add)
+{
+	qp->wr_atomic_fetch_add(qp, rkey, remote_addr, add);
+}
+
+static inline void ibv_wr_bind_mw(struct ibv_qp_ex *qp, struct ibv_mw *mw,
+				  uint32_t rkey,
+				  const struct ibv_mw_bind_info *bind_info)
+{
+	qp->wr_bind_mw(qp, mw, rkey, bind_info);
+}
+
+static inline void ibv_wr_local_inv(struct ibv_qp_ex *qp,
+				    uint32_t invalidate_rkey)
+{
+	qp->wr_local_inv(qp, invalidate_rkey);
+}
+
+static inline void ibv_wr_rdma_read(struct ibv_qp_ex *qp, uint32_t rkey,
+				    uint64_t remote_addr)
+{
+	qp->wr_rdma_read(qp, rkey, remote_addr);
+}
+
+static inline void ibv_wr_rdma_write(struct ibv_qp_ex *qp, uint32_t rkey,
+				     uint64_t remote_addr)
+{
+	qp->wr_rdma_write(qp, rkey, remote_addr);
+}
+
+static inline void ibv_wr_rdma_write_imm(struct ibv_qp_ex *qp, uint32_t rkey,
+					 uint64_t remote_addr, __be32 imm_data)
+{
+	qp->wr_rdma_write_imm(qp, rkey, remote_addr, imm_data);
+}
+
+static inline void ibv_wr_send(struct ibv_qp_ex *qp)
+{
+	qp->wr_send(qp);
+}
+
+static inline void ibv_wr_send_imm(struct ibv_qp_ex *qp, __be32 imm_data)
+{
+	qp->wr_send_imm(qp, imm_data);
+}
+
+static inline void ibv_wr_send_inv(struct ibv_qp_ex *qp,
+				   uint32_t invalidate_rkey)
+{
+	qp->wr_send_inv(qp, invalidate_rkey);
+}
+
+static inline void ibv_wr_set_ud_addr(struct ibv_qp_ex *qp, struct ibv_ah *ah,
+				      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	qp->wr_set_ud_addr(qp, ah, remote_qpn, remote_qkey);
+}
+
+static inline void ibv_wr_set_xrc_srqn(struct ibv_qp_ex *qp,
+				       uint32_t remote_srqn)
+{
+	qp->wr_set_xrc_srqn(qp, remote_srqn);
+}
+
+static inline void ibv_wr_set_inline_data(struct ibv_qp_ex *qp, void *addr,
+					  size_t length)
+{
+	qp->wr_set_inline_data(qp, addr, length);
+}
+
+static inline void ibv_wr_set_inline_data_list(struct ibv_qp_ex *qp,
+					       size_t num_buf,
+					       const struct ibv_data_buf *buf_list)
+{
+	qp->wr_set_inline_data_list(qp, num_buf, buf_list);
+}
+
+static inline void ibv_wr_set_sge(struct ibv_qp_ex *qp, uint32_t lkey,
+				  uint64_t addr, uint32_t length)
+{
+	qp->wr_set_sge(qp, lkey, addr, length);
+}
+
+static inline void ibv_wr_set_sge_list(struct ibv_qp_ex *qp, size_t num_sge,
+				       const struct ibv_sge *sg_list)
+{
+	qp->wr_set_sge_list(qp, num_sge, sg_list);
+}
+
+static inline void ibv_wr_start(struct ibv_qp_ex *qp)
+{
+	qp->wr_start(qp);
+}
+
+static inline int ibv_wr_complete(struct ibv_qp_ex *qp)
+{
+	return qp->wr_complete(qp);
+}
+
+static inline void ibv_wr_abort(struct ibv_qp_ex *qp)
+{
+	qp->wr_abort(qp);
+}
+
 struct ibv_comp_channel {
 	struct ibv_context     *context;
 	int			fd;
@@ -1583,7 +1799,8 @@ struct ibv_context {
 
 enum ibv_cq_init_attr_mask {
 	IBV_CQ_INIT_ATTR_MASK_FLAGS	= 1 << 0,
-	IBV_CQ_INIT_ATTR_MASK_RESERVED	= 1 << 1
+	IBV_CQ_INIT_ATTR_MASK_PD	= 1 << 1,
+	IBV_CQ_INIT_ATTR_MASK_RESERVED	= 1 << 2
 };
 
 enum ibv_create_cq_attr_flags {
@@ -1614,6 +1831,10 @@ struct ibv_cq_init_attr_ex {
 	 * enum ibv_create_cq_attr_flags
 	 */
 	uint32_t		flags;
+	/* A parent domain whose thread domain the CQ is used from, valid
+	 * with IBV_CQ_INIT_ATTR_MASK_PD.
+	 */
+	struct ibv_pd		*parent_domain;
 };
 
 enum ibv_values_mask {
@@ -1637,6 +1858,11 @@ enum verbs_context_mask {
 
 struct verbs_context {
 	/*  "grows up" - new fields go here */
+	struct ibv_pd *(*alloc_parent_domain)(struct ibv_context *context,
+					      struct ibv_parent_domain_init_attr *attr);
+	int (*dealloc_td)(struct ibv_td *td);
+	struct ibv_td *(*alloc_td)(struct ibv_context *context,
+				   struct ibv_td_init_attr *init_attr);
 	int (*post_srq_ops)(struct ibv_srq *srq,
 			    struct ibv_ops_wr *op,
 			    struct ibv_ops_wr **bad_op);
@@ -1878,6 +2104,55 @@ int ibv_rereg_mr(struct ibv_mr *mr, int flags,
  */
 int ibv_dereg_mr(struct ibv_mr *mr);
 
+struct ibv_mr_cache;
+
+enum ibv_mr_cache_init_attr_mask {
+	IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS	= 1 << 0,
+};
+
+enum ibv_mr_cache_flags {
+	/* Drop regions when their pages are unmapped, using userfaultfd */
+	IBV_MR_CACHE_AUTO_INVALIDATE		= 1 << 0,
+};
+
+struct ibv_mr_cache_init_attr {
+	/* Regions not in use are evicted above this many bytes, 0 for none */
+	size_t			max_bytes;
+	int			access;
+	uint32_t		comp_mask;
+	uint32_t		flags;	/* use enum ibv_mr_cache_flags */
+};
+
+/**
+ * ibv_mr_cache_create - Create a cache of memory regions of a PD
+ */
+struct ibv_mr_cache *ibv_mr_cache_create(struct ibv_pd *pd,
+					 struct ibv_mr_cache_init_attr *attr);
+
+/**
+ * ibv_mr_cache_destroy - Deregister all the regions of a cache and free it
+ */
+int ibv_mr_cache_destroy(struct ibv_mr_cache *cache);
+
+/**
+ * ibv_mr_cache_get - Return a memory region covering a range, registering
+ * it if it is not in the cache
+ */
+struct ibv_mr *ibv_mr_cache_get(struct ibv_mr_cache *cache, void *addr,
+				size_t length);
+
+/**
+ * ibv_mr_cache_put - Release a memory region returned by ibv_mr_cache_get
+ */
+void ibv_mr_cache_put(struct ibv_mr_cache *cache, struct ibv_mr *mr);
+
+/**
+ * ibv_mr_cache_invalidate - Drop the regions covering a range from the
+ * cache, before it is unmapped or remapped
+ */
+void ibv_mr_cache_invalidate(struct ibv_mr_cache *cache, void *addr,
+			     size_t length);
+
 /**
  * ibv_alloc_mw - Allocate a memory window
  */
@@ -1951,6 +2226,74 @@ struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe,
 			     struct ibv_comp_channel *channel,
 			     int comp_vector);
 
+/**
+ * ibv_alloc_td - Allocate a thread domain
+ * @context - Context the thread domain is allocated on
+ * @init_attr - Attributes of the thread domain
+ */
+static inline struct ibv_td *ibv_alloc_td(struct ibv_context *context,
+					  struct ibv_td_init_attr *init_attr)
+{
+	struct verbs_context *vctx = verbs_get_ctx_op(context, alloc_td);
+
+	if (!vctx) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	if (init_attr->comp_mask) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return vctx->alloc_td(context, init_attr);
+}
+
+/**
+ * ibv_dealloc_td - Free a thread domain
+ * @td - The thread domain, which may not be referenced by any parent domain
+ */
+static inline int ibv_dealloc_td(struct ibv_td *td)
+{
+	struct verbs_context *vctx = verbs_get_ctx_op(td->context, dealloc_td);
+
+	if (!vctx)
+		return ENOSYS;
+
+	return vctx->dealloc_td(td);
+}
+
+/**
+ * ibv_alloc_parent_domain - Allocate a parent domain
+ * @context - Context the parent domain is allocated on
+ * @attr - The protection domain and thread domain it is made of
+ */
+static inline struct ibv_pd *
+ibv_alloc_parent_domain(struct ibv_context *context,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct verbs_context *vctx = verbs_get_ctx_op(context,
+						      alloc_parent_domain);
+	struct ibv_pd *pd;
+
+	if (!vctx) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	if (!attr->pd ||
+	    attr->comp_mask & ~(IBV_PARENT_DOMAIN_INIT_ATTR_RESERVED - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pd = vctx->alloc_parent_domain(context, attr);
+	if (pd)
+		pd->context = context;
+
+	return pd;
+}
+
 /**
  * ibv_create_cq_ex - Create a completion queue
  * @context - Context CQ will be attached to
@@ -2001,6 +2344,27 @@ int ibv_destroy_cq(struct ibv_cq *cq);
 int ibv_get_cq_event(struct ibv_comp_channel *channel,
 		     struct ibv_cq **cq, void **cq_context);
 
+struct ibv_cq_event {
+	struct ibv_cq	       *cq;
+	void		       *cq_context;
+};
+
+/**
+ * ibv_get_cq_events - Read a batch of CQ events
+ * @channel: Channel to get the events from.
+ * @events: Array used to return the CQ and CQ context of each event.
+ * @max: Number of entries in @events.
+ *
+ * Blocks until an event is available, unless the channel fd is
+ * non-blocking, in which case it also keeps reading for as long as
+ * events are queued, up to @max.  Whether the fd is non-blocking is
+ * looked up once, by the first call with @max > 1.  Returns the number of events read, or
+ * -1 with errno set if there were none.  Each event must be acknowledged
+ * with ibv_ack_cq_events() like those of ibv_get_cq_event().
+ */
+int ibv_get_cq_events(struct ibv_comp_channel *channel,
+		      struct ibv_cq_event *events, int max);
+
 /**
  * ibv_ack_cq_events - Acknowledge CQ completion events
  * @cq: CQ to acknowledge events for
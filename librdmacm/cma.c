@@ -428,6 +428,25 @@ static void ucma_put_device(struct cma_device *cma_dev)
 	pthread_mutex_unlock(&mut);
 }
 
+/*
+ * Keep the device used by an id, and its PD, open after the id is destroyed.
+ */
+struct cma_device *ucma_hold_device(struct rdma_cm_id *id)
+{
+	struct cma_id_private *id_priv;
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	pthread_mutex_lock(&mut);
+	id_priv->cma_dev->refcnt++;
+	pthread_mutex_unlock(&mut);
+	return id_priv->cma_dev;
+}
+
+void ucma_release_device(struct cma_device *cma_dev)
+{
+	ucma_put_device(cma_dev);
+}
+
 static struct ibv_xrcd *ucma_get_xrcd(struct cma_device *cma_dev)
 {
 	struct ibv_xrcd_init_attr attr;
@@ -1389,6 +1408,28 @@ err1:
 	return ret;
 }
 
+/*
+ * Assign a connected QP created by the caller, in the reset state and on
+ * the id's PD, to the id.  The QP is moved to the init state, and is
+ * destroyed with the id's CQs by rdma_destroy_qp.
+ */
+int ucma_attach_qp(struct rdma_cm_id *id, struct ibv_qp *qp)
+{
+	struct cma_id_private *id_priv;
+	int ret;
+
+	if (id->qp || qp->pd != id->pd || ucma_is_ud_qp(id->qp_type))
+		return ERR(EINVAL);
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	ret = ucma_init_conn_qp(id_priv, qp);
+	if (ret)
+		return ret;
+
+	id->qp = qp;
+	return 0;
+}
+
 int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
 		   struct ibv_qp_init_attr *qp_init_attr)
 {
@@ -86,6 +86,11 @@ int ucma_max_qpsize(struct rdma_cm_id *id);
 int ucma_complete(struct rdma_cm_id *id);
 int ucma_shutdown(struct rdma_cm_id *id);
 
+struct cma_device;
+struct cma_device *ucma_hold_device(struct rdma_cm_id *id);
+void ucma_release_device(struct cma_device *cma_dev);
+int ucma_attach_qp(struct rdma_cm_id *id, struct ibv_qp *qp);
+
 static inline int ERR(int err)
 {
 	errno = err;
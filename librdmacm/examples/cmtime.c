@@ -43,6 +43,7 @@
 #include <netinet/tcp.h>
 
 #include <rdma/rdma_cma.h>
+#include <rdma/rsocket.h>
 #include "common.h"
 
 static struct rdma_addrinfo hints, *rai;
@@ -52,6 +53,7 @@ static char *dst_addr;
 static char *src_addr;
 static int timeout = 2000;
 static int retries = 2;
+static int time_rs;
 
 enum step {
 	STEP_CREATE_ID,
@@ -107,6 +109,28 @@ static volatile int completed[STEP_CNT];
 static struct ibv_qp_init_attr init_qp_attr;
 static struct rdma_conn_param conn_param;
 
+enum rs_step {
+	RS_STEP_SOCKET,
+	RS_STEP_BIND,
+	RS_STEP_CONNECT,
+	RS_STEP_ACCEPT,
+	RS_STEP_CLOSE,
+	RS_STEP_TOTAL,
+	RS_STEP_CNT
+};
+
+static const char *rs_step_str[] = {
+	"rsocket",
+	"rbind",
+	"rconnect",
+	"raccept",
+	"rclose",
+	"total"
+};
+
+/* rsocket mode latencies, in us, indexed by step and connection */
+static float *rs_times[RS_STEP_CNT];
+
 #define start_perf(n, s)	gettimeofday(&((n)->times[s][0]), NULL)
 #define end_perf(n, s)		gettimeofday(&((n)->times[s][1]), NULL)
 #define start_time(s)		gettimeofday(&times[s][0], NULL)
@@ -190,6 +214,193 @@ static void show_perf(void)
 	}
 }
 
+static int compare_float(const void *a, const void *b)
+{
+	float x = *(const float *) a, y = *(const float *) b;
+
+	return (x > y) - (x < y);
+}
+
+static float percentile(float *us, int cnt, int pct)
+{
+	return us[(cnt - 1) * pct / 100];
+}
+
+static void show_rs_perf(int cnt)
+{
+	int i;
+
+	if (!cnt) {
+		printf("no connections completed\n");
+		return;
+	}
+
+	printf("step             min us     p50 us     p90 us     p99 us     max us\n");
+	for (i = 0; i < RS_STEP_CNT; i++) {
+		if (!rs_times[i])
+			continue;
+
+		qsort(rs_times[i], cnt, sizeof(*rs_times[i]), compare_float);
+		printf("%-13s: %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		       rs_step_str[i], rs_times[i][0],
+		       percentile(rs_times[i], cnt, 50),
+		       percentile(rs_times[i], cnt, 90),
+		       percentile(rs_times[i], cnt, 99), rs_times[i][cnt - 1]);
+	}
+}
+
+static int alloc_rs_times(enum rs_step step)
+{
+	rs_times[step] = calloc(connections, sizeof(*rs_times[step]));
+	return rs_times[step] ? 0 : -ENOMEM;
+}
+
+static void free_rs_times(void)
+{
+	int i;
+
+	for (i = 0; i < RS_STEP_CNT; i++)
+		free(rs_times[i]);
+}
+
+/*
+ * Connections are established one at a time, so that each step is timed
+ * without contention from other connections.
+ */
+static int run_rs_client(void)
+{
+	struct timeval t[5];
+	int rs, cnt, ret;
+
+	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
+	if (ret) {
+		printf("getaddrinfo error: %s\n", gai_strerror(ret));
+		return ret;
+	}
+
+	if (alloc_rs_times(RS_STEP_SOCKET) || alloc_rs_times(RS_STEP_CONNECT) ||
+	    alloc_rs_times(RS_STEP_CLOSE) || alloc_rs_times(RS_STEP_TOTAL) ||
+	    (src_addr && alloc_rs_times(RS_STEP_BIND))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	printf("connecting\n");
+	for (cnt = 0; cnt < connections; cnt++) {
+		gettimeofday(&t[0], NULL);
+		rs = rsocket(rai->ai_family, SOCK_STREAM, 0);
+		if (rs < 0) {
+			perror("rsocket");
+			ret = rs;
+			break;
+		}
+
+		gettimeofday(&t[1], NULL);
+		if (src_addr) {
+			ret = rbind(rs, rai->ai_src_addr, rai->ai_src_len);
+			if (ret) {
+				perror("rbind");
+				rclose(rs);
+				break;
+			}
+		}
+
+		gettimeofday(&t[2], NULL);
+		ret = rconnect(rs, rai->ai_dst_addr, rai->ai_dst_len);
+		if (ret) {
+			perror("rconnect");
+			rclose(rs);
+			break;
+		}
+
+		gettimeofday(&t[3], NULL);
+		rclose(rs);
+		gettimeofday(&t[4], NULL);
+
+		rs_times[RS_STEP_SOCKET][cnt] = diff_us(&t[1], &t[0]);
+		if (src_addr)
+			rs_times[RS_STEP_BIND][cnt] = diff_us(&t[2], &t[1]);
+		rs_times[RS_STEP_CONNECT][cnt] = diff_us(&t[3], &t[2]);
+		rs_times[RS_STEP_CLOSE][cnt] = diff_us(&t[4], &t[3]);
+		rs_times[RS_STEP_TOTAL][cnt] = diff_us(&t[4], &t[0]);
+	}
+
+	show_rs_perf(cnt);
+out:
+	free_rs_times();
+	return ret;
+}
+
+/*
+ * The server waits for the client to close each connection before
+ * accepting the next, matching the client's serialized connections.
+ */
+static int run_rs_server(void)
+{
+	struct timeval t[4];
+	int lrs, rs, cnt, ret, val = 1;
+	char c;
+
+	ret = get_rdma_addr(src_addr, dst_addr, port, &hints, &rai);
+	if (ret) {
+		printf("getrdmaaddr error: %s\n", gai_strerror(ret));
+		return ret;
+	}
+
+	if (alloc_rs_times(RS_STEP_ACCEPT) || alloc_rs_times(RS_STEP_CLOSE)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	lrs = rsocket(rai->ai_family, SOCK_STREAM, 0);
+	if (lrs < 0) {
+		perror("rsocket");
+		ret = lrs;
+		goto out;
+	}
+
+	rsetsockopt(lrs, SOL_SOCKET, SO_REUSEADDR, &val, sizeof val);
+	ret = rbind(lrs, rai->ai_src_addr, rai->ai_src_len);
+	if (ret) {
+		perror("rbind");
+		goto close;
+	}
+
+	ret = rlisten(lrs, 1);
+	if (ret) {
+		perror("rlisten");
+		goto close;
+	}
+
+	printf("accepting\n");
+	for (cnt = 0; cnt < connections; cnt++) {
+		gettimeofday(&t[0], NULL);
+		rs = raccept(lrs, NULL, NULL);
+		if (rs < 0) {
+			perror("raccept");
+			ret = rs;
+			break;
+		}
+
+		gettimeofday(&t[1], NULL);
+		while (rrecv(rs, &c, sizeof c, 0) > 0)
+			;
+		gettimeofday(&t[2], NULL);
+		rclose(rs);
+		gettimeofday(&t[3], NULL);
+
+		rs_times[RS_STEP_ACCEPT][cnt] = diff_us(&t[1], &t[0]);
+		rs_times[RS_STEP_CLOSE][cnt] = diff_us(&t[3], &t[2]);
+	}
+
+	show_rs_perf(cnt);
+close:
+	rclose(lrs);
+out:
+	free_rs_times();
+	return ret;
+}
+
 static void addr_handler(struct node *n)
 {
 	end_perf(n, STEP_RESOLVE_ADDR);
@@ -614,7 +825,7 @@ int main(int argc, char **argv)
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:p:r:t:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:p:r:t:R")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -634,6 +845,9 @@ int main(int argc, char **argv)
 		case 't':
 			timeout = atoi(optarg);
 			break;
+		case 'R':
+			time_rs = 1;
+			break;
 		default:
 			printf("usage: %s\n", argv[0]);
 			printf("\t[-s server_address]\n");
@@ -642,10 +856,23 @@ int main(int argc, char **argv)
 			printf("\t[-p port_number]\n");
 			printf("\t[-r retries]\n");
 			printf("\t[-t timeout_ms]\n");
+			printf("\t[-R (time rsocket connections)]\n");
 			exit(1);
 		}
 	}
 
+	if (time_rs) {
+		if (dst_addr) {
+			ret = run_rs_client();
+		} else {
+			hints.ai_flags |= RAI_PASSIVE;
+			ret = run_rs_server();
+		}
+		if (rai)
+			rdma_freeaddrinfo(rai);
+		return ret;
+	}
+
 	init_qp_attr.cap.max_send_wr = 1;
 	init_qp_attr.cap.max_recv_wr = 1;
 	init_qp_attr.cap.max_send_sge = 1;
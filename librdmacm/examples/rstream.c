@@ -89,6 +89,12 @@ static int iterations = 1;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
 static int buffer_size, inline_size = 64;
+static uint32_t zcopy_threshold;
+static int use_shared;
+static int use_more;
+static int more;
+static int conn_count = 1;
+static int *conns;
 static char test_name[10] = "custom";
 static const char *port = "7471";
 static int keepalive;
@@ -123,6 +129,32 @@ static void show_perf(void)
 		(usec / iterations) / (transfer_count * 2));
 }
 
+static void show_mem(void)
+{
+	char str[32];
+	long long rss;
+	long size, pages;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return;
+
+	if (fscanf(f, "%ld %ld", &size, &pages) != 2) {
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	rss = (long long) pages * sysconf(_SC_PAGESIZE);
+	cnt_str(str, sizeof str, conn_count);
+	printf("connections: %s", str);
+	size_str(str, sizeof str, rss);
+	printf("  rss: %s", str);
+	size_str(str, sizeof str, rss / conn_count);
+	printf("  rss/conn: %s\n", str);
+}
+
 static void init_latency_test(int size)
 {
 	char sstr[5];
@@ -165,7 +197,7 @@ static int send_xfer(int size)
 				return ret;
 		}
 
-		ret = rs_send(rs, buf + offset, size - offset, flags);
+		ret = rs_send(rs, buf + offset, size - offset, flags | more);
 		if (ret > 0) {
 			offset += ret;
 		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
@@ -234,15 +266,25 @@ static int run_test(void)
 	gettimeofday(&start, NULL);
 	for (i = 0; i < iterations; i++) {
 		for (t = 0; t < transfer_count; t++) {
+			if (conns)
+				rs = conns[t % conn_count];
+			if (use_more && t + 1 < transfer_count)
+				more = MSG_MORE;
 			ret = dst_addr ? send_xfer(transfer_size) :
 					 recv_xfer(transfer_size);
+			more = 0;
 			if (ret)
 				goto out;
 		}
 
 		for (t = 0; t < transfer_count; t++) {
+			if (conns)
+				rs = conns[t % conn_count];
+			if (use_more && t + 1 < transfer_count)
+				more = MSG_MORE;
 			ret = dst_addr ? recv_xfer(transfer_size) :
 					 send_xfer(transfer_size);
+			more = 0;
 			if (ret)
 				goto out;
 		}
@@ -307,6 +349,14 @@ static void set_options(int fd)
 			val = 0;
 			rs_setsockopt(fd, SOL_RDMA, RDMA_INLINE, &val, sizeof val);
 		}
+
+		if (zcopy_threshold)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_ZCOPY_THRESHOLD,
+				      &zcopy_threshold, sizeof zcopy_threshold);
+
+		if (use_shared)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_SHARED, &use_shared,
+				      sizeof use_shared);
 	}
 
 	if (keepalive)
@@ -353,7 +403,7 @@ static int server_listen(void)
 		goto close;
 	}
 
-	ret = rs_listen(lrs, 1);
+	ret = rs_listen(lrs, conn_count);
 	if (ret)
 		perror("rlisten");
 
@@ -496,6 +546,41 @@ free:
 	return ret;
 }
 
+/*
+ * Open conn_count connections, report the memory used by them, then run
+ * the transfer test, spreading transfers round-robin over the connections.
+ */
+static int run_conns(void)
+{
+	int i, ret = 0;
+
+	conns = calloc(conn_count, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < conn_count; i++) {
+		ret = dst_addr ? client_connect() : server_connect();
+		if (ret)
+			goto close;
+		conns[i] = rs;
+	}
+
+	show_mem();
+	rs = conns[0];
+	ret = run_test();
+
+close:
+	while (i--) {
+		rs_shutdown(conns[i], SHUT_RDWR);
+		rs_close(conns[i]);
+	}
+	free(conns);
+	conns = NULL;
+	return ret;
+}
+
 static int run(void)
 {
 	int i, ret = 0;
@@ -545,6 +630,9 @@ static int run(void)
 			init_bandwidth_test(test_size[i].size);
 			run_test();
 		}
+	} else if (conn_count > 1) {
+		ret = run_conns();
+		goto free;
 	} else {
 		ret = dst_addr ? client_connect() : server_connect();
 		if (ret)
@@ -590,6 +678,12 @@ static int set_test_opt(const char *arg)
 		case 'v':
 			verify = 1;
 			break;
+		case 'h':
+			use_shared = 1;
+			break;
+		case 'm':
+			use_more = 1;
+			break;
 		default:
 			return -1;
 		}
@@ -609,6 +703,10 @@ static int set_test_opt(const char *arg)
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
+		} else if (!strncasecmp("shared", arg, 6)) {
+			use_shared = 1;
+		} else if (!strncasecmp("more", arg, 4)) {
+			use_more = 1;
 		} else {
 			return -1;
 		}
@@ -622,7 +720,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:z:c:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -669,6 +767,15 @@ int main(int argc, char **argv)
 		case 'k':
 			keepalive = atoi(optarg);
 			break;
+		case 'z':
+			zcopy_threshold = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			custom = 1;
+			conn_count = atoi(optarg);
+			if (conn_count < 1)
+				conn_count = 1;
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -687,6 +794,8 @@ int main(int argc, char **argv)
 			printf("\t[-S transfer_size or all]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-k keepalive_time]\n");
+			printf("\t[-z zcopy_threshold]\n");
+			printf("\t[-c connection_count]\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -695,6 +804,8 @@ int main(int argc, char **argv)
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
+			printf("\t    h|shared - share rsocket receive resources\n");
+			printf("\t    m|more - coalesce transfers using MSG_MORE\n");
 			exit(1);
 		}
 	}
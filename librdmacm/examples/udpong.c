@@ -27,6 +27,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -75,6 +76,7 @@ struct message {
 };
 
 #define CTRL_MSG_SIZE 16
+#define MAX_BATCH 64
 
 struct client {
 	uint64_t recvcnt;
@@ -92,6 +94,8 @@ static int echo;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
 static int buffer_size;
+static int peers;
+static int batch;
 static char test_name[10] = "custom";
 static const char *port = "7174";
 static char *dst_addr;
@@ -257,6 +261,32 @@ static int svr_process(struct message *msg, size_t size,
 	return (ret == size) ? 0 : (int) ret;
 }
 
+static int svr_recv_batch(struct mmsghdr *mmsg, int cnt)
+{
+	struct pollfd fds;
+	int ret;
+
+	if (use_async) {
+		fds.fd = rs;
+		fds.events = POLLIN;
+	}
+
+	do {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = rs_recvmmsg(rs, mmsg, cnt, flags | MSG_WAITFORONE, NULL);
+	} while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN));
+
+	if (ret < 0)
+		perror("rrecvmmsg");
+
+	return ret;
+}
+
 static int svr_bind(void)
 {
 	struct addrinfo hints, *res;
@@ -289,11 +319,55 @@ out:
 	return ret;
 }
 
+static int svr_run_batch(void)
+{
+	struct mmsghdr mmsg[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	union socket_addr addr[MAX_BATCH];
+	struct message *msgs;
+	int i, cnt, ret;
+
+	msgs = calloc(batch, sizeof *msgs);
+	if (!msgs)
+		return -1;
+
+	memset(mmsg, 0, sizeof mmsg);
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = &msgs[i];
+		iov[i].iov_len = sizeof msgs[i];
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		mmsg[i].msg_hdr.msg_name = &addr[i];
+	}
+
+	ret = svr_bind();
+	while (!ret) {
+		for (i = 0; i < batch; i++)
+			mmsg[i].msg_hdr.msg_namelen = sizeof addr[i];
+
+		cnt = svr_recv_batch(mmsg, batch);
+		if (cnt < 0) {
+			ret = cnt;
+			break;
+		}
+
+		for (i = 0; i < cnt && !ret; i++)
+			ret = svr_process(&msgs[i], mmsg[i].msg_len, &addr[i],
+					  mmsg[i].msg_hdr.msg_namelen);
+	}
+
+	free(msgs);
+	return ret;
+}
+
 static int svr_run(void)
 {
 	ssize_t len;
 	int ret;
 
+	if (batch)
+		return svr_run_batch();
+
 	ret = svr_bind();
 	while (!ret) {
 		g_addrlen = sizeof g_addr;
@@ -323,7 +397,8 @@ static ssize_t client_send(struct message *msg, size_t size)
 				return ret;
 		}
 
-		ret = rs_send(rs, msg, size, flags);
+		ret = peers ? rs_sendto(rs, msg, size, flags, &g_addr.sa, g_addrlen) :
+			      rs_send(rs, msg, size, flags);
 	} while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN));
 
 	if (ret < 0)
@@ -332,6 +407,47 @@ static ssize_t client_send(struct message *msg, size_t size)
 	return ret;
 }
 
+/* Returns the number of messages sent, which may be less than cnt */
+static int client_send_batch(struct message *msg, size_t size, int cnt)
+{
+	struct mmsghdr mmsg[MAX_BATCH];
+	struct iovec iov;
+	struct pollfd fds;
+	int i, ret;
+
+	iov.iov_base = msg;
+	iov.iov_len = size;
+	memset(mmsg, 0, sizeof(*mmsg) * cnt);
+	for (i = 0; i < cnt; i++) {
+		mmsg[i].msg_hdr.msg_iov = &iov;
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+		if (peers) {
+			mmsg[i].msg_hdr.msg_name = &g_addr;
+			mmsg[i].msg_hdr.msg_namelen = g_addrlen;
+		}
+	}
+
+	if (use_async) {
+		fds.fd = rs;
+		fds.events = POLLOUT;
+	}
+
+	do {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = rs_sendmmsg(rs, mmsg, cnt, flags);
+	} while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN));
+
+	if (ret < 0)
+		perror("rsendmmsg");
+
+	return ret;
+}
+
 static ssize_t client_recv(struct message *msg, size_t size, int timeout)
 {
 	struct pollfd fds;
@@ -382,11 +498,21 @@ static int run_test(void)
 
 	g_msg.op = echo ? msg_op_echo : msg_op_data;
 	gettimeofday(&start, NULL);
-	for (i = 0; i < transfer_count; i++) {
-		ret = echo ? client_send_recv(&g_msg, transfer_size, 1) :
-			     client_send(&g_msg, transfer_size);
-		if (ret != transfer_size)
-			goto out;
+	if (batch && !echo) {
+		for (i = 0; i < transfer_count; i += ret) {
+			ret = transfer_count - i;
+			ret = client_send_batch(&g_msg, transfer_size,
+						ret < batch ? ret : batch);
+			if (ret <= 0)
+				goto out;
+		}
+	} else {
+		for (i = 0; i < transfer_count; i++) {
+			ret = echo ? client_send_recv(&g_msg, transfer_size, 1) :
+				     client_send(&g_msg, transfer_size);
+			if (ret != transfer_size)
+				goto out;
+		}
 	}
 
 	g_msg.op = msg_op_end;
@@ -402,6 +528,44 @@ out:
 	return ret;
 }
 
+/*
+ * Send a message to each of the ports following the server's, so that
+ * the rsocket tracks that many destinations.  Nothing listens on those
+ * ports, and the test then addresses every send to the server, so that
+ * the cost of finding the destination is included in each transfer.
+ */
+static int client_add_peers(void)
+{
+	union socket_addr addr = g_addr;
+	struct timeval t0, t1;
+	uint16_t base;
+	int i, ret;
+
+	base = be16toh(addr.sa.sa_family == AF_INET ?
+		       addr.sin.sin_port : addr.sin6.sin6_port);
+	g_msg.op = msg_op_data;
+	gettimeofday(&t0, NULL);
+	for (i = 1; i <= peers; i++) {
+		if (addr.sa.sa_family == AF_INET)
+			addr.sin.sin_port = htobe16(base + i);
+		else
+			addr.sin6.sin6_port = htobe16(base + i);
+
+		ret = rs_sendto(rs, &g_msg, CTRL_MSG_SIZE, MSG_DONTWAIT,
+				&addr.sa, g_addrlen);
+		if (ret < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+			perror("rsendto");
+			return ret;
+		}
+	}
+	gettimeofday(&t1, NULL);
+
+	printf("added %d peers, %.2f usec/peer\n", peers,
+	       ((t1.tv_sec - t0.tv_sec) * 1000000. +
+		(t1.tv_usec - t0.tv_usec)) / peers);
+	return 0;
+}
+
 static int client_connect(void)
 {
 	struct addrinfo hints, *res;
@@ -430,6 +594,16 @@ static int client_connect(void)
 		goto out;
 	}
 
+	if (peers) {
+		memcpy(&g_addr, res->ai_addr, res->ai_addrlen);
+		g_addrlen = res->ai_addrlen;
+		ret = client_add_peers();
+		if (ret) {
+			rs_close(rs);
+			goto out;
+		}
+	}
+
 	g_msg.op = msg_op_login;
 	ret = client_send_recv(&g_msg, CTRL_MSG_SIZE, 1000);
 	if (ret == CTRL_MSG_SIZE)
@@ -512,7 +686,7 @@ int main(int argc, char **argv)
 {
 	int op, ret;
 
-	while ((op = getopt(argc, argv, "s:b:B:C:S:p:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:B:C:S:p:P:m:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -539,6 +713,21 @@ int main(int argc, char **argv)
 		case 'p':
 			port = optarg;
 			break;
+		case 'P':
+			peers = atoi(optarg);
+			if (peers < 0 || peers > 0xFFFF - atoi(port)) {
+				printf("peer ports must fit after the server port\n");
+				exit(1);
+			}
+			break;
+		case 'm':
+			batch = atoi(optarg);
+			if (batch < 0 || batch > MAX_BATCH) {
+				printf("batch must be at most %d messages\n",
+				       MAX_BATCH);
+				exit(1);
+			}
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -552,6 +741,8 @@ int main(int argc, char **argv)
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size]\n");
 			printf("\t[-p port_number]\n");
+			printf("\t[-P peer_count]\n");
+			printf("\t[-m batch_size]\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -50,6 +51,8 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <inttypes.h>
 
 #include <sys/uio.h>
 
@@ -69,12 +72,16 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -90,6 +97,13 @@ struct socket_calls {
 	int (*dup2)(int oldfd, int newfd);
 	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 	int (*fxstat)(int ver, int fd, struct stat *buf);
+	int (*epoll_create)(int size);
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events,
+			  int maxevents, int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events,
+			   int maxevents, int timeout, const sigset_t *sigmask);
 };
 
 static struct socket_calls real;
@@ -102,10 +116,25 @@ static int sq_size;
 static int rq_size;
 static int sq_inline;
 static int fork_support;
+static char *stats_file;
+static int stats_signal;
+static pid_t stats_pid;
+static struct rsocket_stats closed_stats;
+static int closed_cnt;
+static int stats_pipe[2] = { -1, -1 };
+/*
+ * Held while dumping, and while fd's are removed or replaced, but not while
+ * they are closed.  Only used when stats are enabled.
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set while creating rsocket resources, which may call intercepted routines */
+static __thread int recursive;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -333,6 +362,18 @@ static inline enum fd_type fd_gett(int index)
 	return fdi ? fdi->type : fd_normal;
 }
 
+static void stats_lock_acquire(void)
+{
+	if (stats_file)
+		pthread_mutex_lock(&stats_lock);
+}
+
+static void stats_lock_release(void)
+{
+	if (stats_file)
+		pthread_mutex_unlock(&stats_lock);
+}
+
 static enum fd_type fd_close(int index, int *fd)
 {
 	struct fd_info *fdi;
@@ -340,7 +381,9 @@ static enum fd_type fd_close(int index, int *fd)
 
 	fdi = idm_lookup(&idm, index);
 	if (fdi) {
+		stats_lock_acquire();
 		idm_clear(&idm, index);
+		stats_lock_release();
 		*fd = fdi->fd;
 		type = fdi->type;
 		real.close(index);
@@ -371,6 +414,194 @@ static void getenv_options(void)
 	var = getenv("RDMAV_FORK_SAFE");
 	if (var)
 		fork_support = atoi(var);
+
+	var = getenv("RS_STATS_FILE");
+	if (var && *var)
+		stats_file = var;
+
+	var = getenv("RS_STATS_SIGNAL");
+	if (var)
+		stats_signal = atoi(var);
+}
+
+static void add_stats(struct rsocket_stats *total, struct rsocket_stats *stats)
+{
+	total->send_bytes += stats->send_bytes;
+	total->recv_bytes += stats->recv_bytes;
+	total->send_cqes += stats->send_cqes;
+	total->recv_cqes += stats->recv_cqes;
+	total->writes += stats->writes;
+	total->inline_writes += stats->inline_writes;
+	total->copy_bytes += stats->copy_bytes;
+	total->credit_stalls += stats->credit_stalls;
+	total->cq_polls += stats->cq_polls;
+	total->cq_arms += stats->cq_arms;
+	total->cq_events += stats->cq_events;
+	total->blocked_usec += stats->blocked_usec;
+	total->iomap_hits += stats->iomap_hits;
+}
+
+static void print_stats(FILE *f, const char *name, struct rsocket_stats *stats)
+{
+	fprintf(f, "%-6s %14" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10" PRIu64
+		" %10" PRIu64 " %12" PRIu64 " %8" PRIu64 " %10" PRIu64
+		" %8" PRIu64 " %8" PRIu64 " %12" PRIu64 " %8" PRIu64
+		" %8" PRIu64 "\n", name,
+		stats->send_bytes, stats->recv_bytes, stats->writes,
+		stats->inline_writes, stats->send_cqes, stats->recv_cqes,
+		stats->copy_bytes, stats->credit_stalls, stats->cq_polls,
+		stats->cq_arms, stats->cq_events, stats->blocked_usec,
+		stats->iomap_hits);
+}
+
+/*
+ * Appends a snapshot of the counters of every open rsocket, followed by
+ * their totals, to RS_STATS_FILE.  Counters are read without stopping the
+ * application, so the values of active rsockets may be slightly stale.
+ * The stats lock keeps the rsockets from being removed from the index map
+ * during the snapshot, and they are only closed once removed.
+ */
+static void dump_stats(void)
+{
+	struct rsocket_stats stats, total;
+	struct fd_info *fdi;
+	socklen_t len;
+	char name[16];
+	FILE *f;
+	int i, cnt = 0;
+
+	f = fopen(stats_file, "a");
+	if (!f)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	pthread_mutex_lock(&mut);
+	total = closed_stats;
+	pthread_mutex_unlock(&mut);
+	fprintf(f, "rsocket stats: pid %d time %ld\n", getpid(), (long) time(NULL));
+	fprintf(f, "%-6s %14s %14s %10s %10s %10s %12s %8s %10s %8s %8s %12s %8s %8s\n",
+		"fd", "send_bytes", "recv_bytes", "writes", "inline", "send_cqes",
+		"recv_cqes", "copy_bytes", "stalls", "cq_polls", "cq_arms",
+		"cq_events", "blocked_us", "iomap");
+	for (i = 0; i <= IDX_MAX_INDEX; i++) {
+		fdi = idm_lookup(&idm, i);
+		if (!fdi || fdi->type != fd_rsocket)
+			continue;
+
+		memset(&stats, 0, sizeof stats);
+		len = sizeof stats;
+		if (rs.getsockopt(fdi->fd, SOL_RDMA, RDMA_STATS, &stats, &len))
+			continue;
+
+		snprintf(name, sizeof name, "%d", i);
+		print_stats(f, name, &stats);
+		add_stats(&total, &stats);
+		cnt++;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	print_stats(f, "total", &total);
+	fprintf(f, "%d open rsockets, %d closed\n", cnt, closed_cnt);
+	fclose(f);
+}
+
+static void exit_stats(void)
+{
+	int i;
+
+	/* Forked children inherit our exit handler */
+	if (getpid() != stats_pid)
+		return;
+
+	for (i = 0; !closed_cnt && i <= IDX_MAX_INDEX; i++) {
+		if (fd_gett(i) == fd_rsocket)
+			break;
+	}
+	if (closed_cnt || i <= IDX_MAX_INDEX)
+		dump_stats();
+}
+
+/*
+ * Counters of closed rsockets are kept, so that the totals cover the
+ * lifetime of the process.
+ */
+static void save_stats(int rsocket)
+{
+	struct rsocket_stats stats;
+	socklen_t len = sizeof stats;
+
+	if (!stats_file)
+		return;
+
+	memset(&stats, 0, sizeof stats);
+	if (rs.getsockopt(rsocket, SOL_RDMA, RDMA_STATS, &stats, &len))
+		return;
+
+	pthread_mutex_lock(&mut);
+	add_stats(&closed_stats, &stats);
+	closed_cnt++;
+	pthread_mutex_unlock(&mut);
+}
+
+static void stats_handler(int signum)
+{
+	char c = 0;
+	int save_errno = errno;
+	ssize_t ret;
+
+	/* The write fails if a dump is already pending */
+	ret = real.write(stats_pipe[1], &c, sizeof c);
+	(void) ret;
+	errno = save_errno;
+}
+
+static void *stats_thread(void *arg)
+{
+	char c;
+
+	recursive = 1;
+	while (real.read(stats_pipe[0], &c, sizeof c) > 0)
+		dump_stats();
+	return NULL;
+}
+
+/*
+ * The signal handler only wakes a helper thread, which reads the counters
+ * from a context where taking rsocket locks is safe.
+ */
+static void init_stats(void)
+{
+	struct sigaction sa;
+	pthread_t thread;
+
+	if (!stats_file)
+		return;
+
+	stats_pid = getpid();
+	atexit(exit_stats);
+	if (stats_signal <= 0 || stats_signal >= NSIG)
+		return;
+
+	if (pipe2(stats_pipe, O_CLOEXEC | O_NONBLOCK))
+		return;
+
+	/* The helper thread blocks on its end of the pipe */
+	real.fcntl(stats_pipe[0], F_SETFL, 0);
+	if (pthread_create(&thread, NULL, stats_thread, NULL))
+		goto err;
+	pthread_detach(thread);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = stats_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(stats_signal, &sa, NULL))
+		goto err;
+	return;
+
+err:
+	real.close(stats_pipe[0]);
+	real.close(stats_pipe[1]);
+	stats_pipe[0] = stats_pipe[1] = -1;
 }
 
 static void init_preload(void)
@@ -393,11 +624,13 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
@@ -411,6 +644,11 @@ static void init_preload(void)
 	real.dup2 = dlsym(RTLD_NEXT, "dup2");
 	real.sendfile = dlsym(RTLD_NEXT, "sendfile");
 	real.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+	real.epoll_create = dlsym(RTLD_NEXT, "epoll_create");
+	real.epoll_create1 = dlsym(RTLD_NEXT, "epoll_create1");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 
 	rs.socket = dlsym(RTLD_DEFAULT, "rsocket");
 	rs.bind = dlsym(RTLD_DEFAULT, "rbind");
@@ -420,11 +658,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -435,9 +675,14 @@ static void init_preload(void)
 	rs.setsockopt = dlsym(RTLD_DEFAULT, "rsetsockopt");
 	rs.getsockopt = dlsym(RTLD_DEFAULT, "rgetsockopt");
 	rs.fcntl = dlsym(RTLD_DEFAULT, "rfcntl");
+	rs.epoll_create = dlsym(RTLD_DEFAULT, "repoll_create");
+	rs.epoll_create1 = dlsym(RTLD_DEFAULT, "repoll_create1");
+	rs.epoll_ctl = dlsym(RTLD_DEFAULT, "repoll_ctl");
+	rs.epoll_wait = dlsym(RTLD_DEFAULT, "repoll_wait");
 
 	getenv_options();
 	scan_config();
+	init_stats();
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -506,7 +751,9 @@ static int transpose_socket(int socket, enum fd_type new_type)
 	if (ret)
 		goto err;
 
+	stats_lock_acquire();
 	fd_store(socket, dfd, new_type, fd_ready);
+	stats_lock_release();
 	return dfd;
 
 err:
@@ -531,7 +778,6 @@ static void set_rsocket_options(int rsocket)
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -778,6 +1024,7 @@ int connect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 			return ret;
 
 		rclose(fd);
+
 		fd = ret;
 	} else if (fd_gets(socket) == fd_fork) {
 		fd_store(socket, fd, fd_normal, fd_fork_active);
@@ -809,6 +1056,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -848,6 +1104,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -992,6 +1256,93 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	return ret;
 }
 
+/*
+ * Epoll sets are replaced with repoll sets, so that rsockets may be
+ * added to them.  Rsockets create epoll sets internally, which are
+ * passed through to the real calls.
+ */
+int epoll_create1(int flags)
+{
+	int index, ret;
+
+	init_preload();
+	if (recursive)
+		goto real;
+
+	index = fd_open();
+	if (index < 0)
+		return index;
+
+	recursive = 1;
+	ret = repoll_create1(flags);
+	recursive = 0;
+	if (ret >= 0) {
+		fd_store(index, ret, fd_repoll, fd_ready);
+		return index;
+	}
+	fd_close(index, &ret);
+real:
+	return real.epoll_create1(flags);
+}
+
+int epoll_create(int size)
+{
+	init_preload();
+	if (recursive)
+		return real.epoll_create(size);
+
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int repfd;
+
+	init_preload();
+	return (fd_get(epfd, &repfd) == fd_repoll) ?
+		repoll_ctl(repfd, op, fd_getd(fd), event) :
+		real.epoll_ctl(repfd, op, fd_getd(fd), event);
+}
+
+/*
+ * The signal mask of a repoll set is applied around the wait, so unlike the
+ * kernel call, a signal may be delivered between the mask change and the
+ * wait.
+ */
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	sigset_t oldmask;
+	int repfd, ret, err;
+
+	init_preload();
+	if (fd_get(epfd, &repfd) != fd_repoll)
+		return sigmask ?
+			real.epoll_pwait(repfd, events, maxevents, timeout,
+					 sigmask) :
+			real.epoll_wait(repfd, events, maxevents, timeout);
+
+	if (sigmask && pthread_sigmask(SIG_SETMASK, sigmask, &oldmask))
+		return ERR(EINVAL);
+
+	ret = repoll_wait(repfd, events, maxevents, timeout);
+
+	if (sigmask) {
+		err = errno;
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		errno = err;
+	}
+	return ret;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	return epoll_pwait(epfd, events, maxevents, timeout, NULL);
+}
+
 int shutdown(int socket, int how)
 {
 	int fd;
@@ -1018,9 +1369,17 @@ int close(int socket)
 	if (atomic_fetch_sub(&fdi->refcnt, 1) != 1)
 		return 0;
 
+	stats_lock_acquire();
 	idm_clear(&idm, socket);
+	stats_lock_release();
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	if (fdi->type == fd_normal) {
+		ret = real.close(fdi->fd);
+	} else {
+		if (fdi->type == fd_rsocket)
+			save_stats(fdi->fd);
+		ret = rclose(fdi->fd);
+	}
 	free(fdi);
 	return ret;
 }
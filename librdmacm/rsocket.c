@@ -36,6 +36,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <endian.h>
 #include <stdarg.h>
 #include <netdb.h>
@@ -44,8 +45,10 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <search.h>
 #include <byteswap.h>
 #include <util/compiler.h>
@@ -60,12 +63,21 @@
 #define RS_OLAP_START_SIZE 2048
 #define RS_MAX_TRANSFER 65536
 #define RS_SNDLOWAT 2048
+#define RS_SIG_INTERVAL 16
+#define RS_POLL_BATCH 16
 #define RS_QP_MIN_SIZE 16
 #define RS_QP_MAX_SIZE 0xFFFE
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_ZCOPY_MR_MAX 16
+#define RS_ZCOPY_MAX_IOV 8
+#define RS_SHARED_CQ_SIZE 65536
+#define RS_SHARED_SRQ_SIZE 4096
+#define RS_SHARED_POLL 16
+#define RS_ARENA_SLOTS 32
 static struct index_map idm;
+static struct index_map epm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
 struct rsocket;
@@ -115,7 +127,14 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_mem_max = 0;
+static uint64_t mem_total = (1ULL << 28);
+static uint64_t mem_autotuned;
 static uint32_t polling_time = 10;
+static uint32_t def_cork_delay = 0;
+static int def_shared = 0;
+static int def_pool_size = 0;
+static int def_ah_cache = 4096;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -149,6 +168,7 @@ enum {
 
 #define RS_WR_ID_FLAG_RECV (((uint64_t) 1) << 63)
 #define RS_WR_ID_FLAG_MSG_SEND (((uint64_t) 1) << 62) /* See RS_OPT_MSG_SEND */
+#define RS_WR_ID_FLAG_UNSIG (((uint64_t) 1) << 61) /* See rs_track_send */
 #define rs_send_wr_id(data) ((uint64_t) data)
 #define rs_recv_wr_id(data) (RS_WR_ID_FLAG_RECV | (uint64_t) data)
 #define rs_wr_is_recv(wr_id) (wr_id & RS_WR_ID_FLAG_RECV)
@@ -250,6 +270,12 @@ enum rs_state {
  */
 #define RS_OPT_MSG_SEND   (1 << 1)
 #define RS_OPT_SVC_ACTIVE (1 << 2)
+#define RS_OPT_SHARED     (1 << 3)
+/*
+ * The receive buffer size is adjusted to match the connection's drain rate
+ * and round trip time.  Disabled by SO_RCVBUF, as with TCP.
+ */
+#define RS_OPT_AUTOTUNE   (1 << 4)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -273,13 +299,41 @@ struct ds_header {
 #define DS_IPV4_HDR_LEN  8
 #define DS_IPV6_HDR_LEN 24
 
+struct ds_ah;
+
 struct ds_dest {
 	union socket_addr addr;	/* must be first */
 	struct ds_qp	  *qp;
 	struct ibv_ah	  *ah;
+	struct ds_ah	  *cached_ah;
 	uint32_t	   qpn;
 };
 
+/*
+ * Address handles depend only on the device and the local and remote IP
+ * addresses, so are shared by all datagram rsockets.  Handles that are no
+ * longer referenced by a destination are kept, up to ah_cache_size, and
+ * released in least recently used order.  Each handle holds the device, so
+ * that its PD outlives the rsockets that created it.  A handle found to be
+ * stale is removed from the cache, and destroyed once no longer referenced.
+ */
+struct ds_ah {
+	struct ds_ah	  *next;
+	dlist_entry	  lru_entry;
+	struct cma_device *dev;
+	struct ibv_pd	  *pd;
+	union socket_addr src;
+	union socket_addr dst;
+	struct ibv_ah	  *ah;
+	uint32_t	  hash;
+	int		  refcnt;
+	int		  stale;
+};
+
+#define DS_AH_HASH_SIZE 1024
+#define DS_DEST_MIN_SIZE 64
+#define DS_MMSG_BATCH 32
+
 struct ds_qp {
 	dlist_entry	  list;
 	struct rsocket	  *rs;
@@ -291,9 +345,136 @@ struct ds_qp {
 	struct ibv_mr	  *rmr;
 	uint8_t		  *rbuf;
 
+	/* offsets of posted sends, in order, see ds_post_send */
+	uint32_t	  *sq_ring;
+	int		  sq_head;
+	int		  sq_tail;
+	int		  sq_unsig;
+
 	int		  cq_armed;
 };
 
+/*
+ * Work requests gathered by rsendmmsg and rrecvmmsg, so that they can be
+ * posted to a QP together.
+ */
+struct ds_send_batch {
+	struct ds_qp		*qp;
+	int			cnt;
+	struct ibv_send_wr	wr[DS_MMSG_BATCH];
+	struct ibv_sge		sge[DS_MMSG_BATCH];
+};
+
+struct ds_recv_batch {
+	struct ds_qp		*qp;
+	int			cnt;
+	struct ibv_recv_wr	wr[DS_MMSG_BATCH];
+	struct ibv_sge		sge[DS_MMSG_BATCH][2];
+};
+
+/* Resources held by unsignaled sends preceding a signaled send */
+struct rs_sig_batch {
+	uint32_t	  sqe;
+	uint32_t	  bytes;
+};
+
+/*
+ * Stream rsockets may share receive resources, in order to reduce the
+ * memory and number of CQs needed for large numbers of connections.
+ * Rsockets on the same PD are placed into groups which share an SRQ, a
+ * CQ, and arenas that receive buffers are allocated from.  Because rsocket
+ * receives carry no data, the SRQ is simply kept filled up to the total
+ * receive queue size of its members, or the SRQ size.  Each member
+ * reserves enough CQ entries for its send queue, plus the SRQ is reserved
+ * for receives.
+ *
+ * Completions are polled from the shared CQ by whichever rsocket needs
+ * them, and dispatched by QP number to a small completion queue kept by
+ * each rsocket.  The group lock protects the CQ, SRQ, QP map, arenas, and
+ * rsocket completion queues.
+ *
+ * Threads blocking on the CQ elect one waiter, which is woken either by
+ * a CQ event or by another thread that retrieved the event.  Other
+ * threads wait on a condition until the waiter returns.
+ */
+struct rs_arena {
+	dlist_entry	  entry;
+	uint8_t		  *buf;
+	uint32_t	  buf_size;
+	uint32_t	  free_map;
+};
+
+struct rs_shared {
+	dlist_entry	  entry;
+	struct ibv_pd	  *pd;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	struct ibv_srq	  *srq;
+	fastlock_t	  lock;
+	void		  *qp_map;
+	dlist_entry	  arena_list;
+	int		  refcnt;
+	int		  cq_avail;
+	int		  srq_size;
+	int		  srq_posted;
+	int		  rq_total;
+
+	pthread_mutex_t	  wait_lock;
+	pthread_cond_t	  wait_cond;
+	int		  wake_fd;
+	int		  armed;
+	int		  waiting;
+	unsigned int	  wait_gen;
+};
+
+struct rs_wc {
+	uint64_t	  wr_id;
+	__be32		  imm_data;
+	uint16_t	  status;
+	uint16_t	  wc_flags;
+};
+
+static dlist_entry shared_list = { &shared_list, &shared_list };
+
+/*
+ * Connected endpoints built ahead of time, so that connecting an rsocket
+ * does not need to wait for its CQ, QP, and buffers to be created.  The
+ * buffers are held by a partially initialized rsocket.
+ */
+struct rs_pool_ep {
+	dlist_entry	  entry;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq	  *cq;
+	struct ibv_qp	  *qp;
+	struct rsocket	  *bufs;
+};
+
+/* Endpoints for one device, sized from the first rsocket that uses it */
+struct rs_pool {
+	dlist_entry	  entry;
+	struct cma_device *dev;
+	struct ibv_pd	  *pd;
+	dlist_entry	  ep_list;
+	int		  ep_cnt;
+	int		  failed;
+	uint16_t	  sq_size;
+	uint16_t	  rq_size;
+	uint16_t	  sq_inline;
+	uint16_t	  iomap_size;
+	uint32_t	  sbuf_size;
+	uint32_t	  rbuf_size;
+};
+
+static struct ds_ah *ah_hash[DS_AH_HASH_SIZE];
+static dlist_entry ah_lru = { &ah_lru, &ah_lru };
+static pthread_mutex_t ah_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ah_cnt;
+
+static dlist_entry pool_list = { &pool_list, &pool_list };
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static int pool_running;
+
 struct rsocket {
 	int		  type;
 	int		  index;
@@ -335,14 +516,36 @@ struct rsocket {
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
 
+			uint32_t	  rbuf_min;
+			uint32_t	  rbuf_resize;
+			uint32_t	  rbuf_inflight;
+			uint32_t	  rtt_us;
+			uint64_t	  rtt_stamp;
+			uint64_t	  sgl_stamp;
+
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
+
+			struct rs_sig_batch *sig_fifo;
+			int		  sig_head;
+			int		  sig_tail;
+			uint32_t	  unsig_sqe;
+			uint32_t	  unsig_bytes;
+
+			struct rs_arena	  *arena;
+			struct rs_wc	  *wcq;
+			int		  wcq_size;
+			int		  wcq_head;
+			int		  wcq_tail;
+			int		  wcq_overflow;
 		};
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			struct ds_dest	  **dest_tbl;
+			uint32_t	  dest_size;
+			uint32_t	  dest_cnt;
 			struct ds_dest    *conn_dest;
 
 			int		  udp_sock;
@@ -353,6 +556,7 @@ struct rsocket {
 	};
 
 	int		  opts;
+	struct rs_shared  *shared;
 	int		  fd_flags;
 	uint64_t	  so_opts;
 	uint64_t	  ipv6_opts;
@@ -367,6 +571,11 @@ struct rsocket {
 	uint32_t	  sbuf_size;
 	uint16_t	  sq_size;
 	uint16_t	  sq_inline;
+	uint32_t	  zcopy_threshold;
+	uint32_t	  cork_delay;
+	uint32_t	  cork_len;
+	uint64_t	  cork_stamp;
+	struct rsocket_stats stats;
 
 	uint32_t	  rbuf_size;
 	uint16_t	  rq_size;
@@ -382,6 +591,9 @@ struct rsocket {
 	dlist_entry	  iomap_list;
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
+	dlist_entry	  zcopy_list;
+	int		  zcopy_mr_cnt;
+	dlist_entry	  epoll_items;
 	int		  unack_cqe;
 };
 
@@ -487,6 +699,235 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+/* FNV-1a over the bytes compared by ds_compare_addr */
+static uint32_t ds_hash_addr(const void *addr)
+{
+	const uint8_t *p = addr;
+	uint32_t hash = 2166136261U;
+	size_t i, len;
+
+	len = (((const struct sockaddr *) addr)->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	return hash;
+}
+
+/*
+ * Destinations are kept in an open addressing table with linear probing,
+ * which is kept at most half full.  Returns the slot holding the address,
+ * or the empty slot where it would be inserted.
+ */
+static struct ds_dest **ds_dest_slot(struct rsocket *rs, const void *addr)
+{
+	uint32_t i, mask = rs->dest_size - 1;
+
+	for (i = ds_hash_addr(addr) & mask; rs->dest_tbl[i]; i = (i + 1) & mask) {
+		if (!ds_compare_addr(addr, &rs->dest_tbl[i]->addr))
+			break;
+	}
+	return &rs->dest_tbl[i];
+}
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs, const void *addr)
+{
+	return rs->dest_cnt ? *ds_dest_slot(rs, addr) : NULL;
+}
+
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest **old_tbl;
+	uint32_t i, old_size;
+
+	if ((rs->dest_cnt + 1) * 2 > rs->dest_size) {
+		old_tbl = rs->dest_tbl;
+		old_size = rs->dest_size;
+		rs->dest_size = old_size ? old_size << 1 : DS_DEST_MIN_SIZE;
+		rs->dest_tbl = calloc(rs->dest_size, sizeof(*rs->dest_tbl));
+		if (!rs->dest_tbl) {
+			rs->dest_tbl = old_tbl;
+			rs->dest_size = old_size;
+			return ERR(ENOMEM);
+		}
+
+		for (i = 0; i < old_size; i++) {
+			if (old_tbl[i])
+				*ds_dest_slot(rs, &old_tbl[i]->addr) = old_tbl[i];
+		}
+		free(old_tbl);
+	}
+
+	*ds_dest_slot(rs, &dest->addr) = dest;
+	rs->dest_cnt++;
+	return 0;
+}
+
+/*
+ * Entries following the removed one are shifted back, unless that would
+ * move them before their home slot, so no tombstones are needed.
+ */
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	struct ds_dest **slot;
+	uint32_t i, j, home, mask = rs->dest_size - 1;
+
+	if (!rs->dest_cnt)
+		return;
+
+	slot = ds_dest_slot(rs, &dest->addr);
+	if (*slot != dest)
+		return;
+
+	i = slot - rs->dest_tbl;
+	rs->dest_tbl[i] = NULL;
+	rs->dest_cnt--;
+	for (j = (i + 1) & mask; rs->dest_tbl[j]; j = (j + 1) & mask) {
+		home = ds_hash_addr(&rs->dest_tbl[j]->addr) & mask;
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			rs->dest_tbl[i] = rs->dest_tbl[j];
+			rs->dest_tbl[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/* Address handles do not depend on the port, or any padding */
+static void ds_ah_key(union socket_addr *key, const union socket_addr *addr)
+{
+	memset(key, 0, sizeof *key);
+	key->sa.sa_family = addr->sa.sa_family;
+	if (addr->sa.sa_family == AF_INET) {
+		key->sin.sin_addr = addr->sin.sin_addr;
+	} else {
+		key->sin6.sin6_addr = addr->sin6.sin6_addr;
+		key->sin6.sin6_scope_id = addr->sin6.sin6_scope_id;
+	}
+}
+
+static uint32_t ds_ah_hash(struct ibv_pd *pd, union socket_addr *src,
+			   union socket_addr *dst)
+{
+	return (ds_hash_addr(dst) ^ (ds_hash_addr(src) * 31) ^
+		(uint32_t) ((uintptr_t) pd >> 4)) % DS_AH_HASH_SIZE;
+}
+
+/* Call with ah_lock held */
+static void ds_unlink_ah(struct ds_ah *ah)
+{
+	struct ds_ah **prev;
+
+	for (prev = &ah_hash[ah->hash]; *prev != ah; prev = &(*prev)->next)
+		;
+	*prev = ah->next;
+	dlist_remove(&ah->lru_entry);
+	ah_cnt--;
+}
+
+static void ds_destroy_ah(struct ds_ah *ah)
+{
+	ibv_destroy_ah(ah->ah);
+	ucma_release_device(ah->dev);
+	free(ah);
+}
+
+/* Call with ah_lock held */
+static void ds_trim_ahs(void)
+{
+	struct ds_ah *ah;
+	dlist_entry *entry, *next;
+
+	for (entry = ah_lru.next; entry != &ah_lru && ah_cnt > def_ah_cache;
+	     entry = next) {
+		next = entry->next;
+		ah = container_of(entry, struct ds_ah, lru_entry);
+		if (ah->refcnt)
+			continue;
+
+		ds_unlink_ah(ah);
+		ds_destroy_ah(ah);
+	}
+}
+
+static struct ds_ah *ds_get_ah(struct ibv_pd *pd, union socket_addr *src,
+			       union socket_addr *dst)
+{
+	struct ds_ah *ah;
+
+	pthread_mutex_lock(&ah_lock);
+	for (ah = ah_hash[ds_ah_hash(pd, src, dst)]; ah; ah = ah->next) {
+		if (ah->pd == pd && !ds_compare_addr(&ah->dst, dst) &&
+		    !ds_compare_addr(&ah->src, src)) {
+			ah->refcnt++;
+			dlist_remove(&ah->lru_entry);
+			dlist_insert_tail(&ah->lru_entry, &ah_lru);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ah_lock);
+	return ah;
+}
+
+static struct ds_ah *ds_add_ah(struct rdma_cm_id *cm_id,
+			       union socket_addr *src, union socket_addr *dst,
+			       struct ibv_ah_attr *attr)
+{
+	struct ibv_pd *pd = cm_id->pd;
+	struct ds_ah *ah;
+
+	ah = calloc(1, sizeof(*ah));
+	if (!ah)
+		return NULL;
+
+	ah->ah = ibv_create_ah(pd, attr);
+	if (!ah->ah) {
+		free(ah);
+		return NULL;
+	}
+
+	ah->dev = ucma_hold_device(cm_id);
+	ah->pd = pd;
+	ah->src = *src;
+	ah->dst = *dst;
+	ah->hash = ds_ah_hash(pd, src, dst);
+	ah->refcnt = 1;
+
+	pthread_mutex_lock(&ah_lock);
+	ah->next = ah_hash[ah->hash];
+	ah_hash[ah->hash] = ah;
+	dlist_insert_tail(&ah->lru_entry, &ah_lru);
+	ah_cnt++;
+	ds_trim_ahs();
+	pthread_mutex_unlock(&ah_lock);
+	return ah;
+}
+
+static void ds_put_ah(struct ds_ah *ah)
+{
+	int destroy;
+
+	pthread_mutex_lock(&ah_lock);
+	destroy = !--ah->refcnt && ah->stale;
+	ds_trim_ahs();
+	pthread_mutex_unlock(&ah_lock);
+	if (destroy)
+		ds_destroy_ah(ah);
+}
+
+/*
+ * Removes a handle that no longer reaches its destination from the cache,
+ * so that the next lookup builds a new one, and releases the reference.
+ */
+static void ds_put_stale_ah(struct ds_ah *ah)
+{
+	pthread_mutex_lock(&ah_lock);
+	if (!ah->stale) {
+		ah->stale = 1;
+		ds_unlink_ah(ah);
+	}
+	pthread_mutex_unlock(&ah_lock);
+	ds_put_ah(ah);
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -559,6 +1000,16 @@ static void rs_configure(void)
 			def_wmem = RS_SNDLOWAT << 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_mem_max);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/mem_total", "r"))) {
+		failable_fscanf(f, "%" SCNu64, &mem_total);
+		fclose(f);
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/iomap_size", "r"))) {
 		failable_fscanf(f, "%hu", &def_iomap_size);
 		fclose(f);
@@ -567,6 +1018,26 @@ static void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/cork_delay", "r"))) {
+		failable_fscanf(f, "%u", &def_cork_delay);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/shared_default", "r"))) {
+		failable_fscanf(f, "%d", &def_shared);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/ah_cache_size", "r"))) {
+		failable_fscanf(f, "%d", &def_ah_cache);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/pool_size", "r"))) {
+		failable_fscanf(f, "%d", &def_pool_size);
+		fclose(f);
+	}
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -609,9 +1080,13 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = inherited_rs->sq_inline;
 		rs->sq_size = inherited_rs->sq_size;
 		rs->rq_size = inherited_rs->rq_size;
+		rs->zcopy_threshold = inherited_rs->zcopy_threshold;
+		rs->cork_delay = inherited_rs->cork_delay;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->opts = inherited_rs->opts &
+				   (RS_OPT_SHARED | RS_OPT_AUTOTUNE);
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -619,9 +1094,14 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = def_inline;
 		rs->sq_size = def_sqsize;
 		rs->rq_size = def_rqsize;
+		rs->cork_delay = def_cork_delay;
 		if (type == SOCK_STREAM) {
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			if (def_shared)
+				rs->opts = RS_OPT_SHARED;
+			if (def_mem_max > def_mem)
+				rs->opts |= RS_OPT_AUTOTUNE;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -631,6 +1111,8 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 	fastlock_init(&rs->map_lock);
 	dlist_init(&rs->iomap_list);
 	dlist_init(&rs->iomap_queue);
+	dlist_init(&rs->zcopy_list);
+	dlist_init(&rs->epoll_items);
 	return rs;
 }
 
@@ -640,7 +1122,7 @@ static int rs_set_nonblocking(struct rsocket *rs, int arg)
 	int ret = 0;
 
 	if (rs->type == SOCK_STREAM) {
-		if (rs->cm_id->recv_cq_channel)
+		if (rs->cm_id->recv_cq_channel && !rs->shared)
 			ret = fcntl(rs->cm_id->recv_cq_channel->fd, F_SETFL, arg);
 
 		if (!ret && rs->state < rs_connected)
@@ -699,2531 +1181,4850 @@ static void ds_set_qp_size(struct rsocket *rs)
 		rs->sbuf_size = rs->sq_size * RS_SNDLOWAT;
 }
 
-static int rs_init_bufs(struct rsocket *rs)
+static int rs_compare_qpn(const void *a, const void *b)
 {
-	uint32_t total_rbuf_size, total_sbuf_size;
-	size_t len;
-
-	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
-	if (!rs->rmsg)
-		return ERR(ENOMEM);
+	uint32_t qpn_a = *(const uint32_t *) a, qpn_b = *(const uint32_t *) b;
 
-	total_sbuf_size = rs->sbuf_size;
-	if (rs->sq_inline < RS_MAX_CTRL_MSG)
-		total_sbuf_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
-	rs->sbuf = calloc(total_sbuf_size, 1);
-	if (!rs->sbuf)
-		return ERR(ENOMEM);
+	return (qpn_a > qpn_b) - (qpn_a < qpn_b);
+}
 
-	rs->smr = rdma_reg_msgs(rs->cm_id, rs->sbuf, total_sbuf_size);
-	if (!rs->smr)
-		return -1;
+static void rs_shared_free(struct rs_shared *shr)
+{
+	if (shr->srq)
+		ibv_destroy_srq(shr->srq);
+	if (shr->cq)
+		ibv_destroy_cq(shr->cq);
+	if (shr->channel)
+		ibv_destroy_comp_channel(shr->channel);
+	if (shr->wake_fd >= 0)
+		close(shr->wake_fd);
+	pthread_cond_destroy(&shr->wait_cond);
+	pthread_mutex_destroy(&shr->wait_lock);
+	fastlock_destroy(&shr->lock);
+	free(shr);
+}
 
-	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
-	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
-	rs->target_buffer_list = malloc(len);
-	if (!rs->target_buffer_list)
-		return ERR(ENOMEM);
+static struct rs_shared *rs_shared_alloc(struct rdma_cm_id *cm_id)
+{
+	struct ibv_srq_init_attr srq_attr;
+	struct ibv_device_attr attr;
+	struct rs_shared *shr;
 
-	rs->target_mr = rdma_reg_write(rs->cm_id, rs->target_buffer_list, len);
-	if (!rs->target_mr)
-		return -1;
+	shr = calloc(1, sizeof(*shr));
+	if (!shr)
+		return NULL;
 
-	memset(rs->target_buffer_list, 0, len);
-	rs->target_sgl = rs->target_buffer_list;
-	if (rs->target_iomap_size)
-		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+	fastlock_init(&shr->lock);
+	pthread_mutex_init(&shr->wait_lock, NULL);
+	pthread_cond_init(&shr->wait_cond, NULL);
+	dlist_init(&shr->arena_list);
+	shr->pd = cm_id->pd;
+	shr->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shr->wake_fd < 0)
+		goto err;
 
-	total_rbuf_size = rs->rbuf_size;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
-	rs->rbuf = calloc(total_rbuf_size, 1);
-	if (!rs->rbuf)
-		return ERR(ENOMEM);
+	if (ibv_query_device(cm_id->verbs, &attr))
+		goto err;
 
-	rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
-	if (!rs->rmr)
-		return -1;
+	if (!attr.max_srq) {
+		errno = ENOTSUP;
+		goto err;
+	}
 
-	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
-	rs->sbuf_bytes_avail = rs->sbuf_size;
-	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
+	shr->srq_size = min(attr.max_srq_wr, RS_SHARED_SRQ_SIZE);
+	shr->cq_avail = min(attr.max_cqe, RS_SHARED_CQ_SIZE);
 
-	rs->rbuf_free_offset = rs->rbuf_size >> 1;
-	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
-	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
-	rs->rseq_comp = rs->rq_size >> 1;
-	return 0;
-}
+	shr->channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!shr->channel || set_fd_nonblock(shr->channel->fd, true))
+		goto err;
 
-static int ds_init_bufs(struct ds_qp *qp)
-{
-	qp->rbuf = calloc(qp->rs->rbuf_size + sizeof(struct ibv_grh), 1);
-	if (!qp->rbuf)
-		return ERR(ENOMEM);
+	shr->cq = ibv_create_cq(cm_id->verbs, shr->cq_avail, shr,
+				shr->channel, 0);
+	if (!shr->cq)
+		goto err;
 
-	qp->smr = rdma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
-	if (!qp->smr)
-		return -1;
+	memset(&srq_attr, 0, sizeof srq_attr);
+	srq_attr.attr.max_wr = shr->srq_size;
+	srq_attr.attr.max_sge = 1;
+	shr->srq = ibv_create_srq(shr->pd, &srq_attr);
+	if (!shr->srq)
+		goto err;
 
-	qp->rmr = rdma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
-						     sizeof(struct ibv_grh));
-	if (!qp->rmr)
-		return -1;
+	shr->cq_avail -= shr->srq_size;
+	return shr;
 
-	return 0;
+err:
+	rs_shared_free(shr);
+	return NULL;
 }
 
 /*
- * If a user is waiting on a datagram rsocket through poll or select, then
- * we need the first completion to generate an event on the related epoll fd
- * in order to signal the user.  We arm the CQ on creation for this purpose
+ * Add an rsocket to a group with enough CQ space for its send queue.
  */
-static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+static int rs_shared_join(struct rsocket *rs)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cm_id->recv_cq_channel)
-		return -1;
+	struct rs_shared *shr;
+	dlist_entry *entry;
 
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
-	if (!cm_id->recv_cq)
-		goto err1;
+	rs->wcq_size = rs->sq_size + rs->rq_size + 1;
+	rs->wcq = calloc(rs->wcq_size, sizeof(*rs->wcq));
+	if (!rs->wcq)
+		return ERR(ENOMEM);
 
-	if (rs->fd_flags & O_NONBLOCK) {
-		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
-			goto err2;
+	pthread_mutex_lock(&mut);
+	for (entry = shared_list.next; entry != &shared_list; entry = entry->next) {
+		shr = container_of(entry, struct rs_shared, entry);
+		if (shr->pd == rs->cm_id->pd && shr->cq_avail >= rs->sq_size)
+			goto found;
 	}
 
-	ibv_req_notify_cq(cm_id->recv_cq, 0);
-	cm_id->send_cq_channel = cm_id->recv_cq_channel;
-	cm_id->send_cq = cm_id->recv_cq;
+	shr = rs_shared_alloc(rs->cm_id);
+	if (!shr)
+		goto err;
+
+	if (shr->cq_avail < rs->sq_size) {
+		rs_shared_free(shr);
+		errno = ENOMEM;
+		goto err;
+	}
+	dlist_insert_tail(&shr->entry, &shared_list);
+
+found:
+	shr->cq_avail -= rs->sq_size;
+	shr->refcnt++;
+	fastlock_acquire(&shr->lock);
+	shr->rq_total += rs->rq_size;
+	fastlock_release(&shr->lock);
+	pthread_mutex_unlock(&mut);
+	rs->shared = shr;
 	return 0;
 
-err2:
-	ibv_destroy_cq(cm_id->recv_cq);
-	cm_id->recv_cq = NULL;
-err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
-	cm_id->recv_cq_channel = NULL;
+err:
+	pthread_mutex_unlock(&mut);
+	free(rs->wcq);
+	rs->wcq = NULL;
 	return -1;
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+/* Caller must hold the group lock */
+static void rs_arena_put(struct rs_shared *shr, struct rsocket *rs)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
+	struct rs_arena *arena = rs->arena;
 
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	arena->free_map |= 1 << ((rs->rbuf - arena->buf) / arena->buf_size);
+	ibv_dereg_mr(rs->rmr);
+	rs->arena = NULL;
+	rs->rbuf = NULL;
+	rs->rmr = NULL;
+	if (~arena->free_map)
+		return;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+	dlist_remove(&arena->entry);
+	free(arena->buf);
+	free(arena);
+}
+
+static void rs_shared_leave(struct rsocket *rs)
+{
+	struct rs_shared *shr = rs->shared;
+
+	pthread_mutex_lock(&mut);
+	fastlock_acquire(&shr->lock);
+	shr->rq_total -= rs->rq_size;
+	if (rs->arena)
+		rs_arena_put(shr, rs);
+	fastlock_release(&shr->lock);
+
+	shr->cq_avail += rs->sq_size;
+	if (!--shr->refcnt) {
+		dlist_remove(&shr->entry);
+		rs_shared_free(shr);
 	}
+	pthread_mutex_unlock(&mut);
 
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+	free(rs->wcq);
+	rs->wcq = NULL;
+	rs->shared = NULL;
 }
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+/*
+ * Receive buffers are carved out of larger arenas, with one arena holding
+ * buffers of a single size.  Each buffer is registered on its own, so that
+ * a remote peer can only write into the buffer of its own connection.
+ */
+static int rs_arena_get(struct rsocket *rs)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
+	struct rs_shared *shr = rs->shared;
+	struct rs_arena *arena;
+	dlist_entry *entry;
+	int slot;
 
-	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
-	sge[0].length = sizeof(struct ibv_grh);
-	sge[0].lkey = qp->rmr->lkey;
-	sge[1].addr = (uintptr_t) qp->rbuf + offset;
-	sge[1].length = RS_SNDLOWAT;
-	sge[1].lkey = qp->rmr->lkey;
+	fastlock_acquire(&shr->lock);
+	for (entry = shr->arena_list.next; entry != &shr->arena_list;
+	     entry = entry->next) {
+		arena = container_of(entry, struct rs_arena, entry);
+		if (arena->buf_size == rs->rbuf_size && arena->free_map)
+			goto found;
+	}
 
-	wr.wr_id = rs_recv_wr_id(offset);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 2;
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		goto err1;
 
-	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
-}
+	arena->buf_size = rs->rbuf_size;
+	arena->buf = calloc(RS_ARENA_SLOTS, rs->rbuf_size);
+	if (!arena->buf)
+		goto err2;
 
-static int rs_create_ep(struct rsocket *rs)
-{
-	struct ibv_qp_init_attr qp_attr;
-	int i, ret;
+	arena->free_map = ~0;
+	dlist_insert_head(&arena->entry, &shr->arena_list);
 
-	rs_set_qp_size(rs);
-	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
-		rs->opts |= RS_OPT_MSG_SEND;
-	ret = rs_create_cq(rs, rs->cm_id);
-	if (ret)
-		return ret;
+found:
+	slot = ffs(arena->free_map) - 1;
+	rs->rmr = ibv_reg_mr(shr->pd, arena->buf + slot * arena->buf_size,
+			     arena->buf_size,
+			     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	if (!rs->rmr)
+		goto err3;
 
-	memset(&qp_attr, 0, sizeof qp_attr);
-	qp_attr.qp_context = rs;
-	qp_attr.send_cq = rs->cm_id->send_cq;
-	qp_attr.recv_cq = rs->cm_id->recv_cq;
-	qp_attr.qp_type = IBV_QPT_RC;
-	qp_attr.sq_sig_all = 1;
-	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
-	qp_attr.cap.max_send_sge = 2;
-	qp_attr.cap.max_recv_sge = 1;
-	qp_attr.cap.max_inline_data = rs->sq_inline;
+	arena->free_map &= ~(1 << slot);
+	rs->arena = arena;
+	rs->rbuf = arena->buf + slot * arena->buf_size;
+	fastlock_release(&shr->lock);
+	return 0;
 
-	ret = rdma_create_qp(rs->cm_id, NULL, &qp_attr);
-	if (ret)
-		return ret;
+err3:
+	/* Release an arena that was added for this buffer */
+	if (!~arena->free_map) {
+		dlist_remove(&arena->entry);
+		free(arena->buf);
+		free(arena);
+	}
+	fastlock_release(&shr->lock);
+	return -1;
+err2:
+	free(arena);
+err1:
+	fastlock_release(&shr->lock);
+	return ERR(ENOMEM);
+}
 
-	rs->sq_inline = qp_attr.cap.max_inline_data;
-	if ((rs->opts & RS_OPT_MSG_SEND) && (rs->sq_inline < RS_MSG_SIZE))
-		return ERR(ENOTSUP);
+/* Caller must hold the group lock */
+static int rs_shared_post_recv(struct rs_shared *shr)
+{
+	struct ibv_recv_wr wr, *bad;
+	int target, ret;
 
-	ret = rs_init_bufs(rs);
-	if (ret)
-		return ret;
+	wr.wr_id = rs_recv_wr_id(0);
+	wr.next = NULL;
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
 
-	for (i = 0; i < rs->rq_size; i++) {
-		ret = rs_post_recv(rs);
+	target = min(shr->srq_size, shr->rq_total);
+	while (shr->srq_posted < target) {
+		ret = ibv_post_srq_recv(shr->srq, &wr, &bad);
 		if (ret)
-			return ret;
+			return rdma_seterrno(ret);
+		shr->srq_posted++;
 	}
 	return 0;
 }
 
-static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
+static int rs_shared_add_qp(struct rsocket *rs)
 {
-	if (atomic_fetch_sub(&iomr->refcnt, 1) != 1)
-		return;
+	struct rs_shared *shr = rs->shared;
+	int ret = 0;
 
-	dlist_remove(&iomr->entry);
-	ibv_dereg_mr(iomr->mr);
-	if (iomr->index >= 0)
-		iomr->mr = NULL;
+	fastlock_acquire(&shr->lock);
+	if (!tsearch(&rs->cm_id->qp->qp_num, &shr->qp_map, rs_compare_qpn))
+		ret = ERR(ENOMEM);
 	else
-		free(iomr);
+		ret = rs_shared_post_recv(shr);
+	fastlock_release(&shr->lock);
+
+	rs->cm_id->recv_cq_channel = shr->channel;
+	rs->cm_id->send_cq_channel = shr->channel;
+	rs->cm_id->recv_cq = shr->cq;
+	rs->cm_id->send_cq = shr->cq;
+	return ret;
 }
 
-static void rs_free_iomappings(struct rsocket *rs)
+/*
+ * The CQ and channel belong to the group, so we destroy the QP
+ * directly, rather than through the rdma_cm.
+ */
+static void rs_shared_destroy_qp(struct rsocket *rs)
 {
-	struct rs_iomap_mr *iomr;
+	struct rs_shared *shr = rs->shared;
 
-	while (!dlist_empty(&rs->iomap_list)) {
-		iomr = container_of(rs->iomap_list.next,
-				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
-	}
-	while (!dlist_empty(&rs->iomap_queue)) {
-		iomr = container_of(rs->iomap_queue.next,
-				    struct rs_iomap_mr, entry);
-		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+	fastlock_acquire(&shr->lock);
+	tdelete(&rs->cm_id->qp->qp_num, &shr->qp_map, rs_compare_qpn);
+	fastlock_release(&shr->lock);
+
+	ibv_destroy_qp(rs->cm_id->qp);
+	rs->cm_id->qp = NULL;
+	rs->cm_id->recv_cq_channel = NULL;
+	rs->cm_id->send_cq_channel = NULL;
+	rs->cm_id->recv_cq = NULL;
+	rs->cm_id->send_cq = NULL;
+}
+
+static void rs_shared_arm(struct rs_shared *shr)
+{
+	pthread_mutex_lock(&shr->wait_lock);
+	if (!shr->armed) {
+		ibv_req_notify_cq(shr->cq, 0);
+		shr->armed = 1;
 	}
+	pthread_mutex_unlock(&shr->wait_lock);
 }
 
-static void ds_free_qp(struct ds_qp *qp)
+/*
+ * Retrieve the queued CQ events without blocking.  Wake any threads waiting
+ * on the CQ, so that they poll for their completions.
+ */
+static int rs_shared_get_cq_event(struct rs_shared *shr)
 {
-	if (qp->smr)
-		rdma_dereg_mr(qp->smr);
+	struct ibv_cq_event events[RS_SHARED_POLL];
+	uint64_t val = 1;
+	int n;
 
-	if (qp->rbuf) {
-		if (qp->rmr)
-			rdma_dereg_mr(qp->rmr);
-		free(qp->rbuf);
-	}
+	n = ibv_get_cq_events(shr->channel, events, RS_SHARED_POLL);
+	if (n < 0)
+		return -1;
 
-	if (qp->cm_id) {
-		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
-				  qp->cm_id->recv_cq_channel->fd, NULL);
-			rdma_destroy_qp(qp->cm_id);
-		}
-		rdma_destroy_id(qp->cm_id);
+	/* The channel only serves the shared CQ */
+	ibv_ack_cq_events(shr->cq, n);
+	pthread_mutex_lock(&shr->wait_lock);
+	shr->armed = 0;
+	shr->wait_gen++;
+	if (shr->waiting)
+		write_all(shr->wake_fd, &val, sizeof val);
+	pthread_cond_broadcast(&shr->wait_cond);
+	pthread_mutex_unlock(&shr->wait_lock);
+	return 0;
+}
+
+static int rs_shared_wait(struct rs_shared *shr)
+{
+	struct pollfd fds[2];
+	unsigned int gen;
+	uint64_t val;
+
+	pthread_mutex_lock(&shr->wait_lock);
+	if (!shr->armed) {
+		pthread_mutex_unlock(&shr->wait_lock);
+		return 0;
 	}
 
-	free(qp);
+	if (shr->waiting) {
+		gen = shr->wait_gen;
+		while (gen == shr->wait_gen)
+			pthread_cond_wait(&shr->wait_cond, &shr->wait_lock);
+		pthread_mutex_unlock(&shr->wait_lock);
+		return 0;
+	}
+	shr->waiting = 1;
+	pthread_mutex_unlock(&shr->wait_lock);
+
+	fds[0].fd = shr->channel->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = shr->wake_fd;
+	fds[1].events = POLLIN;
+	poll(fds, 2, -1);
+	if (fds[1].revents & POLLIN)
+		read_all(shr->wake_fd, &val, sizeof val);
+
+	pthread_mutex_lock(&shr->wait_lock);
+	shr->waiting = 0;
+	shr->wait_gen++;
+	pthread_cond_broadcast(&shr->wait_cond);
+	pthread_mutex_unlock(&shr->wait_lock);
+
+	if (fds[0].revents & POLLIN)
+		rs_shared_get_cq_event(shr);
+	return 0;
 }
 
-static void ds_free(struct rsocket *rs)
+/*
+ * Allocate and register the buffers of a stream rsocket.  Shared rsockets
+ * take their receive buffer from an arena when connecting instead.
+ */
+static int rs_alloc_bufs(struct rsocket *rs, struct ibv_pd *pd)
 {
-	struct ds_qp *qp;
+	uint32_t total_rbuf_size, total_sbuf_size;
+	size_t len;
 
-	if (rs->udp_sock >= 0)
-		close(rs->udp_sock);
+	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
+	if (!rs->rmsg)
+		return ERR(ENOMEM);
 
-	if (rs->index >= 0)
-		rs_remove(rs);
+	rs->sig_fifo = calloc(rs->sq_size, sizeof(*rs->sig_fifo));
+	if (!rs->sig_fifo)
+		return ERR(ENOMEM);
 
-	if (rs->dmsg)
-		free(rs->dmsg);
+	total_sbuf_size = rs->sbuf_size;
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		total_sbuf_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	rs->sbuf = calloc(total_sbuf_size, 1);
+	if (!rs->sbuf)
+		return ERR(ENOMEM);
 
-	while ((qp = rs->qp_list)) {
-		ds_remove_qp(rs, qp);
-		ds_free_qp(qp);
-	}
+	rs->smr = ibv_reg_mr(pd, rs->sbuf, total_sbuf_size,
+			     IBV_ACCESS_LOCAL_WRITE);
+	if (!rs->smr)
+		return -1;
 
-	if (rs->epfd >= 0)
-		close(rs->epfd);
+	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
+	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
+	rs->target_buffer_list = malloc(len);
+	if (!rs->target_buffer_list)
+		return ERR(ENOMEM);
 
-	if (rs->sbuf)
-		free(rs->sbuf);
+	rs->target_mr = ibv_reg_mr(pd, rs->target_buffer_list, len,
+				   IBV_ACCESS_LOCAL_WRITE |
+				   IBV_ACCESS_REMOTE_WRITE);
+	if (!rs->target_mr)
+		return -1;
 
-	tdestroy(rs->dest_map, free);
-	fastlock_destroy(&rs->map_lock);
-	fastlock_destroy(&rs->cq_wait_lock);
-	fastlock_destroy(&rs->cq_lock);
-	fastlock_destroy(&rs->rlock);
-	fastlock_destroy(&rs->slock);
-	free(rs);
+	memset(rs->target_buffer_list, 0, len);
+	if (rs->shared)
+		return 0;
+
+	total_rbuf_size = rs->rbuf_size;
+	if (rs->opts & RS_OPT_MSG_SEND)
+		total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
+	rs->rbuf = calloc(total_rbuf_size, 1);
+	if (!rs->rbuf)
+		return ERR(ENOMEM);
+
+	rs->rmr = ibv_reg_mr(pd, rs->rbuf, total_rbuf_size,
+			     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	if (!rs->rmr)
+		return -1;
+
+	return 0;
 }
 
-static void rs_free(struct rsocket *rs)
+/* Buffers taken from the endpoint pool are already allocated */
+static int rs_init_bufs(struct rsocket *rs)
 {
-	if (rs->type == SOCK_DGRAM) {
-		ds_free(rs);
-		return;
-	}
-
-	if (rs->rmsg)
-		free(rs->rmsg);
+	int ret;
 
-	if (rs->sbuf) {
-		if (rs->smr)
-			rdma_dereg_mr(rs->smr);
-		free(rs->sbuf);
+	if (!rs->sbuf) {
+		ret = rs_alloc_bufs(rs, rs->cm_id->pd);
+		if (ret)
+			return ret;
 	}
 
-	if (rs->rbuf) {
-		if (rs->rmr)
-			rdma_dereg_mr(rs->rmr);
-		free(rs->rbuf);
-	}
+	if (rs->shared && rs_arena_get(rs))
+		return -1;
 
-	if (rs->target_buffer_list) {
-		if (rs->target_mr)
-			rdma_dereg_mr(rs->target_mr);
-		free(rs->target_buffer_list);
-	}
+	rs->rbuf_min = rs->rbuf_size;
+	rs->target_sgl = rs->target_buffer_list;
+	if (rs->target_iomap_size)
+		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
 
-	if (rs->index >= 0)
-		rs_remove(rs);
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
+	rs->sbuf_bytes_avail = rs->sbuf_size;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
 
-	if (rs->cm_id) {
-		rs_free_iomappings(rs);
-		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
-			rdma_destroy_qp(rs->cm_id);
-		}
-		rdma_destroy_id(rs->cm_id);
-	}
+	/* Buffers in an arena or holding iWarp messages cannot be moved */
+	if (rs->shared || (rs->opts & RS_OPT_MSG_SEND) ||
+	    def_mem_max <= rs->rbuf_size)
+		rs->opts &= ~RS_OPT_AUTOTUNE;
 
-	fastlock_destroy(&rs->map_lock);
-	fastlock_destroy(&rs->cq_wait_lock);
-	fastlock_destroy(&rs->cq_lock);
-	fastlock_destroy(&rs->rlock);
-	fastlock_destroy(&rs->slock);
-	free(rs);
+	rs->rbuf_free_offset = rs->rbuf_size >> 1;
+	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_inflight = rs->rbuf_size >> 1;
+	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
+	rs->rseq_comp = rs->rq_size >> 1;
+	return 0;
 }
 
-static size_t rs_conn_data_offset(struct rsocket *rs)
+static int ds_init_bufs(struct ds_qp *qp)
 {
-	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
-		sizeof(struct ib_connect_hdr) : 0;
-}
+	qp->sq_ring = calloc(qp->rs->sq_size, sizeof(*qp->sq_ring));
+	if (!qp->sq_ring)
+		return ERR(ENOMEM);
 
-static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
-{
-	conn->version = 1;
-	conn->flags = RS_CONN_FLAG_IOMAP |
-		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
-	conn->credits = htobe16(rs->rq_size);
-	memset(conn->reserved, 0, sizeof conn->reserved);
-	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
+	qp->rbuf = calloc(qp->rs->rbuf_size + sizeof(struct ibv_grh), 1);
+	if (!qp->rbuf)
+		return ERR(ENOMEM);
 
-	conn->target_sgl.addr = (__force uint64_t)htobe64((uintptr_t) rs->target_sgl);
-	conn->target_sgl.length = (__force uint32_t)htobe32(RS_SGL_SIZE);
-	conn->target_sgl.key = (__force uint32_t)htobe32(rs->target_mr->rkey);
+	qp->smr = rdma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
+	if (!qp->smr)
+		return -1;
 
-	conn->data_buf.addr = (__force uint64_t)htobe64((uintptr_t) rs->rbuf);
-	conn->data_buf.length = (__force uint32_t)htobe32(rs->rbuf_size >> 1);
-	conn->data_buf.key = (__force uint32_t)htobe32(rs->rmr->rkey);
+	qp->rmr = rdma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
+						     sizeof(struct ibv_grh));
+	if (!qp->rmr)
+		return -1;
+
+	return 0;
 }
 
-static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+/*
+ * If a user is waiting on a datagram rsocket through poll or select, then
+ * we need the first completion to generate an event on the related epoll fd
+ * in order to signal the user.  We arm the CQ on creation for this purpose
+ */
+static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
 {
-	rs->remote_sgl.addr = be64toh((__force __be64)conn->target_sgl.addr);
-	rs->remote_sgl.length = be32toh((__force __be32)conn->target_sgl.length);
-	rs->remote_sgl.key = be32toh((__force __be32)conn->target_sgl.key);
-	rs->remote_sge = 1;
-	if ((rs_host_is_net() && !(conn->flags & RS_CONN_FLAG_NET)) ||
-	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
-		rs->opts = RS_OPT_SWAP_SGL;
+	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!cm_id->recv_cq_channel)
+		return -1;
 
-	if (conn->flags & RS_CONN_FLAG_IOMAP) {
-		rs->remote_iomap.addr = rs->remote_sgl.addr +
-					sizeof(rs->remote_sgl) * rs->remote_sgl.length;
-		rs->remote_iomap.length = rs_scale_to_value(conn->target_iomap_size, 8);
-		rs->remote_iomap.key = rs->remote_sgl.key;
+	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+				       cm_id, cm_id->recv_cq_channel, 0);
+	if (!cm_id->recv_cq)
+		goto err1;
+
+	if (rs->fd_flags & O_NONBLOCK) {
+		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
+			goto err2;
 	}
 
-	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
-	rs->target_sgl[0].length = be32toh((__force __be32)conn->data_buf.length);
-	rs->target_sgl[0].key = be32toh((__force __be32)conn->data_buf.key);
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
 
-	rs->sseq_comp = be16toh(conn->credits);
+err2:
+	ibv_destroy_cq(cm_id->recv_cq);
+	cm_id->recv_cq = NULL;
+err1:
+	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	cm_id->recv_cq_channel = NULL;
+	return -1;
 }
 
-static int ds_init(struct rsocket *rs, int domain)
+static inline int rs_post_recv(struct rsocket *rs)
 {
-	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
-	if (rs->udp_sock < 0)
-		return rs->udp_sock;
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge;
 
-	rs->epfd = epoll_create(2);
-	if (rs->epfd < 0)
-		return rs->epfd;
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.wr_id = rs_recv_wr_id(0);
+		wr.sg_list = NULL;
+		wr.num_sge = 0;
+	} else {
+		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
+		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+			   (rs->rbuf_msg_index * RS_MSG_SIZE);
+		sge.length = RS_MSG_SIZE;
+		sge.lkey = rs->rmr->lkey;
 
-	return 0;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		if(++rs->rbuf_msg_index == rs->rq_size)
+			rs->rbuf_msg_index = 0;
+	}
+
+	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
 }
 
-static int ds_init_ep(struct rsocket *rs)
+static inline void ds_init_recv_wr(struct rsocket *rs, struct ds_qp *qp,
+				   uint32_t offset, struct ibv_recv_wr *wr,
+				   struct ibv_sge *sge)
 {
-	struct ds_smsg *msg;
-	int i, ret;
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
+	sge[1].lkey = qp->rmr->lkey;
 
-	ds_set_qp_size(rs);
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+}
 
-	rs->sbuf = calloc(rs->sq_size, RS_SNDLOWAT);
-	if (!rs->sbuf)
-		return ERR(ENOMEM);
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
 
-	rs->dmsg = calloc(rs->rq_size + 1, sizeof(*rs->dmsg));
-	if (!rs->dmsg)
-		return ERR(ENOMEM);
+	ds_init_recv_wr(rs, qp, offset, &wr, sge);
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+}
 
-	rs->sqe_avail = rs->sq_size;
-	rs->rqe_avail = rs->rq_size;
+static void ds_flush_recvs(struct ds_recv_batch *batch)
+{
+	struct ibv_recv_wr *bad;
+	int i;
 
-	rs->smsg_free = (struct ds_smsg *) rs->sbuf;
-	msg = rs->smsg_free;
-	for (i = 0; i < rs->sq_size - 1; i++) {
-		msg->next = (void *) msg + RS_SNDLOWAT;
-		msg = msg->next;
-	}
-	msg->next = NULL;
+	if (!batch->cnt)
+		return;
 
-	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
-	if (ret)
-		return ret;
+	for (i = 0; i < batch->cnt - 1; i++)
+		batch->wr[i].next = &batch->wr[i + 1];
+	ibv_post_recv(batch->qp->cm_id->qp, batch->wr, &bad);
+	batch->cnt = 0;
+}
 
-	rs->state = rs_readable | rs_writable;
-	return 0;
+/* Queue a receive buffer to be reposted with others from the same QP */
+static void ds_batch_recv(struct rsocket *rs, struct ds_recv_batch *batch,
+			  struct ds_qp *qp, uint32_t offset)
+{
+	if (batch->cnt && (batch->qp != qp || batch->cnt == DS_MMSG_BATCH))
+		ds_flush_recvs(batch);
+
+	ds_init_recv_wr(rs, qp, offset, &batch->wr[batch->cnt],
+			batch->sge[batch->cnt]);
+	batch->qp = qp;
+	batch->cnt++;
 }
 
-int rsocket(int domain, int type, int protocol)
+static void rs_init_qp_attr(struct rsocket *rs, struct ibv_qp_init_attr *qp_attr)
 {
-	struct rsocket *rs;
-	int index, ret;
+	memset(qp_attr, 0, sizeof *qp_attr);
+	qp_attr->qp_context = rs;
+	qp_attr->qp_type = IBV_QPT_RC;
+	qp_attr->sq_sig_all = 0;
+	qp_attr->cap.max_send_wr = rs->sq_size;
+	qp_attr->cap.max_recv_wr = rs->rq_size;
+	qp_attr->cap.max_send_sge = 2;
+	qp_attr->cap.max_recv_sge = 1;
+	qp_attr->cap.max_inline_data = rs->sq_inline;
+}
 
-	if ((domain != AF_INET && domain != AF_INET6 && domain != AF_IB) ||
-	    ((type != SOCK_STREAM) && (type != SOCK_DGRAM)) ||
-	    (type == SOCK_STREAM && protocol && protocol != IPPROTO_TCP) ||
-	    (type == SOCK_DGRAM && protocol && protocol != IPPROTO_UDP))
-		return ERR(ENOTSUP);
+static void rs_pool_free_ep(struct rs_pool_ep *ep)
+{
+	struct rsocket *bufs = ep->bufs;
 
-	rs_configure();
-	rs = rs_alloc(NULL, type);
-	if (!rs)
-		return ERR(ENOMEM);
+	if (ep->qp)
+		ibv_destroy_qp(ep->qp);
+	if (ep->cq)
+		ibv_destroy_cq(ep->cq);
+	if (ep->channel)
+		ibv_destroy_comp_channel(ep->channel);
 
-	if (type == SOCK_STREAM) {
-		ret = rdma_create_id(NULL, &rs->cm_id, rs, RDMA_PS_TCP);
-		if (ret)
-			goto err;
+	if (bufs->rmr)
+		ibv_dereg_mr(bufs->rmr);
+	free(bufs->rbuf);
+	if (bufs->target_mr)
+		ibv_dereg_mr(bufs->target_mr);
+	free(bufs->target_buffer_list);
+	if (bufs->smr)
+		ibv_dereg_mr(bufs->smr);
+	free(bufs->sbuf);
+	free(bufs->sig_fifo);
+	free(bufs->rmsg);
+	free(bufs);
+	free(ep);
+}
 
-		rs->cm_id->route.addr.src_addr.sa_family = domain;
-		index = rs->cm_id->channel->fd;
-	} else {
-		ret = ds_init(rs, domain);
-		if (ret)
-			goto err;
+static struct rs_pool_ep *rs_pool_alloc_ep(struct rs_pool *pool)
+{
+	struct ibv_qp_init_attr qp_attr;
+	struct ibv_context *verbs = pool->pd->context;
+	struct rs_pool_ep *ep;
+	struct rsocket *bufs;
 
-		index = rs->udp_sock;
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return NULL;
+
+	ep->bufs = bufs = calloc(1, sizeof(*bufs));
+	if (!bufs) {
+		free(ep);
+		return NULL;
 	}
 
-	ret = rs_insert(rs, index);
-	if (ret < 0)
+	bufs->type = SOCK_STREAM;
+	bufs->sq_size = pool->sq_size;
+	bufs->rq_size = pool->rq_size;
+	bufs->sq_inline = pool->sq_inline;
+	bufs->target_iomap_size = pool->iomap_size;
+	bufs->sbuf_size = pool->sbuf_size;
+	bufs->rbuf_size = pool->rbuf_size;
+
+	ep->channel = ibv_create_comp_channel(verbs);
+	if (!ep->channel)
 		goto err;
 
-	return rs->index;
+	ep->cq = ibv_create_cq(verbs, bufs->sq_size + bufs->rq_size, NULL,
+			       ep->channel, 0);
+	if (!ep->cq)
+		goto err;
+
+	rs_init_qp_attr(bufs, &qp_attr);
+	qp_attr.qp_context = NULL;
+	qp_attr.send_cq = ep->cq;
+	qp_attr.recv_cq = ep->cq;
+	ep->qp = ibv_create_qp(pool->pd, &qp_attr);
+	if (!ep->qp)
+		goto err;
+
+	bufs->sq_inline = qp_attr.cap.max_inline_data;
+	if (rs_alloc_bufs(bufs, pool->pd))
+		goto err;
+
+	return ep;
 
 err:
-	rs_free(rs);
-	return ret;
+	rs_pool_free_ep(ep);
+	return NULL;
 }
 
-int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen)
+/*
+ * Keeps each pool filled.  Pools are never removed, so the list may be
+ * walked while endpoints are built without holding the lock.
+ */
+static void *rs_pool_run(void *arg)
 {
-	struct rsocket *rs;
-	int ret;
+	struct rs_pool_ep *ep;
+	struct rs_pool *pool;
+	dlist_entry *entry;
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_STREAM) {
-		ret = rdma_bind_addr(rs->cm_id, (struct sockaddr *) addr);
-		if (!ret)
-			rs->state = rs_bound;
-	} else {
-		if (rs->state == rs_init) {
-			ret = ds_init_ep(rs);
-			if (ret)
-				return ret;
+	pthread_mutex_lock(&pool_lock);
+	while (1) {
+		for (entry = pool_list.next; entry != &pool_list;
+		     entry = entry->next) {
+			pool = container_of(entry, struct rs_pool, entry);
+			while (!pool->failed && pool->ep_cnt < def_pool_size) {
+				pthread_mutex_unlock(&pool_lock);
+				ep = rs_pool_alloc_ep(pool);
+				pthread_mutex_lock(&pool_lock);
+				if (!ep) {
+					pool->failed = 1;
+					break;
+				}
+				dlist_insert_tail(&ep->entry, &pool->ep_list);
+				pool->ep_cnt++;
+			}
 		}
-		ret = bind(rs->udp_sock, addr, addrlen);
+		pthread_cond_wait(&pool_cond, &pool_lock);
 	}
-	return ret;
+	return NULL;
 }
 
-int rlisten(int socket, int backlog)
+static struct rs_pool *rs_pool_alloc(struct rsocket *rs)
 {
-	struct rsocket *rs;
-	int ret;
+	struct rs_pool *pool;
+	pthread_t thread;
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
+	if (!pool_running) {
+		if (pthread_create(&thread, NULL, rs_pool_run, NULL))
+			return NULL;
+		pthread_detach(thread);
+		pool_running = 1;
+	}
 
-	if (rs->state != rs_listening) {
-		ret = rdma_listen(rs->cm_id, backlog);
-		if (!ret)
-			rs->state = rs_listening;
-	} else {
-		ret = 0;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	dlist_init(&pool->ep_list);
+	pool->dev = ucma_hold_device(rs->cm_id);
+	pool->pd = rs->cm_id->pd;
+	pool->sq_size = rs->sq_size;
+	pool->rq_size = rs->rq_size;
+	pool->sq_inline = rs->sq_inline;
+	pool->iomap_size = rs->target_iomap_size;
+	pool->sbuf_size = rs->sbuf_size;
+	pool->rbuf_size = rs->rbuf_size;
+	dlist_insert_tail(&pool->entry, &pool_list);
+	return pool;
+}
+
+static struct rs_pool_ep *rs_pool_remove(struct rsocket *rs)
+{
+	struct rs_pool_ep *ep = NULL;
+	struct rs_pool *pool;
+	dlist_entry *entry;
+
+	pthread_mutex_lock(&pool_lock);
+	for (entry = pool_list.next; entry != &pool_list; entry = entry->next) {
+		pool = container_of(entry, struct rs_pool, entry);
+		if (pool->pd == rs->cm_id->pd)
+			goto found;
 	}
-	return ret;
+
+	pool = rs_pool_alloc(rs);
+	if (!pool)
+		goto out;
+found:
+	if (!dlist_empty(&pool->ep_list) &&
+	    pool->sq_size == rs->sq_size && pool->rq_size == rs->rq_size &&
+	    pool->sq_inline == rs->sq_inline &&
+	    pool->iomap_size == rs->target_iomap_size &&
+	    pool->sbuf_size == rs->sbuf_size &&
+	    pool->rbuf_size == rs->rbuf_size) {
+		ep = container_of(pool->ep_list.next, struct rs_pool_ep, entry);
+		dlist_remove(&ep->entry);
+		pool->ep_cnt--;
+	}
+	pool->failed = 0;
+	pthread_cond_signal(&pool_cond);
+out:
+	pthread_mutex_unlock(&pool_lock);
+	return ep;
 }
 
 /*
- * Nonblocking is usually not inherited between sockets, but we need to
- * inherit it here to establish the connection only.  This is needed to
- * prevent rdma_accept from blocking until the remote side finishes
- * establishing the connection.  If we were to allow rdma_accept to block,
- * then a single thread cannot establish a connection with itself, or
- * two threads which try to connect to each other can deadlock trying to
- * form a connection.
- *
- * Data transfers on the new socket remain blocking unless the user
- * specifies otherwise through rfcntl.
+ * Give the rsocket a pooled endpoint, if one matching its sizes is ready.
+ * Returns 1 if the rsocket was given an endpoint, or 0 if it should create
+ * its own.
  */
-int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
+static int rs_pool_get(struct rsocket *rs)
 {
-	struct rsocket *rs, *new_rs;
-	struct rdma_conn_param param;
-	struct rs_conn_data *creq, cresp;
-	int ret;
+	struct rdma_cm_id *cm_id = rs->cm_id;
+	struct rs_pool_ep *ep;
+	struct rsocket *bufs;
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	new_rs = rs_alloc(rs, rs->type);
-	if (!new_rs)
-		return ERR(ENOMEM);
+	ep = rs_pool_remove(rs);
+	if (!ep)
+		return 0;
 
-	ret = rdma_get_request(rs->cm_id, &new_rs->cm_id);
-	if (ret)
-		goto err;
-
-	ret = rs_insert(new_rs, new_rs->cm_id->channel->fd);
-	if (ret < 0)
-		goto err;
-
-	creq = (struct rs_conn_data *)
-	       (new_rs->cm_id->event->param.conn.private_data + rs_conn_data_offset(rs));
-	if (creq->version != 1) {
-		ret = ERR(ENOTSUP);
-		goto err;
+	if (((rs->fd_flags & O_NONBLOCK) &&
+	     set_fd_nonblock(ep->channel->fd, true)) ||
+	    ucma_attach_qp(cm_id, ep->qp)) {
+		rs_pool_free_ep(ep);
+		return 0;
 	}
 
-	if (rs->fd_flags & O_NONBLOCK)
-		set_fd_nonblock(new_rs->cm_id->channel->fd, true);
-
-	ret = rs_create_ep(new_rs);
-	if (ret)
-		goto err;
-
-	rs_save_conn_data(new_rs, creq);
-	param = new_rs->cm_id->event->param.conn;
-	rs_format_conn_data(new_rs, &cresp);
-	param.private_data = &cresp;
-	param.private_data_len = sizeof cresp;
-	ret = rdma_accept(new_rs->cm_id, &param);
-	if (!ret)
-		new_rs->state = rs_connect_rdwr;
-	else if (errno == EAGAIN || errno == EWOULDBLOCK)
-		new_rs->state = rs_accepting;
-	else
-		goto err;
-
-	if (addr && addrlen)
-		rgetpeername(new_rs->index, addr, addrlen);
-	return new_rs->index;
-
-err:
-	rs_free(new_rs);
-	return ret;
+	ep->qp->qp_context = rs;
+	ibv_req_notify_cq(ep->cq, 0);
+	cm_id->recv_cq_channel = cm_id->send_cq_channel = ep->channel;
+	cm_id->recv_cq = cm_id->send_cq = ep->cq;
+
+	bufs = ep->bufs;
+	rs->sq_inline = bufs->sq_inline;
+	rs->rmsg = bufs->rmsg;
+	rs->sig_fifo = bufs->sig_fifo;
+	rs->sbuf = bufs->sbuf;
+	rs->smr = bufs->smr;
+	rs->target_buffer_list = bufs->target_buffer_list;
+	rs->target_mr = bufs->target_mr;
+	rs->rbuf = bufs->rbuf;
+	rs->rmr = bufs->rmr;
+	free(bufs);
+	free(ep);
+	return 1;
 }
 
-static int rs_do_connect(struct rsocket *rs)
+static int rs_create_ep(struct rsocket *rs)
 {
-	struct rdma_conn_param param;
-	struct rs_conn_private_data cdata;
-	struct rs_conn_data *creq, *cresp;
-	int to, ret;
+	struct ibv_qp_init_attr qp_attr;
+	int i, ret;
 
-	switch (rs->state) {
-	case rs_init:
-	case rs_bound:
-resolve_addr:
-		to = 1000 << rs->retries++;
-		ret = rdma_resolve_addr(rs->cm_id, NULL,
-					&rs->cm_id->route.addr.dst_addr, to);
-		if (!ret)
-			goto resolve_route;
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_resolving_addr;
-		break;
-	case rs_resolving_addr:
-		ret = ucma_complete(rs->cm_id);
-		if (ret) {
-			if (errno == ETIMEDOUT && rs->retries <= RS_CONN_RETRIES)
-				goto resolve_addr;
-			break;
-		}
+	rs_set_qp_size(rs);
+	if (rs->cm_id->verbs->device->transport_type == IBV_TRANSPORT_IWARP)
+		rs->opts |= RS_OPT_MSG_SEND;
 
-		rs->retries = 0;
-resolve_route:
-		to = 1000 << rs->retries++;
-		if (rs->optval) {
-			ret = rdma_set_option(rs->cm_id,  RDMA_OPTION_IB,
-					      RDMA_OPTION_IB_PATH, rs->optval,
-					      rs->optlen);
-			free(rs->optval);
-			rs->optval = NULL;
-			if (!ret) {
-				rs->state = rs_resolving_route;
-				goto resolving_route;
-			}
-		} else {
-			ret = rdma_resolve_route(rs->cm_id, to);
-			if (!ret)
-				goto do_connect;
-		}
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_resolving_route;
-		break;
-	case rs_resolving_route:
-resolving_route:
-		ret = ucma_complete(rs->cm_id);
-		if (ret) {
-			if (errno == ETIMEDOUT && rs->retries <= RS_CONN_RETRIES)
-				goto resolve_route;
-			break;
-		}
-do_connect:
-		ret = rs_create_ep(rs);
-		if (ret)
-			break;
+	if (def_pool_size > 0 &&
+	    !(rs->opts & (RS_OPT_SHARED | RS_OPT_MSG_SEND)) && rs_pool_get(rs))
+		goto init_bufs;
 
-		memset(&param, 0, sizeof param);
-		creq = (void *) &cdata + rs_conn_data_offset(rs);
-		rs_format_conn_data(rs, creq);
-		param.private_data = (void *) creq - rs_conn_data_offset(rs);
-		param.private_data_len = sizeof(*creq) + rs_conn_data_offset(rs);
-		param.flow_control = 1;
-		param.retry_count = 7;
-		param.rnr_retry_count = 7;
-		/* work-around: iWarp issues RDMA read during connection */
-		if (rs->opts & RS_OPT_MSG_SEND)
-			param.initiator_depth = 1;
-		rs->retries = 0;
+	/* iWarp receives carry data, which we do not share */
+	if ((rs->opts & RS_OPT_SHARED) && !(rs->opts & RS_OPT_MSG_SEND))
+		ret = rs_shared_join(rs);
+	else
+		ret = rs_create_cq(rs, rs->cm_id);
+	if (ret)
+		return ret;
 
-		ret = rdma_connect(rs->cm_id, &param);
-		if (!ret)
-			goto connected;
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			rs->state = rs_connecting;
-		break;
-	case rs_connecting:
-		ret = ucma_complete(rs->cm_id);
-		if (ret)
-			break;
-connected:
-		cresp = (struct rs_conn_data *) rs->cm_id->event->param.conn.private_data;
-		if (cresp->version != 1) {
-			ret = ERR(ENOTSUP);
-			break;
-		}
+	rs_init_qp_attr(rs, &qp_attr);
+	if (rs->shared) {
+		qp_attr.send_cq = rs->shared->cq;
+		qp_attr.recv_cq = rs->shared->cq;
+		qp_attr.srq = rs->shared->srq;
+	} else {
+		qp_attr.send_cq = rs->cm_id->send_cq;
+		qp_attr.recv_cq = rs->cm_id->recv_cq;
+	}
 
-		rs_save_conn_data(rs, cresp);
-		rs->state = rs_connect_rdwr;
-		break;
-	case rs_accepting:
-		if (!(rs->fd_flags & O_NONBLOCK))
-			set_fd_nonblock(rs->cm_id->channel->fd, true);
+	ret = rdma_create_qp(rs->cm_id, NULL, &qp_attr);
+	if (ret)
+		return ret;
 
-		ret = ucma_complete(rs->cm_id);
+	if (rs->shared) {
+		ret = rs_shared_add_qp(rs);
 		if (ret)
-			break;
-
-		rs->state = rs_connect_rdwr;
-		break;
-	default:
-		ret = ERR(EINVAL);
-		break;
+			return ret;
 	}
 
-	if (ret) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			errno = EINPROGRESS;
-		} else {
-			rs->state = rs_connect_error;
-			rs->err = errno;
-		}
-	}
-	return ret;
-}
+	rs->sq_inline = qp_attr.cap.max_inline_data;
+	if ((rs->opts & RS_OPT_MSG_SEND) && (rs->sq_inline < RS_MSG_SIZE))
+		return ERR(ENOTSUP);
 
-static int rs_any_addr(const union socket_addr *addr)
-{
-	if (addr->sa.sa_family == AF_INET) {
-		return (addr->sin.sin_addr.s_addr == htobe32(INADDR_ANY) ||
-			addr->sin.sin_addr.s_addr == htobe32(INADDR_LOOPBACK));
-	} else {
-		return (!memcmp(&addr->sin6.sin6_addr, &in6addr_any, 16) ||
-			!memcmp(&addr->sin6.sin6_addr, &in6addr_loopback, 16));
+init_bufs:
+	ret = rs_init_bufs(rs);
+	if (ret || rs->shared)
+		return ret;
+
+	for (i = 0; i < rs->rq_size; i++) {
+		ret = rs_post_recv(rs);
+		if (ret)
+			return ret;
 	}
+	return 0;
 }
 
-static int ds_get_src_addr(struct rsocket *rs,
-			   const struct sockaddr *dest_addr, socklen_t dest_len,
-			   union socket_addr *src_addr, socklen_t *src_len)
+static void rs_release_iomap_mr(struct rs_iomap_mr *iomr)
 {
-	int sock, ret;
-	__be16 port;
-
-	*src_len = sizeof(*src_addr);
-	ret = getsockname(rs->udp_sock, &src_addr->sa, src_len);
-	if (ret || !rs_any_addr(src_addr))
-		return ret;
-
-	port = src_addr->sin.sin_port;
-	sock = socket(dest_addr->sa_family, SOCK_DGRAM, 0);
-	if (sock < 0)
-		return sock;
+	if (atomic_fetch_sub(&iomr->refcnt, 1) != 1)
+		return;
 
-	ret = connect(sock, dest_addr, dest_len);
-	if (ret)
-		goto out;
+	dlist_remove(&iomr->entry);
+	ibv_dereg_mr(iomr->mr);
+	if (iomr->index >= 0)
+		iomr->mr = NULL;
+	else
+		free(iomr);
+}
 
-	*src_len = sizeof(*src_addr);
-	ret = getsockname(sock, &src_addr->sa, src_len);
-	src_addr->sin.sin_port = port;
-out:
-	close(sock);
-	return ret;
+/* An in-flight zero-copy transfer may still hold a reference */
+static void rs_drop_zcopy_mr(struct rsocket *rs, struct rs_iomap_mr *iomr)
+{
+	dlist_remove(&iomr->entry);
+	dlist_init(&iomr->entry);
+	rs->zcopy_mr_cnt--;
+	rs_release_iomap_mr(iomr);
 }
 
-static void ds_format_hdr(struct ds_header *hdr, union socket_addr *addr)
+static void rs_free_iomappings(struct rsocket *rs)
 {
-	if (addr->sa.sa_family == AF_INET) {
-		hdr->version = 4;
-		hdr->length = DS_IPV4_HDR_LEN;
-		hdr->port = addr->sin.sin_port;
-		hdr->addr.ipv4 = addr->sin.sin_addr.s_addr;
-	} else {
-		hdr->version = 6;
-		hdr->length = DS_IPV6_HDR_LEN;
-		hdr->port = addr->sin6.sin6_port;
-		hdr->addr.ipv6.flowinfo= addr->sin6.sin6_flowinfo;
-		memcpy(&hdr->addr.ipv6.addr, &addr->sin6.sin6_addr, 16);
+	struct rs_iomap_mr *iomr;
+
+	while (!dlist_empty(&rs->iomap_list)) {
+		iomr = container_of(rs->iomap_list.next,
+				    struct rs_iomap_mr, entry);
+		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+	}
+	while (!dlist_empty(&rs->iomap_queue)) {
+		iomr = container_of(rs->iomap_queue.next,
+				    struct rs_iomap_mr, entry);
+		riounmap(rs->index, iomr->mr->addr, iomr->mr->length);
+	}
+	while (!dlist_empty(&rs->zcopy_list)) {
+		iomr = container_of(rs->zcopy_list.next,
+				    struct rs_iomap_mr, entry);
+		rs_drop_zcopy_mr(rs, iomr);
 	}
 }
 
-static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
-			  socklen_t addrlen)
+static void ds_free_qp(struct ds_qp *qp)
 {
-	struct ibv_port_attr port_attr;
-	struct ibv_ah_attr attr;
-	int ret;
+	if (qp->smr)
+		rdma_dereg_mr(qp->smr);
 
-	memcpy(&qp->dest.addr, addr, addrlen);
-	qp->dest.qp = qp;
-	qp->dest.qpn = qp->cm_id->qp->qp_num;
+	free(qp->sq_ring);
 
-	ret = ibv_query_port(qp->cm_id->verbs, qp->cm_id->port_num, &port_attr);
-	if (ret)
-		return ret;
+	if (qp->rbuf) {
+		if (qp->rmr)
+			rdma_dereg_mr(qp->rmr);
+		free(qp->rbuf);
+	}
 
-	memset(&attr, 0, sizeof attr);
-	attr.dlid = port_attr.lid;
-	attr.port_num = qp->cm_id->port_num;
-	qp->dest.ah = ibv_create_ah(qp->cm_id->pd, &attr);
-	if (!qp->dest.ah)
-		return ERR(ENOMEM);
+	ds_remove_dest(qp->rs, &qp->dest);
+	if (qp->dest.ah)
+		ibv_destroy_ah(qp->dest.ah);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-	return 0;
+	if (qp->cm_id) {
+		if (qp->cm_id->qp) {
+			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
+				  qp->cm_id->recv_cq_channel->fd, NULL);
+			rdma_destroy_qp(qp->cm_id);
+		}
+		rdma_destroy_id(qp->cm_id);
+	}
+
+	free(qp);
 }
 
-static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
-			socklen_t addrlen, struct ds_qp **new_qp)
+static void ds_free(struct rsocket *rs)
 {
+	struct ds_dest *dest;
 	struct ds_qp *qp;
-	struct ibv_qp_init_attr qp_attr;
-	struct epoll_event event;
-	int i, ret;
-
-	qp = calloc(1, sizeof(*qp));
-	if (!qp)
-		return ERR(ENOMEM);
-
-	qp->rs = rs;
-	ret = rdma_create_id(NULL, &qp->cm_id, qp, RDMA_PS_UDP);
-	if (ret)
-		goto err;
-
-	ds_format_hdr(&qp->hdr, src_addr);
-	ret = rdma_bind_addr(qp->cm_id, &src_addr->sa);
-	if (ret)
-		goto err;
-
-	ret = ds_init_bufs(qp);
-	if (ret)
-		goto err;
-
-	ret = rs_create_cq(rs, qp->cm_id);
-	if (ret)
-		goto err;
+	uint32_t i;
 
-	memset(&qp_attr, 0, sizeof qp_attr);
-	qp_attr.qp_context = qp;
-	qp_attr.send_cq = qp->cm_id->send_cq;
-	qp_attr.recv_cq = qp->cm_id->recv_cq;
-	qp_attr.qp_type = IBV_QPT_UD;
-	qp_attr.sq_sig_all = 1;
-	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
-	qp_attr.cap.max_send_sge = 1;
-	qp_attr.cap.max_recv_sge = 2;
-	qp_attr.cap.max_inline_data = rs->sq_inline;
-	ret = rdma_create_qp(qp->cm_id, NULL, &qp_attr);
-	if (ret)
-		goto err;
+	if (rs->udp_sock >= 0)
+		close(rs->udp_sock);
 
-	rs->sq_inline = qp_attr.cap.max_inline_data;
-	ret = ds_add_qp_dest(qp, src_addr, addrlen);
-	if (ret)
-		goto err;
+	if (rs->index >= 0)
+		rs_remove(rs);
 
-	event.events = EPOLLIN;
-	event.data.ptr = qp;
-	ret = epoll_ctl(rs->epfd,  EPOLL_CTL_ADD,
-			qp->cm_id->recv_cq_channel->fd, &event);
-	if (ret)
-		goto err;
+	if (rs->dmsg)
+		free(rs->dmsg);
 
-	for (i = 0; i < rs->rq_size; i++) {
-		ret = ds_post_recv(rs, qp, i * RS_SNDLOWAT);
-		if (ret)
-			goto err;
+	/* Handles are released before the QPs that hold their PDs */
+	for (i = 0; i < rs->dest_size; i++) {
+		dest = rs->dest_tbl[i];
+		if (dest && dest->cached_ah) {
+			ds_put_ah(dest->cached_ah);
+			dest->cached_ah = NULL;
+			dest->ah = NULL;
+		}
 	}
 
-	ds_insert_qp(rs, qp);
-	*new_qp = qp;
-	return 0;
-err:
-	ds_free_qp(qp);
-	return ret;
-}
+	while ((qp = rs->qp_list)) {
+		ds_remove_qp(rs, qp);
+		ds_free_qp(qp);
+	}
 
-static int ds_get_qp(struct rsocket *rs, union socket_addr *src_addr,
-		     socklen_t addrlen, struct ds_qp **qp)
-{
-	if (rs->qp_list) {
-		*qp = rs->qp_list;
-		do {
-			if (!ds_compare_addr(rdma_get_local_addr((*qp)->cm_id),
-					     src_addr))
-				return 0;
+	if (rs->epfd >= 0)
+		close(rs->epfd);
 
-			*qp = ds_next_qp(*qp);
-		} while (*qp != rs->qp_list);
-	}
+	if (rs->sbuf)
+		free(rs->sbuf);
 
-	return ds_create_qp(rs, src_addr, addrlen, qp);
+	for (i = 0; i < rs->dest_size; i++)
+		free(rs->dest_tbl[i]);
+	free(rs->dest_tbl);
+	fastlock_destroy(&rs->map_lock);
+	fastlock_destroy(&rs->cq_wait_lock);
+	fastlock_destroy(&rs->cq_lock);
+	fastlock_destroy(&rs->rlock);
+	fastlock_destroy(&rs->slock);
+	free(rs);
 }
 
-static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
-		       socklen_t addrlen, struct ds_dest **dest)
+static void rs_free(struct rsocket *rs)
 {
-	union socket_addr src_addr;
-	socklen_t src_len;
-	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
-	int ret = 0;
+	if (rs->type == SOCK_DGRAM) {
+		ds_free(rs);
+		return;
+	}
 
-	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (tdest)
-		goto found;
+	if (rs->rmsg)
+		free(rs->rmsg);
 
-	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
-	if (ret)
-		goto out;
+	free(rs->sig_fifo);
 
-	ret = ds_get_qp(rs, &src_addr, src_len, &qp);
-	if (ret)
-		goto out;
+	if (rs->sbuf) {
+		if (rs->smr)
+			rdma_dereg_mr(rs->smr);
+		free(rs->sbuf);
+	}
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
-	if (!tdest) {
-		new_dest = calloc(1, sizeof(*new_dest));
-		if (!new_dest) {
-			ret = ERR(ENOMEM);
-			goto out;
+	if (rs->rbuf && !rs->arena) {
+		if (rs->rmr)
+			rdma_dereg_mr(rs->rmr);
+		free(rs->rbuf);
+		/* include any growth reserved by a pending resize */
+		if (max(rs->rbuf_size, rs->rbuf_resize) > rs->rbuf_min) {
+			pthread_mutex_lock(&mut);
+			mem_autotuned -= max(rs->rbuf_size, rs->rbuf_resize) -
+					 rs->rbuf_min;
+			pthread_mutex_unlock(&mut);
 		}
-
-		memcpy(&new_dest->addr, addr, addrlen);
-		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
 	}
 
-found:
-	*dest = *tdest;
-out:
-	fastlock_release(&rs->map_lock);
-	return ret;
-}
+	if (rs->target_buffer_list) {
+		if (rs->target_mr)
+			rdma_dereg_mr(rs->target_mr);
+		free(rs->target_buffer_list);
+	}
 
-int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
-{
-	struct rsocket *rs;
-	int ret;
+	if (rs->index >= 0)
+		rs_remove(rs);
 
-	rs = idm_lookup(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_STREAM) {
-		memcpy(&rs->cm_id->route.addr.dst_addr, addr, addrlen);
-		ret = rs_do_connect(rs);
-	} else {
-		if (rs->state == rs_init) {
-			ret = ds_init_ep(rs);
-			if (ret)
-				return ret;
+	if (rs->cm_id) {
+		rs_free_iomappings(rs);
+		if (rs->cm_id->qp) {
+			if (rs->shared) {
+				rs_shared_destroy_qp(rs);
+			} else {
+				ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+				rdma_destroy_qp(rs->cm_id);
+			}
 		}
-
-		fastlock_acquire(&rs->slock);
-		ret = connect(rs->udp_sock, addr, addrlen);
-		if (!ret)
-			ret = ds_get_dest(rs, addr, addrlen, &rs->conn_dest);
-		fastlock_release(&rs->slock);
+		rdma_destroy_id(rs->cm_id);
 	}
-	return ret;
+
+	if (rs->shared)
+		rs_shared_leave(rs);
+
+	fastlock_destroy(&rs->map_lock);
+	fastlock_destroy(&rs->cq_wait_lock);
+	fastlock_destroy(&rs->cq_lock);
+	fastlock_destroy(&rs->rlock);
+	fastlock_destroy(&rs->slock);
+	free(rs);
 }
 
-static void *rs_get_ctrl_buf(struct rsocket *rs)
+static size_t rs_conn_data_offset(struct rsocket *rs)
 {
-	return rs->sbuf + rs->sbuf_size +
-		RS_MAX_CTRL_MSG * (rs->ctrl_seqno & (RS_QP_CTRL_SIZE - 1));
+	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
+		sizeof(struct ib_connect_hdr) : 0;
 }
 
-static int rs_post_msg(struct rsocket *rs, uint32_t msg)
+static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 {
-	struct ibv_send_wr wr, *bad;
-	struct ibv_sge sge;
+	conn->version = 1;
+	conn->flags = RS_CONN_FLAG_IOMAP |
+		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
+	conn->credits = htobe16(rs->rq_size);
+	memset(conn->reserved, 0, sizeof conn->reserved);
+	conn->target_iomap_size = (uint8_t) rs_value_to_scale(rs->target_iomap_size, 8);
 
-	wr.wr_id = rs_send_wr_id(msg);
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-		wr.send_flags = 0;
-		wr.imm_data = htobe32(msg);
-	} else {
-		sge.addr = (uintptr_t) &msg;
-		sge.lkey = 0;
-		sge.length = sizeof msg;
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		wr.opcode = IBV_WR_SEND;
-		wr.send_flags = IBV_SEND_INLINE;
-	}
+	conn->target_sgl.addr = (__force uint64_t)htobe64((uintptr_t) rs->target_sgl);
+	conn->target_sgl.length = (__force uint32_t)htobe32(RS_SGL_SIZE);
+	conn->target_sgl.key = (__force uint32_t)htobe32(rs->target_mr->rkey);
 
-	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+	conn->data_buf.addr = (__force uint64_t)htobe64((uintptr_t) rs->rbuf);
+	conn->data_buf.length = (__force uint32_t)htobe32(rs->rbuf_size >> 1);
+	conn->data_buf.key = (__force uint32_t)htobe32(rs->rmr->rkey);
 }
 
-static int rs_post_write(struct rsocket *rs,
-			 struct ibv_sge *sgl, int nsge,
-			 uint32_t wr_data, int flags,
-			 uint64_t addr, uint32_t rkey)
+static void rs_save_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
 {
-	struct ibv_send_wr wr, *bad;
+	rs->remote_sgl.addr = be64toh((__force __be64)conn->target_sgl.addr);
+	rs->remote_sgl.length = be32toh((__force __be32)conn->target_sgl.length);
+	rs->remote_sgl.key = be32toh((__force __be32)conn->target_sgl.key);
+	rs->remote_sge = 1;
+	if ((rs_host_is_net() && !(conn->flags & RS_CONN_FLAG_NET)) ||
+	    (!rs_host_is_net() && (conn->flags & RS_CONN_FLAG_NET)))
+		rs->opts |= RS_OPT_SWAP_SGL;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
-	wr.next = NULL;
-	wr.sg_list = sgl;
-	wr.num_sge = nsge;
-	wr.opcode = IBV_WR_RDMA_WRITE;
-	wr.send_flags = flags;
-	wr.wr.rdma.remote_addr = addr;
-	wr.wr.rdma.rkey = rkey;
-
-	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
-}
-
-static int rs_post_write_msg(struct rsocket *rs,
-			 struct ibv_sge *sgl, int nsge,
-			 uint32_t msg, int flags,
-			 uint64_t addr, uint32_t rkey)
-{
-	struct ibv_send_wr wr, *bad;
-	struct ibv_sge sge;
-	int ret;
-
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_send_wr_id(msg);
-		wr.sg_list = sgl;
-		wr.num_sge = nsge;
-		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-		wr.send_flags = flags;
-		wr.imm_data = htobe32(msg);
-		wr.wr.rdma.remote_addr = addr;
-		wr.wr.rdma.rkey = rkey;
+	if (conn->flags & RS_CONN_FLAG_IOMAP) {
+		rs->remote_iomap.addr = rs->remote_sgl.addr +
+					sizeof(rs->remote_sgl) * rs->remote_sgl.length;
+		rs->remote_iomap.length = rs_scale_to_value(conn->target_iomap_size, 8);
+		rs->remote_iomap.key = rs->remote_sgl.key;
+	}
 
-		return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
-	} else {
-		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
-		if (!ret) {
-			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
-				   RS_WR_ID_FLAG_MSG_SEND;
-			sge.addr = (uintptr_t) &msg;
-			sge.lkey = 0;
-			sge.length = sizeof msg;
-			wr.sg_list = &sge;
-			wr.num_sge = 1;
-			wr.opcode = IBV_WR_SEND;
-			wr.send_flags = IBV_SEND_INLINE;
+	rs->target_sgl[0].addr = be64toh((__force __be64)conn->data_buf.addr);
+	rs->target_sgl[0].length = be32toh((__force __be32)conn->data_buf.length);
+	rs->target_sgl[0].key = be32toh((__force __be32)conn->data_buf.key);
 
-			ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
-		}
-		return ret;
-	}
+	rs->sseq_comp = be16toh(conn->credits);
 }
 
-static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
-			uint32_t wr_data)
+static int ds_init(struct rsocket *rs, int domain)
 {
-	struct ibv_send_wr wr, *bad;
+	rs->udp_sock = socket(domain, SOCK_DGRAM, 0);
+	if (rs->udp_sock < 0)
+		return rs->udp_sock;
 
-	wr.wr_id = rs_send_wr_id(wr_data);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 1;
-	wr.opcode = IBV_WR_SEND;
-	wr.send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
-	wr.wr.ud.ah = rs->conn_dest->ah;
-	wr.wr.ud.remote_qpn = rs->conn_dest->qpn;
-	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+	rs->epfd = epoll_create(2);
+	if (rs->epfd < 0)
+		return rs->epfd;
 
-	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
+	return 0;
 }
 
-/*
- * Update target SGE before sending data.  Otherwise the remote side may
- * update the entry before we do.
- */
-static int rs_write_data(struct rsocket *rs,
-			 struct ibv_sge *sgl, int nsge,
-			 uint32_t length, int flags)
+static int ds_init_ep(struct rsocket *rs)
 {
-	uint64_t addr;
-	uint32_t rkey;
-
-	rs->sseq_no++;
-	rs->sqe_avail--;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		rs->sqe_avail--;
-	rs->sbuf_bytes_avail -= length;
+	struct ds_smsg *msg;
+	int i, ret;
 
-	addr = rs->target_sgl[rs->target_sge].addr;
-	rkey = rs->target_sgl[rs->target_sge].key;
+	ds_set_qp_size(rs);
 
-	rs->target_sgl[rs->target_sge].addr += length;
-	rs->target_sgl[rs->target_sge].length -= length;
+	rs->sbuf = calloc(rs->sq_size, RS_SNDLOWAT);
+	if (!rs->sbuf)
+		return ERR(ENOMEM);
 
-	if (!rs->target_sgl[rs->target_sge].length) {
-		if (++rs->target_sge == RS_SGL_SIZE)
-			rs->target_sge = 0;
-	}
+	rs->dmsg = calloc(rs->rq_size + 1, sizeof(*rs->dmsg));
+	if (!rs->dmsg)
+		return ERR(ENOMEM);
 
-	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
-				 flags, addr, rkey);
-}
+	rs->sqe_avail = rs->sq_size;
+	rs->rqe_avail = rs->rq_size;
 
-static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t offset,
-			   struct ibv_sge *sgl, int nsge, uint32_t length, int flags)
-{
-	uint64_t addr;
+	rs->smsg_free = (struct ds_smsg *) rs->sbuf;
+	msg = rs->smsg_free;
+	for (i = 0; i < rs->sq_size - 1; i++) {
+		msg->next = (void *) msg + RS_SNDLOWAT;
+		msg = msg->next;
+	}
+	msg->next = NULL;
 
-	rs->sqe_avail--;
-	rs->sbuf_bytes_avail -= length;
+	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
+	if (ret)
+		return ret;
 
-	addr = iom->sge.addr + offset - iom->offset;
-	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
-			     flags, addr, iom->sge.key);
+	rs->state = rs_readable | rs_writable;
+	return 0;
 }
 
-static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
-			  struct ibv_sge *sgl, int nsge, int flags)
+int rsocket(int domain, int type, int protocol)
 {
-	uint64_t addr;
-
-	rs->sseq_no++;
-	rs->sqe_avail--;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		rs->sqe_avail--;
-	rs->sbuf_bytes_avail -= sizeof(struct rs_iomap);
-
-	addr = rs->remote_iomap.addr + iomr->index * sizeof(struct rs_iomap);
-	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_IOMAP_SGL, iomr->index),
-				 flags, addr, rs->remote_iomap.key);
-}
+	struct rsocket *rs;
+	int index, ret;
 
-static uint32_t rs_sbuf_left(struct rsocket *rs)
-{
-	return (uint32_t) (((uint64_t) (uintptr_t) &rs->sbuf[rs->sbuf_size]) -
-			   rs->ssgl[0].addr);
-}
+	if ((domain != AF_INET && domain != AF_INET6 && domain != AF_IB) ||
+	    ((type != SOCK_STREAM) && (type != SOCK_DGRAM)) ||
+	    (type == SOCK_STREAM && protocol && protocol != IPPROTO_TCP) ||
+	    (type == SOCK_DGRAM && protocol && protocol != IPPROTO_UDP))
+		return ERR(ENOTSUP);
 
-static void rs_send_credits(struct rsocket *rs)
-{
-	struct ibv_sge ibsge;
-	struct rs_sge sge, *sge_buf;
-	int flags;
+	rs_configure();
+	rs = rs_alloc(NULL, type);
+	if (!rs)
+		return ERR(ENOMEM);
 
-	rs->ctrl_seqno++;
-	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
-		if (rs->opts & RS_OPT_MSG_SEND)
-			rs->ctrl_seqno++;
+	if (type == SOCK_STREAM) {
+		ret = rdma_create_id(NULL, &rs->cm_id, rs, RDMA_PS_TCP);
+		if (ret)
+			goto err;
 
-		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
-			sge.key = rs->rmr->rkey;
-			sge.length = rs->rbuf_size >> 1;
-		} else {
-			sge.addr = bswap_64((uintptr_t) &rs->rbuf[rs->rbuf_free_offset]);
-			sge.key = bswap_32(rs->rmr->rkey);
-			sge.length = bswap_32(rs->rbuf_size >> 1);
-		}
+		rs->cm_id->route.addr.src_addr.sa_family = domain;
+		index = rs->cm_id->channel->fd;
+	} else {
+		ret = ds_init(rs, domain);
+		if (ret)
+			goto err;
 
-		if (rs->sq_inline < sizeof sge) {
-			sge_buf = rs_get_ctrl_buf(rs);
-			memcpy(sge_buf, &sge, sizeof sge);
-			ibsge.addr = (uintptr_t) sge_buf;
-			ibsge.lkey = rs->smr->lkey;
-			flags = 0;
-		} else {
-			ibsge.addr = (uintptr_t) &sge;
-			ibsge.lkey = 0;
-			flags = IBV_SEND_INLINE;
-		}
-		ibsge.length = sizeof(sge);
+		index = rs->udp_sock;
+	}
 
-		rs_post_write_msg(rs, &ibsge, 1,
-			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size), flags,
-			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
-			rs->remote_sgl.key);
+	ret = rs_insert(rs, index);
+	if (ret < 0)
+		goto err;
 
-		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
-		rs->rbuf_free_offset += rs->rbuf_size >> 1;
-		if (rs->rbuf_free_offset >= rs->rbuf_size)
-			rs->rbuf_free_offset = 0;
-		if (++rs->remote_sge == rs->remote_sgl.length)
-			rs->remote_sge = 0;
-	} else {
-		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
-	}
-}
+	return rs->index;
 
-static inline int rs_ctrl_avail(struct rsocket *rs)
-{
-	return rs->ctrl_seqno != rs->ctrl_max_seqno;
+err:
+	rs_free(rs);
+	return ret;
 }
 
-/* Protocols that do not support RDMA write with immediate may require 2 msgs */
-static inline int rs_2ctrl_avail(struct rsocket *rs)
+int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen)
 {
-	return (int)((rs->ctrl_seqno + 1) - rs->ctrl_max_seqno) < 0;
-}
+	struct rsocket *rs;
+	int ret;
 
-static int rs_give_credits(struct rsocket *rs)
-{
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
-		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		ret = rdma_bind_addr(rs->cm_id, (struct sockaddr *) addr);
+		if (!ret)
+			rs->state = rs_bound;
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
-			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
-		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+		ret = bind(rs->udp_sock, addr, addrlen);
 	}
+	return ret;
 }
 
-static void rs_update_credits(struct rsocket *rs)
+int rlisten(int socket, int backlog)
 {
-	if (rs_give_credits(rs))
-		rs_send_credits(rs);
-}
-
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+
+	if (rs->state != rs_listening) {
+		ret = rdma_listen(rs->cm_id, backlog);
+		if (!ret)
+			rs->state = rs_listening;
+	} else {
+		ret = 0;
+	}
+	return ret;
+}
+
+/*
+ * Nonblocking is usually not inherited between sockets, but we need to
+ * inherit it here to establish the connection only.  This is needed to
+ * prevent rdma_accept from blocking until the remote side finishes
+ * establishing the connection.  If we were to allow rdma_accept to block,
+ * then a single thread cannot establish a connection with itself, or
+ * two threads which try to connect to each other can deadlock trying to
+ * form a connection.
+ *
+ * Data transfers on the new socket remain blocking unless the user
+ * specifies otherwise through rfcntl.
+ */
+int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct rsocket *rs, *new_rs;
+	struct rdma_conn_param param;
+	struct rs_conn_data *creq, cresp;
+	int ret;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	new_rs = rs_alloc(rs, rs->type);
+	if (!new_rs)
+		return ERR(ENOMEM);
+
+	ret = rdma_get_request(rs->cm_id, &new_rs->cm_id);
+	if (ret)
+		goto err;
+
+	ret = rs_insert(new_rs, new_rs->cm_id->channel->fd);
+	if (ret < 0)
+		goto err;
+
+	creq = (struct rs_conn_data *)
+	       (new_rs->cm_id->event->param.conn.private_data + rs_conn_data_offset(rs));
+	if (creq->version != 1) {
+		ret = ERR(ENOTSUP);
+		goto err;
+	}
+
+	if (rs->fd_flags & O_NONBLOCK)
+		set_fd_nonblock(new_rs->cm_id->channel->fd, true);
+
+	ret = rs_create_ep(new_rs);
+	if (ret)
+		goto err;
+
+	rs_save_conn_data(new_rs, creq);
+	param = new_rs->cm_id->event->param.conn;
+	rs_format_conn_data(new_rs, &cresp);
+	param.private_data = &cresp;
+	param.private_data_len = sizeof cresp;
+	ret = rdma_accept(new_rs->cm_id, &param);
+	if (!ret)
+		new_rs->state = rs_connect_rdwr;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		new_rs->state = rs_accepting;
+	else
+		goto err;
+
+	if (addr && addrlen)
+		rgetpeername(new_rs->index, addr, addrlen);
+	return new_rs->index;
+
+err:
+	rs_free(new_rs);
+	return ret;
+}
+
+static int rs_do_connect(struct rsocket *rs)
+{
+	struct rdma_conn_param param;
+	struct rs_conn_private_data cdata;
+	struct rs_conn_data *creq, *cresp;
+	int to, ret;
+
+	switch (rs->state) {
+	case rs_init:
+	case rs_bound:
+resolve_addr:
+		to = 1000 << rs->retries++;
+		ret = rdma_resolve_addr(rs->cm_id, NULL,
+					&rs->cm_id->route.addr.dst_addr, to);
+		if (!ret)
+			goto resolve_route;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			rs->state = rs_resolving_addr;
+		break;
+	case rs_resolving_addr:
+		ret = ucma_complete(rs->cm_id);
+		if (ret) {
+			if (errno == ETIMEDOUT && rs->retries <= RS_CONN_RETRIES)
+				goto resolve_addr;
+			break;
+		}
+
+		rs->retries = 0;
+resolve_route:
+		to = 1000 << rs->retries++;
+		if (rs->optval) {
+			ret = rdma_set_option(rs->cm_id,  RDMA_OPTION_IB,
+					      RDMA_OPTION_IB_PATH, rs->optval,
+					      rs->optlen);
+			free(rs->optval);
+			rs->optval = NULL;
+			if (!ret) {
+				rs->state = rs_resolving_route;
+				goto resolving_route;
+			}
+		} else {
+			ret = rdma_resolve_route(rs->cm_id, to);
+			if (!ret)
+				goto do_connect;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			rs->state = rs_resolving_route;
+		break;
+	case rs_resolving_route:
+resolving_route:
+		ret = ucma_complete(rs->cm_id);
+		if (ret) {
+			if (errno == ETIMEDOUT && rs->retries <= RS_CONN_RETRIES)
+				goto resolve_route;
+			break;
+		}
+do_connect:
+		ret = rs_create_ep(rs);
+		if (ret)
+			break;
+
+		memset(&param, 0, sizeof param);
+		creq = (void *) &cdata + rs_conn_data_offset(rs);
+		rs_format_conn_data(rs, creq);
+		param.private_data = (void *) creq - rs_conn_data_offset(rs);
+		param.private_data_len = sizeof(*creq) + rs_conn_data_offset(rs);
+		param.flow_control = 1;
+		param.retry_count = 7;
+		param.rnr_retry_count = 7;
+		/* work-around: iWarp issues RDMA read during connection */
+		if (rs->opts & RS_OPT_MSG_SEND)
+			param.initiator_depth = 1;
+		rs->retries = 0;
+
+		ret = rdma_connect(rs->cm_id, &param);
+		if (!ret)
+			goto connected;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			rs->state = rs_connecting;
+		break;
+	case rs_connecting:
+		ret = ucma_complete(rs->cm_id);
+		if (ret)
+			break;
+connected:
+		cresp = (struct rs_conn_data *) rs->cm_id->event->param.conn.private_data;
+		if (cresp->version != 1) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		rs_save_conn_data(rs, cresp);
+		rs->state = rs_connect_rdwr;
+		break;
+	case rs_accepting:
+		if (!(rs->fd_flags & O_NONBLOCK))
+			set_fd_nonblock(rs->cm_id->channel->fd, true);
+
+		ret = ucma_complete(rs->cm_id);
+		if (ret)
+			break;
+
+		rs->state = rs_connect_rdwr;
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
+	}
+
+	if (ret) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			errno = EINPROGRESS;
+		} else {
+			rs->state = rs_connect_error;
+			rs->err = errno;
+		}
+	}
+	return ret;
+}
+
+static int rs_any_addr(const union socket_addr *addr)
+{
+	if (addr->sa.sa_family == AF_INET) {
+		return (addr->sin.sin_addr.s_addr == htobe32(INADDR_ANY) ||
+			addr->sin.sin_addr.s_addr == htobe32(INADDR_LOOPBACK));
+	} else {
+		return (!memcmp(&addr->sin6.sin6_addr, &in6addr_any, 16) ||
+			!memcmp(&addr->sin6.sin6_addr, &in6addr_loopback, 16));
+	}
+}
+
+static int ds_get_src_addr(struct rsocket *rs,
+			   const struct sockaddr *dest_addr, socklen_t dest_len,
+			   union socket_addr *src_addr, socklen_t *src_len)
+{
+	int sock, ret;
+	__be16 port;
+
+	*src_len = sizeof(*src_addr);
+	ret = getsockname(rs->udp_sock, &src_addr->sa, src_len);
+	if (ret || !rs_any_addr(src_addr))
+		return ret;
+
+	port = src_addr->sin.sin_port;
+	sock = socket(dest_addr->sa_family, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return sock;
+
+	ret = connect(sock, dest_addr, dest_len);
+	if (ret)
+		goto out;
+
+	*src_len = sizeof(*src_addr);
+	ret = getsockname(sock, &src_addr->sa, src_len);
+	src_addr->sin.sin_port = port;
+out:
+	close(sock);
+	return ret;
+}
+
+static void ds_format_hdr(struct ds_header *hdr, union socket_addr *addr)
+{
+	if (addr->sa.sa_family == AF_INET) {
+		hdr->version = 4;
+		hdr->length = DS_IPV4_HDR_LEN;
+		hdr->port = addr->sin.sin_port;
+		hdr->addr.ipv4 = addr->sin.sin_addr.s_addr;
+	} else {
+		hdr->version = 6;
+		hdr->length = DS_IPV6_HDR_LEN;
+		hdr->port = addr->sin6.sin6_port;
+		hdr->addr.ipv6.flowinfo= addr->sin6.sin6_flowinfo;
+		memcpy(&hdr->addr.ipv6.addr, &addr->sin6.sin6_addr, 16);
+	}
+}
+
+static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
+			  socklen_t addrlen)
+{
+	struct ibv_port_attr port_attr;
+	struct ibv_ah_attr attr;
+	int ret;
+
+	memcpy(&qp->dest.addr, addr, addrlen);
+	qp->dest.qp = qp;
+	qp->dest.qpn = qp->cm_id->qp->qp_num;
+
+	ret = ibv_query_port(qp->cm_id->verbs, qp->cm_id->port_num, &port_attr);
+	if (ret)
+		return ret;
+
+	memset(&attr, 0, sizeof attr);
+	attr.dlid = port_attr.lid;
+	attr.port_num = qp->cm_id->port_num;
+	qp->dest.ah = ibv_create_ah(qp->cm_id->pd, &attr);
+	if (!qp->dest.ah)
+		return ERR(ENOMEM);
+
+	return ds_insert_dest(qp->rs, &qp->dest);
+}
+
+static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
+			socklen_t addrlen, struct ds_qp **new_qp)
+{
+	struct ds_qp *qp;
+	struct ibv_qp_init_attr qp_attr;
+	struct epoll_event event;
+	int i, ret;
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return ERR(ENOMEM);
+
+	qp->rs = rs;
+	ret = rdma_create_id(NULL, &qp->cm_id, qp, RDMA_PS_UDP);
+	if (ret)
+		goto err;
+
+	ds_format_hdr(&qp->hdr, src_addr);
+	ret = rdma_bind_addr(qp->cm_id, &src_addr->sa);
+	if (ret)
+		goto err;
+
+	ret = ds_init_bufs(qp);
+	if (ret)
+		goto err;
+
+	ret = rs_create_cq(rs, qp->cm_id);
+	if (ret)
+		goto err;
+
+	memset(&qp_attr, 0, sizeof qp_attr);
+	qp_attr.qp_context = qp;
+	qp_attr.send_cq = qp->cm_id->send_cq;
+	qp_attr.recv_cq = qp->cm_id->recv_cq;
+	qp_attr.qp_type = IBV_QPT_UD;
+	qp_attr.sq_sig_all = 0;
+	qp_attr.cap.max_send_wr = rs->sq_size;
+	qp_attr.cap.max_recv_wr = rs->rq_size;
+	qp_attr.cap.max_send_sge = 1;
+	qp_attr.cap.max_recv_sge = 2;
+	qp_attr.cap.max_inline_data = rs->sq_inline;
+	ret = rdma_create_qp(qp->cm_id, NULL, &qp_attr);
+	if (ret)
+		goto err;
+
+	rs->sq_inline = qp_attr.cap.max_inline_data;
+	ret = ds_add_qp_dest(qp, src_addr, addrlen);
+	if (ret)
+		goto err;
+
+	event.events = EPOLLIN;
+	event.data.ptr = qp;
+	ret = epoll_ctl(rs->epfd,  EPOLL_CTL_ADD,
+			qp->cm_id->recv_cq_channel->fd, &event);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < rs->rq_size; i++) {
+		ret = ds_post_recv(rs, qp, i * RS_SNDLOWAT);
+		if (ret)
+			goto err;
+	}
+
+	ds_insert_qp(rs, qp);
+	*new_qp = qp;
+	return 0;
+err:
+	ds_free_qp(qp);
+	return ret;
+}
+
+static int ds_get_qp(struct rsocket *rs, union socket_addr *src_addr,
+		     socklen_t addrlen, struct ds_qp **qp)
+{
+	if (rs->qp_list) {
+		*qp = rs->qp_list;
+		do {
+			if (!ds_compare_addr(rdma_get_local_addr((*qp)->cm_id),
+					     src_addr))
+				return 0;
+
+			*qp = ds_next_qp(*qp);
+		} while (*qp != rs->qp_list);
+	}
+
+	return ds_create_qp(rs, src_addr, addrlen, qp);
+}
+
+static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
+		       socklen_t addrlen, struct ds_dest **dest)
+{
+	union socket_addr src_addr;
+	socklen_t src_len;
+	struct ds_qp *qp;
+	struct ds_dest *new_dest;
+	int ret = 0;
+
+	fastlock_acquire(&rs->map_lock);
+	*dest = ds_find_dest(rs, addr);
+	if (*dest)
+		goto out;
+
+	ret = ds_get_src_addr(rs, addr, addrlen, &src_addr, &src_len);
+	if (ret)
+		goto out;
+
+	ret = ds_get_qp(rs, &src_addr, src_len, &qp);
+	if (ret)
+		goto out;
+
+	*dest = ds_find_dest(rs, addr);
+	if (!*dest) {
+		new_dest = calloc(1, sizeof(*new_dest));
+		if (!new_dest) {
+			ret = ERR(ENOMEM);
+			goto out;
+		}
+
+		memcpy(&new_dest->addr, addr, addrlen);
+		new_dest->qp = qp;
+		ret = ds_insert_dest(rs, new_dest);
+		if (ret) {
+			free(new_dest);
+			goto out;
+		}
+		*dest = new_dest;
+	}
+out:
+	fastlock_release(&rs->map_lock);
+	return ret;
+}
+
+int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_lookup(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		memcpy(&rs->cm_id->route.addr.dst_addr, addr, addrlen);
+		ret = rs_do_connect(rs);
+	} else {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+
+		fastlock_acquire(&rs->slock);
+		ret = connect(rs->udp_sock, addr, addrlen);
+		if (!ret)
+			ret = ds_get_dest(rs, addr, addrlen, &rs->conn_dest);
+		fastlock_release(&rs->slock);
+	}
+	return ret;
+}
+
+static void *rs_get_ctrl_buf(struct rsocket *rs)
+{
+	return rs->sbuf + rs->sbuf_size +
+		RS_MAX_CTRL_MSG * (rs->ctrl_seqno & (RS_QP_CTRL_SIZE - 1));
+}
+
+/*
+ * Data writes are only signaled periodically.  A signaled send records the
+ * send queue entries and send buffer space held by the unsignaled sends
+ * that precede it, which are released when its completion is reaped.
+ * Unsignaled sends are flagged in their wr_id, so that completions
+ * generated for them on error are recognized.
+ */
+static void rs_track_send(struct rsocket *rs, struct ibv_send_wr *wr)
+{
+	struct rs_sig_batch *batch;
+
+	if (!(wr->send_flags & IBV_SEND_SIGNALED)) {
+		wr->wr_id |= RS_WR_ID_FLAG_UNSIG;
+		rs->unsig_sqe++;
+		rs->unsig_bytes += rs_msg_data(rs_wr_data(wr->wr_id));
+		return;
+	}
+
+	batch = &rs->sig_fifo[rs->sig_tail];
+	batch->sqe = rs->unsig_sqe;
+	batch->bytes = rs->unsig_bytes;
+	if (++rs->sig_tail == rs->sq_size)
+		rs->sig_tail = 0;
+	rs->unsig_sqe = 0;
+	rs->unsig_bytes = 0;
+}
+
+static void rs_retire_sends(struct rsocket *rs)
+{
+	struct rs_sig_batch *batch;
+
+	batch = &rs->sig_fifo[rs->sig_head];
+	if (++rs->sig_head == rs->sq_size)
+		rs->sig_head = 0;
+	rs->sqe_avail += batch->sqe;
+	rs->sbuf_bytes_avail += batch->bytes;
+}
+
+/*
+ * Signal a data write if enough unsignaled writes have built up, or if the
+ * write leaves too few resources to send again, in which case the sender
+ * may block waiting for this write to complete.
+ */
+static int rs_need_signal(struct rsocket *rs, uint32_t length)
+{
+	return (rs->opts & RS_OPT_MSG_SEND) ||
+	       (rs->unsig_sqe + 1 >= RS_SIG_INTERVAL) ||
+	       (rs->unsig_bytes + length >= (rs->sbuf_size >> 2)) ||
+	       (rs->sqe_avail < RS_SIG_INTERVAL) ||
+	       (rs->sbuf_bytes_avail < RS_SNDLOWAT);
+}
+
+static int rs_post_msg(struct rsocket *rs, uint32_t msg)
+{
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+
+	wr.wr_id = rs_send_wr_id(msg);
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.sg_list = NULL;
+		wr.num_sge = 0;
+		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		wr.send_flags = IBV_SEND_SIGNALED;
+		wr.imm_data = htobe32(msg);
+	} else {
+		sge.addr = (uintptr_t) &msg;
+		sge.lkey = 0;
+		sge.length = sizeof msg;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = IBV_WR_SEND;
+		wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+	}
+
+	rs_track_send(rs, &wr);
+	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+}
+
+static int rs_post_write(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t wr_data, int flags,
+			 uint64_t addr, uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad;
+
+	wr.wr_id = rs_send_wr_id(wr_data);
+	wr.next = NULL;
+	wr.sg_list = sgl;
+	wr.num_sge = nsge;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = flags;
+	wr.wr.rdma.remote_addr = addr;
+	wr.wr.rdma.rkey = rkey;
+
+	rs_track_send(rs, &wr);
+	return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+}
+
+static int rs_post_write_msg(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t msg, int flags,
+			 uint64_t addr, uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	int ret;
+
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.wr_id = rs_send_wr_id(msg);
+		wr.sg_list = sgl;
+		wr.num_sge = nsge;
+		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		wr.send_flags = flags;
+		wr.imm_data = htobe32(msg);
+		wr.wr.rdma.remote_addr = addr;
+		wr.wr.rdma.rkey = rkey;
+
+		rs_track_send(rs, &wr);
+		return rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+	} else {
+		ret = rs_post_write(rs, sgl, nsge, msg, flags, addr, rkey);
+		if (!ret) {
+			wr.wr_id = rs_send_wr_id(rs_msg_set(rs_msg_op(msg), 0)) |
+				   RS_WR_ID_FLAG_MSG_SEND;
+			sge.addr = (uintptr_t) &msg;
+			sge.lkey = 0;
+			sge.length = sizeof msg;
+			wr.sg_list = &sge;
+			wr.num_sge = 1;
+			wr.opcode = IBV_WR_SEND;
+			wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+
+			rs_track_send(rs, &wr);
+			ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+		}
+		return ret;
+	}
+}
+
+/*
+ * Datagram sends are signaled periodically.  Each send message buffer is
+ * only in use by one send, so a completion releases every send posted to
+ * the QP up to and including the one identified by its wr_id.
+ */
+static void ds_init_send_wr(struct rsocket *rs, struct ibv_send_wr *wr,
+			    struct ibv_sge *sge, uint32_t wr_data)
+{
+	struct ds_qp *qp = rs->conn_dest->qp;
+
+	qp->sq_ring[qp->sq_tail] = wr_data;
+	if (++qp->sq_tail == rs->sq_size)
+		qp->sq_tail = 0;
+
+	wr->wr_id = rs_send_wr_id(wr_data);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_SEND;
+	wr->send_flags = (sge->length <= rs->sq_inline) ? IBV_SEND_INLINE : 0;
+	if (++qp->sq_unsig >= RS_SIG_INTERVAL || rs->sqe_avail < RS_SIG_INTERVAL) {
+		wr->send_flags |= IBV_SEND_SIGNALED;
+		qp->sq_unsig = 0;
+	}
+	rs->stats.send_bytes += sge->length;
+	wr->wr.ud.ah = rs->conn_dest->ah;
+	wr->wr.ud.remote_qpn = rs->conn_dest->qpn;
+	wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+}
+
+static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
+			uint32_t wr_data)
+{
+	struct ibv_send_wr wr, *bad;
+
+	ds_init_send_wr(rs, &wr, sge, wr_data);
+	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
+}
+
+/*
+ * Adds the number of sends posted to sent.  Sends that fail to post are
+ * taken back off the send ring, and their buffers and send queue entries
+ * released.  The next send is then signaled, as the send that would have
+ * released the unsignaled sends before it may be among them.
+ */
+static int ds_flush_sends(struct ds_send_batch *batch, unsigned int *sent)
+{
+	struct ds_qp *qp = batch->qp;
+	struct rsocket *rs = qp->rs;
+	struct ibv_send_wr *bad;
+	struct ds_smsg *smsg;
+	int i, posted, ret;
+
+	if (!batch->cnt)
+		return 0;
+
+	for (i = 0; i < batch->cnt - 1; i++)
+		batch->wr[i].next = &batch->wr[i + 1];
+	batch->wr[i].next = NULL;
+	ret = ibv_post_send(qp->cm_id->qp, batch->wr, &bad);
+	posted = ret ? bad - batch->wr : batch->cnt;
+	*sent += posted;
+
+	for (i = batch->cnt - 1; i >= posted; i--) {
+		if (--qp->sq_tail < 0)
+			qp->sq_tail = rs->sq_size - 1;
+		smsg = (struct ds_smsg *) (uintptr_t) batch->sge[i].addr;
+		smsg->next = rs->smsg_free;
+		rs->smsg_free = smsg;
+		rs->sqe_avail++;
+		rs->stats.send_bytes -= batch->sge[i].length;
+	}
+	if (posted < batch->cnt)
+		qp->sq_unsig = RS_SIG_INTERVAL;
+
+	batch->cnt = 0;
+	return rdma_seterrno(ret);
+}
+
+/*
+ * Update target SGE before sending data.  Otherwise the remote side may
+ * update the entry before we do.
+ */
+static int rs_write_data(struct rsocket *rs,
+			 struct ibv_sge *sgl, int nsge,
+			 uint32_t length, int flags)
+{
+	uint64_t addr;
+	uint32_t rkey;
+
+	rs->sseq_no++;
+	rs->sqe_avail--;
+	if (rs->opts & RS_OPT_MSG_SEND)
+		rs->sqe_avail--;
+	rs->sbuf_bytes_avail -= length;
+	rs->stats.send_bytes += length;
+	rs->stats.writes++;
+	if (flags & IBV_SEND_INLINE)
+		rs->stats.inline_writes++;
+	if (rs_need_signal(rs, length))
+		flags |= IBV_SEND_SIGNALED;
+
+	addr = rs->target_sgl[rs->target_sge].addr;
+	rkey = rs->target_sgl[rs->target_sge].key;
+
+	rs->target_sgl[rs->target_sge].addr += length;
+	rs->target_sgl[rs->target_sge].length -= length;
+
+	if (!rs->target_sgl[rs->target_sge].length) {
+		if (++rs->target_sge == RS_SGL_SIZE)
+			rs->target_sge = 0;
+	}
+
+	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
+				 flags, addr, rkey);
+}
+
+static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t offset,
+			   struct ibv_sge *sgl, int nsge, uint32_t length, int flags)
+{
+	uint64_t addr;
+
+	rs->sqe_avail--;
+	rs->sbuf_bytes_avail -= length;
+	rs->stats.send_bytes += length;
+	rs->stats.writes++;
+	if (flags & IBV_SEND_INLINE)
+		rs->stats.inline_writes++;
+
+	addr = iom->sge.addr + offset - iom->offset;
+	return rs_post_write(rs, sgl, nsge, rs_msg_set(RS_OP_WRITE, length),
+			     flags | IBV_SEND_SIGNALED, addr, iom->sge.key);
+}
+
+static int rs_write_iomap(struct rsocket *rs, struct rs_iomap_mr *iomr,
+			  struct ibv_sge *sgl, int nsge, int flags)
+{
+	uint64_t addr;
+
+	rs->sseq_no++;
+	rs->sqe_avail--;
+	if (rs->opts & RS_OPT_MSG_SEND)
+		rs->sqe_avail--;
+	rs->sbuf_bytes_avail -= sizeof(struct rs_iomap);
+
+	addr = rs->remote_iomap.addr + iomr->index * sizeof(struct rs_iomap);
+	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_IOMAP_SGL, iomr->index),
+				 flags | IBV_SEND_SIGNALED, addr, rs->remote_iomap.key);
+}
+
+static uint32_t rs_sbuf_left(struct rsocket *rs)
+{
+	return (uint32_t) (((uint64_t) (uintptr_t) &rs->sbuf[rs->sbuf_size]) -
+			   rs->ssgl[0].addr);
+}
+
+/* Autotuning samples intervals, which must not follow clock steps */
+static uint64_t rs_time_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Receive buffer autotuning.  Each time half of the receive buffer is
+ * advertised, we estimate the rate that the application drains the buffer
+ * and compare the resulting bandwidth-delay product against the buffer size.
+ * The round trip time is sampled from the time that an SGL is sent to a
+ * peer that had used all of its credits, until data using the SGL arrives.
+ * The buffer is grown while the peer stalls on credits and shrunk when the
+ * connection slows, but is never made smaller than its initial size.
+ *
+ * Because the peer writes directly into the receive buffer, a new buffer is
+ * only swapped in once all advertised space has been written and read.  Until
+ * then, further SGL updates are withheld.
+ */
+static void rs_rtt_sample(struct rsocket *rs)
+{
+	uint32_t rtt;
+
+	rtt = (uint32_t) (rs_time_us() - rs->rtt_stamp);
+	rs->rtt_us = rs->rtt_us ? (rs->rtt_us * 7 + rtt) >> 3 : rtt;
+	rs->rtt_stamp = 0;
+}
+
+static void rs_autotune(struct rsocket *rs, int stalled)
+{
+	uint64_t now, rate, bdp;
+	uint32_t size;
+
+	now = rs_time_us();
+	if (stalled)
+		rs->rtt_stamp = now;
+
+	if (!rs->sgl_stamp || now <= rs->sgl_stamp || rs->rbuf_resize)
+		goto out;
+
+	rate = ((uint64_t) (rs->rbuf_size >> 1) * 1000000) / (now - rs->sgl_stamp);
+	bdp = (rate * rs->rtt_us) / 1000000;
+	if (stalled && (bdp << 2) >= rs->rbuf_size && rs->rbuf_size < def_mem_max) {
+		size = min(rs->rbuf_size << 1, def_mem_max);
+		pthread_mutex_lock(&mut);
+		if (mem_autotuned + (size - rs->rbuf_size) <= mem_total) {
+			mem_autotuned += size - rs->rbuf_size;
+			rs->rbuf_resize = size;
+		}
+		pthread_mutex_unlock(&mut);
+	} else if (!stalled && (bdp << 3) < rs->rbuf_size &&
+		   rs->rbuf_size > rs->rbuf_min) {
+		rs->rbuf_resize = max(rs->rbuf_size >> 1, rs->rbuf_min);
+	}
+out:
+	rs->sgl_stamp = now;
+}
+
+/*
+ * Called once the peer has written, and the user has read, all advertised
+ * receive space.  Growth is reserved against mem_total when it is decided.
+ */
+static void rs_resize_rbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr = NULL;
+	uint8_t *buf;
+	uint32_t size;
+
+	size = rs->rbuf_resize;
+	rs->rbuf_resize = 0;
+
+	buf = calloc(size, 1);
+	if (buf)
+		mr = rdma_reg_write(rs->cm_id, buf, size);
+	if (!mr) {
+		free(buf);
+		if (size > rs->rbuf_size) {
+			pthread_mutex_lock(&mut);
+			mem_autotuned -= size - rs->rbuf_size;
+			pthread_mutex_unlock(&mut);
+		}
+		return;
+	}
+
+	rdma_dereg_mr(rs->rmr);
+	free(rs->rbuf);
+	if (size < rs->rbuf_size) {
+		pthread_mutex_lock(&mut);
+		mem_autotuned -= rs->rbuf_size - size;
+		pthread_mutex_unlock(&mut);
+	}
+
+	rs->rmr = mr;
+	rs->rbuf = buf;
+	rs->rbuf_size = size;
+	rs->rbuf_offset = 0;
+	rs->rbuf_free_offset = 0;
+	rs->rbuf_bytes_avail = size;
+}
+
+static int rs_sgl_avail(struct rsocket *rs)
+{
+	if (rs->rbuf_resize)
+		return rs->rbuf_bytes_avail == rs->rbuf_size;
+	return rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1);
+}
+
+static void rs_send_credits(struct rsocket *rs)
+{
+	struct ibv_sge ibsge;
+	struct rs_sge sge, *sge_buf;
+	int flags;
+
+	rs->ctrl_seqno++;
+	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
+	if (rs_sgl_avail(rs)) {
+		if (rs->rbuf_resize)
+			rs_resize_rbuf(rs);
+
+		if (rs->opts & RS_OPT_MSG_SEND)
+			rs->ctrl_seqno++;
+
+		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+			sge.addr = (uintptr_t) &rs->rbuf[rs->rbuf_free_offset];
+			sge.key = rs->rmr->rkey;
+			sge.length = rs->rbuf_size >> 1;
+		} else {
+			sge.addr = bswap_64((uintptr_t) &rs->rbuf[rs->rbuf_free_offset]);
+			sge.key = bswap_32(rs->rmr->rkey);
+			sge.length = bswap_32(rs->rbuf_size >> 1);
+		}
+
+		if (rs->sq_inline < sizeof sge) {
+			sge_buf = rs_get_ctrl_buf(rs);
+			memcpy(sge_buf, &sge, sizeof sge);
+			ibsge.addr = (uintptr_t) sge_buf;
+			ibsge.lkey = rs->smr->lkey;
+			flags = 0;
+		} else {
+			ibsge.addr = (uintptr_t) &sge;
+			ibsge.lkey = 0;
+			flags = IBV_SEND_INLINE;
+		}
+		ibsge.length = sizeof(sge);
+
+		rs_post_write_msg(rs, &ibsge, 1,
+			rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size),
+			flags | IBV_SEND_SIGNALED,
+			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
+			rs->remote_sgl.key);
+
+		if (rs->opts & RS_OPT_AUTOTUNE)
+			rs_autotune(rs, !rs->rbuf_inflight);
+
+		rs->rbuf_inflight += rs->rbuf_size >> 1;
+		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
+		rs->rbuf_free_offset += rs->rbuf_size >> 1;
+		if (rs->rbuf_free_offset >= rs->rbuf_size)
+			rs->rbuf_free_offset = 0;
+		if (++rs->remote_sge == rs->remote_sgl.length)
+			rs->remote_sge = 0;
+	} else {
+		rs_post_msg(rs, rs_msg_set(RS_OP_SGL, rs->rseq_no + rs->rq_size));
+	}
+}
+
+static inline int rs_ctrl_avail(struct rsocket *rs)
+{
+	return rs->ctrl_seqno != rs->ctrl_max_seqno;
+}
+
+/* Protocols that do not support RDMA write with immediate may require 2 msgs */
+static inline int rs_2ctrl_avail(struct rsocket *rs)
+{
+	return (int)((rs->ctrl_seqno + 1) - rs->ctrl_max_seqno) < 0;
+}
+
+static int rs_give_credits(struct rsocket *rs)
+{
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		return (rs_sgl_avail(rs) ||
+			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
+	} else {
+		return (rs_sgl_avail(rs) ||
+			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
+		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
+	}
+}
+
+static void rs_update_credits(struct rsocket *rs)
+{
+	if (rs_give_credits(rs))
+		rs_send_credits(rs);
+}
+
+/*
+ * Returns 1 if the completion consumed a receive, or -1 if the
+ * connection is no longer readable and processing should stop.
+ */
+static int rs_process_wc(struct rsocket *rs, struct ibv_wc *wc)
+{
+	uint32_t msg;
+
+	if (rs_wr_is_recv(wc->wr_id)) {
+		rs->stats.recv_cqes++;
+		if (wc->status != IBV_WC_SUCCESS)
+			return 0;
+
+		if (wc->wc_flags & IBV_WC_WITH_IMM) {
+			msg = be32toh(wc->imm_data);
+		} else {
+			msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
+				[rs_wr_data(wc->wr_id)];
+
+		}
+		switch (rs_msg_op(msg)) {
+		case RS_OP_SGL:
+			rs->sseq_comp = (uint16_t) rs_msg_data(msg);
+			break;
+		case RS_OP_IOMAP_SGL:
+			/* The iomap was updated, that's nice to know. */
+			break;
+		case RS_OP_CTRL:
+			if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
+				rs->state = rs_disconnected;
+				return -1;
+			} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
+				if (rs->state & rs_writable) {
+					rs->state &= ~rs_readable;
+				} else {
+					rs->state = rs_disconnected;
+					return -1;
+				}
+			}
+			break;
+		case RS_OP_WRITE:
+			/* We really shouldn't be here. */
+			break;
+		default:
+			rs->stats.recv_bytes += rs_msg_data(msg);
+			rs->rbuf_inflight -= rs_msg_data(msg);
+			if (rs->rtt_stamp)
+				rs_rtt_sample(rs);
+			rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
+			rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
+			if (++rs->rmsg_tail == rs->rq_size + 1)
+				rs->rmsg_tail = 0;
+			break;
+		}
+		return 1;
+	}
+
+	rs->stats.send_cqes++;
+	if (wc->wr_id & RS_WR_ID_FLAG_UNSIG) {
+		/* Reported on error only, retired by the next signaled send */
+		if (wc->status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+			rs->state = rs_error;
+			rs->err = EIO;
+		}
+		return 0;
+	}
+
+	rs_retire_sends(rs);
+	switch  (rs_msg_op(rs_wr_data(wc->wr_id))) {
+	case RS_OP_SGL:
+		rs->ctrl_max_seqno++;
+		break;
+	case RS_OP_CTRL:
+		rs->ctrl_max_seqno++;
+		if (rs_msg_data(rs_wr_data(wc->wr_id)) == RS_CTRL_DISCONNECT)
+			rs->state = rs_disconnected;
+		break;
+	case RS_OP_IOMAP_SGL:
+		rs->sqe_avail++;
+		if (!rs_wr_is_msg_send(wc->wr_id))
+			rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
+		break;
+	default:
+		rs->sqe_avail++;
+		rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc->wr_id));
+		break;
+	}
+	if (wc->status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
+		rs->state = rs_error;
+		rs->err = EIO;
+	}
+	return 0;
+}
+
+/* Caller must hold the group lock */
+static void rs_shared_queue_wc(struct rsocket *rs, struct ibv_wc *wc)
+{
+	struct rs_wc *swc;
+	int tail;
+
+	tail = rs->wcq_tail + 1;
+	if (tail == rs->wcq_size)
+		tail = 0;
+
+	/*
+	 * Sends are bounded by the send queue, and receives by the credits
+	 * given to the peer, so the peer has exceeded its credits.
+	 */
+	if (tail == rs->wcq_head) {
+		rs->wcq_overflow = 1;
+		return;
+	}
+
+	swc = &rs->wcq[rs->wcq_tail];
+	swc->wr_id = wc->wr_id;
+	swc->imm_data = wc->imm_data;
+	swc->status = wc->status;
+	swc->wc_flags = wc->wc_flags;
+	rs->wcq_tail = tail;
+}
+
+/*
+ * Poll the shared CQ, dispatching completions to their rsockets, then
+ * process the completions queued for this rsocket.  Receives are
+ * reposted to the SRQ on behalf of the entire group.
+ */
+static int rs_shared_poll_cq(struct rsocket *rs)
+{
+	struct rs_shared *shr = rs->shared;
+	struct ibv_wc wc[RS_SHARED_POLL];
+	struct rs_wc *swc;
+	uint32_t **qpn;
+	int i, ret;
+
+	fastlock_acquire(&shr->lock);
+	rs->stats.cq_polls++;
+	while ((ret = ibv_poll_cq(shr->cq, RS_SHARED_POLL, wc)) > 0) {
+		for (i = 0; i < ret; i++) {
+			if (rs_wr_is_recv(wc[i].wr_id))
+				shr->srq_posted--;
+
+			qpn = tfind(&wc[i].qp_num, &shr->qp_map, rs_compare_qpn);
+			if (qpn)
+				rs_shared_queue_wc(container_of(*qpn, struct ibv_qp,
+							qp_num)->qp_context, &wc[i]);
+		}
+	}
+
+	while (rs->wcq_head != rs->wcq_tail) {
+		swc = &rs->wcq[rs->wcq_head];
+		wc[0].wr_id = swc->wr_id;
+		wc[0].imm_data = swc->imm_data;
+		wc[0].status = swc->status;
+		wc[0].wc_flags = swc->wc_flags;
+		if (++rs->wcq_head == rs->wcq_size)
+			rs->wcq_head = 0;
+
+		if (rs_process_wc(rs, &wc[0]) < 0)
+			break;
+	}
+
+	if (!ret)
+		ret = rs_shared_post_recv(shr);
+	if (!ret && rs->wcq_overflow)
+		ret = ERR(EPROTO);
+	fastlock_release(&shr->lock);
+
+	if (ret && (rs->state & rs_connected)) {
+		rs->state = rs_error;
+		rs->err = errno;
+	}
+	return ret;
+}
+
 static int rs_poll_cq(struct rsocket *rs)
 {
-	struct ibv_wc wc;
-	uint32_t msg;
-	int ret, rcnt = 0;
+	struct ibv_wc wc[RS_POLL_BATCH];
+	int i, ret, wc_ret, rcnt = 0, stop = 0;
+
+	if (rs->shared)
+		return rs_shared_poll_cq(rs);
+
+	rs->stats.cq_polls++;
+	while (!stop &&
+	       (ret = ibv_poll_cq(rs->cm_id->recv_cq, RS_POLL_BATCH, wc)) > 0) {
+		for (i = 0; i < ret; i++) {
+			wc_ret = rs_process_wc(rs, &wc[i]);
+			if (wc_ret < 0)
+				stop = 1;
+			else
+				rcnt += wc_ret;
+		}
+	}
+	if (stop)
+		return 0;
+
+	if (rs->state & rs_connected) {
+		while (!ret && rcnt--)
+			ret = rs_post_recv(rs);
+
+		if (ret) {
+			rs->state = rs_error;
+			rs->err = errno;
+		}
+	}
+	return ret;
+}
+
+static int rs_get_cq_event(struct rsocket *rs)
+{
+	struct ibv_cq *cq;
+	void *context;
+	int ret;
+
+	if (rs->shared)
+		return rs_shared_get_cq_event(rs->shared);
+
+	if (!rs->cq_armed)
+		return 0;
+
+	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
+	if (!ret) {
+		rs->stats.cq_events++;
+		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
+			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			rs->unack_cqe = 0;
+		}
+		rs->cq_armed = 0;
+	} else if (!(errno == EAGAIN || errno == EINTR)) {
+		rs->state = rs_error;
+	}
+
+	return ret;
+}
+
+/*
+ * Although we serialize rsend and rrecv calls with respect to themselves,
+ * both calls may run simultaneously and need to poll the CQ for completions.
+ * We need to serialize access to the CQ, but rsend and rrecv need to
+ * allow each other to make forward progress.
+ *
+ * For example, rsend may need to wait for credits from the remote side,
+ * which could be stalled until the remote process calls rrecv.  This should
+ * not block rrecv from receiving data from the remote side however.
+ *
+ * We handle this by using two locks.  The cq_lock protects against polling
+ * the CQ and processing completions.  The cq_wait_lock serializes access to
+ * waiting on the CQ.
+ */
+static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	int ret;
+
+	fastlock_acquire(&rs->cq_lock);
+	do {
+		rs_update_credits(rs);
+		ret = rs_poll_cq(rs);
+		if (test(rs)) {
+			ret = 0;
+			break;
+		} else if (ret) {
+			break;
+		} else if (nonblock) {
+			ret = ERR(EWOULDBLOCK);
+		} else if (rs->shared) {
+			if (!rs->shared->armed) {
+				rs_shared_arm(rs->shared);
+				rs->stats.cq_arms++;
+				continue;
+			}
+
+			rs_update_credits(rs);
+			fastlock_release(&rs->cq_lock);
+			ret = rs_shared_wait(rs->shared);
+			if (!ret)
+				rs->stats.cq_events++;
+			fastlock_acquire(&rs->cq_lock);
+		} else if (!rs->cq_armed) {
+			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
+			rs->cq_armed = 1;
+			rs->stats.cq_arms++;
+		} else {
+			rs_update_credits(rs);
+			fastlock_acquire(&rs->cq_wait_lock);
+			fastlock_release(&rs->cq_lock);
+
+			ret = rs_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
+			fastlock_acquire(&rs->cq_lock);
+		}
+	} while (!ret);
+
+	rs_update_credits(rs);
+	fastlock_release(&rs->cq_lock);
+	return ret;
+}
+
+static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	struct timeval s, e;
+	uint32_t poll_time = 0;
+	uint64_t start;
+	int ret;
+
+	do {
+		ret = rs_process_cq(rs, 1, test);
+		if (!ret || nonblock || errno != EWOULDBLOCK)
+			return ret;
+
+		if (!poll_time)
+			gettimeofday(&s, NULL);
+
+		gettimeofday(&e, NULL);
+		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
+			    (e.tv_usec - s.tv_usec) + 1;
+	} while (poll_time <= polling_time);
+
+	start = rs_time_us();
+	ret = rs_process_cq(rs, 0, test);
+	rs->stats.blocked_usec += rs_time_us() - start;
+	return ret;
+}
+
+static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
+{
+	struct ds_header *hdr;
+
+	hdr = (struct ds_header *) (qp->rbuf + rs_wr_data(wc->wr_id));
+	return ((wc->byte_len >= sizeof(struct ibv_grh) + DS_IPV4_HDR_LEN) &&
+		((hdr->version == 4 && hdr->length == DS_IPV4_HDR_LEN) ||
+		 (hdr->version == 6 && hdr->length == DS_IPV6_HDR_LEN)));
+}
+
+/*
+ * Poll all CQs associated with a datagram rsocket.  We need to drop any
+ * received messages that we do not have room to store.  To limit drops,
+ * we only poll if we have room to store the receive or we need a send
+ * buffer.  To ensure fairness, we poll the CQs round robin, remembering
+ * where we left off.
+ */
+static void ds_poll_cqs(struct rsocket *rs)
+{
+	struct ds_qp *qp;
+	struct ds_smsg *smsg;
+	struct ds_rmsg *rmsg;
+	struct ibv_wc wc;
+	uint32_t offset;
+	int ret, cnt;
+
+	if (!(qp = rs->qp_list))
+		return;
+
+	rs->stats.cq_polls++;
+	do {
+		cnt = 0;
+		do {
+			ret = ibv_poll_cq(qp->cm_id->recv_cq, 1, &wc);
+			if (ret <= 0) {
+				qp = ds_next_qp(qp);
+				continue;
+			}
+
+			if (rs_wr_is_recv(wc.wr_id)) {
+				rs->stats.recv_cqes++;
+				if (rs->rqe_avail && wc.status == IBV_WC_SUCCESS &&
+				    ds_valid_recv(qp, &wc)) {
+					rs->rqe_avail--;
+					rmsg = &rs->dmsg[rs->rmsg_tail];
+					rmsg->qp = qp;
+					rmsg->offset = rs_wr_data(wc.wr_id);
+					rmsg->length = wc.byte_len - sizeof(struct ibv_grh);
+					rs->stats.recv_bytes += rmsg->length;
+					if (++rs->rmsg_tail == rs->rq_size + 1)
+						rs->rmsg_tail = 0;
+				} else {
+					ds_post_recv(rs, qp, rs_wr_data(wc.wr_id));
+				}
+			} else {
+				rs->stats.send_cqes++;
+				do {
+					offset = qp->sq_ring[qp->sq_head];
+					if (++qp->sq_head == rs->sq_size)
+						qp->sq_head = 0;
+					smsg = (struct ds_smsg *) (rs->sbuf + offset);
+					smsg->next = rs->smsg_free;
+					rs->smsg_free = smsg;
+					rs->sqe_avail++;
+				} while (offset != rs_wr_data(wc.wr_id));
+			}
+
+			qp = ds_next_qp(qp);
+			if (!rs->rqe_avail && rs->sqe_avail) {
+				rs->qp_list = qp;
+				return;
+			}
+			cnt++;
+		} while (qp != rs->qp_list);
+	} while (cnt);
+}
+
+static void ds_req_notify_cqs(struct rsocket *rs)
+{
+	struct ds_qp *qp;
+
+	if (!(qp = rs->qp_list))
+		return;
+
+	do {
+		if (!qp->cq_armed) {
+			ibv_req_notify_cq(qp->cm_id->recv_cq, 0);
+			qp->cq_armed = 1;
+		}
+		qp = ds_next_qp(qp);
+	} while (qp != rs->qp_list);
+}
+
+static int ds_get_cq_event(struct rsocket *rs)
+{
+	struct epoll_event event;
+	struct ds_qp *qp;
+	struct ibv_cq *cq;
+	void *context;
+	int ret;
+
+	if (!rs->cq_armed)
+		return 0;
+
+	ret = epoll_wait(rs->epfd, &event, 1, -1);
+	if (ret <= 0)
+		return ret;
+
+	qp = event.data.ptr;
+	ret = ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
+	if (!ret) {
+		rs->stats.cq_events++;
+		ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
+		qp->cq_armed = 0;
+		rs->cq_armed = 0;
+	}
+
+	return ret;
+}
+
+static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	int ret = 0;
+
+	fastlock_acquire(&rs->cq_lock);
+	do {
+		ds_poll_cqs(rs);
+		if (test(rs)) {
+			ret = 0;
+			break;
+		} else if (nonblock) {
+			ret = ERR(EWOULDBLOCK);
+		} else if (!rs->cq_armed) {
+			ds_req_notify_cqs(rs);
+			rs->cq_armed = 1;
+			rs->stats.cq_arms++;
+		} else {
+			fastlock_acquire(&rs->cq_wait_lock);
+			fastlock_release(&rs->cq_lock);
+
+			ret = ds_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
+			fastlock_acquire(&rs->cq_lock);
+		}
+	} while (!ret);
+
+	fastlock_release(&rs->cq_lock);
+	return ret;
+}
+
+static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+{
+	struct timeval s, e;
+	uint32_t poll_time = 0;
+	uint64_t start;
+	int ret;
+
+	do {
+		ret = ds_process_cqs(rs, 1, test);
+		if (!ret || nonblock || errno != EWOULDBLOCK)
+			return ret;
+
+		if (!poll_time)
+			gettimeofday(&s, NULL);
+
+		gettimeofday(&e, NULL);
+		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
+			    (e.tv_usec - s.tv_usec) + 1;
+	} while (poll_time <= polling_time);
+
+	start = rs_time_us();
+	ret = ds_process_cqs(rs, 0, test);
+	rs->stats.blocked_usec += rs_time_us() - start;
+	return ret;
+}
+
+static int rs_nonblocking(struct rsocket *rs, int flags)
+{
+	return (rs->fd_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
+}
+
+static int rs_is_cq_armed(struct rsocket *rs)
+{
+	return rs->shared ? rs->shared->armed : rs->cq_armed;
+}
+
+static int rs_poll_all(struct rsocket *rs)
+{
+	return 1;
+}
+
+/*
+ * We use hardware flow control to prevent over running the remote
+ * receive queue.  However, data transfers still require space in
+ * the remote rmsg queue, or we risk losing notification that data
+ * has been transfered.
+ *
+ * Be careful with race conditions in the check below.  The target SGL
+ * may be updated by a remote RDMA write.
+ */
+static int rs_can_send(struct rsocket *rs)
+{
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+		       (rs->sseq_no != rs->sseq_comp) &&
+		       (rs->target_sgl[rs->target_sge].length != 0);
+	} else {
+		return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
+		       (rs->sseq_no != rs->sseq_comp) &&
+		       (rs->target_sgl[rs->target_sge].length != 0);
+	}
+}
+
+static void rs_count_stall(struct rsocket *rs)
+{
+	if ((rs->sseq_no == rs->sseq_comp) ||
+	    !rs->target_sgl[rs->target_sge].length)
+		rs->stats.credit_stalls++;
+}
+
+static int ds_can_send(struct rsocket *rs)
+{
+	return rs->sqe_avail;
+}
+
+static int ds_all_sends_done(struct rsocket *rs)
+{
+	return rs->sqe_avail == rs->sq_size;
+}
+
+static int rs_conn_can_send(struct rsocket *rs)
+{
+	return rs_can_send(rs) || !(rs->state & rs_writable);
+}
+
+static int rs_conn_can_send_ctrl(struct rsocket *rs)
+{
+	return rs_ctrl_avail(rs) || !(rs->state & rs_connected);
+}
+
+static int rs_have_rdata(struct rsocket *rs)
+{
+	return (rs->rmsg_head != rs->rmsg_tail);
+}
+
+static int rs_conn_have_rdata(struct rsocket *rs)
+{
+	return rs_have_rdata(rs) || !(rs->state & rs_readable);
+}
+
+static int rs_conn_all_sends_done(struct rsocket *rs)
+{
+	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
+		rs->sqe_avail == rs->sq_size) ||
+	       !(rs->state & rs_connected);
+}
+
+static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
+		       struct ds_header *hdr)
+{
+	union socket_addr sa;
+
+	memset(&sa, 0, sizeof sa);
+	if (hdr->version == 4) {
+		if (*addrlen > sizeof(sa.sin))
+			*addrlen = sizeof(sa.sin);
+
+		sa.sin.sin_family = AF_INET;
+		sa.sin.sin_port = hdr->port;
+		sa.sin.sin_addr.s_addr =  hdr->addr.ipv4;
+	} else {
+		if (*addrlen > sizeof(sa.sin6))
+			*addrlen = sizeof(sa.sin6);
+
+		sa.sin6.sin6_family = AF_INET6;
+		sa.sin6.sin6_port = hdr->port;
+		sa.sin6.sin6_flowinfo = hdr->addr.ipv6.flowinfo;
+		memcpy(&sa.sin6.sin6_addr, &hdr->addr.ipv6.addr, 16);
+	}
+	memcpy(addr, &sa, *addrlen);
+}
+
+static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
+			   struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	int ret;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (!rs_have_rdata(rs)) {
+		ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_have_rdata);
+		if (ret)
+			return ret;
+	}
+
+	rmsg = &rs->dmsg[rs->rmsg_head];
+	hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+	if (len > rmsg->length - hdr->length)
+		len = rmsg->length - hdr->length;
+
+	memcpy(buf, (void *) hdr + hdr->length, len);
+	if (addrlen)
+		ds_set_src(src_addr, addrlen, hdr);
+
+	if (!(flags & MSG_PEEK)) {
+		ds_post_recv(rs, rmsg->qp, rmsg->offset);
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+	}
+
+	return len;
+}
+
+/*
+ * Receive buffers are queued on the batch for reposting, rather than being
+ * posted individually.  Pending buffers are posted before blocking.
+ */
+static ssize_t ds_recvmsg(struct rsocket *rs, struct msghdr *msg, int flags,
+			  struct ds_recv_batch *batch)
+{
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	size_t i, len, xfer, copied = 0;
+	void *data;
+	int ret;
+
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (!rs_have_rdata(rs)) {
+		ds_flush_recvs(batch);
+		ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_have_rdata);
+		if (ret)
+			return ret;
+	}
+
+	rmsg = &rs->dmsg[rs->rmsg_head];
+	hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+	data = (void *) hdr + hdr->length;
+	len = rmsg->length - hdr->length;
+
+	for (i = 0; i < msg->msg_iovlen && copied < len; i++) {
+		xfer = min_t(size_t, msg->msg_iov[i].iov_len, len - copied);
+		memcpy(msg->msg_iov[i].iov_base, data + copied, xfer);
+		copied += xfer;
+	}
+
+	msg->msg_flags = (copied < len) ? MSG_TRUNC : 0;
+	msg->msg_controllen = 0;
+	if (msg->msg_name)
+		ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+	else
+		msg->msg_namelen = 0;
+
+	if (!(flags & MSG_PEEK)) {
+		ds_batch_recv(rs, batch, rmsg->qp, rmsg->offset);
+		if (++rs->rmsg_head == rs->rq_size + 1)
+			rs->rmsg_head = 0;
+		rs->rqe_avail++;
+	}
+
+	return copied;
+}
+
+static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
+{
+	size_t left = len;
+	uint32_t end_size, rsize;
+	int rmsg_head, rbuf_offset;
+
+	rmsg_head = rs->rmsg_head;
+	rbuf_offset = rs->rbuf_offset;
+
+	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
+		if (left < rs->rmsg[rmsg_head].data) {
+			rsize = left;
+		} else {
+			rsize = rs->rmsg[rmsg_head].data;
+			if (++rmsg_head == rs->rq_size + 1)
+				rmsg_head = 0;
+		}
+
+		end_size = rs->rbuf_size - rbuf_offset;
+		if (rsize > end_size) {
+			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
+			rbuf_offset = 0;
+			buf += end_size;
+			rsize -= end_size;
+			left -= end_size;
+		}
+		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
+		rbuf_offset += rsize;
+		buf += rsize;
+	}
+
+	return len - left;
+}
+
+static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, size_t len)
+{
+	size_t size;
+
+	while (len) {
+		size = (*iov)->iov_len - *offset;
+		if (size > len) {
+			memcpy (dst, (*iov)->iov_base + *offset, len);
+			*offset += len;
+			break;
+		}
+
+		memcpy(dst, (*iov)->iov_base + *offset, size);
+		len -= size;
+		dst += size;
+		(*iov)++;
+		*offset = 0;
+	}
+}
+
+/*
+ * Small write coalescing.  Data sent with MSG_MORE, while TCP_CORK is set,
+ * or while earlier writes are outstanding and RDMA_CORK_DELAY is set, is
+ * copied into the send buffer without being written to the remote side.
+ * The coalesced data sits at the head of the send buffer's free space,
+ * starting at ssgl[0].addr, and is written using as few RDMA writes as the
+ * target SGL allows once the socket is uncorked, a send is made without
+ * MSG_MORE, the coalesced data reaches rs_cork_max, or the socket is read
+ * or polled (unless TCP_CORK is set).  There is no timer, so data held by
+ * RDMA_CORK_DELAY is only flushed once the socket is next used.
+ */
+static uint32_t rs_cork_max(struct rsocket *rs)
+{
+	return min_t(uint32_t, rs->sbuf_size >> 2, RS_MAX_TRANSFER);
+}
+
+static int rs_cork_wanted(struct rsocket *rs, int flags)
+{
+	if ((flags & MSG_MORE) || (rs->tcp_opts & (1 << TCP_CORK)))
+		return 1;
+
+	if (!rs->cork_delay || (rs->tcp_opts & (1 << TCP_NODELAY)) ||
+	    rs->sbuf_bytes_avail == rs->sbuf_size)
+		return 0;
+
+	return !rs->cork_len ||
+	       (rs_time_us() - rs->cork_stamp < rs->cork_delay);
+}
+
+static int rs_cork_flush(struct rsocket *rs, int nonblock)
+{
+	uint32_t xfer_size;
+	int nsge, ret;
+
+	while (rs->cork_len) {
+		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
+			ret = rs_get_comp(rs, nonblock, rs_conn_can_send);
+			if (ret)
+				return ret;
+			if (!(rs->state & rs_writable))
+				return ERR(ECONNRESET);
+		}
+
+		xfer_size = min_t(uint32_t, rs->cork_len, RS_MAX_TRANSFER);
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		if (xfer_size <= rs_sbuf_left(rs)) {
+			rs->ssgl[0].length = xfer_size;
+			nsge = 1;
+		} else {
+			rs->ssgl[0].length = rs_sbuf_left(rs);
+			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
+			nsge = 2;
+		}
+
+		ret = rs_write_data(rs, rs->ssgl, nsge, xfer_size,
+				    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
+		if (ret)
+			return ret;
+
+		if (nsge == 2)
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		else if (xfer_size < rs_sbuf_left(rs))
+			rs->ssgl[0].addr += xfer_size;
+		else
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		rs->cork_len -= xfer_size;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if the data was added to the coalesced data, in which case
+ * the send is complete.  Otherwise, any coalesced data must be flushed
+ * before the data is sent.
+ */
+static int rs_cork_append(struct rsocket *rs, const struct iovec *iov,
+			  size_t len, int flags)
+{
+	uint8_t *dst;
+	size_t offset = 0, size;
+	int hold;
+
+	hold = rs_cork_wanted(rs, flags);
+	if ((!hold && !rs->cork_len) || !(rs->state & rs_writable) ||
+	    rs->cork_len + len > rs_cork_max(rs) ||
+	    rs->cork_len + len > rs->sbuf_bytes_avail)
+		return 0;
+
+	if (!rs->cork_len && rs->cork_delay)
+		rs->cork_stamp = rs_time_us();
+
+	dst = (uint8_t *) (uintptr_t) rs->ssgl[0].addr + rs->cork_len;
+	if (dst >= rs->sbuf + rs->sbuf_size)
+		dst -= rs->sbuf_size;
+	size = min_t(size_t, len, rs->sbuf + rs->sbuf_size - dst);
+	rs_copy_iov(dst, &iov, &offset, size);
+	rs_copy_iov(rs->sbuf, &iov, &offset, len - size);
+	rs->cork_len += len;
+	rs->stats.copy_bytes += len;
+
+	if (!hold || rs->cork_len >= rs_cork_max(rs))
+		rs_cork_flush(rs, rs_nonblocking(rs, flags));
+	return 1;
+}
+
+/* Flush coalesced data before waiting for a reply, unless corked */
+static void rs_cork_release(struct rsocket *rs, int nonblock)
+{
+	if (!rs->cork_len || (rs->tcp_opts & (1 << TCP_CORK)))
+		return;
+
+	fastlock_acquire(&rs->slock);
+	rs_cork_flush(rs, nonblock);
+	fastlock_release(&rs->slock);
+}
+
+/*
+ * Continue to receive any queued data even if the remote side has disconnected.
+ */
+ssize_t rrecv(int socket, void *buf, size_t len, int flags)
+{
+	struct rsocket *rs;
+	size_t left = len;
+	uint32_t end_size, rsize;
+	int ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+	rs_cork_release(rs, rs_nonblocking(rs, flags));
+	fastlock_acquire(&rs->rlock);
+	do {
+		if (!rs_have_rdata(rs)) {
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_have_rdata);
+			if (ret)
+				break;
+		}
+
+		if (flags & MSG_PEEK) {
+			left = len - rs_peek(rs, buf, left);
+			break;
+		}
+
+		for (; left && rs_have_rdata(rs); left -= rsize) {
+			if (left < rs->rmsg[rs->rmsg_head].data) {
+				rsize = left;
+				rs->rmsg[rs->rmsg_head].data -= left;
+			} else {
+				rs->rseq_no++;
+				rsize = rs->rmsg[rs->rmsg_head].data;
+				if (++rs->rmsg_head == rs->rq_size + 1)
+					rs->rmsg_head = 0;
+			}
+
+			end_size = rs->rbuf_size - rs->rbuf_offset;
+			if (rsize > end_size) {
+				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
+				rs->rbuf_offset = 0;
+				buf += end_size;
+				rsize -= end_size;
+				left -= end_size;
+				rs->rbuf_bytes_avail += end_size;
+			}
+			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
+			rs->rbuf_offset += rsize;
+			buf += rsize;
+			rs->rbuf_bytes_avail += rsize;
+		}
+
+	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
+
+	rs->stats.copy_bytes += len - left;
+	fastlock_release(&rs->rlock);
+	return (ret && left == len) ? ret : len - left;
+}
+
+ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
+		  struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	struct rsocket *rs;
+	int ret;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	ret = rrecv(socket, buf, len, flags);
+	if (ret > 0 && src_addr)
+		rgetpeername(socket, src_addr, addrlen);
+
+	return ret;
+}
+
+/*
+ * Simple, straightforward implementation for now that only tries to fill
+ * in the first vector.
+ */
+static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
+{
+	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+}
+
+ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
+{
+	if (msg->msg_control && msg->msg_controllen)
+		return ERR(ENOTSUP);
+
+	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+}
+
+/*
+ * Datagrams already polled from the CQ are returned without re-acquiring
+ * any locks, and their receive buffers are reposted together.  As with
+ * recvmmsg, the timeout is only checked after each datagram is received.
+ */
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct ds_recv_batch batch;
+	struct rsocket *rs;
+	uint64_t end = 0;
+	unsigned int i;
+	int ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+
+	if (timeout)
+		end = rs_time_us() + timeout->tv_sec * 1000000 +
+		      timeout->tv_nsec / 1000;
+
+	if (rs->type == SOCK_STREAM) {
+		for (i = 0; i < vlen; i++) {
+			ret = rrecvmsg(socket, &msgvec[i].msg_hdr,
+				       flags & ~MSG_WAITFORONE);
+			if (ret < 0)
+				break;
+
+			msgvec[i].msg_len = ret;
+			if (flags & MSG_WAITFORONE)
+				flags |= MSG_DONTWAIT;
+			if (timeout && rs_time_us() >= end) {
+				i++;
+				break;
+			}
+		}
+		return i ? i : ret;
+	}
+
+	batch.cnt = 0;
+	fastlock_acquire(&rs->rlock);
+	for (i = 0; i < vlen; i++) {
+		ret = ds_recvmsg(rs, &msgvec[i].msg_hdr,
+				 flags & ~MSG_WAITFORONE, &batch);
+		if (ret < 0)
+			break;
+
+		msgvec[i].msg_len = ret;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+		if (timeout && rs_time_us() >= end) {
+			i++;
+			break;
+		}
+	}
+	ds_flush_recvs(&batch);
+	fastlock_release(&rs->rlock);
+	return i ? i : ret;
+}
+
+ssize_t rread(int socket, void *buf, size_t count)
+{
+	return rrecv(socket, buf, count, 0);
+}
+
+ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt)
+{
+	return rrecvv(socket, iov, iovcnt, 0);
+}
+
+static int rs_send_iomaps(struct rsocket *rs, int flags)
+{
+	struct rs_iomap_mr *iomr;
+	struct ibv_sge sge;
+	struct rs_iomap iom;
+	int ret;
+
+	fastlock_acquire(&rs->map_lock);
+	while (!dlist_empty(&rs->iomap_queue)) {
+		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		iomr = container_of(rs->iomap_queue.next, struct rs_iomap_mr, entry);
+		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+			iom.offset = iomr->offset;
+			iom.sge.addr = (uintptr_t) iomr->mr->addr;
+			iom.sge.length = iomr->mr->length;
+			iom.sge.key = iomr->mr->rkey;
+		} else {
+			iom.offset = bswap_64(iomr->offset);
+			iom.sge.addr = bswap_64((uintptr_t) iomr->mr->addr);
+			iom.sge.length = bswap_32(iomr->mr->length);
+			iom.sge.key = bswap_32(iomr->mr->rkey);
+		}
+
+		if (rs->sq_inline >= sizeof iom) {
+			sge.addr = (uintptr_t) &iom;
+			sge.length = sizeof iom;
+			sge.lkey = 0;
+			ret = rs_write_iomap(rs, iomr, &sge, 1, IBV_SEND_INLINE);
+		} else if (rs_sbuf_left(rs) >= sizeof iom) {
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &iom, sizeof iom);
+			rs->ssgl[0].length = sizeof iom;
+			ret = rs_write_iomap(rs, iomr, rs->ssgl, 1, 0);
+			if (rs_sbuf_left(rs) > sizeof iom)
+				rs->ssgl[0].addr += sizeof iom;
+			else
+				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		} else {
+			rs->ssgl[0].length = rs_sbuf_left(rs);
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &iom,
+				rs->ssgl[0].length);
+			rs->ssgl[1].length = sizeof iom - rs->ssgl[0].length;
+			memcpy(rs->sbuf, ((void *) &iom) + rs->ssgl[0].length,
+			       rs->ssgl[1].length);
+			ret = rs_write_iomap(rs, iomr, rs->ssgl, 2, 0);
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		}
+		dlist_remove(&iomr->entry);
+		dlist_insert_tail(&iomr->entry, &rs->iomap_list);
+		if (ret)
+			break;
+	}
+
+	rs->iomap_pending = !dlist_empty(&rs->iomap_queue);
+	fastlock_release(&rs->map_lock);
+	return ret;
+}
+
+static ssize_t ds_sendv_udp(struct rsocket *rs, const struct iovec *iov,
+			    int iovcnt, int flags, uint8_t op)
+{
+	struct ds_udp_header hdr;
+	struct msghdr msg;
+	struct iovec miov[8];
+	ssize_t ret;
+
+	if (iovcnt > 8)
+		return ERR(ENOTSUP);
+
+	hdr.tag = htobe32(DS_UDP_TAG);
+	hdr.version = rs->conn_dest->qp->hdr.version;
+	hdr.op = op;
+	hdr.reserved = 0;
+	hdr.qpn = htobe32(rs->conn_dest->qp->cm_id->qp->qp_num & 0xFFFFFF);
+	if (rs->conn_dest->qp->hdr.version == 4) {
+		hdr.length = DS_UDP_IPV4_HDR_LEN;
+		hdr.addr.ipv4 = rs->conn_dest->qp->hdr.addr.ipv4;
+	} else {
+		hdr.length = DS_UDP_IPV6_HDR_LEN;
+		memcpy(hdr.addr.ipv6, &rs->conn_dest->qp->hdr.addr.ipv6, 16);
+	}
+
+	miov[0].iov_base = &hdr;
+	miov[0].iov_len = hdr.length;
+	if (iov && iovcnt)
+		memcpy(&miov[1], iov, sizeof(*iov) * iovcnt);
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = &rs->conn_dest->addr;
+	msg.msg_namelen = ucma_addrlen(&rs->conn_dest->addr.sa);
+	msg.msg_iov = miov;
+	msg.msg_iovlen = iovcnt + 1;
+	ret = sendmsg(rs->udp_sock, &msg, flags);
+	return ret > 0 ? ret - hdr.length : ret;
+}
+
+static ssize_t ds_send_udp(struct rsocket *rs, const void *buf, size_t len,
+			   int flags, uint8_t op)
+{
+	struct iovec iov;
+	if (buf && len) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		return ds_sendv_udp(rs, &iov, 1, flags, op);
+	} else {
+		return ds_sendv_udp(rs, NULL, 0, flags, op);
+	}
+}
 
-	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
-		if (rs_wr_is_recv(wc.wr_id)) {
-			if (wc.status != IBV_WC_SUCCESS)
-				continue;
-			rcnt++;
+static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
+{
+	struct ds_smsg *msg;
+	struct ibv_sge sge;
+	uint64_t offset;
+	int ret = 0;
 
-			if (wc.wc_flags & IBV_WC_WITH_IMM) {
-				msg = be32toh(wc.imm_data);
-			} else {
-				msg = ((uint32_t *) (rs->rbuf + rs->rbuf_size))
-					[rs_wr_data(wc.wr_id)];
+	if (!rs->conn_dest->ah)
+		return ds_send_udp(rs, buf, len, flags, RS_OP_DATA);
 
-			}
-			switch (rs_msg_op(msg)) {
-			case RS_OP_SGL:
-				rs->sseq_comp = (uint16_t) rs_msg_data(msg);
-				break;
-			case RS_OP_IOMAP_SGL:
-				/* The iomap was updated, that's nice to know. */
-				break;
-			case RS_OP_CTRL:
-				if (rs_msg_data(msg) == RS_CTRL_DISCONNECT) {
-					rs->state = rs_disconnected;
-					return 0;
-				} else if (rs_msg_data(msg) == RS_CTRL_SHUTDOWN) {
-					if (rs->state & rs_writable) {
-						rs->state &= ~rs_readable;
-					} else {
-						rs->state = rs_disconnected;
-						return 0;
-					}
-				}
-				break;
-			case RS_OP_WRITE:
-				/* We really shouldn't be here. */
-				break;
-			default:
-				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
-				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
-				if (++rs->rmsg_tail == rs->rq_size + 1)
-					rs->rmsg_tail = 0;
-				break;
-			}
-		} else {
-			switch  (rs_msg_op(rs_wr_data(wc.wr_id))) {
-			case RS_OP_SGL:
-				rs->ctrl_max_seqno++;
-				break;
-			case RS_OP_CTRL:
-				rs->ctrl_max_seqno++;
-				if (rs_msg_data(rs_wr_data(wc.wr_id)) == RS_CTRL_DISCONNECT)
-					rs->state = rs_disconnected;
-				break;
-			case RS_OP_IOMAP_SGL:
-				rs->sqe_avail++;
-				if (!rs_wr_is_msg_send(wc.wr_id))
-					rs->sbuf_bytes_avail += sizeof(struct rs_iomap);
-				break;
-			default:
-				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
+	if (!ds_can_send(rs)) {
+		ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+		if (ret)
+			return ret;
+	}
+
+	msg = rs->smsg_free;
+	rs->smsg_free = msg->next;
+	rs->sqe_avail--;
+
+	memcpy((void *) msg, &rs->conn_dest->qp->hdr, rs->conn_dest->qp->hdr.length);
+	memcpy((void *) msg + rs->conn_dest->qp->hdr.length, buf, len);
+	sge.addr = (uintptr_t) msg;
+	sge.length = rs->conn_dest->qp->hdr.length + len;
+	sge.lkey = rs->conn_dest->qp->smr->lkey;
+	offset = (uint8_t *) msg - rs->sbuf;
+
+	ret = ds_post_send(rs, &sge, offset);
+	return ret ? ret : len;
+}
+
+static int rs_use_zcopy(struct rsocket *rs, size_t len, int iovcnt, int flags)
+{
+	return rs->zcopy_threshold && (len >= rs->zcopy_threshold) &&
+	       (iovcnt <= RS_ZCOPY_MAX_IOV) && !rs_nonblocking(rs, flags);
+}
+
+/*
+ * Zero-copy registrations are cached on the zcopy_list in most recently
+ * used order, so that applications reusing their buffers only pay for
+ * ibv_reg_mr once.  The least recently used idle registration is released
+ * once more than RS_ZCOPY_MR_MAX are cached.  Applications must call
+ * riounmap before releasing a buffer that was sent using zero-copy.
+ */
+static struct rs_iomap_mr *rs_get_zcopy_mr(struct rsocket *rs,
+					   const void *buf, size_t len)
+{
+	struct rs_iomap_mr *iomr;
+	dlist_entry *entry;
+
+	for (entry = rs->zcopy_list.next; entry != &rs->zcopy_list;
+	     entry = entry->next) {
+		iomr = container_of(entry, struct rs_iomap_mr, entry);
+		if ((uintptr_t) buf >= (uintptr_t) iomr->mr->addr &&
+		    (uintptr_t) buf + len <=
+		    (uintptr_t) iomr->mr->addr + iomr->mr->length) {
+			dlist_remove(&iomr->entry);
+			rs->stats.iomap_hits++;
+			goto found;
+		}
+	}
+
+	iomr = calloc(1, sizeof(*iomr));
+	if (!iomr)
+		return NULL;
+
+	iomr->mr = ibv_reg_mr(rs->cm_id->pd, (void *) buf, len,
+			      IBV_ACCESS_LOCAL_WRITE);
+	if (!iomr->mr) {
+		free(iomr);
+		return NULL;
+	}
+
+	iomr->index = -1;
+	atomic_store(&iomr->refcnt, 1);
+	if (++rs->zcopy_mr_cnt > RS_ZCOPY_MR_MAX) {
+		for (entry = rs->zcopy_list.prev; entry != &rs->zcopy_list;
+		     entry = entry->prev) {
+			if (atomic_load(&container_of(entry, struct rs_iomap_mr,
+						      entry)->refcnt) == 1) {
+				rs_drop_zcopy_mr(rs, container_of(entry,
+						 struct rs_iomap_mr, entry));
 				break;
 			}
-			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
-				rs->state = rs_error;
-				rs->err = EIO;
-			}
 		}
 	}
+found:
+	dlist_insert_head(&iomr->entry, &rs->zcopy_list);
+	atomic_fetch_add(&iomr->refcnt, 1);
+	return iomr;
+}
 
-	if (rs->state & rs_connected) {
-		while (!ret && rcnt--)
-			ret = rs_post_recv(rs);
+static void rs_put_zcopy_mrs(struct rsocket *rs, struct rs_iomap_mr **iomr,
+			     int cnt)
+{
+	int i;
 
-		if (ret) {
-			rs->state = rs_error;
-			rs->err = errno;
+	fastlock_acquire(&rs->map_lock);
+	for (i = 0; i < cnt; i++) {
+		if (iomr[i])
+			rs_release_iomap_mr(iomr[i]);
+	}
+	fastlock_release(&rs->map_lock);
+}
+
+static int rs_get_zcopy_mrs(struct rsocket *rs, const struct iovec *iov,
+			    int iovcnt, struct rs_iomap_mr **iomr)
+{
+	int i;
+
+	fastlock_acquire(&rs->map_lock);
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len) {
+			iomr[i] = NULL;
+			continue;
 		}
+
+		iomr[i] = rs_get_zcopy_mr(rs, iov[i].iov_base, iov[i].iov_len);
+		if (!iomr[i])
+			break;
 	}
-	return ret;
+	fastlock_release(&rs->map_lock);
+
+	if (i < iovcnt) {
+		rs_put_zcopy_mrs(rs, iomr, i);
+		return -1;
+	}
+	return 0;
 }
 
-static int rs_get_cq_event(struct rsocket *rs)
+/*
+ * Zero-copy transfers write directly from the user's buffers into the
+ * remote receive buffers, bypassing the send buffer.  The send buffer
+ * space is still accounted for in order to bound the amount of data in
+ * flight.  Because the user may reuse their buffers once we return, we
+ * wait for all writes to complete before doing so.
+ */
+static ssize_t rs_sendv_zcopy(struct rsocket *rs, const struct iovec *iov,
+			      int iovcnt, struct rs_iomap_mr **iomr,
+			      size_t len)
 {
-	struct ibv_cq *cq;
-	void *context;
-	int ret;
+	struct ibv_sge sge;
+	size_t left = len, offset = 0;
+	uint32_t xfer_size;
+	int i = 0, ret = 0;
 
-	if (!rs->cq_armed)
-		return 0;
+	for (; left; left -= xfer_size, offset += xfer_size) {
+		while (offset == iov[i].iov_len) {
+			i++;
+			offset = 0;
+		}
 
-	ret = ibv_get_cq_event(rs->cm_id->recv_cq_channel, &cq, &context);
-	if (!ret) {
-		if (++rs->unack_cqe >= rs->sq_size + rs->rq_size) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
-			rs->unack_cqe = 0;
+		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
+			ret = rs_get_comp(rs, 0, rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
 		}
-		rs->cq_armed = 0;
-	} else if (!(errno == EAGAIN || errno == EINTR)) {
-		rs->state = rs_error;
+
+		xfer_size = min_t(size_t, iov[i].iov_len - offset, RS_MAX_TRANSFER);
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		sge.addr = (uintptr_t) iov[i].iov_base + offset;
+		sge.length = xfer_size;
+		sge.lkey = iomr[i]->mr->lkey;
+		/* the last write must complete before the user's buffer is released */
+		ret = rs_write_data(rs, &sge, 1, xfer_size,
+				    xfer_size == left ? IBV_SEND_SIGNALED : 0);
+		if (ret)
+			break;
 	}
 
-	return ret;
+	/*
+	 * Unsignaled writes only complete behind a signaled one.  If the
+	 * transfer failed before posting it, waiting for them could hang, so
+	 * the error is reported instead.
+	 */
+	if (ret && rs->unsig_sqe) {
+		rs_put_zcopy_mrs(rs, iomr, iovcnt);
+		return ret;
+	}
+
+	if (left != len)
+		rs_get_comp(rs, 0, rs_conn_all_sends_done);
+
+	rs_put_zcopy_mrs(rs, iomr, iovcnt);
+	return (ret && left == len) ? ret : len - left;
 }
 
 /*
- * Although we serialize rsend and rrecv calls with respect to themselves,
- * both calls may run simultaneously and need to poll the CQ for completions.
- * We need to serialize access to the CQ, but rsend and rrecv need to
- * allow each other to make forward progress.
- *
- * For example, rsend may need to wait for credits from the remote side,
- * which could be stalled until the remote process calls rrecv.  This should
- * not block rrecv from receiving data from the remote side however.
- *
- * We handle this by using two locks.  The cq_lock protects against polling
- * the CQ and processing completions.  The cq_wait_lock serializes access to
- * waiting on the CQ.
+ * We overlap sending the data, by posting a small work request immediately,
+ * then increasing the size of the send on each iteration.
  */
-static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 {
-	int ret;
+	struct rsocket *rs;
+	struct rs_iomap_mr *iomr;
+	struct ibv_sge sge;
+	struct iovec iov;
+	size_t left = len;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int ret = 0;
 
-	fastlock_acquire(&rs->cq_lock);
-	do {
-		rs_update_credits(rs);
-		ret = rs_poll_cq(rs);
-		if (test(rs)) {
-			ret = 0;
-			break;
-		} else if (ret) {
-			break;
-		} else if (nonblock) {
-			ret = ERR(EWOULDBLOCK);
-		} else if (!rs->cq_armed) {
-			ibv_req_notify_cq(rs->cm_id->recv_cq, 0);
-			rs->cq_armed = 1;
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->slock);
+		ret = dsend(rs, buf, len, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
+
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, flags);
+		if (ret)
+			goto out;
+	}
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	if (rs_cork_append(rs, &iov, len, flags)) {
+		left = 0;
+		goto out;
+	}
+
+	if (rs->cork_len) {
+		ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			goto out;
+	}
+
+	if (rs_use_zcopy(rs, len, 1, flags)) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		if (!rs_get_zcopy_mrs(rs, &iov, 1, &iomr)) {
+			ret = rs_sendv_zcopy(rs, &iov, 1, &iomr, len);
+			fastlock_release(&rs->slock);
+			return ret;
+		}
+	}
+
+	for (; left; left -= xfer_size, buf += xfer_size) {
+		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
 		} else {
-			rs_update_credits(rs);
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+			xfer_size = left;
+		}
 
-			ret = rs_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		if (xfer_size <= rs->sq_inline) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = 0;
+			ret = rs_write_data(rs, &sge, 1, xfer_size, IBV_SEND_INLINE);
+		} else if (xfer_size <= rs_sbuf_left(rs)) {
+			rs->stats.copy_bytes += xfer_size;
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
+			rs->ssgl[0].length = xfer_size;
+			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size, 0);
+			if (xfer_size < rs_sbuf_left(rs))
+				rs->ssgl[0].addr += xfer_size;
+			else
+				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		} else {
+			rs->stats.copy_bytes += xfer_size;
+			rs->ssgl[0].length = rs_sbuf_left(rs);
+			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf,
+				rs->ssgl[0].length);
+			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
+			memcpy(rs->sbuf, buf + rs->ssgl[0].length, rs->ssgl[1].length);
+			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size, 0);
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
 		}
-	} while (!ret);
+		if (ret)
+			break;
+	}
+out:
+	fastlock_release(&rs->slock);
 
-	rs_update_credits(rs);
-	fastlock_release(&rs->cq_lock);
-	return ret;
+	return (ret && left == len) ? ret : len - left;
 }
 
-static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest_addr, socklen_t addrlen)
 {
-	struct timeval s, e;
-	uint32_t poll_time = 0;
+	struct rsocket *rs;
 	int ret;
 
-	do {
-		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
-
-		if (!poll_time)
-			gettimeofday(&s, NULL);
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		if (dest_addr || addrlen)
+			return ERR(EISCONN);
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		return rsend(socket, buf, len, flags);
+	}
 
-	ret = rs_process_cq(rs, 0, test);
-	return ret;
-}
+	if (rs->state == rs_init) {
+		ret = ds_init_ep(rs);
+		if (ret)
+			return ret;
+	}
 
-static int ds_valid_recv(struct ds_qp *qp, struct ibv_wc *wc)
-{
-	struct ds_header *hdr;
+	fastlock_acquire(&rs->slock);
+	if (!rs->conn_dest || ds_compare_addr(dest_addr, &rs->conn_dest->addr)) {
+		ret = ds_get_dest(rs, dest_addr, addrlen, &rs->conn_dest);
+		if (ret)
+			goto out;
+	}
 
-	hdr = (struct ds_header *) (qp->rbuf + rs_wr_data(wc->wr_id));
-	return ((wc->byte_len >= sizeof(struct ibv_grh) + DS_IPV4_HDR_LEN) &&
-		((hdr->version == 4 && hdr->length == DS_IPV4_HDR_LEN) ||
-		 (hdr->version == 6 && hdr->length == DS_IPV6_HDR_LEN)));
+	ret = dsend(rs, buf, len, flags);
+out:
+	fastlock_release(&rs->slock);
+	return ret;
 }
 
-/*
- * Poll all CQs associated with a datagram rsocket.  We need to drop any
- * received messages that we do not have room to store.  To limit drops,
- * we only poll if we have room to store the receive or we need a send
- * buffer.  To ensure fairness, we poll the CQs round robin, remembering
- * where we left off.
- */
-static void ds_poll_cqs(struct rsocket *rs)
+static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
-	struct ds_qp *qp;
-	struct ds_smsg *smsg;
-	struct ds_rmsg *rmsg;
-	struct ibv_wc wc;
-	int ret, cnt;
+	struct rsocket *rs;
+	struct rs_iomap_mr *iomr[RS_ZCOPY_MAX_IOV];
+	const struct iovec *cur_iov;
+	size_t left, len, offset = 0;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	int i, ret = 0;
 
-	if (!(qp = rs->qp_list))
-		return;
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
+	}
 
-	do {
-		cnt = 0;
-		do {
-			ret = ibv_poll_cq(qp->cm_id->recv_cq, 1, &wc);
-			if (ret <= 0) {
-				qp = ds_next_qp(qp);
-				continue;
-			}
+	cur_iov = iov;
+	len = iov[0].iov_len;
+	for (i = 1; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	left = len;
 
-			if (rs_wr_is_recv(wc.wr_id)) {
-				if (rs->rqe_avail && wc.status == IBV_WC_SUCCESS &&
-				    ds_valid_recv(qp, &wc)) {
-					rs->rqe_avail--;
-					rmsg = &rs->dmsg[rs->rmsg_tail];
-					rmsg->qp = qp;
-					rmsg->offset = rs_wr_data(wc.wr_id);
-					rmsg->length = wc.byte_len - sizeof(struct ibv_grh);
-					if (++rs->rmsg_tail == rs->rq_size + 1)
-						rs->rmsg_tail = 0;
-				} else {
-					ds_post_recv(rs, qp, rs_wr_data(wc.wr_id));
-				}
-			} else {
-				smsg = (struct ds_smsg *) (rs->sbuf + rs_wr_data(wc.wr_id));
-				smsg->next = rs->smsg_free;
-				rs->smsg_free = smsg;
-				rs->sqe_avail++;
-			}
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, flags);
+		if (ret)
+			goto out;
+	}
 
-			qp = ds_next_qp(qp);
-			if (!rs->rqe_avail && rs->sqe_avail) {
-				rs->qp_list = qp;
-				return;
-			}
-			cnt++;
-		} while (qp != rs->qp_list);
-	} while (cnt);
-}
+	if (rs_cork_append(rs, iov, len, flags)) {
+		left = 0;
+		goto out;
+	}
 
-static void ds_req_notify_cqs(struct rsocket *rs)
-{
-	struct ds_qp *qp;
+	if (rs->cork_len) {
+		ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			goto out;
+	}
 
-	if (!(qp = rs->qp_list))
-		return;
+	if (rs_use_zcopy(rs, len, iovcnt, flags) &&
+	    !rs_get_zcopy_mrs(rs, iov, iovcnt, iomr)) {
+		ret = rs_sendv_zcopy(rs, iov, iovcnt, iomr, len);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
 
-	do {
-		if (!qp->cq_armed) {
-			ibv_req_notify_cq(qp->cm_id->recv_cq, 0);
-			qp->cq_armed = 1;
+	for (; left; left -= xfer_size) {
+		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
 		}
-		qp = ds_next_qp(qp);
-	} while (qp != rs->qp_list);
-}
-
-static int ds_get_cq_event(struct rsocket *rs)
-{
-	struct epoll_event event;
-	struct ds_qp *qp;
-	struct ibv_cq *cq;
-	void *context;
-	int ret;
 
-	if (!rs->cq_armed)
-		return 0;
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
+		} else {
+			xfer_size = left;
+		}
 
-	ret = epoll_wait(rs->epfd, &event, 1, -1);
-	if (ret <= 0)
-		return ret;
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
 
-	qp = event.data.ptr;
-	ret = ibv_get_cq_event(qp->cm_id->recv_cq_channel, &cq, &context);
-	if (!ret) {
-		ibv_ack_cq_events(qp->cm_id->recv_cq, 1);
-		qp->cq_armed = 0;
-		rs->cq_armed = 0;
+		rs->stats.copy_bytes += xfer_size;
+		if (xfer_size <= rs_sbuf_left(rs)) {
+			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr,
+				    &cur_iov, &offset, xfer_size);
+			rs->ssgl[0].length = xfer_size;
+			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size,
+					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
+			if (xfer_size < rs_sbuf_left(rs))
+				rs->ssgl[0].addr += xfer_size;
+			else
+				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		} else {
+			rs->ssgl[0].length = rs_sbuf_left(rs);
+			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr, &cur_iov,
+				    &offset, rs->ssgl[0].length);
+			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
+			rs_copy_iov(rs->sbuf, &cur_iov, &offset, rs->ssgl[1].length);
+			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size,
+					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		}
+		if (ret)
+			break;
 	}
+out:
+	fastlock_release(&rs->slock);
 
-	return ret;
+	return (ret && left == len) ? ret : len - left;
 }
 
-static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
+ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
+{
+	if (msg->msg_control && msg->msg_controllen)
+		return ERR(ENOTSUP);
+
+	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
+}
+
+/*
+ * Sends are gathered into chains of work requests, so that consecutive
+ * datagrams sent over the same QP are posted together.  Queued sends are
+ * posted before blocking, or before sending through the UDP socket.
+ */
+static int dsendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		     unsigned int vlen, int flags)
 {
+	struct ds_send_batch batch;
+	struct ds_smsg *smsg;
+	struct msghdr *msg;
+	unsigned int i, sent = 0;
+	size_t j, len;
+	uint32_t offset;
 	int ret = 0;
 
-	fastlock_acquire(&rs->cq_lock);
-	do {
-		ds_poll_cqs(rs);
-		if (test(rs)) {
-			ret = 0;
+	batch.cnt = 0;
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
 			break;
-		} else if (nonblock) {
-			ret = ERR(EWOULDBLOCK);
-		} else if (!rs->cq_armed) {
-			ds_req_notify_cqs(rs);
-			rs->cq_armed = 1;
-		} else {
-			fastlock_acquire(&rs->cq_wait_lock);
-			fastlock_release(&rs->cq_lock);
+		}
 
-			ret = ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fastlock_acquire(&rs->cq_lock);
+		if (batch.cnt && batch.qp != rs->conn_dest->qp) {
+			ret = ds_flush_sends(&batch, &sent);
+			if (ret)
+				break;
 		}
-	} while (!ret);
 
-	fastlock_release(&rs->cq_lock);
-	return ret;
-}
+		if (!rs->conn_dest->ah) {
+			ret = ds_flush_sends(&batch, &sent);
+			if (ret)
+				break;
 
-static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
-{
-	struct timeval s, e;
-	uint32_t poll_time = 0;
-	int ret;
+			ret = ds_sendv_udp(rs, msg->msg_iov, (int) msg->msg_iovlen,
+					   flags, RS_OP_DATA);
+			if (ret < 0)
+				break;
 
-	do {
-		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
-			return ret;
+			msgvec[i].msg_len = ret;
+			sent++;
+			continue;
+		}
 
-		if (!poll_time)
-			gettimeofday(&s, NULL);
+		for (j = 0, len = 0; j < msg->msg_iovlen; j++)
+			len += msg->msg_iov[j].iov_len;
+		if (len > RS_SNDLOWAT - rs->conn_dest->qp->hdr.length) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
 
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
+		if (!ds_can_send(rs)) {
+			ret = ds_flush_sends(&batch, &sent);
+			if (ret)
+				break;
 
-	ret = ds_process_cqs(rs, 0, test);
-	return ret;
-}
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
+			if (ret)
+				break;
+		}
 
-static int rs_nonblocking(struct rsocket *rs, int flags)
-{
-	return (rs->fd_flags & O_NONBLOCK) || (flags & MSG_DONTWAIT);
-}
+		smsg = rs->smsg_free;
+		rs->smsg_free = smsg->next;
+		rs->sqe_avail--;
 
-static int rs_is_cq_armed(struct rsocket *rs)
-{
-	return rs->cq_armed;
-}
+		offset = rs->conn_dest->qp->hdr.length;
+		memcpy((void *) smsg, &rs->conn_dest->qp->hdr, offset);
+		for (j = 0; j < msg->msg_iovlen; j++) {
+			memcpy((void *) smsg + offset, msg->msg_iov[j].iov_base,
+			       msg->msg_iov[j].iov_len);
+			offset += msg->msg_iov[j].iov_len;
+		}
 
-static int rs_poll_all(struct rsocket *rs)
-{
-	return 1;
-}
+		batch.sge[batch.cnt].addr = (uintptr_t) smsg;
+		batch.sge[batch.cnt].length = offset;
+		batch.sge[batch.cnt].lkey = rs->conn_dest->qp->smr->lkey;
+		ds_init_send_wr(rs, &batch.wr[batch.cnt], &batch.sge[batch.cnt],
+				(uint8_t *) smsg - rs->sbuf);
+		batch.qp = rs->conn_dest->qp;
+		msgvec[i].msg_len = len;
 
-/*
- * We use hardware flow control to prevent over running the remote
- * receive queue.  However, data transfers still require space in
- * the remote rmsg queue, or we risk losing notification that data
- * has been transfered.
- *
- * Be careful with race conditions in the check below.  The target SGL
- * may be updated by a remote RDMA write.
- */
-static int rs_can_send(struct rsocket *rs)
-{
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return rs->sqe_avail && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
-	} else {
-		return (rs->sqe_avail >= 2) && (rs->sbuf_bytes_avail >= RS_SNDLOWAT) &&
-		       (rs->sseq_no != rs->sseq_comp) &&
-		       (rs->target_sgl[rs->target_sge].length != 0);
+		if (++batch.cnt == DS_MMSG_BATCH) {
+			ret = ds_flush_sends(&batch, &sent);
+			if (ret)
+				break;
+		}
 	}
-}
 
-static int ds_can_send(struct rsocket *rs)
-{
-	return rs->sqe_avail;
-}
+	if (ds_flush_sends(&batch, &sent))
+		ret = -1;
 
-static int ds_all_sends_done(struct rsocket *rs)
-{
-	return rs->sqe_avail == rs->sq_size;
+	return sent ? sent : ret;
 }
 
-static int rs_conn_can_send(struct rsocket *rs)
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
 {
-	return rs_can_send(rs) || !(rs->state & rs_writable);
-}
+	struct rsocket *rs;
+	unsigned int i;
+	int ret = 0;
 
-static int rs_conn_can_send_ctrl(struct rsocket *rs)
-{
-	return rs_ctrl_avail(rs) || !(rs->state & rs_connected);
-}
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_STREAM) {
+		for (i = 0; i < vlen; i++) {
+			ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+			if (ret < 0)
+				break;
 
-static int rs_have_rdata(struct rsocket *rs)
-{
-	return (rs->rmsg_head != rs->rmsg_tail);
-}
+			msgvec[i].msg_len = ret;
+		}
+		return i ? i : ret;
+	}
 
-static int rs_conn_have_rdata(struct rsocket *rs)
-{
-	return rs_have_rdata(rs) || !(rs->state & rs_readable);
+	if (rs->state == rs_init) {
+		ret = ds_init_ep(rs);
+		if (ret)
+			return ret;
+	}
+
+	fastlock_acquire(&rs->slock);
+	ret = dsendmmsg(rs, msgvec, vlen, flags);
+	fastlock_release(&rs->slock);
+	return ret;
 }
 
-static int rs_conn_all_sends_done(struct rsocket *rs)
+ssize_t rwrite(int socket, const void *buf, size_t count)
 {
-	return ((((int) rs->ctrl_max_seqno) - ((int) rs->ctrl_seqno)) +
-		rs->sqe_avail == rs->sq_size) ||
-	       !(rs->state & rs_connected);
+	return rsend(socket, buf, count, 0);
 }
 
-static void ds_set_src(struct sockaddr *addr, socklen_t *addrlen,
-		       struct ds_header *hdr)
+ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
 {
-	union socket_addr sa;
-
-	memset(&sa, 0, sizeof sa);
-	if (hdr->version == 4) {
-		if (*addrlen > sizeof(sa.sin))
-			*addrlen = sizeof(sa.sin);
-
-		sa.sin.sin_family = AF_INET;
-		sa.sin.sin_port = hdr->port;
-		sa.sin.sin_addr.s_addr =  hdr->addr.ipv4;
-	} else {
-		if (*addrlen > sizeof(sa.sin6))
-			*addrlen = sizeof(sa.sin6);
-
-		sa.sin6.sin6_family = AF_INET6;
-		sa.sin6.sin6_port = hdr->port;
-		sa.sin6.sin6_flowinfo = hdr->addr.ipv6.flowinfo;
-		memcpy(&sa.sin6.sin6_addr, &hdr->addr.ipv6.addr, 16);
-	}
-	memcpy(addr, &sa, *addrlen);
+	return rsendv(socket, iov, iovcnt, 0);
 }
 
-static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
-			   struct sockaddr *src_addr, socklen_t *addrlen)
+static struct pollfd *rs_fds_alloc(nfds_t nfds)
 {
-	struct ds_rmsg *rmsg;
-	struct ds_header *hdr;
-	int ret;
-
-	if (!(rs->state & rs_readable))
-		return ERR(EINVAL);
-
-	if (!rs_have_rdata(rs)) {
-		ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
-				  rs_have_rdata);
-		if (ret)
-			return ret;
-	}
-
-	rmsg = &rs->dmsg[rs->rmsg_head];
-	hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
-	if (len > rmsg->length - hdr->length)
-		len = rmsg->length - hdr->length;
+	static __thread struct pollfd *rfds;
+	static __thread nfds_t rnfds;
 
-	memcpy(buf, (void *) hdr + hdr->length, len);
-	if (addrlen)
-		ds_set_src(src_addr, addrlen, hdr);
+	if (nfds > rnfds) {
+		if (rfds)
+			free(rfds);
 
-	if (!(flags & MSG_PEEK)) {
-		ds_post_recv(rs, rmsg->qp, rmsg->offset);
-		if (++rs->rmsg_head == rs->rq_size + 1)
-			rs->rmsg_head = 0;
-		rs->rqe_avail++;
+		rfds = malloc(sizeof(*rfds) * nfds);
+		rnfds = rfds ? nfds : 0;
 	}
 
-	return len;
+	return rfds;
 }
 
-static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
+static int rs_poll_rs(struct rsocket *rs, int events,
+		      int nonblock, int (*test)(struct rsocket *rs))
 {
-	size_t left = len;
-	uint32_t end_size, rsize;
-	int rmsg_head, rbuf_offset;
-
-	rmsg_head = rs->rmsg_head;
-	rbuf_offset = rs->rbuf_offset;
+	struct pollfd fds;
+	short revents;
+	int ret;
 
-	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
-		if (left < rs->rmsg[rmsg_head].data) {
-			rsize = left;
-		} else {
-			rsize = rs->rmsg[rmsg_head].data;
-			if (++rmsg_head == rs->rq_size + 1)
-				rmsg_head = 0;
-		}
+check_cq:
+	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
+	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
+		rs_cork_release(rs, 1);
+		rs_process_cq(rs, nonblock, test);
 
-		end_size = rs->rbuf_size - rbuf_offset;
-		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
-			rbuf_offset = 0;
-			buf += end_size;
-			rsize -= end_size;
-			left -= end_size;
-		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
-		rbuf_offset += rsize;
-		buf += rsize;
-	}
+		revents = 0;
+		if ((events & POLLIN) && rs_conn_have_rdata(rs))
+			revents |= POLLIN;
+		if ((events & POLLOUT) && rs_can_send(rs))
+			revents |= POLLOUT;
+		if (!(rs->state & rs_connected)) {
+			if (rs->state == rs_disconnected)
+				revents |= POLLHUP;
+			else
+				revents |= POLLERR;
+		}
 
-	return len - left;
-}
+		return revents;
+	} else if (rs->type == SOCK_DGRAM) {
+		ds_process_cqs(rs, nonblock, test);
 
-/*
- * Continue to receive any queued data even if the remote side has disconnected.
- */
-ssize_t rrecv(int socket, void *buf, size_t len, int flags)
-{
-	struct rsocket *rs;
-	size_t left = len;
-	uint32_t end_size, rsize;
-	int ret = 0;
+		revents = 0;
+		if ((events & POLLIN) && rs_have_rdata(rs))
+			revents |= POLLIN;
+		if ((events & POLLOUT) && ds_can_send(rs))
+			revents |= POLLOUT;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, NULL, NULL);
-		fastlock_release(&rs->rlock);
-		return ret;
+		return revents;
+	}
+
+	if (rs->state == rs_listening) {
+		fds.fd = rs->cm_id->channel->fd;
+		fds.events = events;
+		fds.revents = 0;
+		poll(&fds, 1, 0);
+		return fds.revents;
 	}
 
 	if (rs->state & rs_opening) {
 		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
+		if (ret && (errno == EINPROGRESS)) {
+			errno = 0;
+		} else {
+			goto check_cq;
 		}
 	}
-	fastlock_acquire(&rs->rlock);
-	do {
-		if (!rs_have_rdata(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_have_rdata);
-			if (ret)
-				break;
-		}
-
-		if (flags & MSG_PEEK) {
-			left = len - rs_peek(rs, buf, left);
-			break;
-		}
-
-		for (; left && rs_have_rdata(rs); left -= rsize) {
-			if (left < rs->rmsg[rs->rmsg_head].data) {
-				rsize = left;
-				rs->rmsg[rs->rmsg_head].data -= left;
-			} else {
-				rs->rseq_no++;
-				rsize = rs->rmsg[rs->rmsg_head].data;
-				if (++rs->rmsg_head == rs->rq_size + 1)
-					rs->rmsg_head = 0;
-			}
-
-			end_size = rs->rbuf_size - rs->rbuf_offset;
-			if (rsize > end_size) {
-				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
-				rs->rbuf_offset = 0;
-				buf += end_size;
-				rsize -= end_size;
-				left -= end_size;
-				rs->rbuf_bytes_avail += end_size;
-			}
-			memcpy(buf, &rs->rbuf[rs->rbuf_offset], rsize);
-			rs->rbuf_offset += rsize;
-			buf += rsize;
-			rs->rbuf_bytes_avail += rsize;
-		}
 
-	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
+	if (rs->state == rs_connect_error) {
+		revents = 0;
+		if (events & POLLOUT)
+			revents |= POLLOUT;
+		if (events & POLLIN)
+			revents |= POLLIN;
+		revents |= POLLERR;
+		return revents;
+	}
 
-	fastlock_release(&rs->rlock);
-	return (ret && left == len) ? ret : len - left;
+	return 0;
 }
 
-ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
-		  struct sockaddr *src_addr, socklen_t *addrlen)
+static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
 {
 	struct rsocket *rs;
-	int ret;
-
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->rlock);
-		ret = ds_recvfrom(rs, buf, len, flags, src_addr, addrlen);
-		fastlock_release(&rs->rlock);
-		return ret;
-	}
+	int i, cnt = 0;
 
-	ret = rrecv(socket, buf, len, flags);
-	if (ret > 0 && src_addr)
-		rgetpeername(socket, src_addr, addrlen);
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		else
+			poll(&fds[i], 1, 0);
 
-	return ret;
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
 }
 
 /*
- * Simple, straightforward implementation for now that only tries to fill
- * in the first vector.
+ * Return the fd that becomes readable when an rsocket may have new events.
  */
-static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
+static int rs_wait_fd(struct rsocket *rs)
 {
-	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+
+	return (rs->state >= rs_connected) ?
+		rs->cm_id->recv_cq_channel->fd : rs->cm_id->channel->fd;
 }
 
-ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
+static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 {
-	if (msg->msg_control && msg->msg_controllen)
-		return ERR(ENOTSUP);
+	struct rsocket *rs;
+	int i;
 
-	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
-}
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
+			if (fds[i].revents)
+				return 1;
 
-ssize_t rread(int socket, void *buf, size_t count)
-{
-	return rrecv(socket, buf, count, 0);
+			rfds[i].fd = rs_wait_fd(rs);
+			rfds[i].events = POLLIN;
+		} else {
+			rfds[i].fd = fds[i].fd;
+			rfds[i].events = fds[i].events;
+		}
+		rfds[i].revents = 0;
+	}
+	return 0;
 }
 
-ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt)
+static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 {
-	return rrecvv(socket, iov, iovcnt, 0);
+	struct rsocket *rs;
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (!rfds[i].revents)
+			continue;
+
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			fastlock_acquire(&rs->cq_wait_lock);
+			if (rs->type == SOCK_STREAM)
+				rs_get_cq_event(rs);
+			else
+				ds_get_cq_event(rs);
+			fastlock_release(&rs->cq_wait_lock);
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		} else {
+			fds[i].revents = rfds[i].revents;
+		}
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
 }
 
-static int rs_send_iomaps(struct rsocket *rs, int flags)
+/*
+ * We need to poll *all* fd's that the user specifies at least once.
+ * Note that we may receive events on an rsocket that may not be reported
+ * to the user (e.g. connection events or credit updates).  Process those
+ * events, then return to polling until we find ones of interest.
+ */
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
 {
-	struct rs_iomap_mr *iomr;
-	struct ibv_sge sge;
-	struct rs_iomap iom;
+	struct timeval s, e;
+	struct pollfd *rfds;
+	uint32_t poll_time = 0;
 	int ret;
 
-	fastlock_acquire(&rs->map_lock);
-	while (!dlist_empty(&rs->iomap_queue)) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
+	do {
+		ret = rs_poll_check(fds, nfds);
+		if (ret || !timeout)
+			return ret;
 
-		iomr = container_of(rs->iomap_queue.next, struct rs_iomap_mr, entry);
-		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			iom.offset = iomr->offset;
-			iom.sge.addr = (uintptr_t) iomr->mr->addr;
-			iom.sge.length = iomr->mr->length;
-			iom.sge.key = iomr->mr->rkey;
-		} else {
-			iom.offset = bswap_64(iomr->offset);
-			iom.sge.addr = bswap_64((uintptr_t) iomr->mr->addr);
-			iom.sge.length = bswap_32(iomr->mr->length);
-			iom.sge.key = bswap_32(iomr->mr->rkey);
-		}
+		if (!poll_time)
+			gettimeofday(&s, NULL);
 
-		if (rs->sq_inline >= sizeof iom) {
-			sge.addr = (uintptr_t) &iom;
-			sge.length = sizeof iom;
-			sge.lkey = 0;
-			ret = rs_write_iomap(rs, iomr, &sge, 1, IBV_SEND_INLINE);
-		} else if (rs_sbuf_left(rs) >= sizeof iom) {
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &iom, sizeof iom);
-			rs->ssgl[0].length = sizeof iom;
-			ret = rs_write_iomap(rs, iomr, rs->ssgl, 1, 0);
-			if (rs_sbuf_left(rs) > sizeof iom)
-				rs->ssgl[0].addr += sizeof iom;
-			else
-				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
-		} else {
-			rs->ssgl[0].length = rs_sbuf_left(rs);
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, &iom,
-				rs->ssgl[0].length);
-			rs->ssgl[1].length = sizeof iom - rs->ssgl[0].length;
-			memcpy(rs->sbuf, ((void *) &iom) + rs->ssgl[0].length,
-			       rs->ssgl[1].length);
-			ret = rs_write_iomap(rs, iomr, rs->ssgl, 2, 0);
-			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
-		}
-		dlist_remove(&iomr->entry);
-		dlist_insert_tail(&iomr->entry, &rs->iomap_list);
+		gettimeofday(&e, NULL);
+		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
+			    (e.tv_usec - s.tv_usec) + 1;
+	} while (poll_time <= polling_time);
+
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
+	do {
+		ret = rs_poll_arm(rfds, fds, nfds);
 		if (ret)
 			break;
-	}
 
-	rs->iomap_pending = !dlist_empty(&rs->iomap_queue);
-	fastlock_release(&rs->map_lock);
+		ret = poll(rfds, nfds, timeout);
+		if (ret <= 0)
+			break;
+
+		ret = rs_poll_events(rfds, fds, nfds);
+	} while (!ret);
+
 	return ret;
 }
 
-static ssize_t ds_sendv_udp(struct rsocket *rs, const struct iovec *iov,
-			    int iovcnt, int flags, uint8_t op)
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
 {
-	struct ds_udp_header hdr;
-	struct msghdr msg;
-	struct iovec miov[8];
-	ssize_t ret;
+	struct pollfd *fds;
+	int fd, i = 0;
 
-	if (iovcnt > 8)
-		return ERR(ENOTSUP);
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
 
-	hdr.tag = htobe32(DS_UDP_TAG);
-	hdr.version = rs->conn_dest->qp->hdr.version;
-	hdr.op = op;
-	hdr.reserved = 0;
-	hdr.qpn = htobe32(rs->conn_dest->qp->cm_id->qp->qp_num & 0xFFFFFF);
-	if (rs->conn_dest->qp->hdr.version == 4) {
-		hdr.length = DS_UDP_IPV4_HDR_LEN;
-		hdr.addr.ipv4 = rs->conn_dest->qp->hdr.addr.ipv4;
-	} else {
-		hdr.length = DS_UDP_IPV6_HDR_LEN;
-		memcpy(hdr.addr.ipv6, &rs->conn_dest->qp->hdr.addr.ipv6, 16);
-	}
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
 
-	miov[0].iov_base = &hdr;
-	miov[0].iov_len = hdr.length;
-	if (iov && iovcnt)
-		memcpy(&miov[1], iov, sizeof(*iov) * iovcnt);
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
 
-	memset(&msg, 0, sizeof msg);
-	msg.msg_name = &rs->conn_dest->addr;
-	msg.msg_namelen = ucma_addrlen(&rs->conn_dest->addr.sa);
-	msg.msg_iov = miov;
-	msg.msg_iovlen = iovcnt + 1;
-	ret = sendmsg(rs->udp_sock, &msg, flags);
-	return ret > 0 ? ret - hdr.length : ret;
-}
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
 
-static ssize_t ds_send_udp(struct rsocket *rs, const void *buf, size_t len,
-			   int flags, uint8_t op)
-{
-	struct iovec iov;
-	if (buf && len) {
-		iov.iov_base = (void *) buf;
-		iov.iov_len = len;
-		return ds_sendv_udp(rs, &iov, 1, flags, op);
-	} else {
-		return ds_sendv_udp(rs, NULL, 0, flags, op);
+		if (fds[i].fd)
+			i++;
 	}
+
+	*nfds = i;
+	return fds;
 }
 
-static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
 {
-	struct ds_smsg *msg;
-	struct ibv_sge sge;
-	uint64_t offset;
-	int ret = 0;
-
-	if (!rs->conn_dest->ah)
-		return ds_send_udp(rs, buf, len, flags, RS_OP_DATA);
+	int i, cnt = 0;
 
-	if (!ds_can_send(rs)) {
-		ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
-		if (ret)
-			return ret;
-	}
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
 
-	msg = rs->smsg_free;
-	rs->smsg_free = msg->next;
-	rs->sqe_avail--;
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
 
-	memcpy((void *) msg, &rs->conn_dest->qp->hdr, rs->conn_dest->qp->hdr.length);
-	memcpy((void *) msg + rs->conn_dest->qp->hdr.length, buf, len);
-	sge.addr = (uintptr_t) msg;
-	sge.length = rs->conn_dest->qp->hdr.length + len;
-	sge.lkey = rs->conn_dest->qp->smr->lkey;
-	offset = (uint8_t *) msg - rs->sbuf;
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
 
-	ret = ds_post_send(rs, &sge, offset);
-	return ret ? ret : len;
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
 }
 
-/*
- * We overlap sending the data, by posting a small work request immediately,
- * then increasing the size of the send on each iteration.
- */
-ssize_t rsend(int socket, const void *buf, size_t len, int flags)
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
 {
-	struct rsocket *rs;
-	struct ibv_sge sge;
-	size_t left = len;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int ret = 0;
+	struct pollfd *fds;
+	int ret;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM) {
-		fastlock_acquire(&rs->slock);
-		ret = dsend(rs, buf, len, flags);
-		fastlock_release(&rs->slock);
-		return ret;
-	}
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
 
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
-	}
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
 
-	fastlock_acquire(&rs->slock);
-	if (rs->iomap_pending) {
-		ret = rs_send_iomaps(rs, flags);
-		if (ret)
-			goto out;
-	}
-	for (; left; left -= xfer_size, buf += xfer_size) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
 
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
-		}
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
 
-		if (xfer_size > rs->sbuf_bytes_avail)
-			xfer_size = rs->sbuf_bytes_avail;
-		if (xfer_size > rs->target_sgl[rs->target_sge].length)
-			xfer_size = rs->target_sgl[rs->target_sge].length;
+	free(fds);
+	return ret;
+}
 
-		if (xfer_size <= rs->sq_inline) {
-			sge.addr = (uintptr_t) buf;
-			sge.length = xfer_size;
-			sge.lkey = 0;
-			ret = rs_write_data(rs, &sge, 1, xfer_size, IBV_SEND_INLINE);
-		} else if (xfer_size <= rs_sbuf_left(rs)) {
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
-			rs->ssgl[0].length = xfer_size;
-			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size, 0);
-			if (xfer_size < rs_sbuf_left(rs))
-				rs->ssgl[0].addr += xfer_size;
-			else
-				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
-		} else {
-			rs->ssgl[0].length = rs_sbuf_left(rs);
-			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf,
-				rs->ssgl[0].length);
-			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
-			memcpy(rs->sbuf, buf + rs->ssgl[0].length, rs->ssgl[1].length);
-			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size, 0);
-			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
-		}
-		if (ret)
-			break;
-	}
-out:
-	fastlock_release(&rs->slock);
 
-	return (ret && left == len) ? ret : len - left;
-}
+/*
+ * repoll - epoll style interface supporting rsockets and normal fd's.
+ *
+ * The handle returned to the user is a kernel epoll fd.  Normal fd's are
+ * added to it directly, and their events are reported as-is.  An rsocket
+ * is represented in the kernel set by the fd that becomes readable when
+ * the rsocket may have new events (see rs_wait_fd).  When that fd fires,
+ * we process the rsocket's CQ and place it on a ready list.  Rsockets on
+ * the ready list are re-checked on every wait, which gives level triggered
+ * behavior without blocking in the kernel.  Edge triggered notification
+ * is not supported for rsockets, and is treated as level triggered.
+ *
+ * Items are indexed by the user's fd.  Kernel registrations are indexed
+ * by the registered fd, which is stored as the kernel event data.  Several
+ * rsockets may wait on the same fd if they share a CQ.  Kernel events for
+ * fd's that have since been removed are simply ignored.
+ *
+ * As with epoll, closing a normal fd removes it from the kernel set, but
+ * our item stays behind.  Such stale items are dropped once the fd number
+ * is registered again, see rs_epoll_drop_stale.
+ */
+struct rs_epoll {
+	int		  epfd;
+	fastlock_t	  lock;
+	dlist_entry	  item_list;
+	dlist_entry	  ready_list;
+	struct index_map  items;
+	struct index_map  kfds;
+};
 
-ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
-		const struct sockaddr *dest_addr, socklen_t addrlen)
+struct rs_epoll_kfd {
+	dlist_entry	  item_list;
+};
+
+struct rs_epoll_item {
+	dlist_entry	  ep_entry;
+	dlist_entry	  ready_entry;
+	dlist_entry	  rs_entry;
+	dlist_entry	  kfd_entry;
+	struct rs_epoll	  *ep;
+	struct rsocket	  *rs;
+	int		  fd;
+	int		  kfd;
+	int		  ready;
+	int		  disabled;
+	struct epoll_event event;
+};
+
+static struct epoll_event *rs_epoll_events_alloc(int maxevents)
 {
-	struct rsocket *rs;
-	int ret;
+	static __thread struct epoll_event *kevents;
+	static __thread int rmaxevents;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->type == SOCK_STREAM) {
-		if (dest_addr || addrlen)
-			return ERR(EISCONN);
+	if (maxevents > rmaxevents) {
+		if (kevents)
+			free(kevents);
 
-		return rsend(socket, buf, len, flags);
+		kevents = malloc(sizeof(*kevents) * maxevents);
+		rmaxevents = kevents ? maxevents : 0;
 	}
 
-	if (rs->state == rs_init) {
-		ret = ds_init_ep(rs);
-		if (ret)
-			return ret;
-	}
+	return kevents;
+}
 
-	fastlock_acquire(&rs->slock);
-	if (!rs->conn_dest || ds_compare_addr(dest_addr, &rs->conn_dest->addr)) {
-		ret = ds_get_dest(rs, dest_addr, addrlen, &rs->conn_dest);
-		if (ret)
-			goto out;
+static void rs_epoll_set_ready(struct rs_epoll_item *item)
+{
+	if (!item->ready) {
+		dlist_insert_tail(&item->ready_entry, &item->ep->ready_list);
+		item->ready = 1;
 	}
+}
 
-	ret = dsend(rs, buf, len, flags);
-out:
-	fastlock_release(&rs->slock);
-	return ret;
+static void rs_epoll_clear_ready(struct rs_epoll_item *item)
+{
+	if (item->ready) {
+		dlist_remove(&item->ready_entry);
+		item->ready = 0;
+	}
 }
 
-static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, size_t len)
+static void rs_epoll_unregister(struct rs_epoll_item *item)
 {
-	size_t size;
+	struct rs_epoll *ep = item->ep;
+	struct rs_epoll_kfd *kent;
 
-	while (len) {
-		size = (*iov)->iov_len - *offset;
-		if (size > len) {
-			memcpy (dst, (*iov)->iov_base + *offset, len);
-			*offset += len;
-			break;
-		}
+	if (item->kfd < 0)
+		return;
 
-		memcpy(dst, (*iov)->iov_base + *offset, size);
-		len -= size;
-		dst += size;
-		(*iov)++;
-		*offset = 0;
+	dlist_remove(&item->kfd_entry);
+	kent = idm_at(&ep->kfds, item->kfd);
+	if (dlist_empty(&kent->item_list)) {
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->kfd, NULL);
+		idm_clear(&ep->kfds, item->kfd);
+		free(kent);
 	}
+	item->kfd = -1;
 }
 
-static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
+static int rs_epoll_kfd_add(struct rs_epoll_item *item, int kfd, uint32_t events)
 {
-	struct rsocket *rs;
-	const struct iovec *cur_iov;
-	size_t left, len, offset = 0;
-	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int i, ret = 0;
+	struct rs_epoll *ep = item->ep;
+	struct rs_epoll_kfd *kent;
+	struct epoll_event event;
 
-	rs = idm_at(&idm, socket);
-	if (!rs)
-		return ERR(EBADF);
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret) {
-			if (errno == EINPROGRESS)
-				errno = EAGAIN;
-			return ret;
-		}
-	}
+	kent = idm_lookup(&ep->kfds, kfd);
+	if (!kent) {
+		kent = calloc(1, sizeof(*kent));
+		if (!kent)
+			return ERR(ENOMEM);
 
-	cur_iov = iov;
-	len = iov[0].iov_len;
-	for (i = 1; i < iovcnt; i++)
-		len += iov[i].iov_len;
-	left = len;
+		dlist_init(&kent->item_list);
+		if (idm_set(&ep->kfds, kfd, kent) < 0)
+			goto err1;
 
-	fastlock_acquire(&rs->slock);
-	if (rs->iomap_pending) {
-		ret = rs_send_iomaps(rs, flags);
-		if (ret)
-			goto out;
+		event.events = events;
+		event.data.u64 = 0;
+		event.data.fd = kfd;
+		if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, kfd, &event))
+			goto err2;
 	}
-	for (; left; left -= xfer_size) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
-			if (ret)
-				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
-		}
-
-		if (olen < left) {
-			xfer_size = olen;
-			if (olen < RS_MAX_TRANSFER)
-				olen <<= 1;
-		} else {
-			xfer_size = left;
-		}
 
-		if (xfer_size > rs->sbuf_bytes_avail)
-			xfer_size = rs->sbuf_bytes_avail;
-		if (xfer_size > rs->target_sgl[rs->target_sge].length)
-			xfer_size = rs->target_sgl[rs->target_sge].length;
+	dlist_insert_tail(&item->kfd_entry, &kent->item_list);
+	item->kfd = kfd;
+	return 0;
 
-		if (xfer_size <= rs_sbuf_left(rs)) {
-			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr,
-				    &cur_iov, &offset, xfer_size);
-			rs->ssgl[0].length = xfer_size;
-			ret = rs_write_data(rs, rs->ssgl, 1, xfer_size,
-					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
-			if (xfer_size < rs_sbuf_left(rs))
-				rs->ssgl[0].addr += xfer_size;
-			else
-				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
-		} else {
-			rs->ssgl[0].length = rs_sbuf_left(rs);
-			rs_copy_iov((void *) (uintptr_t) rs->ssgl[0].addr, &cur_iov,
-				    &offset, rs->ssgl[0].length);
-			rs->ssgl[1].length = xfer_size - rs->ssgl[0].length;
-			rs_copy_iov(rs->sbuf, &cur_iov, &offset, rs->ssgl[1].length);
-			ret = rs_write_data(rs, rs->ssgl, 2, xfer_size,
-					    xfer_size <= rs->sq_inline ? IBV_SEND_INLINE : 0);
-			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
-		}
-		if (ret)
-			break;
-	}
-out:
-	fastlock_release(&rs->slock);
+err2:
+	idm_clear(&ep->kfds, kfd);
+err1:
+	free(kent);
+	return -1;
+}
 
-	return (ret && left == len) ? ret : len - left;
+static void rs_epoll_del(struct rs_epoll_item *item)
+{
+	rs_epoll_unregister(item);
+	rs_epoll_clear_ready(item);
+	dlist_remove(&item->ep_entry);
+	if (item->rs)
+		dlist_remove(&item->rs_entry);
+	idm_clear(&item->ep->items, item->fd);
+	free(item);
 }
 
-ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
+/*
+ * A normal fd that was closed without being removed is no longer in the
+ * kernel set, so adding its number to the kernel set succeeds.  If the fd
+ * is still registered, the add fails with EEXIST and nothing changes.
+ */
+static void rs_epoll_drop_stale(struct rs_epoll *ep, int fd)
 {
-	if (msg->msg_control && msg->msg_controllen)
-		return ERR(ENOTSUP);
+	struct rs_epoll_item *item;
+	struct rs_epoll_kfd *kent;
+	struct epoll_event event;
 
-	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
+	kent = idm_lookup(&ep->kfds, fd);
+	if (!kent)
+		return;
+
+	item = container_of(kent->item_list.next, struct rs_epoll_item, kfd_entry);
+	if (item->rs)
+		return;
+
+	event.events = 0;
+	event.data.u64 = 0;
+	event.data.fd = fd;
+	if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &event))
+		return;
+
+	/* removes the kernel registration that we just made */
+	rs_epoll_del(item);
 }
 
-ssize_t rwrite(int socket, const void *buf, size_t count)
+/*
+ * Make sure the kernel is waiting on the correct fd for an rsocket.  The
+ * fd changes once a stream rsocket connects.
+ */
+static int rs_epoll_register(struct rs_epoll_item *item)
 {
-	return rsend(socket, buf, count, 0);
+	int kfd;
+
+	kfd = rs_wait_fd(item->rs);
+	if (kfd == item->kfd)
+		return 0;
+
+	rs_epoll_unregister(item);
+	rs_epoll_drop_stale(item->ep, kfd);
+	return rs_epoll_kfd_add(item, kfd, EPOLLIN);
 }
 
-ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
+static uint32_t rs_epoll_poll_item(struct rs_epoll_item *item, int nonblock,
+				   int (*test)(struct rsocket *rs))
 {
-	return rsendv(socket, iov, iovcnt, 0);
+	uint32_t events = item->event.events;
+
+	return rs_poll_rs(item->rs, events & (EPOLLIN | EPOLLOUT),
+			  nonblock, test) & (events | EPOLLERR | EPOLLHUP);
 }
 
-static struct pollfd *rs_fds_alloc(nfds_t nfds)
+static int rs_epoll_add(struct rs_epoll *ep, int fd, struct epoll_event *event)
 {
-	static __thread struct pollfd *rfds;
-	static __thread nfds_t rnfds;
+	struct rs_epoll_item *item;
+	int ret;
 
-	if (nfds > rnfds) {
-		if (rfds)
-			free(rfds);
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
 
-		rfds = malloc(sizeof(*rfds) * nfds);
-		rnfds = rfds ? nfds : 0;
+	item->ep = ep;
+	item->fd = fd;
+	item->kfd = -1;
+	item->event = *event;
+	item->rs = idm_lookup(&idm, fd);
+	if (!item->rs) {
+		ret = rs_epoll_kfd_add(item, fd, event->events);
+		if (ret)
+			goto err1;
 	}
 
-	return rfds;
+	ret = idm_set(&ep->items, fd, item);
+	if (ret < 0)
+		goto err2;
+
+	dlist_insert_tail(&item->ep_entry, &ep->item_list);
+	if (item->rs) {
+		dlist_insert_tail(&item->rs_entry, &item->rs->epoll_items);
+		/* Check for events on the next wait, which also arms the rsocket */
+		rs_epoll_set_ready(item);
+	}
+	return 0;
+
+err2:
+	rs_epoll_unregister(item);
+err1:
+	free(item);
+	return ret;
 }
 
-static int rs_poll_rs(struct rsocket *rs, int events,
-		      int nonblock, int (*test)(struct rsocket *rs))
+static int rs_epoll_mod(struct rs_epoll_item *item, struct epoll_event *event)
 {
-	struct pollfd fds;
-	short revents;
-	int ret;
-
-check_cq:
-	if ((rs->type == SOCK_STREAM) && ((rs->state & rs_connected) ||
-	     (rs->state == rs_disconnected) || (rs->state & rs_error))) {
-		rs_process_cq(rs, nonblock, test);
+	struct epoll_event kevent;
 
-		revents = 0;
-		if ((events & POLLIN) && rs_conn_have_rdata(rs))
-			revents |= POLLIN;
-		if ((events & POLLOUT) && rs_can_send(rs))
-			revents |= POLLOUT;
-		if (!(rs->state & rs_connected)) {
-			if (rs->state == rs_disconnected)
-				revents |= POLLHUP;
-			else
-				revents |= POLLERR;
-		}
+	if (!item->rs) {
+		kevent.events = event->events;
+		kevent.data.u64 = 0;
+		kevent.data.fd = item->fd;
+		if (epoll_ctl(item->ep->epfd, EPOLL_CTL_MOD, item->fd, &kevent))
+			return -1;
+	}
 
-		return revents;
-	} else if (rs->type == SOCK_DGRAM) {
-		ds_process_cqs(rs, nonblock, test);
+	item->event = *event;
+	if (item->rs) {
+		item->disabled = 0;
+		rs_epoll_set_ready(item);
+	}
+	return 0;
+}
 
-		revents = 0;
-		if ((events & POLLIN) && rs_have_rdata(rs))
-			revents |= POLLIN;
-		if ((events & POLLOUT) && ds_can_send(rs))
-			revents |= POLLOUT;
+/*
+ * Called when closing an rsocket.  Lock ordering is mut, then ep->lock.
+ */
+static void rs_epoll_remove_rs(struct rsocket *rs)
+{
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
 
-		return revents;
+	pthread_mutex_lock(&mut);
+	while (!dlist_empty(&rs->epoll_items)) {
+		item = container_of(rs->epoll_items.next,
+				    struct rs_epoll_item, rs_entry);
+		ep = item->ep;
+		fastlock_acquire(&ep->lock);
+		rs_epoll_del(item);
+		fastlock_release(&ep->lock);
 	}
+	pthread_mutex_unlock(&mut);
+}
 
-	if (rs->state == rs_listening) {
-		fds.fd = rs->cm_id->channel->fd;
-		fds.events = events;
-		fds.revents = 0;
-		poll(&fds, 1, 0);
-		return fds.revents;
-	}
+static int rs_epoll_close(int epfd)
+{
+	struct rs_epoll *ep;
+	int i;
 
-	if (rs->state & rs_opening) {
-		ret = rs_do_connect(rs);
-		if (ret && (errno == EINPROGRESS)) {
-			errno = 0;
-		} else {
-			goto check_cq;
-		}
+	pthread_mutex_lock(&mut);
+	ep = idm_lookup(&epm, epfd);
+	if (!ep) {
+		pthread_mutex_unlock(&mut);
+		return EBADF;
 	}
 
-	if (rs->state == rs_connect_error) {
-		revents = 0;
-		if (events & POLLOUT)
-			revents |= POLLOUT;
-		if (events & POLLIN)
-			revents |= POLLIN;
-		revents |= POLLERR;
-		return revents;
-	}
+	idm_clear(&epm, epfd);
+	fastlock_acquire(&ep->lock);
+	while (!dlist_empty(&ep->item_list))
+		rs_epoll_del(container_of(ep->item_list.next,
+					  struct rs_epoll_item, ep_entry));
+	fastlock_release(&ep->lock);
+	pthread_mutex_unlock(&mut);
 
+	for (i = 0; i < IDX_ARRAY_SIZE; i++) {
+		free(ep->items.array[i]);
+		free(ep->kfds.array[i]);
+	}
+	fastlock_destroy(&ep->lock);
+	close(ep->epfd);
+	free(ep);
 	return 0;
 }
 
-static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
+int repoll_create1(int flags)
 {
-	struct rsocket *rs;
-	int i, cnt = 0;
+	struct rs_epoll *ep;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs)
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		else
-			poll(&fds[i], 1, 0);
+	if (flags & ~EPOLL_CLOEXEC)
+		return ERR(EINVAL);
 
-		if (fds[i].revents)
-			cnt++;
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return ERR(ENOMEM);
+
+	ep->epfd = epoll_create1(flags);
+	if (ep->epfd < 0) {
+		ret = ep->epfd;
+		goto err1;
 	}
-	return cnt;
+
+	fastlock_init(&ep->lock);
+	dlist_init(&ep->item_list);
+	dlist_init(&ep->ready_list);
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&epm, ep->epfd, ep);
+	pthread_mutex_unlock(&mut);
+	if (ret < 0)
+		goto err2;
+
+	return ep->epfd;
+
+err2:
+	fastlock_destroy(&ep->lock);
+	close(ep->epfd);
+err1:
+	free(ep);
+	return ret;
 }
 
-static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+int repoll_create(int size)
 {
-	struct rsocket *rs;
-	int i;
-
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 0, rs_is_cq_armed);
-			if (fds[i].revents)
-				return 1;
+	if (size <= 0)
+		return ERR(EINVAL);
 
-			if (rs->type == SOCK_STREAM) {
-				if (rs->state >= rs_connected)
-					rfds[i].fd = rs->cm_id->recv_cq_channel->fd;
-				else
-					rfds[i].fd = rs->cm_id->channel->fd;
-			} else {
-				rfds[i].fd = rs->epfd;
-			}
-			rfds[i].events = POLLIN;
-		} else {
-			rfds[i].fd = fds[i].fd;
-			rfds[i].events = fds[i].events;
-		}
-		rfds[i].revents = 0;
-	}
-	return 0;
+	return repoll_create1(0);
 }
 
-static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	struct rsocket *rs;
-	int i, cnt = 0;
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		if (!rfds[i].revents)
-			continue;
+	ep = idm_lookup(&epm, epfd);
+	if (!ep)
+		return ERR(EBADF);
 
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			fastlock_acquire(&rs->cq_wait_lock);
-			if (rs->type == SOCK_STREAM)
-				rs_get_cq_event(rs);
-			else
-				ds_get_cq_event(rs);
-			fastlock_release(&rs->cq_wait_lock);
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+	if (fd == epfd)
+		return ERR(EINVAL);
+
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	pthread_mutex_lock(&mut);
+	fastlock_acquire(&ep->lock);
+	if (op == EPOLL_CTL_ADD)
+		rs_epoll_drop_stale(ep, fd);
+	item = idm_lookup(&ep->items, fd);
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		ret = item ? ERR(EEXIST) : rs_epoll_add(ep, fd, event);
+		break;
+	case EPOLL_CTL_MOD:
+		ret = item ? rs_epoll_mod(item, event) : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		if (item) {
+			rs_epoll_del(item);
+			ret = 0;
 		} else {
-			fds[i].revents = rfds[i].revents;
+			ret = ERR(ENOENT);
 		}
-		if (fds[i].revents)
-			cnt++;
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
-	return cnt;
+	fastlock_release(&ep->lock);
+	pthread_mutex_unlock(&mut);
+	return ret;
 }
 
 /*
- * We need to poll *all* fd's that the user specifies at least once.
- * Note that we may receive events on an rsocket that may not be reported
- * to the user (e.g. connection events or credit updates).  Process those
- * events, then return to polling until we find ones of interest.
+ * Re-check rsockets on the ready list, dropping those which no longer
+ * have events.  If we run out of space to report events, rotate the list
+ * so that the remaining rsockets are checked first on the next call.
  */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+static int rs_epoll_check_ready(struct rs_epoll *ep, struct epoll_event *events,
+				int cnt, int maxevents)
 {
-	struct timeval s, e;
-	struct pollfd *rfds;
-	uint32_t poll_time = 0;
-	int ret;
-
-	do {
-		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
-			return ret;
-
-		if (!poll_time)
-			gettimeofday(&s, NULL);
-
-		gettimeofday(&e, NULL);
-		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
-			    (e.tv_usec - s.tv_usec) + 1;
-	} while (poll_time <= polling_time);
-
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
+	struct rs_epoll_item *item;
+	dlist_entry *entry;
+	uint32_t revents;
 
-	do {
-		ret = rs_poll_arm(rfds, fds, nfds);
-		if (ret)
+	for (entry = ep->ready_list.next; entry != &ep->ready_list; ) {
+		if (cnt == maxevents) {
+			dlist_remove(&ep->ready_list);
+			dlist_insert_before(&ep->ready_list, entry);
 			break;
+		}
 
-		ret = poll(rfds, nfds, timeout);
-		if (ret <= 0)
-			break;
+		item = container_of(entry, struct rs_epoll_item, ready_entry);
+		entry = entry->next;
 
-		ret = rs_poll_events(rfds, fds, nfds);
-	} while (!ret);
+		revents = rs_epoll_poll_item(item, 1, rs_poll_all);
+		if (!revents) {
+			rs_epoll_clear_ready(item);
+			continue;
+		}
 
-	return ret;
+		events[cnt].events = revents;
+		events[cnt++].data = item->event.data;
+		if (item->event.events & EPOLLONESHOT) {
+			rs_epoll_clear_ready(item);
+			rs_epoll_unregister(item);
+			item->disabled = 1;
+		}
+	}
+	return cnt;
 }
 
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+/*
+ * Process events returned by the kernel, then report all ready items.
+ * Normal fd's are reported first.  There can be no more of those than
+ * maxevents, since that limits the number of kernel events.
+ */
+static int rs_epoll_events(struct rs_epoll *ep, struct epoll_event *kevents,
+			   int nevents, struct epoll_event *events, int maxevents)
 {
-	struct pollfd *fds;
-	int fd, i = 0;
-
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
+	struct rs_epoll_item *item;
+	struct rs_epoll_kfd *kent;
+	struct rsocket *rs;
+	dlist_entry *entry;
+	int i, cnt = 0;
 
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
-		}
+	fastlock_acquire(&ep->lock);
+	for (i = 0; i < nevents; i++) {
+		kent = idm_lookup(&ep->kfds, kevents[i].data.fd);
+		if (!kent)
+			continue;
 
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
+		item = container_of(kent->item_list.next,
+				    struct rs_epoll_item, kfd_entry);
+		rs = item->rs;
+		if (!rs) {
+			events[cnt].events = kevents[i].events;
+			events[cnt++].data = item->event.data;
+			continue;
 		}
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
+		/* All rsockets waiting on the fd share the event */
+		fastlock_acquire(&rs->cq_wait_lock);
+		if (rs->type == SOCK_STREAM)
+			rs_get_cq_event(rs);
+		else
+			ds_get_cq_event(rs);
+		fastlock_release(&rs->cq_wait_lock);
 
-		if (fds[i].fd)
-			i++;
+		for (entry = kent->item_list.next; entry != &kent->item_list;
+		     entry = entry->next)
+			rs_epoll_set_ready(container_of(entry, struct rs_epoll_item,
+							kfd_entry));
 	}
 
-	*nfds = i;
-	return fds;
+	cnt = rs_epoll_check_ready(ep, events, cnt, maxevents);
+	fastlock_release(&ep->lock);
+	return cnt;
 }
 
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
+/*
+ * Arm all rsockets that are not ready, so that the kernel will signal us
+ * when they have new events.  Rsockets that are found to be ready are
+ * placed on the ready list.  Only rsockets whose CQ is not armed need to
+ * be checked.  Rsockets which are not yet connected are driven by the
+ * rdma_cm channel, which is level triggered.
+ */
+static int rs_epoll_arm(struct rs_epoll *ep)
 {
-	int i, cnt = 0;
+	struct rs_epoll_item *item;
+	struct rsocket *rs;
+	dlist_entry *entry;
+	int cnt = 0;
 
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
-		}
+	fastlock_acquire(&ep->lock);
+	for (entry = ep->item_list.next; entry != &ep->item_list;
+	     entry = entry->next) {
+		item = container_of(entry, struct rs_epoll_item, ep_entry);
+		rs = item->rs;
+		if (!rs || item->ready || item->disabled)
+			continue;
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
+		if (!rs_is_cq_armed(rs) &&
+		    ((rs->type == SOCK_DGRAM) || (rs->state >= rs_connected)) &&
+		    rs_epoll_poll_item(item, 0, rs_is_cq_armed)) {
+			rs_epoll_set_ready(item);
 			cnt++;
+			continue;
 		}
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
+		if (rs_epoll_register(item)) {
+			cnt = -1;
+			break;
 		}
 	}
+	fastlock_release(&ep->lock);
 	return cnt;
 }
 
-static int rs_convert_timeout(struct timeval *timeout)
+/*
+ * Like rpoll, we poll for events for a short time before arming the
+ * rsockets and blocking in the kernel.
+ */
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
-}
+	struct epoll_event *kevents;
+	struct rs_epoll *ep;
+	struct timeval s, e;
+	uint32_t poll_time = 0;
+	int nevents, ret;
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
-{
-	struct pollfd *fds;
-	int ret;
+	ep = idm_lookup(&epm, epfd);
+	if (!ep)
+		return ERR(EBADF);
 
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
+	if (maxevents <= 0)
+		return ERR(EINVAL);
+
+	kevents = rs_epoll_events_alloc(maxevents);
+	if (!kevents)
 		return ERR(ENOMEM);
 
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	do {
+		ret = epoll_wait(ep->epfd, kevents, maxevents, 0);
+		if (ret < 0)
+			return ret;
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+		ret = rs_epoll_events(ep, kevents, ret, events, maxevents);
+		if (ret || !timeout)
+			return ret;
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+		if (!poll_time)
+			gettimeofday(&s, NULL);
+
+		gettimeofday(&e, NULL);
+		poll_time = (e.tv_sec - s.tv_sec) * 1000000 +
+			    (e.tv_usec - s.tv_usec) + 1;
+	} while (poll_time <= polling_time);
+
+	do {
+		ret = rs_epoll_arm(ep);
+		if (ret < 0)
+			break;
+
+		nevents = epoll_wait(ep->epfd, kevents, maxevents, ret ? 0 : timeout);
+		if (nevents <= 0) {
+			if (!ret) {
+				ret = nevents;
+				break;
+			}
+			nevents = 0;
+		}
+
+		ret = rs_epoll_events(ep, kevents, nevents, events, maxevents);
+	} while (!ret);
 
-	free(fds);
 	return ret;
 }
 
@@ -3246,6 +6047,12 @@ int rshutdown(int socket, int how)
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
 
+	if ((rs->state & rs_writable) && rs->cork_len && how != SHUT_RD) {
+		fastlock_acquire(&rs->slock);
+		rs_cork_flush(rs, 0);
+		fastlock_release(&rs->slock);
+	}
+
 	if (rs->state & rs_connected) {
 		if (how == SHUT_RDWR) {
 			ctrl = RS_CTRL_DISCONNECT;
@@ -3309,7 +6116,7 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return rs_epoll_close(socket);
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
@@ -3319,6 +6126,7 @@ int rclose(int socket)
 		ds_shutdown(rs);
 	}
 
+	rs_epoll_remove_rs(rs);
 	rs_free(rs);
 	return 0;
 }
@@ -3429,8 +6237,11 @@ int rsetsockopt(int socket, int level, int optname,
 			break;
 		case SO_RCVBUF:
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
-			    (rs->type == SOCK_DGRAM && !rs->qp_list))
+			    (rs->type == SOCK_DGRAM && !rs->qp_list)) {
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+				if (rs->type == SOCK_STREAM)
+					rs->opts &= ~RS_OPT_AUTOTUNE;
+			}
 			ret = 0;
 			break;
 		case SO_SNDBUF:
@@ -3477,6 +6288,15 @@ int rsetsockopt(int socket, int level, int optname,
 			opt_on = *(int *) optval;
 			ret = 0;
 			break;
+		case TCP_CORK:
+			opt_on = *(int *) optval;
+			if (!opt_on && rs->type == SOCK_STREAM && rs->cork_len) {
+				fastlock_acquire(&rs->slock);
+				rs_cork_flush(rs, rs_nonblocking(rs, 0));
+				fastlock_release(&rs->slock);
+			}
+			ret = 0;
+			break;
 		case TCP_MAXSEG:
 			ret = 0;
 			break;
@@ -3500,7 +6320,8 @@ int rsetsockopt(int socket, int level, int optname,
 		}
 		break;
 	case SOL_RDMA:
-		if (rs->state >= rs_opening) {
+		if (rs->state >= rs_opening && optname != RDMA_ZCOPY_THRESHOLD &&
+		    optname != RDMA_CORK_DELAY) {
 			ret = ERR(EINVAL);
 			break;
 		}
@@ -3535,6 +6356,33 @@ int rsetsockopt(int socket, int level, int optname,
 				ret = ERR(ENOMEM);
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->zcopy_threshold = *(uint32_t *) optval;
+			ret = 0;
+			break;
+		case RDMA_SHARED:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_SHARED;
+			else
+				rs->opts &= ~RS_OPT_SHARED;
+			ret = 0;
+			break;
+		case RDMA_CORK_DELAY:
+			if (rs->type != SOCK_STREAM) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->cork_delay = *(uint32_t *) optval;
+			ret = 0;
+			break;
 		default:
 			break;
 		}
@@ -3634,6 +6482,7 @@ int rgetsockopt(int socket, int level, int optname,
 			*optlen = sizeof(int);
 			break;
 		case TCP_NODELAY:
+		case TCP_CORK:
 			*((int *) optval) = !!(rs->tcp_opts & (1 << optname));
 			*optlen = sizeof(int);
 			break;
@@ -3707,6 +6556,22 @@ int rgetsockopt(int socket, int level, int optname,
 				}
 			}
 			break;
+		case RDMA_ZCOPY_THRESHOLD:
+			*((uint32_t *) optval) = rs->zcopy_threshold;
+			*optlen = sizeof(uint32_t);
+			break;
+		case RDMA_SHARED:
+			*((int *) optval) = !!(rs->opts & RS_OPT_SHARED);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_CORK_DELAY:
+			*((int *) optval) = rs->cork_delay;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_STATS:
+			*optlen = min_t(socklen_t, *optlen, sizeof(rs->stats));
+			memcpy(optval, &rs->stats, *optlen);
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -3855,7 +6720,20 @@ int riounmap(int socket, void *buf, size_t len)
 			goto out;
 		}
 	}
-	ret = ERR(EINVAL);
+
+	/* Zero-copy registrations are dropped if they overlap the buffer */
+	ret = -1;
+	for (entry = rs->zcopy_list.next; entry != &rs->zcopy_list; ) {
+		iomr = container_of(entry, struct rs_iomap_mr, entry);
+		entry = entry->next;
+		if ((uintptr_t) iomr->mr->addr < (uintptr_t) buf + len &&
+		    (uintptr_t) buf < (uintptr_t) iomr->mr->addr + iomr->mr->length) {
+			rs_drop_zcopy_mr(rs, iomr);
+			ret = 0;
+		}
+	}
+	if (ret)
+		ret = ERR(EINVAL);
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -3891,14 +6769,22 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 		if (ret)
 			goto out;
 	}
+
+	if (rs->cork_len) {
+		ret = rs_cork_flush(rs, rs_nonblocking(rs, flags));
+		if (ret)
+			goto out;
+	}
 	for (; left; left -= xfer_size, buf += xfer_size, offset += xfer_size) {
 		if (!iom || offset > iom->offset + iom->sge.length) {
 			iom = rs_find_iomap(rs, offset);
 			if (!iom)
 				break;
+			rs->stats.iomap_hits++;
 		}
 
 		if (!rs_can_send(rs)) {
+			rs_count_stall(rs);
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
 					  rs_conn_can_send);
 			if (ret)
@@ -3929,6 +6815,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			ret = rs_write_direct(rs, iom, offset, &sge, 1,
 					      xfer_size, IBV_SEND_INLINE);
 		} else if (xfer_size <= rs_sbuf_left(rs)) {
+			rs->stats.copy_bytes += xfer_size;
 			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf, xfer_size);
 			rs->ssgl[0].length = xfer_size;
 			ret = rs_write_direct(rs, iom, offset, rs->ssgl, 1, xfer_size, 0);
@@ -3937,6 +6824,7 @@ size_t riowrite(int socket, const void *buf, size_t count, off_t offset, int fla
 			else
 				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
 		} else {
+			rs->stats.copy_bytes += xfer_size;
 			rs->ssgl[0].length = rs_sbuf_left(rs);
 			memcpy((void *) (uintptr_t) rs->ssgl[0].addr, buf,
 				rs->ssgl[0].length);
@@ -4080,24 +6968,43 @@ static uint8_t udp_svc_path_bits(struct ds_dest *dest)
 
 static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t qpn)
 {
-	union socket_addr saddr;
+	union socket_addr saddr, src_key, dst_key;
+	struct ibv_pd *pd = dest->qp->cm_id->pd;
+	struct ds_ah *cached_ah;
 	struct rdma_cm_id *id;
 	struct ibv_ah_attr attr;
 	int ret;
 
+	memcpy(&saddr, rdma_get_local_addr(dest->qp->cm_id),
+	       ucma_addrlen(rdma_get_local_addr(dest->qp->cm_id)));
+	ds_ah_key(&src_key, &saddr);
+	ds_ah_key(&dst_key, &dest->addr);
+
+	/*
+	 * A destination that already has a handle is recovering from a change
+	 * of the peer, whose route may have changed with it.  The cached
+	 * handle is dropped and the route resolved again.
+	 */
 	if (dest->ah) {
 		fastlock_acquire(&rs->slock);
-		ibv_destroy_ah(dest->ah);
+		cached_ah = dest->cached_ah;
+		if (!cached_ah)
+			ibv_destroy_ah(dest->ah);
 		dest->ah = NULL;
+		dest->cached_ah = NULL;
 		fastlock_release(&rs->slock);
+		if (cached_ah)
+			ds_put_stale_ah(cached_ah);
+	} else {
+		cached_ah = ds_get_ah(pd, &src_key, &dst_key);
+		if (cached_ah)
+			goto found;
 	}
 
 	ret = rdma_create_id(NULL, &id, NULL, dest->qp->cm_id->ps);
 	if  (ret)
 		return;
 
-	memcpy(&saddr, rdma_get_local_addr(dest->qp->cm_id),
-	       ucma_addrlen(rdma_get_local_addr(dest->qp->cm_id)));
 	if (saddr.sa.sa_family == AF_INET)
 		saddr.sin.sin_port = 0;
 	else
@@ -4125,12 +7032,17 @@ static void udp_svc_create_ah(struct rsocket *rs, struct ds_dest *dest, uint32_t
 	attr.static_rate = id->route.path_rec->rate;
 	attr.port_num  = id->port_num;
 
+	cached_ah = ds_add_ah(dest->qp->cm_id, &src_key, &dst_key, &attr);
+out:
+	rdma_destroy_id(id);
+	if (!cached_ah)
+		return;
+found:
 	fastlock_acquire(&rs->slock);
 	dest->qpn = qpn;
-	dest->ah = ibv_create_ah(dest->qp->cm_id->pd, &attr);
+	dest->cached_ah = cached_ah;
+	dest->ah = cached_ah->ah;
 	fastlock_release(&rs->slock);
-out:
-	rdma_destroy_id(id);
 }
 
 static int udp_svc_valid_udp_hdr(struct ds_udp_header *udp_hdr,
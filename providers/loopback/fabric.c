@@ -0,0 +1,334 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loopback.h"
+
+void lb_lock(lb_lock_t *lock)
+{
+	unsigned int spins = 0;
+
+	while (atomic_exchange_explicit(lock, 1, memory_order_acquire)) {
+		/* The holder may be a descheduled process */
+		if (++spins % 128 == 0)
+			sched_yield();
+	}
+}
+
+static bool pid_alive(pid_t pid)
+{
+	return !(kill(pid, 0) && errno == ESRCH);
+}
+
+int lb_fabric_open(struct lb_context *ctx, const char *name)
+{
+	struct lb_fabric *fabric;
+	struct stat st;
+	char *path;
+	int fd, ret = 0;
+
+	if (asprintf(&path, "/rdma_loopback_%s", name) < 0)
+		return ENOMEM;
+
+	fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+	free(path);
+	if (fd < 0)
+		return errno;
+
+	/* A new fabric is zero filled, which is a valid empty fabric */
+	if (fstat(fd, &st) || (st.st_size < sizeof(*fabric) &&
+			       ftruncate(fd, sizeof(*fabric)))) {
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+
+	fabric = mmap(NULL, sizeof(*fabric), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	close(fd);
+	if (fabric == MAP_FAILED)
+		return errno;
+
+	lb_lock(&fabric->lock);
+	if (!fabric->magic) {
+		fabric->version = LB_FABRIC_VERSION;
+		fabric->next_qp = LB_FIRST_QPN;
+		atomic_store(&fabric->magic, LB_FABRIC_MAGIC);
+	} else if (fabric->magic != LB_FABRIC_MAGIC ||
+		   fabric->version != LB_FABRIC_VERSION) {
+		ret = EPROTO;
+	}
+	lb_unlock(&fabric->lock);
+
+	if (ret) {
+		munmap(fabric, sizeof(*fabric));
+		return ret;
+	}
+
+	ctx->fabric = fabric;
+	return 0;
+}
+
+void lb_fabric_close(struct lb_context *ctx)
+{
+	struct lb_remote_obj *robj, *tmp;
+
+	list_for_each_safe(&ctx->remote_objs, robj, tmp, entry) {
+		list_del(&robj->entry);
+		munmap(robj->obj, robj->obj->size);
+		free(robj);
+	}
+
+	munmap(ctx->fabric, sizeof(*ctx->fabric));
+}
+
+/*
+ * Shared objects are unlinked as soon as they are created.  Other processes
+ * open them through /proc/<pid>/fd of the owner, so they are released when
+ * the owner and all processes that have mapped them are gone.
+ */
+void *lb_obj_create(struct lb_context *ctx, size_t size)
+{
+	struct lb_obj *obj;
+	char *path;
+	uint32_t id;
+	int fd;
+
+	do {
+		id = atomic_fetch_add(&ctx->fabric->next_obj, 1) + 1;
+	} while (!id);
+
+	if (asprintf(&path, "/rdma_loopback.%d.%u", ctx->pid, id) < 0)
+		return NULL;
+
+	fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		free(path);
+		return NULL;
+	}
+	shm_unlink(path);
+	free(path);
+
+	size = align(size, sysconf(_SC_PAGESIZE));
+	if (ftruncate(fd, size))
+		goto err;
+
+	obj = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (obj == MAP_FAILED)
+		goto err;
+
+	obj->id = id;
+	obj->fd = fd;
+	obj->size = size;
+	return obj;
+
+err:
+	close(fd);
+	return NULL;
+}
+
+void lb_obj_destroy(struct lb_context *ctx, void *ptr)
+{
+	struct lb_obj *obj = ptr;
+	int fd = obj->fd;
+
+	atomic_store(&obj->alive, 0);
+	munmap(obj, obj->size);
+	close(fd);
+}
+
+struct lb_obj *lb_obj_get(struct lb_context *ctx, pid_t pid, int fd,
+			  uint32_t id)
+{
+	struct lb_remote_obj *robj;
+	struct lb_obj *obj = NULL;
+	struct stat st;
+	char *path;
+	int ofd;
+
+	pthread_mutex_lock(&ctx->obj_lock);
+
+	list_for_each(&ctx->remote_objs, robj, entry) {
+		if (robj->id == id) {
+			obj = robj->obj;
+			goto out;
+		}
+	}
+
+	if (asprintf(&path, "/proc/%d/fd/%d", pid, fd) < 0)
+		goto out;
+	ofd = open(path, O_RDWR | O_CLOEXEC);
+	free(path);
+	if (ofd < 0)
+		goto out;
+
+	if (fstat(ofd, &st) || st.st_size < sizeof(*obj)) {
+		close(ofd);
+		goto out;
+	}
+
+	obj = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   ofd, 0);
+	close(ofd);
+	if (obj == MAP_FAILED) {
+		obj = NULL;
+		goto out;
+	}
+
+	/* The descriptor may have been reused for something else */
+	if (obj->id != id || obj->size != st.st_size) {
+		munmap(obj, st.st_size);
+		obj = NULL;
+		goto out;
+	}
+
+	robj = calloc(1, sizeof(*robj));
+	if (!robj) {
+		munmap(obj, st.st_size);
+		obj = NULL;
+		goto out;
+	}
+	robj->id = id;
+	robj->obj = obj;
+	list_add_tail(&ctx->remote_objs, &robj->entry);
+
+out:
+	pthread_mutex_unlock(&ctx->obj_lock);
+	if (obj && !atomic_load(&obj->alive))
+		return NULL;
+	return obj;
+}
+
+/* Entries left behind by processes that exited are reused */
+static bool qp_ent_free(struct lb_qp_ent *ent)
+{
+	return !ent->in_use || !pid_alive(ent->pid);
+}
+
+struct lb_qp_ent *lb_qp_alloc(struct lb_context *ctx, uint32_t *qpn)
+{
+	struct lb_fabric *fabric = ctx->fabric;
+	struct lb_qp_ent *ent = NULL;
+	uint32_t i, n;
+
+	lb_lock(&fabric->lock);
+	for (i = 0; i < LB_MAX_QP - LB_FIRST_QPN; i++) {
+		n = fabric->next_qp + i;
+		if (n >= LB_MAX_QP)
+			n -= LB_MAX_QP - LB_FIRST_QPN;
+		if (qp_ent_free(&fabric->qp[n])) {
+			ent = &fabric->qp[n];
+			break;
+		}
+	}
+	if (ent) {
+		memset(ent, 0, sizeof(*ent));
+		ent->in_use = 1;
+		ent->pid = ctx->pid;
+		fabric->next_qp = n + 1 < LB_MAX_QP ? n + 1 : LB_FIRST_QPN;
+		*qpn = n;
+	}
+	lb_unlock(&fabric->lock);
+
+	if (!ent)
+		errno = ENOMEM;
+	return ent;
+}
+
+void lb_qp_free(struct lb_context *ctx, struct lb_qp_ent *ent)
+{
+	lb_lock(&ctx->fabric->lock);
+	atomic_store(&ent->state, IBV_QPS_RESET);
+	ent->in_use = 0;
+	lb_unlock(&ctx->fabric->lock);
+}
+
+struct lb_qp_ent *lb_qp_lookup(struct lb_context *ctx, uint32_t qpn)
+{
+	struct lb_qp_ent *ent;
+
+	if (qpn < LB_FIRST_QPN || qpn >= LB_MAX_QP)
+		return NULL;
+
+	ent = &ctx->fabric->qp[qpn];
+	if (!ent->in_use)
+		return NULL;
+	return ent;
+}
+
+int lb_mr_alloc(struct lb_context *ctx, struct lb_pd *pd, void *addr,
+		size_t length, int access, uint32_t *key)
+{
+	struct lb_fabric *fabric = ctx->fabric;
+	struct lb_mr_ent *ent = NULL;
+	uint32_t i, n;
+
+	lb_lock(&fabric->lock);
+	for (i = 0; i < LB_MAX_MR - 1; i++) {
+		n = (fabric->next_mr + i) % (LB_MAX_MR - 1) + 1;
+		if (!fabric->mr[n].key || !pid_alive(fabric->mr[n].pid)) {
+			ent = &fabric->mr[n];
+			break;
+		}
+	}
+	if (ent) {
+		if (!++fabric->mr_gen)
+			fabric->mr_gen = 1;
+		ent->pd = pd->pdn;
+		ent->pid = ctx->pid;
+		ent->access = access;
+		ent->addr = (uintptr_t)addr;
+		ent->length = length;
+		*key = n << 8 | fabric->mr_gen;
+		atomic_store_explicit(&ent->key, *key, memory_order_release);
+		fabric->next_mr = n;
+	}
+	lb_unlock(&fabric->lock);
+
+	return ent ? 0 : ENOMEM;
+}
+
+void lb_mr_free(struct lb_context *ctx, uint32_t key)
+{
+	lb_lock(&ctx->fabric->lock);
+	atomic_store(&ctx->fabric->mr[key >> 8].key, 0);
+	lb_unlock(&ctx->fabric->lock);
+}
+
+bool lb_mr_check(struct lb_context *ctx, uint32_t key, pid_t pid,
+		 uint32_t pd, uint64_t addr, uint64_t length,
+		 unsigned int access)
+{
+	struct lb_mr_ent *ent;
+	bool ok;
+
+	if ((key >> 8) >= LB_MAX_MR)
+		return false;
+
+	ent = &ctx->fabric->mr[key >> 8];
+	if (atomic_load_explicit(&ent->key, memory_order_acquire) != key)
+		return false;
+
+	ok = ent->pid == pid && ent->pd == pd &&
+	     (ent->access & access) == access &&
+	     addr >= ent->addr && length <= ent->length &&
+	     addr - ent->addr <= ent->length - length;
+
+	/* The region may have been deregistered while it was checked */
+	atomic_thread_fence(memory_order_acquire);
+	return ok && atomic_load_explicit(&ent->key,
+					  memory_order_relaxed) == key;
+}
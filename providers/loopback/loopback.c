@@ -0,0 +1,627 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+#define PFX "loopback: "
+
+/* Devices are created by loopback_sysfs, see loopback(7) */
+static const struct verbs_match_ent hca_table[] = {
+	VERBS_MODALIAS_MATCH("rdma_loopback:*", NULL),
+	{}
+};
+
+static int lb_query_device(struct ibv_context *context,
+			   struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	strcpy(attr->fw_ver, "1.0.0");
+	attr->node_guid = ibv_get_device_guid(context->device);
+	attr->sys_image_guid = attr->node_guid;
+	attr->max_mr_size = UINT64_MAX;
+	attr->page_size_cap = ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	attr->max_qp = LB_MAX_QP - LB_FIRST_QPN;
+	attr->max_qp_wr = LB_MAX_WR;
+	attr->device_cap_flags = IBV_DEVICE_RC_RNR_NAK_GEN;
+	attr->max_sge = LB_MAX_SGE;
+	attr->max_sge_rd = LB_MAX_SGE;
+	attr->max_cq = INT_MAX;
+	attr->max_cqe = LB_MAX_CQE;
+	attr->max_mr = LB_MAX_MR - 1;
+	attr->max_pd = INT_MAX;
+	attr->max_qp_rd_atom = LB_MAX_RD_ATOMIC;
+	attr->max_qp_init_rd_atom = LB_MAX_RD_ATOMIC;
+	attr->max_res_rd_atom = LB_MAX_RD_ATOMIC * attr->max_qp;
+	attr->atomic_cap = IBV_ATOMIC_HCA;
+	attr->max_ah = INT_MAX;
+	attr->max_srq = INT_MAX;
+	attr->max_srq_wr = LB_MAX_WR;
+	attr->max_srq_sge = LB_MAX_SGE;
+	attr->max_pkeys = 1;
+	attr->phys_port_cnt = 1;
+	return 0;
+}
+
+static int lb_query_port(struct ibv_context *context, uint8_t port,
+			 struct ibv_port_attr *attr)
+{
+	if (port != 1)
+		return EINVAL;
+
+	memset(attr, 0, sizeof(*attr));
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->gid_tbl_len = 1;
+	attr->max_msg_sz = 1U << 31;
+	attr->pkey_tbl_len = 1;
+	attr->lid = 1;
+	attr->sm_lid = 1;
+	attr->max_vl_num = 1;
+	attr->active_width = 1;		/* 1X */
+	attr->active_speed = 1;		/* SDR */
+	attr->phys_state = 5;		/* LinkUp */
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+static struct ibv_pd *lb_alloc_pd(struct ibv_context *context)
+{
+	struct lb_context *ctx = to_lctx(context);
+	struct lb_pd *pd;
+
+	pd = calloc(1, sizeof(*pd));
+	if (!pd)
+		return NULL;
+
+	do {
+		pd->pdn = atomic_fetch_add(&ctx->fabric->next_pd, 1) + 1;
+	} while (!pd->pdn);
+
+	return &pd->ibv_pd;
+}
+
+static int lb_dealloc_pd(struct ibv_pd *pd)
+{
+	free(to_lpd(pd));
+	return 0;
+}
+
+static struct ibv_mr *lb_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct ibv_mr *mr;
+	uint32_t key;
+	int ret;
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr)
+		return NULL;
+
+	ret = lb_mr_alloc(to_lctx(pd->context), to_lpd(pd), addr, length,
+			  access, &key);
+	if (ret) {
+		free(mr);
+		errno = ret;
+		return NULL;
+	}
+
+	mr->lkey = key;
+	mr->rkey = key;
+	mr->handle = key;
+	return mr;
+}
+
+static int lb_dereg_mr(struct ibv_mr *ibmr)
+{
+	lb_mr_free(to_lctx(ibmr->context), ibmr->lkey);
+	free(ibmr);
+	return 0;
+}
+
+static struct ibv_cq *lb_create_cq(struct ibv_context *context, int cqe,
+				   struct ibv_comp_channel *channel,
+				   int comp_vector)
+{
+	struct lb_cq *cq;
+
+	if (cqe < 1 || cqe > LB_MAX_CQE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	cq->obj = lb_obj_create(to_lctx(context), sizeof(*cq->obj) +
+				cqe * sizeof(struct ibv_wc));
+	if (!cq->obj) {
+		free(cq);
+		return NULL;
+	}
+	cq->obj->cqe = cqe;
+	atomic_store(&cq->obj->obj.alive, 1);
+
+	cq->ibv_cq.cqe = cqe;
+	return &cq->ibv_cq;
+}
+
+/*
+ * There is no event channel, completions must be polled for.  Failing here
+ * keeps applications from blocking forever in ibv_get_cq_event().
+ */
+static int lb_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	return EOPNOTSUPP;
+}
+
+static int lb_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct lb_cq *cq = to_lcq(ibcq);
+
+	lb_obj_destroy(to_lctx(ibcq->context), cq->obj);
+	free(cq);
+	return 0;
+}
+
+static struct lb_rq_obj *lb_rq_create(struct lb_context *ctx,
+				      uint32_t max_wr, uint32_t max_sge)
+{
+	struct lb_rq_obj *rq;
+	uint32_t stride;
+
+	stride = sizeof(struct lb_rwqe) + max_sge * sizeof(struct ibv_sge);
+	rq = lb_obj_create(ctx, sizeof(*rq) + (size_t)max_wr * stride);
+	if (!rq)
+		return NULL;
+
+	rq->max_wr = max_wr;
+	rq->max_sge = max_sge;
+	rq->stride = stride;
+	atomic_store(&rq->obj.alive, 1);
+	return rq;
+}
+
+static struct ibv_srq *lb_create_srq(struct ibv_pd *pd,
+				     struct ibv_srq_init_attr *attr)
+{
+	struct lb_srq *srq;
+
+	if (!attr->attr.max_wr || attr->attr.max_wr > LB_MAX_WR ||
+	    attr->attr.max_sge > LB_MAX_SGE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		return NULL;
+
+	srq->obj = lb_rq_create(to_lctx(pd->context), attr->attr.max_wr,
+				attr->attr.max_sge ?: 1);
+	if (!srq->obj) {
+		free(srq);
+		return NULL;
+	}
+
+	attr->attr.max_sge = srq->obj->max_sge;
+	return &srq->ibv_srq;
+}
+
+/* The SRQ limit event and resizing are not supported */
+static int lb_modify_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr,
+			 int attr_mask)
+{
+	return EOPNOTSUPP;
+}
+
+static int lb_query_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr)
+{
+	struct lb_srq *srq = to_lsrq(ibsrq);
+
+	attr->max_wr = srq->obj->max_wr;
+	attr->max_sge = srq->obj->max_sge;
+	attr->srq_limit = 0;
+	return 0;
+}
+
+static int lb_destroy_srq(struct ibv_srq *ibsrq)
+{
+	struct lb_srq *srq = to_lsrq(ibsrq);
+
+	lb_obj_destroy(to_lctx(ibsrq->context), srq->obj);
+	free(srq);
+	return 0;
+}
+
+static struct ibv_qp *create_qp(struct ibv_context *context,
+				struct ibv_qp_init_attr_ex *attr)
+{
+	struct lb_context *ctx = to_lctx(context);
+	struct ibv_qp_cap *cap = &attr->cap;
+	struct ibv_pd *pd = attr->pd;
+	struct lb_qp *qp;
+	struct lb_obj *rq_obj;
+	int ret;
+
+	if (!(attr->comp_mask & IBV_QP_INIT_ATTR_PD) || !attr->pd ||
+	    (attr->comp_mask & ~(IBV_QP_INIT_ATTR_PD |
+				 IBV_QP_INIT_ATTR_SEND_OPS_FLAGS))) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if ((attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UC &&
+	     attr->qp_type != IBV_QPT_UD) ||
+	    !attr->send_cq || !attr->recv_cq ||
+	    !cap->max_send_wr || cap->max_send_wr > LB_MAX_WR ||
+	    cap->max_send_sge > LB_MAX_SGE ||
+	    cap->max_inline_data > LB_MAX_INLINE ||
+	    (!attr->srq && (!cap->max_recv_wr || cap->max_recv_wr > LB_MAX_WR ||
+			    cap->max_recv_sge > LB_MAX_SGE))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		ret = lb_qp_fill_wr_pfns(qp, attr);
+		if (ret) {
+			free(qp);
+			errno = ret;
+			return NULL;
+		}
+		qp->vqp.comp_mask = VERBS_QP_EX;
+	}
+
+	cap->max_send_sge = cap->max_send_sge ?: 1;
+	qp->sq_stride = sizeof(struct lb_swqe) +
+			cap->max_send_sge * sizeof(struct ibv_sge);
+	qp->sq = calloc(cap->max_send_wr, qp->sq_stride);
+	if (!qp->sq)
+		goto err_qp;
+	if (cap->max_inline_data) {
+		qp->sq_inline = calloc(cap->max_send_wr,
+				       cap->max_inline_data);
+		if (!qp->sq_inline)
+			goto err_sq;
+	}
+
+	if (attr->srq) {
+		rq_obj = &to_lsrq(attr->srq)->obj->obj;
+		cap->max_recv_wr = 0;
+		cap->max_recv_sge = 0;
+	} else {
+		qp->rq = lb_rq_create(ctx, cap->max_recv_wr,
+				      cap->max_recv_sge ?: 1);
+		if (!qp->rq)
+			goto err_sq;
+		cap->max_recv_sge = qp->rq->max_sge;
+		rq_obj = &qp->rq->obj;
+	}
+
+	qp->ent = lb_qp_alloc(ctx, &qp->ibv_qp.qp_num);
+	if (!qp->ent)
+		goto err_rq;
+
+	qp->ent->qp_type = attr->qp_type;
+	qp->ent->pd = to_lpd(pd)->pdn;
+	qp->ent->rq_fd = rq_obj->fd;
+	qp->ent->rq_id = rq_obj->id;
+	qp->ent->rcq_fd = to_lcq(attr->recv_cq)->obj->obj.fd;
+	qp->ent->rcq_id = to_lcq(attr->recv_cq)->obj->obj.id;
+
+	pthread_spin_init(&qp->sq_lock, PTHREAD_PROCESS_PRIVATE);
+	memcpy(&qp->init_attr, attr, sizeof(qp->init_attr));
+	qp->attr.qp_state = IBV_QPS_RESET;
+	qp->attr.cap = *cap;
+
+	/* Set by libibverbs for ibv_create_qp() only */
+	qp->ibv_qp.context = context;
+	qp->ibv_qp.qp_context = attr->qp_context;
+	qp->ibv_qp.pd = pd;
+	qp->ibv_qp.send_cq = attr->send_cq;
+	qp->ibv_qp.recv_cq = attr->recv_cq;
+	qp->ibv_qp.srq = attr->srq;
+	qp->ibv_qp.qp_type = attr->qp_type;
+	qp->ibv_qp.state = IBV_QPS_RESET;
+	pthread_mutex_init(&qp->ibv_qp.mutex, NULL);
+	pthread_cond_init(&qp->ibv_qp.cond, NULL);
+	return &qp->ibv_qp;
+
+err_rq:
+	if (qp->rq)
+		lb_obj_destroy(ctx, qp->rq);
+err_sq:
+	free(qp->sq_inline);
+	free(qp->sq);
+err_qp:
+	free(qp);
+	return NULL;
+}
+
+static struct ibv_qp *lb_create_qp(struct ibv_pd *pd,
+				   struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_init_attr_ex attr_ex = {};
+	struct ibv_qp *qp;
+
+	memcpy(&attr_ex, attr, sizeof(*attr));
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD;
+	attr_ex.pd = pd;
+
+	qp = create_qp(pd->context, &attr_ex);
+	if (qp)
+		memcpy(attr, &attr_ex, sizeof(*attr));
+	return qp;
+}
+
+static struct ibv_qp *lb_create_qp_ex(struct ibv_context *context,
+				      struct ibv_qp_init_attr_ex *attr)
+{
+	return create_qp(context, attr);
+}
+
+static int lb_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+		       int attr_mask, struct ibv_qp_init_attr *init_attr)
+{
+	struct lb_qp *qp = to_lqp(ibqp);
+
+	*attr = qp->attr;
+	attr->qp_state = atomic_load(&qp->ent->state);
+	*init_attr = qp->init_attr;
+	return 0;
+}
+
+static bool lb_qp_transition_ok(enum ibv_qp_state cur, enum ibv_qp_state next)
+{
+	switch (next) {
+	case IBV_QPS_RESET:
+	case IBV_QPS_ERR:
+		return true;
+	case IBV_QPS_INIT:
+		return cur == IBV_QPS_RESET || cur == IBV_QPS_INIT;
+	case IBV_QPS_RTR:
+		return cur == IBV_QPS_INIT;
+	case IBV_QPS_RTS:
+		return cur == IBV_QPS_RTR || cur == IBV_QPS_RTS ||
+		       cur == IBV_QPS_SQD || cur == IBV_QPS_SQE;
+	case IBV_QPS_SQD:
+		return cur == IBV_QPS_RTS || cur == IBV_QPS_SQD;
+	default:
+		return false;
+	}
+}
+
+static int lb_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			int attr_mask)
+{
+	struct lb_qp *qp = to_lqp(ibqp);
+	enum ibv_qp_state cur, next;
+
+	cur = atomic_load(&qp->ent->state);
+	if (attr_mask & IBV_QP_CUR_STATE)
+		cur = attr->cur_qp_state;
+	next = attr_mask & IBV_QP_STATE ? attr->qp_state : cur;
+
+	if (!lb_qp_transition_ok(cur, next) ||
+	    (attr_mask & IBV_QP_PORT && attr->port_num != 1) ||
+	    (attr_mask & IBV_QP_PKEY_INDEX && attr->pkey_index) ||
+	    (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC &&
+	     attr->max_rd_atomic > LB_MAX_RD_ATOMIC) ||
+	    (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC &&
+	     attr->max_dest_rd_atomic > LB_MAX_RD_ATOMIC))
+		return EINVAL;
+
+	if (attr_mask & IBV_QP_ACCESS_FLAGS) {
+		qp->attr.qp_access_flags = attr->qp_access_flags;
+		qp->ent->access = attr->qp_access_flags;
+	}
+	if (attr_mask & IBV_QP_PKEY_INDEX)
+		qp->attr.pkey_index = attr->pkey_index;
+	if (attr_mask & IBV_QP_PORT)
+		qp->attr.port_num = attr->port_num;
+	if (attr_mask & IBV_QP_QKEY) {
+		qp->attr.qkey = attr->qkey;
+		qp->ent->qkey = attr->qkey;
+	}
+	if (attr_mask & IBV_QP_AV)
+		qp->attr.ah_attr = attr->ah_attr;
+	if (attr_mask & IBV_QP_PATH_MTU)
+		qp->attr.path_mtu = attr->path_mtu;
+	if (attr_mask & IBV_QP_TIMEOUT)
+		qp->attr.timeout = attr->timeout;
+	if (attr_mask & IBV_QP_RETRY_CNT)
+		qp->attr.retry_cnt = attr->retry_cnt;
+	if (attr_mask & IBV_QP_RNR_RETRY)
+		qp->attr.rnr_retry = attr->rnr_retry;
+	if (attr_mask & IBV_QP_RQ_PSN)
+		qp->attr.rq_psn = attr->rq_psn;
+	if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+		qp->attr.max_rd_atomic = attr->max_rd_atomic;
+	if (attr_mask & IBV_QP_MIN_RNR_TIMER) {
+		qp->attr.min_rnr_timer = attr->min_rnr_timer;
+		qp->ent->min_rnr_timer = attr->min_rnr_timer;
+	}
+	if (attr_mask & IBV_QP_SQ_PSN)
+		qp->attr.sq_psn = attr->sq_psn;
+	if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+		qp->attr.max_dest_rd_atomic = attr->max_dest_rd_atomic;
+	if (attr_mask & IBV_QP_DEST_QPN) {
+		qp->attr.dest_qp_num = attr->dest_qp_num;
+		qp->ent->dest_qpn = attr->dest_qp_num;
+	}
+
+	if (!(attr_mask & IBV_QP_STATE))
+		return 0;
+
+	qp->attr.qp_state = next;
+	if (next == IBV_QPS_RESET) {
+		atomic_store(&qp->ent->state, next);
+		lb_qp_reset(qp);
+	} else if (next == IBV_QPS_ERR) {
+		lb_qp_flush(qp);
+	} else {
+		atomic_store(&qp->ent->state, next);
+	}
+	return 0;
+}
+
+static int lb_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct lb_context *ctx = to_lctx(ibqp->context);
+	struct lb_qp *qp = to_lqp(ibqp);
+
+	lb_qp_remove_pending(qp);
+	lb_qp_free(ctx, qp->ent);
+	if (qp->rq)
+		lb_obj_destroy(ctx, qp->rq);
+	pthread_spin_destroy(&qp->sq_lock);
+	free(qp->sq_inline);
+	free(qp->sq);
+	free(qp);
+	return 0;
+}
+
+static struct ibv_ah *lb_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
+{
+	struct lb_ah *ah;
+
+	if (attr->port_num != 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ah = calloc(1, sizeof(*ah));
+	if (!ah)
+		return NULL;
+
+	ah->attr = *attr;
+	return &ah->ibv_ah;
+}
+
+static int lb_destroy_ah(struct ibv_ah *ah)
+{
+	free(to_lah(ah));
+	return 0;
+}
+
+static const struct ibv_context_ops lb_ctx_ops = {
+	.query_device	= lb_query_device,
+	.query_port	= lb_query_port,
+	.alloc_pd	= lb_alloc_pd,
+	.dealloc_pd	= lb_dealloc_pd,
+	.reg_mr		= lb_reg_mr,
+	.dereg_mr	= lb_dereg_mr,
+	.create_cq	= lb_create_cq,
+	.poll_cq	= lb_poll_cq,
+	.req_notify_cq	= lb_req_notify_cq,
+	.destroy_cq	= lb_destroy_cq,
+	.create_srq	= lb_create_srq,
+	.modify_srq	= lb_modify_srq,
+	.query_srq	= lb_query_srq,
+	.destroy_srq	= lb_destroy_srq,
+	.post_srq_recv	= lb_post_srq_recv,
+	.create_qp	= lb_create_qp,
+	.query_qp	= lb_query_qp,
+	.modify_qp	= lb_modify_qp,
+	.destroy_qp	= lb_destroy_qp,
+	.post_send	= lb_post_send,
+	.post_recv	= lb_post_recv,
+	.create_ah	= lb_create_ah,
+	.destroy_ah	= lb_destroy_ah,
+};
+
+static int lb_init_context(struct verbs_device *vdev,
+			   struct ibv_context *ibctx, int cmd_fd)
+{
+	struct lb_context *ctx = to_lctx(ibctx);
+	struct verbs_context *v_ctx = verbs_get_ctx(ibctx);
+	int fds[2];
+	int ret;
+
+	/* Nothing is ever written, but applications may wait for events */
+	if (pipe2(fds, O_CLOEXEC))
+		return errno;
+
+	ret = lb_fabric_open(ctx, to_ldev(&vdev->device)->name);
+	if (ret) {
+		fprintf(stderr, PFX "Couldn't open fabric of %s: %s\n",
+			to_ldev(&vdev->device)->name, strerror(ret));
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	}
+
+	ctx->pid = getpid();
+	ctx->async_wfd = fds[1];
+	pthread_mutex_init(&ctx->obj_lock, NULL);
+	list_head_init(&ctx->remote_objs);
+	pthread_mutex_init(&ctx->pending_lock, NULL);
+	list_head_init(&ctx->pending_qps);
+
+	ibctx->async_fd = fds[0];
+	ibctx->num_comp_vectors = 1;
+	ibctx->ops = lb_ctx_ops;
+	verbs_set_ctx_op(v_ctx, create_qp_ex, lb_create_qp_ex);
+	return 0;
+}
+
+static void lb_uninit_context(struct verbs_device *vdev,
+			      struct ibv_context *ibctx)
+{
+	struct lb_context *ctx = to_lctx(ibctx);
+
+	lb_fabric_close(ctx);
+	close(ctx->async_wfd);
+	pthread_mutex_destroy(&ctx->obj_lock);
+	pthread_mutex_destroy(&ctx->pending_lock);
+}
+
+static void lb_uninit_device(struct verbs_device *verbs_device)
+{
+	free(to_ldev(&verbs_device->device));
+}
+
+static struct verbs_device *lb_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
+{
+	struct lb_device *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	strcpy(dev->name, sysfs_dev->ibdev_name);
+	dev->ibv_dev.sz = sizeof(*dev);
+	dev->ibv_dev.size_of_context =
+		sizeof(struct lb_context) - sizeof(struct ibv_context);
+	return &dev->ibv_dev;
+}
+
+static const struct verbs_device_ops lb_dev_ops = {
+	.name = "loopback",
+	.match_min_abi_version = 1,
+	.match_max_abi_version = 1,
+	.match_table = hca_table,
+	.alloc_device = lb_device_alloc,
+	.uninit_device = lb_uninit_device,
+	.init_context = lb_init_context,
+	.uninit_context = lb_uninit_context,
+	.no_cmd_fd = true,
+};
+PROVIDER_DRIVER(lb_dev_ops);
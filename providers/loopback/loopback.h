@@ -0,0 +1,322 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <infiniband/driver.h>
+#include <ccan/list.h>
+
+/*
+ * The loopback provider implements verbs in process memory.  All contexts
+ * opened on a loopback device, in this or other processes, are joined by a
+ * fabric: a shared memory directory of the QPs and memory regions of the
+ * device.  The receive queues and CQs of each QP are kept in shared memory
+ * objects of their own, so that the requester of an operation can consume
+ * receive WQEs and write completions of the responder directly.  Data is
+ * moved with process_vm_readv()/process_vm_writev(), or memcpy() when both
+ * ends are in the same process.  All work is done by the thread that posts
+ * it, or by a later post or poll of the requester when it must be retried.
+ */
+
+#define LB_MAX_QP		4096
+#define LB_MAX_MR		(1 << 16)
+#define LB_FIRST_QPN		2
+#define LB_MAX_WR		16384
+#define LB_MAX_SGE		32
+#define LB_MAX_CQE		(1 << 20)
+#define LB_MAX_INLINE		512
+#define LB_MAX_RD_ATOMIC	16
+#define LB_UD_MTU		4096
+#define LB_GRH_SIZE		40
+
+enum {
+	LB_FABRIC_MAGIC		= 0x4c4f4f50,	/* "LOOP" */
+	LB_FABRIC_VERSION	= 1,
+};
+
+/* A spinlock that may be shared between processes */
+typedef atomic_uint lb_lock_t;
+
+void lb_lock(lb_lock_t *lock);
+
+static inline void lb_unlock(lb_lock_t *lock)
+{
+	atomic_store_explicit(lock, 0, memory_order_release);
+}
+
+/* Fabric directory entry of a QP, written by its owner.  Shared objects
+ * are found through the file descriptor that the owning process holds for
+ * them, and checked against their fabric wide id.
+ */
+struct lb_qp_ent {
+	_Atomic(uint32_t)	state;		/* enum ibv_qp_state */
+	uint32_t		in_use;
+	uint32_t		qp_type;
+	uint32_t		pd;
+	pid_t			pid;
+	int			rq_fd;		/* RQ or SRQ */
+	uint32_t		rq_id;
+	int			rcq_fd;		/* recv CQ */
+	uint32_t		rcq_id;
+	uint32_t		dest_qpn;
+	uint32_t		qkey;
+	uint32_t		access;
+	uint32_t		min_rnr_timer;
+};
+
+/* Fabric directory entry of a memory region.  Keys are the index of the
+ * entry shifted left by 8, plus a generation count in the low byte.
+ */
+struct lb_mr_ent {
+	_Atomic(uint32_t)	key;		/* 0 when free */
+	uint32_t		pd;
+	pid_t			pid;
+	uint32_t		access;
+	uint64_t		addr;
+	uint64_t		length;
+};
+
+struct lb_fabric {
+	_Atomic(uint32_t)	magic;
+	uint32_t		version;
+	lb_lock_t		lock;		/* QP and MR allocation */
+	lb_lock_t		atomic_lock;	/* all atomic operations */
+	_Atomic(uint32_t)	next_obj;
+	_Atomic(uint32_t)	next_pd;
+	uint32_t		next_qp;
+	uint32_t		next_mr;
+	uint8_t			mr_gen;
+	struct lb_qp_ent	qp[LB_MAX_QP];
+	struct lb_mr_ent	mr[LB_MAX_MR];
+};
+
+/* Shared memory objects holding a CQ or a receive queue */
+struct lb_obj {
+	lb_lock_t		lock;
+	_Atomic(uint32_t)	alive;
+	uint32_t		id;
+	int			fd;		/* in the owning process */
+	size_t			size;
+};
+
+struct lb_cq_obj {
+	struct lb_obj		obj;
+	uint32_t		cqe;
+	uint32_t		prod;
+	uint32_t		cons;
+	uint32_t		overflow;
+	struct ibv_wc		wc[];
+};
+
+struct lb_rwqe {
+	uint64_t		wr_id;
+	uint32_t		num_sge;
+	uint32_t		reserved;
+	struct ibv_sge		sge[];
+};
+
+struct lb_rq_obj {
+	struct lb_obj		obj;
+	uint32_t		max_wr;
+	uint32_t		max_sge;
+	uint32_t		stride;
+	uint32_t		head;		/* consumed by requesters */
+	uint32_t		tail;		/* posted by the owner */
+	uint32_t		reserved;
+	uint8_t			wqe[];
+};
+
+/* A mapping of a shared object found through a QP entry.  Mappings are kept
+ * until the context is closed, so that pointers cached by QPs stay valid.
+ */
+struct lb_remote_obj {
+	struct list_node	entry;
+	uint32_t		id;
+	struct lb_obj		*obj;
+};
+
+struct lb_device {
+	struct verbs_device	ibv_dev;
+	char			name[IBV_SYSFS_NAME_MAX];
+};
+
+struct lb_context {
+	struct ibv_context	ibv_ctx;
+	struct lb_fabric	*fabric;
+	pid_t			pid;
+	int			async_wfd;
+	pthread_mutex_t		obj_lock;
+	struct list_head	remote_objs;
+	/* QPs that have send WQEs waiting to be retried */
+	pthread_mutex_t		pending_lock;
+	struct list_head	pending_qps;
+	_Atomic(uint32_t)	num_pending;
+};
+
+struct lb_pd {
+	struct ibv_pd		ibv_pd;
+	uint32_t		pdn;
+};
+
+struct lb_ah {
+	struct ibv_ah		ibv_ah;
+	struct ibv_ah_attr	attr;
+};
+
+struct lb_cq {
+	struct ibv_cq		ibv_cq;
+	struct lb_cq_obj	*obj;
+	unsigned int		empty_polls;
+};
+
+struct lb_srq {
+	struct ibv_srq		ibv_srq;
+	struct lb_rq_obj	*obj;
+};
+
+/* A send WQE, copied when posted */
+struct lb_swqe {
+	uint64_t		wr_id;
+	enum ibv_wr_opcode	opcode;
+	unsigned int		send_flags;
+	__be32			imm_data;
+	uint32_t		num_sge;
+	uint32_t		inline_len;
+	uint64_t		remote_addr;
+	uint32_t		rkey;
+	uint64_t		compare_add;
+	uint64_t		swap;
+	struct ibv_ah_attr	ah_attr;
+	uint32_t		remote_qpn;
+	uint32_t		remote_qkey;
+	uint8_t			retries;
+	uint8_t			rnr_retries;
+	struct timespec		retry_at;	/* zero unless stalled */
+	uint8_t			*inline_data;
+	struct ibv_sge		sge[];
+};
+
+struct lb_qp {
+	union {
+		struct ibv_qp		ibv_qp;
+		struct verbs_qp		vqp;
+	};
+	struct lb_qp_ent	*ent;
+	struct lb_rq_obj	*rq;		/* NULL with an SRQ */
+	pthread_spinlock_t	sq_lock;
+	uint8_t			*sq;
+	uint8_t			*sq_inline;
+	uint32_t		sq_stride;
+	uint32_t		sq_head;
+	uint32_t		sq_tail;
+	struct ibv_qp_init_attr	init_attr;
+	struct ibv_qp_attr	attr;
+	bool			pending;
+	struct list_node	pending_entry;
+	/* Work request builder state, under sq_lock */
+	struct lb_swqe		*cur_wqe;
+	uint32_t		wr_tail;
+	int			wr_err;
+	/* The receive queue and CQ of the last destination */
+	struct {
+		uint32_t		rq_id;
+		uint32_t		rcq_id;
+		struct lb_rq_obj	*rq;
+		struct lb_cq_obj	*rcq;
+	} peer;
+};
+
+#define to_lxxx(xxx, type)						\
+	container_of(ib##xxx, struct lb_##type, ibv_##xxx)
+
+static inline struct lb_context *to_lctx(struct ibv_context *ibctx)
+{
+	return to_lxxx(ctx, context);
+}
+
+static inline struct lb_device *to_ldev(struct ibv_device *ibdev)
+{
+	return container_of(ibdev, struct lb_device, ibv_dev.device);
+}
+
+static inline struct lb_pd *to_lpd(struct ibv_pd *ibpd)
+{
+	return to_lxxx(pd, pd);
+}
+
+static inline struct lb_cq *to_lcq(struct ibv_cq *ibcq)
+{
+	return to_lxxx(cq, cq);
+}
+
+static inline struct lb_srq *to_lsrq(struct ibv_srq *ibsrq)
+{
+	return to_lxxx(srq, srq);
+}
+
+static inline struct lb_qp *to_lqp(struct ibv_qp *ibqp)
+{
+	return to_lxxx(qp, qp);
+}
+
+static inline struct lb_ah *to_lah(struct ibv_ah *ibah)
+{
+	return to_lxxx(ah, ah);
+}
+
+static inline unsigned long align(unsigned long val, unsigned long align)
+{
+	return (val + align - 1) & ~(align - 1);
+}
+
+static inline struct lb_rwqe *lb_rq_wqe(struct lb_rq_obj *rq, uint32_t idx)
+{
+	return (struct lb_rwqe *)(rq->wqe + (idx % rq->max_wr) * rq->stride);
+}
+
+static inline struct lb_swqe *lb_sq_wqe(struct lb_qp *qp, uint32_t idx)
+{
+	return (struct lb_swqe *)(qp->sq +
+				  (idx % qp->init_attr.cap.max_send_wr) *
+				  qp->sq_stride);
+}
+
+/* fabric.c */
+int lb_fabric_open(struct lb_context *ctx, const char *name);
+void lb_fabric_close(struct lb_context *ctx);
+void *lb_obj_create(struct lb_context *ctx, size_t size);
+void lb_obj_destroy(struct lb_context *ctx, void *obj);
+struct lb_obj *lb_obj_get(struct lb_context *ctx, pid_t pid, int fd,
+			  uint32_t id);
+struct lb_qp_ent *lb_qp_alloc(struct lb_context *ctx, uint32_t *qpn);
+void lb_qp_free(struct lb_context *ctx, struct lb_qp_ent *ent);
+struct lb_qp_ent *lb_qp_lookup(struct lb_context *ctx, uint32_t qpn);
+int lb_mr_alloc(struct lb_context *ctx, struct lb_pd *pd, void *addr,
+		size_t length, int access, uint32_t *key);
+void lb_mr_free(struct lb_context *ctx, uint32_t key);
+bool lb_mr_check(struct lb_context *ctx, uint32_t key, pid_t pid,
+		 uint32_t pd, uint64_t addr, uint64_t length,
+		 unsigned int access);
+
+/* qp.c */
+int lb_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		 struct ibv_send_wr **bad_wr);
+int lb_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+		 struct ibv_recv_wr **bad_wr);
+int lb_post_srq_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *wr,
+		     struct ibv_recv_wr **bad_wr);
+int lb_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc);
+void lb_qp_flush(struct lb_qp *qp);
+void lb_qp_reset(struct lb_qp *qp);
+void lb_qp_remove_pending(struct lb_qp *qp);
+int lb_qp_fill_wr_pfns(struct lb_qp *qp,
+		       const struct ibv_qp_init_attr_ex *attr);
+
+#endif /* LOOPBACK_H */
@@ -0,0 +1,1139 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include <ccan/minmax.h>
+
+#include "loopback.h"
+
+enum lb_result {
+	LB_DONE,
+	LB_RETRY,
+};
+
+/* IBA table 45, the RNR NAK timer field in units of 10 usec */
+static const uint32_t rnr_timer_10us[32] = {
+	65536, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+	12288, 16384, 24576, 32768, 49152,
+};
+
+/* A local timeout of 0 is infinite, the WQE is retried without limit */
+#define LB_INFINITE_RETRY_NS 1000000
+
+/* Empty polls of a CQ before the CPU is given up to the process that is
+ * expected to complete work on it.
+ */
+#define LB_POLL_YIELD 64
+
+static void ts_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static bool responder_ready(enum ibv_qp_state state)
+{
+	return state == IBV_QPS_RTR || state == IBV_QPS_RTS ||
+	       state == IBV_QPS_SQD || state == IBV_QPS_SQE;
+}
+
+static void iov_copy(const struct iovec *dst, const struct iovec *src,
+		     size_t len)
+{
+	size_t doff = 0, soff = 0, n;
+
+	while (len) {
+		while (doff == dst->iov_len) {
+			dst++;
+			doff = 0;
+		}
+		while (soff == src->iov_len) {
+			src++;
+			soff = 0;
+		}
+		n = min(dst->iov_len - doff, src->iov_len - soff);
+		n = min(n, len);
+		memcpy((uint8_t *)dst->iov_base + doff,
+		       (uint8_t *)src->iov_base + soff, n);
+		doff += n;
+		soff += n;
+		len -= n;
+	}
+}
+
+/* Moves len bytes between local memory and the memory of process pid */
+static bool vm_copy(struct lb_context *ctx, pid_t pid,
+		    const struct iovec *local, unsigned long nlocal,
+		    const struct iovec *remote, unsigned long nremote,
+		    size_t len, bool write)
+{
+	if (!len)
+		return true;
+
+	if (pid == ctx->pid) {
+		if (write)
+			iov_copy(remote, local, len);
+		else
+			iov_copy(local, remote, len);
+		return true;
+	}
+
+	if (write)
+		return process_vm_writev(pid, local, nlocal, remote, nremote,
+					 0) == len;
+	return process_vm_readv(pid, local, nlocal, remote, nremote, 0) == len;
+}
+
+/* Returns the number of iovecs covering len bytes of the SGEs after skip */
+static unsigned int sge_to_iov(const struct ibv_sge *sge, uint32_t num_sge,
+			       size_t skip, size_t len, struct iovec *iov)
+{
+	unsigned int n = 0;
+	uint32_t i;
+	size_t l;
+
+	for (i = 0; i < num_sge && len; i++) {
+		l = sge[i].length;
+		if (skip >= l) {
+			skip -= l;
+			continue;
+		}
+		l = min(l - skip, len);
+		iov[n].iov_base = (void *)(uintptr_t)(sge[i].addr + skip);
+		iov[n].iov_len = l;
+		skip = 0;
+		len -= l;
+		n++;
+	}
+	return n;
+}
+
+static bool check_sges(struct lb_context *ctx, const struct ibv_sge *sge,
+		       uint32_t num_sge, pid_t pid, uint32_t pd,
+		       unsigned int access, uint64_t *len)
+{
+	uint32_t i;
+
+	*len = 0;
+	for (i = 0; i < num_sge; i++) {
+		if (sge[i].length &&
+		    !lb_mr_check(ctx, sge[i].lkey, pid, pd, sge[i].addr,
+				 sge[i].length, access))
+			return false;
+		*len += sge[i].length;
+	}
+	return true;
+}
+
+static void cq_push(struct lb_cq_obj *cq, const struct ibv_wc *wc)
+{
+	lb_lock(&cq->obj.lock);
+	if (cq->prod - cq->cons < cq->cqe) {
+		cq->wc[cq->prod % cq->cqe] = *wc;
+		cq->prod++;
+	} else {
+		cq->overflow = 1;
+	}
+	lb_unlock(&cq->obj.lock);
+}
+
+static void flush_rq(struct lb_qp *qp)
+{
+	struct lb_cq_obj *cq = to_lcq(qp->ibv_qp.recv_cq)->obj;
+	struct lb_rq_obj *rq = qp->rq;
+	struct ibv_wc wc = {
+		.status = IBV_WC_WR_FLUSH_ERR,
+		.opcode = IBV_WC_RECV,
+		.qp_num = qp->ibv_qp.qp_num,
+	};
+
+	if (!rq)
+		return;
+
+	lb_lock(&rq->obj.lock);
+	for (; rq->head != rq->tail; rq->head++) {
+		wc.wr_id = lb_rq_wqe(rq, rq->head)->wr_id;
+		cq_push(cq, &wc);
+	}
+	lb_unlock(&rq->obj.lock);
+}
+
+static enum ibv_wc_opcode wr_to_wc_opcode(enum ibv_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_WC_RDMA_WRITE;
+	case IBV_WR_RDMA_READ:
+		return IBV_WC_RDMA_READ;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		return IBV_WC_COMP_SWAP;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return IBV_WC_FETCH_ADD;
+	default:
+		return IBV_WC_SEND;
+	}
+}
+
+/* Must be called with the sq_lock held */
+static void flush_sq(struct lb_qp *qp)
+{
+	struct lb_cq_obj *cq = to_lcq(qp->ibv_qp.send_cq)->obj;
+	struct ibv_wc wc = {
+		.status = IBV_WC_WR_FLUSH_ERR,
+		.qp_num = qp->ibv_qp.qp_num,
+	};
+	struct lb_swqe *wqe;
+
+	for (; qp->sq_head != qp->sq_tail; qp->sq_head++) {
+		wqe = lb_sq_wqe(qp, qp->sq_head);
+		wc.wr_id = wqe->wr_id;
+		wc.opcode = wr_to_wc_opcode(wqe->opcode);
+		cq_push(cq, &wc);
+	}
+}
+
+void lb_qp_flush(struct lb_qp *qp)
+{
+	pthread_spin_lock(&qp->sq_lock);
+	atomic_store(&qp->ent->state, IBV_QPS_ERR);
+	flush_sq(qp);
+	pthread_spin_unlock(&qp->sq_lock);
+	flush_rq(qp);
+}
+
+void lb_qp_reset(struct lb_qp *qp)
+{
+	lb_qp_remove_pending(qp);
+
+	pthread_spin_lock(&qp->sq_lock);
+	qp->sq_head = qp->sq_tail = 0;
+	pthread_spin_unlock(&qp->sq_lock);
+
+	if (qp->rq) {
+		lb_lock(&qp->rq->obj.lock);
+		qp->rq->head = qp->rq->tail = 0;
+		lb_unlock(&qp->rq->obj.lock);
+	}
+}
+
+static void set_pending(struct lb_qp *qp)
+{
+	struct lb_context *ctx = to_lctx(qp->ibv_qp.context);
+
+	pthread_mutex_lock(&ctx->pending_lock);
+	if (!qp->pending) {
+		qp->pending = true;
+		list_add_tail(&ctx->pending_qps, &qp->pending_entry);
+		atomic_fetch_add(&ctx->num_pending, 1);
+	}
+	pthread_mutex_unlock(&ctx->pending_lock);
+}
+
+/* Must be called with the pending_lock held */
+static void clear_pending(struct lb_context *ctx, struct lb_qp *qp)
+{
+	if (qp->pending) {
+		qp->pending = false;
+		list_del(&qp->pending_entry);
+		atomic_fetch_sub(&ctx->num_pending, 1);
+	}
+}
+
+void lb_qp_remove_pending(struct lb_qp *qp)
+{
+	struct lb_context *ctx = to_lctx(qp->ibv_qp.context);
+
+	pthread_mutex_lock(&ctx->pending_lock);
+	clear_pending(ctx, qp);
+	pthread_mutex_unlock(&ctx->pending_lock);
+}
+
+static enum lb_result retry(struct lb_qp *qp, struct lb_swqe *wqe, bool rnr,
+			    uint32_t rnr_timer, struct ibv_wc *wc)
+{
+	uint64_t delay;
+
+	if (rnr) {
+		/* An RNR retry count of 7 is infinite */
+		if (qp->attr.rnr_retry != 7 &&
+		    wqe->rnr_retries++ >= qp->attr.rnr_retry) {
+			wc->status = IBV_WC_RNR_RETRY_EXC_ERR;
+			return LB_DONE;
+		}
+		delay = rnr_timer_10us[rnr_timer % 32] * 10000ULL;
+	} else if (qp->attr.timeout) {
+		if (wqe->retries++ >= qp->attr.retry_cnt) {
+			wc->status = IBV_WC_RETRY_EXC_ERR;
+			return LB_DONE;
+		}
+		delay = 4096ULL << qp->attr.timeout;
+	} else {
+		delay = LB_INFINITE_RETRY_NS;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wqe->retry_at);
+	ts_add_ns(&wqe->retry_at, delay);
+	return LB_RETRY;
+}
+
+/* Finds the receive queue and CQ of a destination QP */
+static bool get_peer(struct lb_qp *qp, struct lb_qp_ent *ent)
+{
+	struct lb_context *ctx = to_lctx(qp->ibv_qp.context);
+	struct lb_obj *rq, *rcq;
+
+	if (qp->peer.rq && ent->rq_id == qp->peer.rq_id &&
+	    ent->rcq_id == qp->peer.rcq_id)
+		return atomic_load(&qp->peer.rq->obj.alive) &&
+		       atomic_load(&qp->peer.rcq->obj.alive);
+
+	rq = lb_obj_get(ctx, ent->pid, ent->rq_fd, ent->rq_id);
+	rcq = lb_obj_get(ctx, ent->pid, ent->rcq_fd, ent->rcq_id);
+	if (!rq || !rcq)
+		return false;
+
+	qp->peer.rq_id = rq->id;
+	qp->peer.rcq_id = rcq->id;
+	qp->peer.rq = container_of(rq, struct lb_rq_obj, obj);
+	qp->peer.rcq = container_of(rcq, struct lb_cq_obj, obj);
+	return true;
+}
+
+static bool take_rwqe(struct lb_rq_obj *rq, uint64_t *wr_id,
+		      struct ibv_sge *sge, uint32_t *num_sge)
+{
+	struct lb_rwqe *rwqe;
+
+	lb_lock(&rq->obj.lock);
+	if (rq->head == rq->tail) {
+		lb_unlock(&rq->obj.lock);
+		return false;
+	}
+	rwqe = lb_rq_wqe(rq, rq->head);
+	*wr_id = rwqe->wr_id;
+	*num_sge = min(rwqe->num_sge, rq->max_sge);
+	memcpy(sge, rwqe->sge, *num_sge * sizeof(*sge));
+	rq->head++;
+	lb_unlock(&rq->obj.lock);
+	return true;
+}
+
+static enum lb_result execute_atomic(struct lb_qp *qp, struct lb_swqe *wqe,
+				     struct lb_qp_ent *ent, struct ibv_wc *wc)
+{
+	struct lb_context *ctx = to_lctx(qp->ibv_qp.context);
+	struct iovec local, remote;
+	uint64_t old, new;
+	bool ok;
+
+	if (wqe->remote_addr % sizeof(uint64_t)) {
+		wc->status = IBV_WC_REM_INV_REQ_ERR;
+		return LB_DONE;
+	}
+	if (!(ent->access & IBV_ACCESS_REMOTE_ATOMIC) ||
+	    !lb_mr_check(ctx, wqe->rkey, ent->pid, ent->pd, wqe->remote_addr,
+			 sizeof(old), IBV_ACCESS_REMOTE_ATOMIC)) {
+		wc->status = IBV_WC_REM_ACCESS_ERR;
+		return LB_DONE;
+	}
+
+	local.iov_base = &old;
+	local.iov_len = sizeof(old);
+	remote.iov_base = (void *)(uintptr_t)wqe->remote_addr;
+	remote.iov_len = sizeof(old);
+
+	/* Atomics are only atomic with respect to each other */
+	lb_lock(&ctx->fabric->atomic_lock);
+	ok = vm_copy(ctx, ent->pid, &local, 1, &remote, 1, sizeof(old), false);
+	if (ok) {
+		if (wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+			new = old + wqe->compare_add;
+		else
+			new = old == wqe->compare_add ? wqe->swap : old;
+		local.iov_base = &new;
+		if (new != old)
+			ok = vm_copy(ctx, ent->pid, &local, 1, &remote, 1,
+				     sizeof(new), true);
+	}
+	lb_unlock(&ctx->fabric->atomic_lock);
+
+	if (!ok) {
+		wc->status = IBV_WC_REM_OP_ERR;
+		return LB_DONE;
+	}
+
+	memcpy((void *)(uintptr_t)wqe->sge[0].addr, &old, sizeof(old));
+	wc->byte_len = sizeof(old);
+	return LB_DONE;
+}
+
+/*
+ * Runs a send WQE to completion, or returns LB_RETRY when an RC destination
+ * is not ready or has no receive WQE.  Errors seen by the responder are
+ * completed on its receive CQ, but do not move the responder QP to the
+ * error state.
+ */
+static enum lb_result execute(struct lb_qp *qp, struct lb_swqe *wqe,
+			      struct ibv_wc *wc)
+{
+	struct lb_context *ctx = to_lctx(qp->ibv_qp.context);
+	enum ibv_qp_type type = qp->ibv_qp.qp_type;
+	struct iovec liov[LB_MAX_SGE], riov[LB_MAX_SGE];
+	struct ibv_sge rsge[LB_MAX_SGE];
+	struct ibv_wc rwc = {};
+	unsigned int nliov, nriov;
+	struct lb_qp_ent *ent;
+	uint32_t dest_qpn, num_rsge;
+	uint64_t len, rlen;
+	size_t grh = 0;
+	bool imm_recv;
+
+	/* Local checks */
+	if (wqe->inline_len) {
+		liov[0].iov_base = wqe->inline_data;
+		liov[0].iov_len = wqe->inline_len;
+		nliov = 1;
+		len = wqe->inline_len;
+	} else {
+		unsigned int access = 0;
+
+		if (wqe->opcode == IBV_WR_RDMA_READ ||
+		    wqe->opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+		    wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+			access = IBV_ACCESS_LOCAL_WRITE;
+		if (!check_sges(ctx, wqe->sge, wqe->num_sge, ctx->pid,
+				qp->ent->pd, access, &len)) {
+			wc->status = IBV_WC_LOC_PROT_ERR;
+			return LB_DONE;
+		}
+		nliov = sge_to_iov(wqe->sge, wqe->num_sge, 0, len, liov);
+	}
+	wc->byte_len = len;
+
+	if ((wqe->opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+	     wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) &&
+	    (wqe->num_sge != 1 || len != sizeof(uint64_t))) {
+		wc->status = IBV_WC_LOC_LEN_ERR;
+		return LB_DONE;
+	}
+	if (type == IBV_QPT_UD && len > LB_UD_MTU) {
+		wc->status = IBV_WC_LOC_LEN_ERR;
+		return LB_DONE;
+	}
+
+	/* Find the destination, UC and UD drop messages that can't be
+	 * delivered, RC retries them.
+	 */
+	dest_qpn = type == IBV_QPT_UD ? wqe->remote_qpn :
+		   qp->attr.dest_qp_num;
+	ent = lb_qp_lookup(ctx, dest_qpn);
+	if (!ent || !responder_ready(atomic_load(&ent->state)) ||
+	    ent->qp_type != type ||
+	    (type != IBV_QPT_UD && ent->dest_qpn != qp->ibv_qp.qp_num) ||
+	    (type == IBV_QPT_UD && ent->qkey != wqe->remote_qkey) ||
+	    !get_peer(qp, ent))
+		return type == IBV_QPT_RC ? retry(qp, wqe, false, 0, wc) :
+					    LB_DONE;
+
+	switch (wqe->opcode) {
+	case IBV_WR_RDMA_READ:
+		if (!(ent->access & IBV_ACCESS_REMOTE_READ) ||
+		    !lb_mr_check(ctx, wqe->rkey, ent->pid, ent->pd,
+				 wqe->remote_addr, len,
+				 IBV_ACCESS_REMOTE_READ)) {
+			wc->status = IBV_WC_REM_ACCESS_ERR;
+			return LB_DONE;
+		}
+		riov[0].iov_base = (void *)(uintptr_t)wqe->remote_addr;
+		riov[0].iov_len = len;
+		if (!vm_copy(ctx, ent->pid, liov, nliov, riov, 1, len, false))
+			wc->status = IBV_WC_REM_OP_ERR;
+		return LB_DONE;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return execute_atomic(qp, wqe, ent, wc);
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		if (!(ent->access & IBV_ACCESS_REMOTE_WRITE) ||
+		    !lb_mr_check(ctx, wqe->rkey, ent->pid, ent->pd,
+				 wqe->remote_addr, len,
+				 IBV_ACCESS_REMOTE_WRITE)) {
+			if (type == IBV_QPT_RC)
+				wc->status = IBV_WC_REM_ACCESS_ERR;
+			return LB_DONE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Everything else consumes a receive WQE, except RDMA WRITE */
+	imm_recv = wqe->opcode != IBV_WR_RDMA_WRITE;
+	if (imm_recv && !take_rwqe(qp->peer.rq, &rwc.wr_id, rsge, &num_rsge))
+		return type == IBV_QPT_RC ?
+			retry(qp, wqe, true, ent->min_rnr_timer, wc) : LB_DONE;
+
+	rwc.qp_num = dest_qpn;
+	rwc.src_qp = qp->ibv_qp.qp_num;
+	rwc.slid = 1;
+	rwc.byte_len = len;
+
+	if (wqe->opcode == IBV_WR_RDMA_WRITE ||
+	    wqe->opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+		riov[0].iov_base = (void *)(uintptr_t)wqe->remote_addr;
+		riov[0].iov_len = len;
+		nriov = 1;
+		rwc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+	} else {
+		/* Space is left for a GRH, but none is written */
+		if (type == IBV_QPT_UD) {
+			grh = LB_GRH_SIZE;
+			rwc.byte_len += grh;
+			rwc.sl = wqe->ah_attr.sl;
+			if (wqe->ah_attr.is_global)
+				rwc.wc_flags |= IBV_WC_GRH;
+		}
+		rwc.opcode = IBV_WC_RECV;
+
+		if (!check_sges(ctx, rsge, num_rsge, ent->pid, ent->pd,
+				IBV_ACCESS_LOCAL_WRITE, &rlen)) {
+			rwc.status = IBV_WC_LOC_PROT_ERR;
+			cq_push(qp->peer.rcq, &rwc);
+			if (type == IBV_QPT_RC)
+				wc->status = IBV_WC_REM_OP_ERR;
+			return LB_DONE;
+		}
+		if (rlen < len + grh) {
+			rwc.status = IBV_WC_LOC_LEN_ERR;
+			cq_push(qp->peer.rcq, &rwc);
+			if (type == IBV_QPT_RC)
+				wc->status = IBV_WC_REM_INV_REQ_ERR;
+			return LB_DONE;
+		}
+		nriov = sge_to_iov(rsge, num_rsge, grh, len, riov);
+	}
+
+	if (!vm_copy(ctx, ent->pid, liov, nliov, riov, nriov, len, true)) {
+		rwc.status = IBV_WC_GENERAL_ERR;
+		if (type == IBV_QPT_RC)
+			wc->status = IBV_WC_REM_OP_ERR;
+	}
+
+	if (imm_recv) {
+		if (wqe->opcode != IBV_WR_SEND) {
+			rwc.wc_flags |= IBV_WC_WITH_IMM;
+			rwc.imm_data = wqe->imm_data;
+		}
+		cq_push(qp->peer.rcq, &rwc);
+	}
+	return LB_DONE;
+}
+
+/*
+ * Runs the send queue until it is empty or its head WQE has to wait.
+ * Returns true in the latter case.  Must be called with the sq_lock held.
+ */
+static bool process_sq(struct lb_qp *qp, struct timespec *now)
+{
+	struct lb_cq_obj *cq = to_lcq(qp->ibv_qp.send_cq)->obj;
+	struct lb_swqe *wqe;
+	struct ibv_wc wc;
+
+	if (atomic_load(&qp->ent->state) != IBV_QPS_RTS)
+		return false;
+
+	while (qp->sq_head != qp->sq_tail) {
+		wqe = lb_sq_wqe(qp, qp->sq_head);
+
+		if (wqe->retry_at.tv_sec) {
+			if (!now->tv_sec)
+				clock_gettime(CLOCK_MONOTONIC, now);
+			if (ts_before(now, &wqe->retry_at))
+				return true;
+		}
+
+		memset(&wc, 0, sizeof(wc));
+		wc.wr_id = wqe->wr_id;
+		wc.opcode = wr_to_wc_opcode(wqe->opcode);
+		wc.qp_num = qp->ibv_qp.qp_num;
+		if (execute(qp, wqe, &wc) == LB_RETRY)
+			return true;
+		qp->sq_head++;
+
+		if (wc.status != IBV_WC_SUCCESS) {
+			cq_push(cq, &wc);
+			atomic_store(&qp->ent->state, IBV_QPS_ERR);
+			flush_sq(qp);
+			return false;
+		}
+		if (wqe->send_flags & IBV_SEND_SIGNALED ||
+		    qp->init_attr.sq_sig_all)
+			cq_push(cq, &wc);
+	}
+	return false;
+}
+
+/* Retries the stalled send queues of a context */
+static void progress(struct lb_context *ctx)
+{
+	struct timespec now = {};
+	struct lb_qp *qp, *tmp;
+	bool stalled, error;
+
+	if (!atomic_load_explicit(&ctx->num_pending, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&ctx->pending_lock);
+	list_for_each_safe(&ctx->pending_qps, qp, tmp, pending_entry) {
+		/* Queues being posted to are run by the poster */
+		if (pthread_spin_trylock(&qp->sq_lock))
+			continue;
+		stalled = process_sq(qp, &now);
+		error = atomic_load(&qp->ent->state) == IBV_QPS_ERR;
+		pthread_spin_unlock(&qp->sq_lock);
+
+		if (error)
+			flush_rq(qp);
+		if (!stalled)
+			clear_pending(ctx, qp);
+	}
+	pthread_mutex_unlock(&ctx->pending_lock);
+}
+
+static int validate_send_wr(struct lb_qp *qp, struct ibv_send_wr *wr)
+{
+	enum ibv_qp_type type = qp->ibv_qp.qp_type;
+	uint32_t len = 0;
+	int i;
+
+	if (wr->num_sge < 0 || wr->num_sge > qp->init_attr.cap.max_send_sge)
+		return EINVAL;
+
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		break;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		if (type == IBV_QPT_UD)
+			return EINVAL;
+		break;
+	case IBV_WR_RDMA_READ:
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		if (type != IBV_QPT_RC || wr->send_flags & IBV_SEND_INLINE)
+			return EINVAL;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	if (type == IBV_QPT_UD && !wr->wr.ud.ah)
+		return EINVAL;
+
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		for (i = 0; i < wr->num_sge; i++)
+			len += wr->sg_list[i].length;
+		if (len > qp->init_attr.cap.max_inline_data)
+			return EINVAL;
+	}
+	return 0;
+}
+
+static void queue_send_wr(struct lb_qp *qp, struct ibv_send_wr *wr)
+{
+	uint32_t idx = qp->sq_tail % qp->init_attr.cap.max_send_wr;
+	struct lb_swqe *wqe = lb_sq_wqe(qp, qp->sq_tail);
+	int i;
+
+	wqe->wr_id = wr->wr_id;
+	wqe->opcode = wr->opcode;
+	wqe->send_flags = wr->send_flags;
+	wqe->imm_data = wr->imm_data;
+	wqe->retries = 0;
+	wqe->rnr_retries = 0;
+	wqe->retry_at.tv_sec = 0;
+	wqe->inline_len = 0;
+	wqe->num_sge = wr->num_sge;
+
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		/* Inline data is copied when posted, the buffers are not
+		 * registered and may be reused once this returns.
+		 */
+		wqe->inline_data = qp->sq_inline +
+				   idx * qp->init_attr.cap.max_inline_data;
+		for (i = 0; i < wr->num_sge; i++) {
+			memcpy(wqe->inline_data + wqe->inline_len,
+			       (void *)(uintptr_t)wr->sg_list[i].addr,
+			       wr->sg_list[i].length);
+			wqe->inline_len += wr->sg_list[i].length;
+		}
+		wqe->num_sge = 0;
+	} else {
+		memcpy(wqe->sge, wr->sg_list, wr->num_sge * sizeof(*wqe->sge));
+	}
+
+	switch (wr->opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+	case IBV_WR_RDMA_READ:
+		wqe->remote_addr = wr->wr.rdma.remote_addr;
+		wqe->rkey = wr->wr.rdma.rkey;
+		break;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		wqe->remote_addr = wr->wr.atomic.remote_addr;
+		wqe->rkey = wr->wr.atomic.rkey;
+		wqe->compare_add = wr->wr.atomic.compare_add;
+		wqe->swap = wr->wr.atomic.swap;
+		break;
+	default:
+		break;
+	}
+
+	if (qp->ibv_qp.qp_type == IBV_QPT_UD) {
+		wqe->ah_attr = to_lah(wr->wr.ud.ah)->attr;
+		wqe->remote_qpn = wr->wr.ud.remote_qpn;
+		/* A Q_Key with the high bit set is replaced by the QP's */
+		wqe->remote_qkey = wr->wr.ud.remote_qkey & 0x80000000 ?
+				   qp->attr.qkey : wr->wr.ud.remote_qkey;
+	}
+
+	qp->sq_tail++;
+}
+
+/* Executes the queued send WQEs and releases sq_lock */
+static void run_sq_unlock(struct lb_qp *qp, enum ibv_qp_state state)
+{
+	struct timespec now = {};
+	bool stalled = false;
+
+	if (state == IBV_QPS_ERR)
+		flush_sq(qp);
+	else
+		stalled = process_sq(qp, &now);
+	state = atomic_load(&qp->ent->state);
+	pthread_spin_unlock(&qp->sq_lock);
+
+	if (stalled)
+		set_pending(qp);
+	if (state == IBV_QPS_ERR)
+		flush_rq(qp);
+}
+
+int lb_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+		 struct ibv_send_wr **bad_wr)
+{
+	struct lb_context *ctx = to_lctx(ibqp->context);
+	struct lb_qp *qp = to_lqp(ibqp);
+	enum ibv_qp_state state;
+	int ret = 0;
+
+	progress(ctx);
+
+	state = atomic_load(&qp->ent->state);
+	if (state != IBV_QPS_RTS && state != IBV_QPS_ERR) {
+		*bad_wr = wr;
+		return EINVAL;
+	}
+
+	pthread_spin_lock(&qp->sq_lock);
+	for (; wr; wr = wr->next) {
+		ret = validate_send_wr(qp, wr);
+		if (!ret && qp->sq_tail - qp->sq_head >=
+			    qp->init_attr.cap.max_send_wr)
+			ret = ENOMEM;
+		if (ret) {
+			*bad_wr = wr;
+			break;
+		}
+		queue_send_wr(qp, wr);
+	}
+
+	run_sq_unlock(qp, state);
+	return ret;
+}
+
+/*
+ * Work request builder.  WQEs are written past the tail of the send queue
+ * and queued all at once by wr_complete, which then executes them like
+ * ibv_post_send() does.
+ */
+static inline struct lb_qp *wr_to_lqp(struct ibv_qp_ex *ibqp)
+{
+	return to_lqp(&ibqp->qp_base);
+}
+
+static struct lb_swqe *wr_begin(struct ibv_qp_ex *ibqp,
+				enum ibv_wr_opcode opcode)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+	struct lb_swqe *wqe;
+
+	if (qp->wr_err)
+		return NULL;
+
+	if (qp->wr_tail - qp->sq_head >= qp->init_attr.cap.max_send_wr) {
+		qp->wr_err = ENOMEM;
+		return NULL;
+	}
+
+	wqe = lb_sq_wqe(qp, qp->wr_tail++);
+	wqe->wr_id = ibqp->wr_id;
+	wqe->opcode = opcode;
+	wqe->send_flags = ibqp->wr_flags & ~IBV_SEND_INLINE;
+	wqe->imm_data = 0;
+	wqe->retries = 0;
+	wqe->rnr_retries = 0;
+	wqe->retry_at.tv_sec = 0;
+	wqe->inline_len = 0;
+	wqe->num_sge = 0;
+
+	qp->cur_wqe = wqe;
+	return wqe;
+}
+
+static void lb_wr_send(struct ibv_qp_ex *ibqp)
+{
+	wr_begin(ibqp, IBV_WR_SEND);
+}
+
+static void lb_wr_send_imm(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	struct lb_swqe *wqe = wr_begin(ibqp, IBV_WR_SEND_WITH_IMM);
+
+	if (wqe)
+		wqe->imm_data = imm_data;
+}
+
+static struct lb_swqe *wr_rdma(struct ibv_qp_ex *ibqp,
+			       enum ibv_wr_opcode opcode, uint32_t rkey,
+			       uint64_t remote_addr)
+{
+	struct lb_swqe *wqe = wr_begin(ibqp, opcode);
+
+	if (wqe) {
+		wqe->remote_addr = remote_addr;
+		wqe->rkey = rkey;
+	}
+	return wqe;
+}
+
+static void lb_wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	wr_rdma(ibqp, IBV_WR_RDMA_WRITE, rkey, remote_addr);
+}
+
+static void lb_wr_rdma_write_imm(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				 uint64_t remote_addr, __be32 imm_data)
+{
+	struct lb_swqe *wqe;
+
+	wqe = wr_rdma(ibqp, IBV_WR_RDMA_WRITE_WITH_IMM, rkey, remote_addr);
+	if (wqe)
+		wqe->imm_data = imm_data;
+}
+
+static void lb_wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			    uint64_t remote_addr)
+{
+	wr_rdma(ibqp, IBV_WR_RDMA_READ, rkey, remote_addr);
+}
+
+static void lb_wr_atomic_cmp_swp(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				 uint64_t remote_addr, uint64_t compare,
+				 uint64_t swap)
+{
+	struct lb_swqe *wqe;
+
+	wqe = wr_rdma(ibqp, IBV_WR_ATOMIC_CMP_AND_SWP, rkey, remote_addr);
+	if (wqe) {
+		wqe->compare_add = compare;
+		wqe->swap = swap;
+	}
+}
+
+static void lb_wr_atomic_fetch_add(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				   uint64_t remote_addr, uint64_t add)
+{
+	struct lb_swqe *wqe;
+
+	wqe = wr_rdma(ibqp, IBV_WR_ATOMIC_FETCH_AND_ADD, rkey, remote_addr);
+	if (wqe)
+		wqe->compare_add = add;
+}
+
+static void lb_wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+			      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+	struct lb_swqe *wqe = qp->cur_wqe;
+
+	if (qp->wr_err)
+		return;
+
+	wqe->ah_attr = to_lah(ah)->attr;
+	wqe->remote_qpn = remote_qpn;
+	wqe->remote_qkey = remote_qkey & 0x80000000 ?
+			   qp->attr.qkey : remote_qkey;
+}
+
+static void lb_wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+			       const struct ibv_sge *sg_list)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+	struct lb_swqe *wqe = qp->cur_wqe;
+
+	if (qp->wr_err)
+		return;
+
+	if (num_sge > qp->init_attr.cap.max_send_sge) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+
+	memcpy(wqe->sge, sg_list, num_sge * sizeof(*wqe->sge));
+	wqe->num_sge = num_sge;
+}
+
+static void lb_wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey,
+			  uint64_t addr, uint32_t length)
+{
+	struct ibv_sge sge = {
+		.addr = addr,
+		.length = length,
+		.lkey = lkey,
+	};
+
+	lb_wr_set_sge_list(ibqp, 1, &sge);
+}
+
+static void lb_wr_set_inline_data_list(struct ibv_qp_ex *ibqp, size_t num_buf,
+				       const struct ibv_data_buf *buf_list)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+	struct lb_swqe *wqe = qp->cur_wqe;
+	uint32_t idx;
+	size_t i;
+
+	if (qp->wr_err)
+		return;
+
+	if (wqe->opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+	    wqe->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+
+	idx = (qp->wr_tail - 1) % qp->init_attr.cap.max_send_wr;
+	wqe->inline_data = qp->sq_inline +
+			   idx * qp->init_attr.cap.max_inline_data;
+	for (i = 0; i < num_buf; i++) {
+		if (buf_list[i].length > qp->init_attr.cap.max_inline_data -
+					 wqe->inline_len) {
+			qp->wr_err = EINVAL;
+			return;
+		}
+		memcpy(wqe->inline_data + wqe->inline_len, buf_list[i].addr,
+		       buf_list[i].length);
+		wqe->inline_len += buf_list[i].length;
+	}
+	wqe->send_flags |= IBV_SEND_INLINE;
+}
+
+static void lb_wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+				  size_t length)
+{
+	struct ibv_data_buf buf = {
+		.addr = addr,
+		.length = length,
+	};
+
+	lb_wr_set_inline_data_list(ibqp, 1, &buf);
+}
+
+static void lb_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+
+	progress(to_lctx(ibqp->qp_base.context));
+
+	pthread_spin_lock(&qp->sq_lock);
+	qp->wr_tail = qp->sq_tail;
+	qp->wr_err = 0;
+}
+
+static void lb_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	pthread_spin_unlock(&wr_to_lqp(ibqp)->sq_lock);
+}
+
+static int lb_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct lb_qp *qp = wr_to_lqp(ibqp);
+	enum ibv_qp_state state;
+
+	state = atomic_load(&qp->ent->state);
+	if (state != IBV_QPS_RTS && state != IBV_QPS_ERR && !qp->wr_err)
+		qp->wr_err = EINVAL;
+
+	if (qp->wr_err) {
+		lb_wr_abort(ibqp);
+		return qp->wr_err;
+	}
+
+	qp->sq_tail = qp->wr_tail;
+	run_sq_unlock(qp, state);
+	return 0;
+}
+
+int lb_qp_fill_wr_pfns(struct lb_qp *qp, const struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_qp_ex *ibqp = &qp->vqp.qp_ex;
+	uint64_t ops = attr->send_ops_flags;
+	uint64_t supported = IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_SEND_WITH_IMM;
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+		supported |= IBV_QP_EX_WITH_RDMA_READ |
+			     IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+			     IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+		/* fall through */
+	case IBV_QPT_UC:
+		supported |= IBV_QP_EX_WITH_RDMA_WRITE |
+			     IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM;
+		break;
+	case IBV_QPT_UD:
+		ibqp->wr_set_ud_addr = lb_wr_set_ud_addr;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	if (ops & ~supported)
+		return EOPNOTSUPP;
+
+	ibqp->wr_start = lb_wr_start;
+	ibqp->wr_complete = lb_wr_complete;
+	ibqp->wr_abort = lb_wr_abort;
+	ibqp->wr_set_sge = lb_wr_set_sge;
+	ibqp->wr_set_sge_list = lb_wr_set_sge_list;
+	ibqp->wr_set_inline_data = lb_wr_set_inline_data;
+	ibqp->wr_set_inline_data_list = lb_wr_set_inline_data_list;
+
+	if (ops & IBV_QP_EX_WITH_SEND)
+		ibqp->wr_send = lb_wr_send;
+	if (ops & IBV_QP_EX_WITH_SEND_WITH_IMM)
+		ibqp->wr_send_imm = lb_wr_send_imm;
+	if (ops & IBV_QP_EX_WITH_RDMA_WRITE)
+		ibqp->wr_rdma_write = lb_wr_rdma_write;
+	if (ops & IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM)
+		ibqp->wr_rdma_write_imm = lb_wr_rdma_write_imm;
+	if (ops & IBV_QP_EX_WITH_RDMA_READ)
+		ibqp->wr_rdma_read = lb_wr_rdma_read;
+	if (ops & IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP)
+		ibqp->wr_atomic_cmp_swp = lb_wr_atomic_cmp_swp;
+	if (ops & IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD)
+		ibqp->wr_atomic_fetch_add = lb_wr_atomic_fetch_add;
+
+	return 0;
+}
+
+static int post_rq(struct lb_rq_obj *rq, struct ibv_recv_wr *wr,
+		   struct ibv_recv_wr **bad_wr)
+{
+	struct lb_rwqe *rwqe;
+	int ret = 0;
+
+	lb_lock(&rq->obj.lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge < 0 || wr->num_sge > rq->max_sge)
+			ret = EINVAL;
+		else if (rq->tail - rq->head >= rq->max_wr)
+			ret = ENOMEM;
+		if (ret) {
+			*bad_wr = wr;
+			break;
+		}
+
+		rwqe = lb_rq_wqe(rq, rq->tail);
+		rwqe->wr_id = wr->wr_id;
+		rwqe->num_sge = wr->num_sge;
+		memcpy(rwqe->sge, wr->sg_list, wr->num_sge * sizeof(*rwqe->sge));
+		rq->tail++;
+	}
+	lb_unlock(&rq->obj.lock);
+	return ret;
+}
+
+int lb_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+		 struct ibv_recv_wr **bad_wr)
+{
+	struct lb_qp *qp = to_lqp(ibqp);
+	enum ibv_qp_state state;
+	int ret;
+
+	state = atomic_load(&qp->ent->state);
+	if (!qp->rq || state == IBV_QPS_RESET) {
+		*bad_wr = wr;
+		return EINVAL;
+	}
+
+	ret = post_rq(qp->rq, wr, bad_wr);
+	if (state == IBV_QPS_ERR)
+		flush_rq(qp);
+	return ret;
+}
+
+int lb_post_srq_recv(struct ibv_srq *ibsrq, struct ibv_recv_wr *wr,
+		     struct ibv_recv_wr **bad_wr)
+{
+	return post_rq(to_lsrq(ibsrq)->obj, wr, bad_wr);
+}
+
+int lb_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	struct lb_cq *lcq = to_lcq(ibcq);
+	struct lb_cq_obj *cq = lcq->obj;
+	uint32_t i, n;
+
+	progress(to_lctx(ibcq->context));
+
+	lb_lock(&cq->obj.lock);
+	if (cq->overflow) {
+		lb_unlock(&cq->obj.lock);
+		return -1;
+	}
+	n = min((uint32_t)ne, cq->prod - cq->cons);
+	for (i = 0; i < n; i++)
+		wc[i] = cq->wc[(cq->cons + i) % cq->cqe];
+	cq->cons += n;
+	lb_unlock(&cq->obj.lock);
+
+	if (n)
+		lcq->empty_polls = 0;
+	else if (++lcq->empty_polls == LB_POLL_YIELD) {
+		lcq->empty_polls = 0;
+		sched_yield();
+	}
+	return n;
+}
@@ -0,0 +1,201 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/*
+ * Checks the ranges that the memory region cache registers, and that with
+ * IBV_MR_CACHE_AUTO_INVALIDATE it drops regions whose pages are unmapped,
+ * using a loopback device.
+ *
+ * usage: loopback_mr_cache LOOPBACK_SYSFS PROVIDER
+ *
+ * The automatic invalidation checks are skipped when userfaultfd is not
+ * permitted.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <infiniband/verbs.h>
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct ibv_pd *pd;
+static size_t page_size;
+
+static char *map_pages(void *hint, size_t npages)
+{
+	char *p;
+
+	p = mmap(hint, npages * page_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | (hint ? MAP_FIXED : 0), -1, 0);
+	CHECK(p != MAP_FAILED);
+	return p;
+}
+
+/* Remote access regions are not rounded to pages, local ones are */
+static void test_ranges(void)
+{
+	struct ibv_mr_cache_init_attr attr = {
+		.access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
+	};
+	struct ibv_mr_cache *cache;
+	struct ibv_mr *mr, *mr2, *mr3;
+	char *buf = map_pages(NULL, 4);
+
+	cache = ibv_mr_cache_create(pd, &attr);
+	CHECK(cache);
+	mr = ibv_mr_cache_get(cache, buf + 10, 20);
+	CHECK(mr && mr->addr == buf + 10 && mr->length == 20);
+	/* Overlapping ranges are merged, adjacent ones are not */
+	mr2 = ibv_mr_cache_get(cache, buf + 30, 10);
+	CHECK(mr2 && mr2 != mr && mr2->addr == buf + 30);
+	mr3 = ibv_mr_cache_get(cache, buf + 20, 15);
+	CHECK(mr3 && mr3->addr == buf + 10 && mr3->length == 30);
+	ibv_mr_cache_put(cache, mr);
+	ibv_mr_cache_put(cache, mr2);
+	ibv_mr_cache_put(cache, mr3);
+	CHECK(!ibv_mr_cache_destroy(cache));
+
+	attr.access = IBV_ACCESS_LOCAL_WRITE;
+	cache = ibv_mr_cache_create(pd, &attr);
+	CHECK(cache);
+	mr = ibv_mr_cache_get(cache, buf + 10, 20);
+	CHECK(mr && mr->addr == buf && mr->length == page_size);
+	mr2 = ibv_mr_cache_get(cache, buf + 100, 10);
+	CHECK(mr2 == mr);
+	ibv_mr_cache_put(cache, mr);
+	ibv_mr_cache_put(cache, mr2);
+	CHECK(!ibv_mr_cache_destroy(cache));
+
+	attr.comp_mask = IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS;
+	attr.flags = 1 << 31;
+	CHECK(!ibv_mr_cache_create(pd, &attr) && errno == EINVAL);
+
+	munmap(buf, 4 * page_size);
+}
+
+static void test_auto_invalidate(void)
+{
+	struct ibv_mr_cache_init_attr attr = {
+		.access = IBV_ACCESS_LOCAL_WRITE,
+		.comp_mask = IBV_MR_CACHE_INIT_ATTR_MASK_FLAGS,
+		.flags = IBV_MR_CACHE_AUTO_INVALIDATE,
+	};
+	struct ibv_mr_cache *cache;
+	struct ibv_mr *mr, *mr2;
+	char *buf;
+	int fd;
+
+	cache = ibv_mr_cache_create(pd, &attr);
+	if (!cache) {
+		CHECK(errno == EPERM || errno == EOPNOTSUPP || errno == ENOSYS);
+		printf("userfaultfd not available, automatic invalidation not tested\n");
+		return;
+	}
+
+	/* Pages not populated yet are filled as usual */
+	buf = map_pages(NULL, 2);
+	mr = ibv_mr_cache_get(cache, buf, 2 * page_size);
+	CHECK(mr);
+	CHECK(buf[page_size] == 0);
+	memset(buf, 1, 2 * page_size);
+
+	/* Regions in use are replaced once their pages are removed */
+	CHECK(!madvise(buf, page_size, MADV_DONTNEED));
+	CHECK(buf[0] == 0 && buf[page_size] == 1);
+	mr2 = ibv_mr_cache_get(cache, buf, 2 * page_size);
+	CHECK(mr2 && mr2 != mr);
+	ibv_mr_cache_put(cache, mr);
+	mr = ibv_mr_cache_get(cache, buf, 2 * page_size);
+	CHECK(mr == mr2);
+	ibv_mr_cache_put(cache, mr);
+
+	/* and once the memory is unmapped and mapped again */
+	CHECK(!munmap(buf, 2 * page_size));
+	CHECK(map_pages(buf, 2) == buf);
+	mr = ibv_mr_cache_get(cache, buf, 2 * page_size);
+	CHECK(mr && mr != mr2);
+	ibv_mr_cache_put(cache, mr2);
+	ibv_mr_cache_put(cache, mr);
+
+	/*
+	 * A union that can not be registered, here because the second page
+	 * maps a file that userfaultfd can not watch, leaves the cached region
+	 * in place.
+	 */
+	fd = open("/proc/self/exe", O_RDONLY);
+	CHECK(fd >= 0);
+	CHECK(mmap(buf + page_size, page_size, PROT_READ,
+		   MAP_PRIVATE | MAP_FIXED, fd, 0) == buf + page_size);
+	close(fd);
+	mr = ibv_mr_cache_get(cache, buf, page_size);
+	CHECK(mr);
+	CHECK(!ibv_mr_cache_get(cache, buf, 2 * page_size));
+	mr2 = ibv_mr_cache_get(cache, buf + 10, 10);
+	CHECK(mr2 == mr);
+	ibv_mr_cache_put(cache, mr);
+	ibv_mr_cache_put(cache, mr2);
+
+	CHECK(!ibv_mr_cache_destroy(cache));
+	munmap(buf, 2 * page_size);
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/loopback_mr_cache.XXXXXX";
+	struct ibv_device **dev_list;
+	struct ibv_context *context;
+	char *cmd;
+	int num;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s LOOPBACK_SYSFS PROVIDER\n", argv[0]);
+		return 1;
+	}
+
+	/* A hang in a userfaultfd wait fails the test */
+	alarm(60);
+	page_size = sysconf(_SC_PAGESIZE);
+
+	CHECK(mkdtemp(dir));
+	CHECK(asprintf(&cmd, "sh '%s' '%s'", argv[1], dir) > 0);
+	CHECK(!system(cmd));
+	free(cmd);
+	setenv("SYSFS_PATH", dir, 1);
+	setenv("RDMAV_DRIVERS", argv[2], 1);
+
+	dev_list = ibv_get_device_list(&num);
+	CHECK(dev_list && num == 1);
+	context = ibv_open_device(dev_list[0]);
+	CHECK(context);
+	pd = ibv_alloc_pd(context);
+	CHECK(pd);
+
+	test_ranges();
+	test_auto_invalidate();
+
+	CHECK(!ibv_dealloc_pd(pd));
+	CHECK(!ibv_close_device(context));
+	ibv_free_device_list(dev_list);
+
+	CHECK(asprintf(&cmd, "rm -rf '%s'", dir) > 0);
+	CHECK(!system(cmd));
+	free(cmd);
+	printf("loopback MR cache test passed\n");
+	return 0;
+}
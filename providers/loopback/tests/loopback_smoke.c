@@ -0,0 +1,291 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/*
+ * Drives RC SEND, RDMA WRITE and RDMA READ, and UD SEND, between QPs of a
+ * loopback device, checking the data moved and the completions reported.
+ *
+ * usage: loopback_smoke LOOPBACK_SYSFS PROVIDER
+ *
+ * The loopback_sysfs script creates a temporary device tree, and PROVIDER
+ * is the provider library without its suffix, as given to RDMAV_DRIVERS.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+
+#define BUF_SIZE	8192
+#define GRH_SIZE	40
+#define QKEY		0x11111111
+#define POLL_LOOPS	1000000
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct ibv_pd *pd;
+static struct ibv_cq *scq, *rcq;
+static struct ibv_mr *mr;
+static char *buf;
+
+static struct ibv_qp *create_qp(enum ibv_qp_type type)
+{
+	struct ibv_qp_init_attr attr = {
+		.send_cq = scq,
+		.recv_cq = rcq,
+		.cap = {
+			.max_send_wr = 8,
+			.max_recv_wr = 8,
+			.max_send_sge = 1,
+			.max_recv_sge = 1,
+		},
+		.qp_type = type,
+	};
+	struct ibv_qp *qp;
+
+	qp = ibv_create_qp(pd, &attr);
+	CHECK(qp);
+	return qp;
+}
+
+static void connect_qp(struct ibv_qp *qp, uint32_t dest_qpn)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_INIT,
+		.port_num = 1,
+		.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
+				   IBV_ACCESS_REMOTE_READ,
+	};
+	int mask = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT;
+
+	if (qp->qp_type == IBV_QPT_UD) {
+		attr.qkey = QKEY;
+		mask |= IBV_QP_QKEY;
+	} else {
+		mask |= IBV_QP_ACCESS_FLAGS;
+	}
+	CHECK(!ibv_modify_qp(qp, &attr, mask));
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTR;
+	mask = IBV_QP_STATE;
+	if (qp->qp_type == IBV_QPT_RC) {
+		attr.path_mtu = IBV_MTU_1024;
+		attr.dest_qp_num = dest_qpn;
+		attr.max_dest_rd_atomic = 1;
+		attr.min_rnr_timer = 1;
+		attr.ah_attr.dlid = 1;
+		attr.ah_attr.port_num = 1;
+		mask |= IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+			IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC |
+			IBV_QP_MIN_RNR_TIMER;
+	}
+	CHECK(!ibv_modify_qp(qp, &attr, mask));
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_RTS;
+	mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+	if (qp->qp_type == IBV_QPT_RC) {
+		attr.timeout = 10;
+		attr.retry_cnt = 1;
+		attr.rnr_retry = 1;
+		attr.max_rd_atomic = 1;
+		mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+			IBV_QP_MAX_QP_RD_ATOMIC;
+	}
+	CHECK(!ibv_modify_qp(qp, &attr, mask));
+}
+
+static void post_recv(struct ibv_qp *qp, size_t offset, uint32_t length)
+{
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)buf + offset,
+		.length = length,
+		.lkey = mr->lkey,
+	};
+	struct ibv_recv_wr wr = {
+		.wr_id = offset,
+		.sg_list = &sge,
+		.num_sge = 1,
+	}, *bad;
+
+	CHECK(!ibv_post_recv(qp, &wr, &bad));
+}
+
+static void post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+		      size_t offset, uint32_t length)
+{
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)buf + offset,
+		.length = length,
+		.lkey = mr->lkey,
+	};
+	struct ibv_send_wr *bad;
+
+	wr->wr_id = offset;
+	wr->sg_list = &sge;
+	wr->num_sge = 1;
+	wr->send_flags = IBV_SEND_SIGNALED;
+	CHECK(!ibv_post_send(qp, wr, &bad));
+}
+
+static void poll_one(struct ibv_cq *cq, struct ibv_qp *qp,
+		     enum ibv_wc_opcode opcode, uint32_t byte_len)
+{
+	struct ibv_wc wc;
+	int i, n = 0;
+
+	for (i = 0; i < POLL_LOOPS && !n; i++)
+		n = ibv_poll_cq(cq, 1, &wc);
+	CHECK(n == 1);
+	CHECK(wc.status == IBV_WC_SUCCESS);
+	CHECK(wc.opcode == opcode);
+	CHECK(wc.qp_num == qp->qp_num);
+	if (opcode & IBV_WC_RECV || opcode == IBV_WC_RDMA_READ)
+		CHECK(wc.byte_len == byte_len);
+}
+
+static void test_rc(void)
+{
+	static const char msg[] = "loopback rc";
+	struct ibv_send_wr wr;
+	struct ibv_qp *a, *b;
+
+	a = create_qp(IBV_QPT_RC);
+	b = create_qp(IBV_QPT_RC);
+	connect_qp(a, b->qp_num);
+	connect_qp(b, a->qp_num);
+
+	memcpy(buf, msg, sizeof(msg));
+	post_recv(b, 1024, 1024);
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_SEND;
+	post_send(a, &wr, 0, sizeof(msg));
+	poll_one(scq, a, IBV_WC_SEND, 0);
+	poll_one(rcq, b, IBV_WC_RECV, sizeof(msg));
+	CHECK(!memcmp(buf + 1024, msg, sizeof(msg)));
+
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.wr.rdma.remote_addr = (uintptr_t)buf + 2048;
+	wr.wr.rdma.rkey = mr->rkey;
+	post_send(a, &wr, 0, sizeof(msg));
+	poll_one(scq, a, IBV_WC_RDMA_WRITE, 0);
+	CHECK(!memcmp(buf + 2048, msg, sizeof(msg)));
+
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_RDMA_READ;
+	wr.wr.rdma.remote_addr = (uintptr_t)buf + 2048;
+	wr.wr.rdma.rkey = mr->rkey;
+	post_send(b, &wr, 3072, sizeof(msg));
+	poll_one(scq, b, IBV_WC_RDMA_READ, sizeof(msg));
+	CHECK(!memcmp(buf + 3072, msg, sizeof(msg)));
+
+	CHECK(!ibv_destroy_qp(a));
+	CHECK(!ibv_destroy_qp(b));
+}
+
+static void test_ud(void)
+{
+	static const char msg[] = "loopback ud";
+	struct ibv_ah_attr ah_attr = {
+		.dlid = 1,
+		.port_num = 1,
+	};
+	struct ibv_send_wr wr;
+	struct ibv_qp *a, *b;
+	struct ibv_ah *ah;
+
+	a = create_qp(IBV_QPT_UD);
+	b = create_qp(IBV_QPT_UD);
+	connect_qp(a, 0);
+	connect_qp(b, 0);
+	ah = ibv_create_ah(pd, &ah_attr);
+	CHECK(ah);
+
+	memcpy(buf + 4096, msg, sizeof(msg));
+	post_recv(b, 5120, GRH_SIZE + 1024);
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_SEND;
+	wr.wr.ud.ah = ah;
+	wr.wr.ud.remote_qpn = b->qp_num;
+	wr.wr.ud.remote_qkey = QKEY;
+	post_send(a, &wr, 4096, sizeof(msg));
+	poll_one(scq, a, IBV_WC_SEND, 0);
+	poll_one(rcq, b, IBV_WC_RECV, GRH_SIZE + sizeof(msg));
+	CHECK(!memcmp(buf + 5120 + GRH_SIZE, msg, sizeof(msg)));
+
+	CHECK(!ibv_destroy_ah(ah));
+	CHECK(!ibv_destroy_qp(a));
+	CHECK(!ibv_destroy_qp(b));
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/loopback_smoke.XXXXXX";
+	struct ibv_device **dev_list;
+	struct ibv_context *context;
+	char *cmd;
+	int num;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s LOOPBACK_SYSFS PROVIDER\n", argv[0]);
+		return 1;
+	}
+
+	CHECK(mkdtemp(dir));
+	CHECK(asprintf(&cmd, "sh '%s' '%s'", argv[1], dir) > 0);
+	CHECK(!system(cmd));
+	free(cmd);
+	setenv("SYSFS_PATH", dir, 1);
+	setenv("RDMAV_DRIVERS", argv[2], 1);
+
+	dev_list = ibv_get_device_list(&num);
+	CHECK(dev_list && num == 1);
+	context = ibv_open_device(dev_list[0]);
+	CHECK(context);
+
+	buf = calloc(1, BUF_SIZE);
+	CHECK(buf);
+	pd = ibv_alloc_pd(context);
+	CHECK(pd);
+	mr = ibv_reg_mr(pd, buf, BUF_SIZE, IBV_ACCESS_LOCAL_WRITE |
+			IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+	CHECK(mr);
+	scq = ibv_create_cq(context, 16, NULL, NULL, 0);
+	rcq = ibv_create_cq(context, 16, NULL, NULL, 0);
+	CHECK(scq && rcq);
+
+	/* Completion events are not supported */
+	CHECK(ibv_req_notify_cq(rcq, 0) == EOPNOTSUPP);
+
+	test_rc();
+	test_ud();
+
+	CHECK(!ibv_destroy_cq(scq));
+	CHECK(!ibv_destroy_cq(rcq));
+	CHECK(!ibv_dereg_mr(mr));
+	CHECK(!ibv_dealloc_pd(pd));
+	CHECK(!ibv_close_device(context));
+	ibv_free_device_list(dev_list);
+	free(buf);
+
+	CHECK(asprintf(&cmd, "rm -rf '%s'", dir) > 0);
+	CHECK(!system(cmd));
+	free(cmd);
+	printf("loopback smoke test passed\n");
+	return 0;
+}
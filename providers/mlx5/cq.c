@@ -52,6 +52,11 @@ enum {
 	CQ_POLL_ERR				= -2
 };
 
+enum {
+	/* CQEs whose ownership is checked at once by the extended poll API */
+	MLX5_CQ_LAZY_POLL_BATCH			= 16,
+};
+
 enum {
 	MLX5_CQ_MODIFY_RESEIZE = 0,
 	MLX5_CQ_MODIFY_MODER = 1,
@@ -133,11 +138,6 @@ static void *get_sw_cqe(struct mlx5_cq *cq, int n)
 	}
 }
 
-static void *next_cqe_sw(struct mlx5_cq *cq)
-{
-	return get_sw_cqe(cq, cq->cons_index);
-}
-
 static void update_cons_index(struct mlx5_cq *cq)
 {
 	cq->dbrec[MLX5_CQ_SET_CI] = htobe32(cq->cons_index & 0xffffff);
@@ -505,32 +505,144 @@ static inline int get_cur_rsc(struct mlx5_context *mctx,
 
 }
 
+/*
+ * A compressed CQE block starts with a title CQE, in the format
+ * MLX5_CQE_FORMAT_COMPRESSED, whose byte count is the number of completions
+ * in the block.  The block takes one CQ entry per completion.  What differs
+ * from one completion to the next is kept in arrays of mini CQEs, the first
+ * one in the entry after the title and the next ones in every
+ * MLX5_MINI_CQE_ARRAY_SIZE'th entry from the title.  Each completion is
+ * expanded into the title, patched with the fields of its mini CQE, which is
+ * then parsed like any other CQE.  The ownership of the other entries of a block
+ * cannot be checked, so every entry is invalidated once consumed.
+ */
+static void mlx5_start_zip(struct mlx5_cq *cq, struct mlx5_cqe64 *title)
+{
+	struct mlx5_cq_zip *zip = &cq->zip;
+
+	memcpy(&zip->title, title, sizeof(zip->title));
+	zip->title.op_own &= 0xf0;
+	zip->left = be32toh(title->byte_cnt);
+	zip->wqe_counter = be16toh(title->wqe_counter);
+	memcpy(zip->mini, get_cqe(cq, (cq->cons_index + 1) & cq->ibv_cq.cqe),
+	       sizeof(zip->mini));
+	zip->idx = 0;
+}
+
+static struct mlx5_cqe64 *mlx5_next_zip_cqe(struct mlx5_cq *cq)
+{
+	struct mlx5_cq_zip *zip = &cq->zip;
+	struct mlx5_cqe64 *cqe64 = &zip->title;
+	struct mlx5_mini_cqe8 *mini;
+	struct mlx5_cqe64 *entry;
+
+	entry = get_cqe(cq, cq->cons_index & cq->ibv_cq.cqe);
+	if (zip->idx == MLX5_MINI_CQE_ARRAY_SIZE) {
+		memcpy(zip->mini, entry, sizeof(zip->mini));
+		zip->idx = 0;
+	}
+	entry->op_own = MLX5_CQE_INVALID << 4;
+	++cq->cons_index;
+	--zip->left;
+
+	mini = &zip->mini[zip->idx++];
+	cqe64->byte_cnt = mini->byte_cnt;
+	if (mlx5dv_get_cqe_opcode(cqe64) == MLX5_CQE_REQ) {
+		cqe64->wqe_counter = mini->s_wqe_info.wqe_counter;
+		cqe64->sop_drop_qpn =
+			htobe32((be32toh(cqe64->sop_drop_qpn) & 0xffffff) |
+				mini->s_wqe_info.s_wqe_opcode << 24);
+		return cqe64;
+	}
+
+	cqe64->wqe_counter = htobe16(zip->wqe_counter++);
+	if (cq->mini_cqe_format == MLX5DV_CQE_RES_FORMAT_CSUM)
+		cqe64->checksum = mini->checksum;
+	else
+		cqe64->rx_hash_res = mini->rx_hash_result;
+
+	return cqe64;
+}
+
+/*
+ * Count the CQEs, up to n - 1, that software owns after the one at the
+ * consumer index, which it is known to own.  The ownership bytes are one per
+ * cache line, so they are checked one by one.  The count stops at the title
+ * of a compressed block, as the other entries of the block carry no
+ * ownership bit.
+ */
+static inline int mlx5_count_sw_cqes(struct mlx5_cq *cq, void *cqe, int n)
+{
+	struct mlx5_cqe64 *cqe64;
+	int i;
+
+	for (i = 1; i < n; i++) {
+		cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
+		if (mlx5dv_get_cqe_format(cqe64) == MLX5_CQE_FORMAT_COMPRESSED)
+			break;
+
+		cqe = get_sw_cqe(cq, cq->cons_index + i);
+		if (!cqe)
+			break;
+	}
+
+	return i - 1;
+}
+
+/*
+ * n is the number of CQEs that the caller may still take.  The ones found
+ * in software ownership beyond the first are kept in cq->ready, so that
+ * their contents are ordered after all their ownership checks by a single
+ * barrier.
+ */
 static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 				    struct mlx5_cqe64 **pcqe64,
-				    void **pcqe)
+				    void **pcqe, int n)
 				    ALWAYS_INLINE;
 static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 				    struct mlx5_cqe64 **pcqe64,
-				    void **pcqe)
+				    void **pcqe, int n)
 {
 	void *cqe;
 	struct mlx5_cqe64 *cqe64;
 
-	cqe = next_cqe_sw(cq);
-	if (!cqe)
-		return CQ_EMPTY;
+	if (cq->zip.left) {
+		cqe64 = mlx5_next_zip_cqe(cq);
+		*pcqe64 = cqe64;
+		*pcqe = cqe64;
+		return CQ_OK;
+	}
 
-	cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
+	if (cq->ready) {
+		cq->ready--;
+		cqe = get_cqe(cq, cq->cons_index & cq->ibv_cq.cqe);
+	} else {
+		cqe = get_sw_cqe(cq, cq->cons_index);
+		if (!cqe)
+			return CQ_EMPTY;
 
-	++cq->cons_index;
+		cq->ready = mlx5_count_sw_cqes(cq, cqe, n);
+
+		/*
+		 * Make sure we read CQ entry contents after we've checked the
+		 * ownership bit.
+		 */
+		udma_from_device_barrier();
+	}
+
+	cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
 
 	VALGRIND_MAKE_MEM_DEFINED(cqe64, sizeof *cqe64);
 
-	/*
-	 * Make sure we read CQ entry contents after we've checked the
-	 * ownership bit.
-	 */
-	udma_from_device_barrier();
+	if (mlx5dv_get_cqe_format(cqe64) == MLX5_CQE_FORMAT_COMPRESSED) {
+		mlx5_start_zip(cq, cqe64);
+		cqe64 = mlx5_next_zip_cqe(cq);
+		*pcqe64 = cqe64;
+		*pcqe = cqe64;
+		return CQ_OK;
+	}
+
+	++cq->cons_index;
 
 #ifdef MLX5_DEBUG
 	{
@@ -886,18 +998,18 @@ static inline int mlx5_parse_lazy_cqe(struct mlx5_cq *cq,
 static inline int mlx5_poll_one(struct mlx5_cq *cq,
 				struct mlx5_resource **cur_rsc,
 				struct mlx5_srq **cur_srq,
-				struct ibv_wc *wc, int cqe_ver)
+				struct ibv_wc *wc, int cqe_ver, int n)
 				ALWAYS_INLINE;
 static inline int mlx5_poll_one(struct mlx5_cq *cq,
 				struct mlx5_resource **cur_rsc,
 				struct mlx5_srq **cur_srq,
-				struct ibv_wc *wc, int cqe_ver)
+				struct ibv_wc *wc, int cqe_ver, int n)
 {
 	struct mlx5_cqe64 *cqe64;
 	void *cqe;
 	int err;
 
-	err = mlx5_get_next_cqe(cq, &cqe64, &cqe);
+	err = mlx5_get_next_cqe(cq, &cqe64, &cqe, n);
 	if (err == CQ_EMPTY)
 		return err;
 
@@ -929,7 +1041,8 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne,
 	mlx5_spin_lock(&cq->lock);
 
 	for (npolled = 0; npolled < ne; ++npolled) {
-		err = mlx5_poll_one(cq, &rsc, &srq, wc + npolled, cqe_ver);
+		err = mlx5_poll_one(cq, &rsc, &srq, wc + npolled, cqe_ver,
+				    ne - npolled);
 		if (err != CQ_OK)
 			break;
 	}
@@ -1033,7 +1146,7 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq, struct ibv_poll_cq_att
 	cq->cur_rsc = NULL;
 	cq->cur_srq = NULL;
 
-	err = mlx5_get_next_cqe(cq, &cqe64, &cqe);
+	err = mlx5_get_next_cqe(cq, &cqe64, &cqe, MLX5_CQ_LAZY_POLL_BATCH);
 	if (err == CQ_EMPTY) {
 		if (lock)
 			mlx5_spin_unlock(&cq->lock);
@@ -1083,7 +1196,7 @@ static inline int mlx5_next_poll(struct ibv_cq_ex *ibcq,
 	void *cqe;
 	int err;
 
-	err = mlx5_get_next_cqe(cq, &cqe64, &cqe);
+	err = mlx5_get_next_cqe(cq, &cqe64, &cqe, MLX5_CQ_LAZY_POLL_BATCH);
 	if (err == CQ_EMPTY) {
 		if (stall == POLLING_MODE_STALL_ADAPTIVE)
 			cq->flags |= MLX5_CQ_FLAGS_EMPTY_DURING_POLL;
@@ -1594,6 +1707,92 @@ static inline int free_res_cqe(struct mlx5_cqe64 *cqe64, uint32_t rsn,
 	return 0;
 }
 
+/* The number of CQ entries taken by the CQE at index n, 64 bytes CQEs only */
+static uint32_t cqe_entries(struct mlx5_cq *cq, uint32_t n)
+{
+	struct mlx5_cqe64 *cqe64 = get_cqe(cq, n & cq->ibv_cq.cqe);
+
+	if (mlx5dv_get_cqe_format(cqe64) == MLX5_CQE_FORMAT_COMPRESSED &&
+	    cqe64->byte_cnt)
+		return be32toh(cqe64->byte_cnt);
+
+	return 1;
+}
+
+/*
+ * As __mlx5_cq_clean(), for a CQ that may hold compressed CQE blocks.  The
+ * entries of a block are freed or moved together, according to its title
+ * CQE, and only the title gets the ownership bit of its new index.  The
+ * rest of the block being polled is a block whose title is in cq->zip.
+ */
+static void mlx5_cq_clean_compressed(struct mlx5_cq *cq, uint32_t rsn,
+				     struct mlx5_srq *srq)
+{
+	int cqe_version = to_mctx(cq->ibv_cq.context)->cqe_version;
+	uint32_t mask = cq->ibv_cq.cqe;
+	struct mlx5_cqe64 *cqe64, *dest64;
+	uint32_t prod_index, end, i;
+	uint32_t *start, nstart = 0;
+	uint32_t nfreed = 0;
+	uint8_t owner_bit;
+	bool partial;
+
+	for (prod_index = cq->cons_index + cq->zip.left;
+	     get_sw_cqe(cq, prod_index);
+	     prod_index += cqe_entries(cq, prod_index))
+		if (prod_index - cq->cons_index >= mask)
+			break;
+
+	start = malloc((prod_index - cq->cons_index + 1) * sizeof(*start));
+	if (!start)
+		return;
+
+	if (cq->zip.left)
+		start[nstart++] = cq->cons_index;
+	for (i = cq->cons_index + cq->zip.left; i != prod_index;
+	     i += cqe_entries(cq, i))
+		start[nstart++] = i;
+
+	end = prod_index;
+	while (nstart--) {
+		partial = cq->zip.left && !nstart;
+		cqe64 = partial ? &cq->zip.title :
+				  get_cqe(cq, start[nstart] & mask);
+		if (free_res_cqe(cqe64, rsn, srq, cqe_version)) {
+			nfreed += end - start[nstart];
+			if (partial)
+				cq->zip.left = 0;
+		} else if (nfreed) {
+			for (i = end; i-- != start[nstart];) {
+				cqe64 = get_cqe(cq, i & mask);
+				dest64 = get_cqe(cq, (i + nfreed) & mask);
+				memcpy(dest64, cqe64, sizeof(*dest64));
+				if (i != start[nstart] || partial)
+					continue;
+				owner_bit = (i + nfreed) & (mask + 1) ? 1 : 0;
+				dest64->op_own = owner_bit |
+					(dest64->op_own & ~MLX5_CQE_OWNER_MASK);
+			}
+		}
+		end = start[nstart];
+	}
+	free(start);
+
+	if (nfreed) {
+		for (i = cq->cons_index; i != cq->cons_index + nfreed; i++) {
+			cqe64 = get_cqe(cq, i & mask);
+			cqe64->op_own = MLX5_CQE_INVALID << 4;
+		}
+		cq->cons_index += nfreed;
+		/*
+		 * Make sure update of buffer contents is done before
+		 * updating consumer index.
+		 */
+		udma_to_device_barrier();
+		update_cons_index(cq);
+	}
+}
+
 void __mlx5_cq_clean(struct mlx5_cq *cq, uint32_t rsn, struct mlx5_srq *srq)
 {
 	uint32_t prod_index;
@@ -1606,6 +1805,14 @@ void __mlx5_cq_clean(struct mlx5_cq *cq, uint32_t rsn, struct mlx5_srq *srq)
 	if (!cq || cq->flags & MLX5_CQ_FLAGS_DV_OWNED)
 		return;
 
+	/* Entries may move, they are checked again by the next poll */
+	cq->ready = 0;
+
+	if (cq->flags & MLX5_CQ_FLAGS_COMPRESSED_CQE) {
+		mlx5_cq_clean_compressed(cq, rsn, srq);
+		return;
+	}
+
 	/*
 	 * First we need to find the current producer index, so we
 	 * know where to start cleaning from.  It doesn't matter if HW
@@ -1676,30 +1883,39 @@ void mlx5_cq_resize_copy_cqes(struct mlx5_cq *cq)
 	int dsize;
 	int i;
 	uint8_t sw_own;
+	/* Entries of a compressed CQE block after its title */
+	uint32_t raw;
 
 	ssize = cq->cqe_sz;
 	dsize = cq->resize_cqe_sz;
 
 	i = cq->cons_index;
+	raw = cq->zip.left;
 	scqe = get_buf_cqe(cq->active_buf, i & cq->active_cqes, ssize);
 	scqe64 = ssize == 64 ? scqe : scqe + 64;
 	start_cqe = scqe;
-	if (is_hw(scqe64->op_own, i, cq->active_cqes)) {
+	if (!raw && is_hw(scqe64->op_own, i, cq->active_cqes)) {
 		fprintf(stderr, "expected cqe in sw ownership\n");
 		return;
 	}
 
-	while ((scqe64->op_own >> 4) != MLX5_CQE_RESIZE_CQ) {
+	while (raw || (scqe64->op_own >> 4) != MLX5_CQE_RESIZE_CQ) {
 		dcqe = get_buf_cqe(cq->resize_buf, (i + 1) & (cq->resize_cqes - 1), dsize);
 		dcqe64 = dsize == 64 ? dcqe : dcqe + 64;
 		sw_own = sw_ownership_bit(i + 1, cq->resize_cqes);
 		memcpy(dcqe, scqe, ssize);
-		dcqe64->op_own = (dcqe64->op_own & ~MLX5_CQE_OWNER_MASK) | sw_own;
+		if (raw) {
+			raw--;
+		} else {
+			dcqe64->op_own = (dcqe64->op_own & ~MLX5_CQE_OWNER_MASK) | sw_own;
+			if (mlx5dv_get_cqe_format(scqe64) == MLX5_CQE_FORMAT_COMPRESSED)
+				raw = be32toh(scqe64->byte_cnt) - 1;
+		}
 
 		++i;
 		scqe = get_buf_cqe(cq->active_buf, i & cq->active_cqes, ssize);
 		scqe64 = ssize == 64 ? scqe : scqe + 64;
-		if (is_hw(scqe64->op_own, i, cq->active_cqes)) {
+		if (!raw && is_hw(scqe64->op_own, i, cq->active_cqes)) {
 			fprintf(stderr, "expected cqe in sw ownership\n");
 			return;
 		}
@@ -1710,6 +1926,7 @@ void mlx5_cq_resize_copy_cqes(struct mlx5_cq *cq)
 		}
 	}
 	++cq->cons_index;
+	cq->ready = 0;
 }
 
 int mlx5_alloc_cq_buf(struct mlx5_context *mctx, struct mlx5_cq *cq,
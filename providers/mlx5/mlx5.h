@@ -215,6 +215,7 @@ struct mlx5_db_page;
 struct mlx5_spinlock {
 	pthread_spinlock_t		lock;
 	int				in_use;
+	int				need_lock;
 };
 
 enum mlx5_uar_type {
@@ -319,6 +320,19 @@ struct mlx5_buf {
 struct mlx5_pd {
 	struct ibv_pd			ibv_pd;
 	uint32_t			pdn;
+	atomic_int			refcount;
+	/* Set on parent domains only */
+	struct mlx5_pd		       *mprotection_domain;
+};
+
+struct mlx5_td {
+	struct ibv_td			ibv_td;
+	atomic_int			refcount;
+};
+
+struct mlx5_parent_domain {
+	struct mlx5_pd			mpd;
+	struct mlx5_td		       *mtd;
 };
 
 enum {
@@ -334,6 +348,16 @@ enum {
 	MLX5_CQ_FLAGS_SINGLE_THREADED = 1 << 4,
 	MLX5_CQ_FLAGS_DV_OWNED = 1 << 5,
 	MLX5_CQ_FLAGS_TM_SYNC_REQ = 1 << 6,
+	MLX5_CQ_FLAGS_COMPRESSED_CQE = 1 << 7,
+};
+
+/* Expansion state of the compressed CQE block being polled */
+struct mlx5_cq_zip {
+	struct mlx5_cqe64		title;
+	struct mlx5_mini_cqe8		mini[MLX5_MINI_CQE_ARRAY_SIZE];
+	uint32_t			left;
+	uint16_t			wqe_counter;
+	uint8_t				idx;
 };
 
 struct mlx5_cq {
@@ -362,6 +386,10 @@ struct mlx5_cq {
 	struct mlx5_cqe64		*cqe64;
 	uint32_t			flags;
 	int			umr_opcode;
+	uint8_t				mini_cqe_format;
+	struct mlx5_cq_zip		zip;
+	/* CQEs from cons_index on known to be in software ownership */
+	int				ready;
 };
 
 struct mlx5_tag_entry {
@@ -484,6 +512,20 @@ struct mlx5_qp {
 	uint16_t			max_tso_header;
 	int                             rss_qp;
 	uint32_t			flags; /* Use enum mlx5_qp_flags */
+
+	/* Work request builder state, valid between wr_start and
+	 * wr_complete/wr_abort while sq.lock is held.
+	 */
+	struct mlx5_wqe_ctrl_seg       *cur_ctrl;
+	void			       *cur_data;
+	int				cur_size;	/* in 16 byte units */
+	int				cur_setters;	/* calls left to finish the WQE */
+	bool				cur_atomic;
+	bool				inl_wqe;
+	int				wr_err;
+	unsigned			nreq;
+	unsigned			cur_post_rb;
+	uint8_t				fm_cache_rb;
 };
 
 struct mlx5_ah {
@@ -554,7 +596,32 @@ static inline struct mlx5_context *to_mctx(struct ibv_context *ibctx)
 
 static inline struct mlx5_pd *to_mpd(struct ibv_pd *ibpd)
 {
-	return to_mxxx(pd, pd);
+	struct mlx5_pd *mpd = to_mxxx(pd, pd);
+
+	if (mpd->mprotection_domain)
+		return mpd->mprotection_domain;
+
+	return mpd;
+}
+
+static inline struct mlx5_parent_domain *to_mparent_domain(struct ibv_pd *ibpd)
+{
+	struct mlx5_parent_domain *mparent_domain;
+
+	if (!ibpd)
+		return NULL;
+
+	mparent_domain = container_of(ibpd, struct mlx5_parent_domain,
+				      mpd.ibv_pd);
+	if (!mparent_domain->mpd.mprotection_domain)
+		return NULL;
+
+	return mparent_domain;
+}
+
+static inline struct mlx5_td *to_mtd(struct ibv_td *ibtd)
+{
+	return to_mxxx(td, td);
 }
 
 static inline struct mlx5_cq *to_mcq(struct ibv_cq *ibcq)
@@ -650,6 +717,11 @@ int mlx5_query_port(struct ibv_context *context, uint8_t port,
 
 struct ibv_pd *mlx5_alloc_pd(struct ibv_context *context);
 int mlx5_free_pd(struct ibv_pd *pd);
+struct ibv_td *mlx5_alloc_td(struct ibv_context *context,
+			     struct ibv_td_init_attr *init_attr);
+int mlx5_dealloc_td(struct ibv_td *td);
+struct ibv_pd *mlx5_alloc_parent_domain(struct ibv_context *context,
+					struct ibv_parent_domain_init_attr *attr);
 
 struct ibv_mr *mlx5_reg_mr(struct ibv_pd *pd, void *addr,
 			   size_t length, int access);
@@ -667,6 +739,8 @@ struct ibv_cq *mlx5_create_cq(struct ibv_context *context, int cqe,
 struct ibv_cq_ex *mlx5_create_cq_ex(struct ibv_context *context,
 				    struct ibv_cq_init_attr_ex *cq_attr);
 void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_attr);
+int mlx5_qp_fill_wr_pfns(struct mlx5_context *ctx, struct mlx5_qp *qp,
+			 const struct ibv_qp_init_attr_ex *attr);
 int mlx5_alloc_cq_buf(struct mlx5_context *mctx, struct mlx5_cq *cq,
 		      struct mlx5_buf *buf, int nent, int cqe_sz);
 int mlx5_free_cq_buf(struct mlx5_context *ctx, struct mlx5_buf *buf);
@@ -765,13 +839,14 @@ static inline void *mlx5_find_uidx(struct mlx5_context *ctx, uint32_t uidx)
 
 static inline int mlx5_spin_lock(struct mlx5_spinlock *lock)
 {
-	if (!mlx5_single_threaded)
+	if (lock->need_lock)
 		return pthread_spin_lock(&lock->lock);
 
 	if (unlikely(lock->in_use)) {
 		fprintf(stderr, "*** ERROR: multithreading vilation ***\n"
 			"You are running a multithreaded application but\n"
-			"you set MLX5_SINGLE_THREADED=1. Please unset it.\n");
+			"you set MLX5_SINGLE_THREADED=1 or used a resource\n"
+			"of a thread domain from several threads.\n");
 		abort();
 	} else {
 		lock->in_use = 1;
@@ -787,7 +862,7 @@ static inline int mlx5_spin_lock(struct mlx5_spinlock *lock)
 
 static inline int mlx5_spin_unlock(struct mlx5_spinlock *lock)
 {
-	if (!mlx5_single_threaded)
+	if (lock->need_lock)
 		return pthread_spin_unlock(&lock->lock);
 
 	lock->in_use = 0;
@@ -795,12 +870,27 @@ static inline int mlx5_spin_unlock(struct mlx5_spinlock *lock)
 	return 0;
 }
 
-static inline int mlx5_spinlock_init(struct mlx5_spinlock *lock)
+static inline int mlx5_spinlock_init(struct mlx5_spinlock *lock, int need_lock)
 {
 	lock->in_use = 0;
+	lock->need_lock = need_lock;
 	return pthread_spin_init(&lock->lock, PTHREAD_PROCESS_PRIVATE);
 }
 
+/* Resources created on a parent domain with a thread domain are only used
+ * by one thread at a time and need no lock.
+ */
+static inline int mlx5_spinlock_init_pd(struct mlx5_spinlock *lock,
+					struct ibv_pd *pd)
+{
+	struct mlx5_parent_domain *mparent_domain = to_mparent_domain(pd);
+
+	if (mparent_domain && mparent_domain->mtd)
+		return mlx5_spinlock_init(lock, 0);
+
+	return mlx5_spinlock_init(lock, !mlx5_single_threaded);
+}
+
 static inline int mlx5_spinlock_destroy(struct mlx5_spinlock *lock)
 {
 	return pthread_spin_destroy(&lock->lock);
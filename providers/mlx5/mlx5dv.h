@@ -309,9 +309,12 @@ struct mlx5_tm_cqe {
 struct mlx5_cqe64 {
 	union {
 		struct {
-			uint8_t		rsvd0[17];
+			uint8_t		rsvd0[12];
+			__be32		rx_hash_res;
+			uint8_t		rx_hash_type;
 			uint8_t		ml_path;
-			uint8_t		rsvd20[4];
+			uint8_t		rsvd20[2];
+			__be16		checksum;
 			__be16		slid;
 			__be32		flags_rqpn;
 			uint8_t		hds_ip_ext;
@@ -339,6 +342,32 @@ enum {
 	MLX5_TMC_SUCCESS	= 0x80000000U,
 };
 
+enum {
+	MLX5_CQE_FORMAT_COMPRESSED	= 0x3,
+};
+
+enum {
+	MLX5_MINI_CQE_ARRAY_SIZE	= 8,
+};
+
+/*
+ * The fields of a completion of a compressed CQE block that differ from
+ * the title CQE of the block, which one depends on cqe_comp_res_format for
+ * responder completions.
+ */
+struct mlx5_mini_cqe8 {
+	union {
+		__be32		rx_hash_result;
+		__be16		checksum;
+		struct {
+			__be16	wqe_counter;
+			uint8_t	s_wqe_opcode;
+			uint8_t	reserved;
+		} s_wqe_info;
+	};
+	__be32		byte_cnt;
+};
+
 enum mlx5dv_cqe_comp_res_format {
 	MLX5DV_CQE_RES_FORMAT_HASH		= 1 << 0,
 	MLX5DV_CQE_RES_FORMAT_CSUM		= 1 << 1,
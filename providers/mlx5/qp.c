@@ -1130,6 +1130,689 @@ int mlx5_bind_mw(struct ibv_qp *qp, struct ibv_mw *mw,
 	return 0;
 }
 
+/*
+ * Work request builder.  WQEs are written straight into the send queue; the
+ * opcode call writes the control segment and the segments of the opcode, and
+ * the WQE is finished once its data, and the address of UD and XRC QPs, has
+ * been set.  The transport segments of UD and XRC QPs have a fixed position
+ * right after the control segment, so they may be set in any order.
+ */
+enum {
+	MLX5_WR_UD_HDR_SIZE	= sizeof(struct mlx5_wqe_datagram_seg) / 16,
+	MLX5_WR_XRC_HDR_SIZE	= sizeof(struct mlx5_wqe_xrc_seg) / 16,
+};
+
+static inline struct mlx5_qp *wr_to_mqp(struct ibv_qp_ex *ibqp)
+{
+	return to_mqp(&ibqp->qp_base);
+}
+
+static void wr_finish(struct mlx5_qp *qp)
+{
+	struct mlx5_wqe_ctrl_seg *ctrl = qp->cur_ctrl;
+
+	ctrl->qpn_ds = htobe32(qp->cur_size | (qp->ibv_qp->qp_num << 8));
+	if (unlikely(qp->wq_sig))
+		ctrl->signature = wq_sig(ctrl);
+
+	qp->sq.cur_post += DIV_ROUND_UP(qp->cur_size * 16, MLX5_SEND_WQE_BB);
+	qp->nreq++;
+}
+
+static inline void wr_setter_done(struct mlx5_qp *qp)
+{
+	if (--qp->cur_setters == 0)
+		wr_finish(qp);
+}
+
+/* Returns the segment after the control segment, or NULL if the batch has
+ * already failed.
+ */
+static inline void *wr_begin(struct ibv_qp_ex *ibqp, uint32_t mlx5_opcode,
+			     __be32 imm)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_ctrl_seg *ctrl;
+	unsigned idx;
+	uint8_t fence;
+
+	if (unlikely(qp->wr_err))
+		return NULL;
+
+	/* The previous work request was not finished */
+	if (unlikely(qp->cur_setters)) {
+		qp->wr_err = EINVAL;
+		return NULL;
+	}
+
+	if (unlikely(mlx5_wq_overflow(&qp->sq, qp->nreq,
+				      to_mcq(qp->ibv_qp->send_cq)))) {
+		mlx5_dbg(to_mctx(qp->ibv_qp->context)->dbg_fp,
+			 MLX5_DBG_QP_SEND, "work queue overflow\n");
+		qp->wr_err = ENOMEM;
+		return NULL;
+	}
+
+	if (ibqp->wr_flags & IBV_SEND_FENCE)
+		fence = MLX5_WQE_CTRL_FENCE;
+	else
+		fence = qp->fm_cache;
+	qp->fm_cache = 0;
+
+	idx = qp->sq.cur_post & (qp->sq.wqe_cnt - 1);
+	ctrl = mlx5_get_send_wqe(qp, idx);
+	*(uint32_t *)((void *)ctrl + 8) = 0;
+	ctrl->imm = imm;
+	ctrl->fm_ce_se = qp->sq_signal_bits | fence |
+		(ibqp->wr_flags & IBV_SEND_SIGNALED ?
+		 MLX5_WQE_CTRL_CQ_UPDATE : 0) |
+		(ibqp->wr_flags & IBV_SEND_SOLICITED ?
+		 MLX5_WQE_CTRL_SOLICITED : 0);
+	ctrl->opmod_idx_opcode = htobe32(((qp->sq.cur_post & 0xffff) << 8) |
+					 mlx5_opcode);
+
+	qp->sq.wrid[idx] = ibqp->wr_id;
+	qp->sq.wqe_head[idx] = qp->sq.head + qp->nreq;
+
+	qp->cur_ctrl = ctrl;
+	qp->cur_size = sizeof(*ctrl) / 16;
+	qp->cur_atomic = false;
+
+	return ctrl + 1;
+}
+
+/* Reserves the transport segment of the QP type and returns the segment
+ * that follows it.
+ */
+static inline void *wr_begin_transport(struct ibv_qp_ex *ibqp,
+				       uint32_t mlx5_opcode, __be32 imm,
+				       int hdr_size)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	void *seg;
+
+	seg = wr_begin(ibqp, mlx5_opcode, imm);
+	if (unlikely(!seg))
+		return NULL;
+
+	qp->cur_size += hdr_size;
+	qp->cur_setters = hdr_size ? 1 : 0;
+	return seg + hdr_size * 16;
+}
+
+/* The data setter finishes the WQE, along with the transport setter if any */
+static inline void wr_expect_data(struct mlx5_qp *qp, void *seg)
+{
+	if (unlikely(seg == qp->sq.qend))
+		seg = mlx5_get_send_wqe(qp, 0);
+	qp->cur_data = seg;
+	qp->cur_setters++;
+}
+
+static inline void _wr_send(struct ibv_qp_ex *ibqp, uint32_t mlx5_opcode,
+			    __be32 imm, int hdr_size)
+{
+	void *seg;
+
+	seg = wr_begin_transport(ibqp, mlx5_opcode, imm, hdr_size);
+	if (unlikely(!seg))
+		return;
+
+	wr_expect_data(wr_to_mqp(ibqp), seg);
+}
+
+static inline void _wr_rdma(struct ibv_qp_ex *ibqp, uint32_t mlx5_opcode,
+			    uint32_t rkey, uint64_t remote_addr, __be32 imm,
+			    int hdr_size)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	void *seg;
+
+	seg = wr_begin_transport(ibqp, mlx5_opcode, imm, hdr_size);
+	if (unlikely(!seg))
+		return;
+
+	set_raddr_seg(seg, remote_addr, rkey);
+	seg += sizeof(struct mlx5_wqe_raddr_seg);
+	qp->cur_size += sizeof(struct mlx5_wqe_raddr_seg) / 16;
+
+	wr_expect_data(qp, seg);
+}
+
+static inline void _wr_atomic(struct ibv_qp_ex *ibqp, uint32_t mlx5_opcode,
+			      uint32_t rkey, uint64_t remote_addr,
+			      uint64_t swap, uint64_t compare_add,
+			      int hdr_size)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_atomic_seg *aseg;
+	void *seg;
+
+	seg = wr_begin_transport(ibqp, mlx5_opcode, 0, hdr_size);
+	if (unlikely(!seg))
+		return;
+
+	set_raddr_seg(seg, remote_addr, rkey);
+	seg += sizeof(struct mlx5_wqe_raddr_seg);
+
+	aseg = seg;
+	if (mlx5_opcode == MLX5_OPCODE_ATOMIC_CS) {
+		aseg->swap_add = htobe64(swap);
+		aseg->compare = htobe64(compare_add);
+	} else {
+		aseg->swap_add = htobe64(compare_add);
+	}
+	seg += sizeof(struct mlx5_wqe_atomic_seg);
+
+	qp->cur_size += (sizeof(struct mlx5_wqe_raddr_seg) +
+			 sizeof(struct mlx5_wqe_atomic_seg)) / 16;
+	qp->cur_atomic = true;
+
+	wr_expect_data(qp, seg);
+}
+
+static inline void _wr_umr(struct ibv_qp_ex *ibqp, __be32 imm,
+			   enum ibv_mw_type type, uint32_t rkey,
+			   struct ibv_mw_bind_info *bind_info,
+			   enum ibv_wc_opcode wc_opcode)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	unsigned idx = qp->sq.cur_post & (qp->sq.wqe_cnt - 1);
+	void *seg;
+	int err;
+
+	seg = wr_begin(ibqp, MLX5_OPCODE_UMR, imm);
+	if (unlikely(!seg))
+		return;
+
+	err = set_bind_wr(qp, type, rkey, bind_info, qp->ibv_qp->qp_num,
+			  &seg, &qp->cur_size);
+	if (unlikely(err)) {
+		qp->wr_err = err;
+		return;
+	}
+
+	qp->sq.wr_data[idx] = wc_opcode;
+	qp->fm_cache = MLX5_WQE_CTRL_INITIATOR_SMALL_FENCE;
+	wr_finish(qp);
+}
+
+static void mlx5_send_wr_bind_mw(struct ibv_qp_ex *ibqp, struct ibv_mw *mw,
+				 uint32_t rkey,
+				 const struct ibv_mw_bind_info *bind_info)
+{
+	struct ibv_mw_bind_info info = *bind_info;
+
+	_wr_umr(ibqp, htobe32(mw->rkey), mw->type, rkey, &info,
+		IBV_WC_BIND_MW);
+}
+
+static void mlx5_send_wr_local_inv(struct ibv_qp_ex *ibqp,
+				   uint32_t invalidate_rkey)
+{
+	struct ibv_mw_bind_info info = {};
+
+	_wr_umr(ibqp, htobe32(invalidate_rkey), IBV_MW_TYPE_2, 0, &info,
+		IBV_WC_LOCAL_INV);
+}
+
+/* RC and UC QPs */
+static void mlx5_send_wr_send_rc(struct ibv_qp_ex *ibqp)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND, 0, 0);
+}
+
+static void mlx5_send_wr_send_imm_rc(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND_IMM, imm_data, 0);
+}
+
+static void mlx5_send_wr_send_inv_rc(struct ibv_qp_ex *ibqp,
+				     uint32_t invalidate_rkey)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND_INVAL, htobe32(invalidate_rkey), 0);
+}
+
+static void mlx5_send_wr_rdma_write_rc(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				       uint64_t remote_addr)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_WRITE, rkey, remote_addr, 0, 0);
+}
+
+static void mlx5_send_wr_rdma_write_imm_rc(struct ibv_qp_ex *ibqp,
+					   uint32_t rkey, uint64_t remote_addr,
+					   __be32 imm_data)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_WRITE_IMM, rkey, remote_addr,
+		 imm_data, 0);
+}
+
+static void mlx5_send_wr_rdma_read_rc(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				      uint64_t remote_addr)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_READ, rkey, remote_addr, 0, 0);
+}
+
+static void mlx5_send_wr_atomic_cmp_swp_rc(struct ibv_qp_ex *ibqp,
+					   uint32_t rkey, uint64_t remote_addr,
+					   uint64_t compare, uint64_t swap)
+{
+	_wr_atomic(ibqp, MLX5_OPCODE_ATOMIC_CS, rkey, remote_addr, swap,
+		   compare, 0);
+}
+
+static void mlx5_send_wr_atomic_fetch_add_rc(struct ibv_qp_ex *ibqp,
+					     uint32_t rkey,
+					     uint64_t remote_addr, uint64_t add)
+{
+	_wr_atomic(ibqp, MLX5_OPCODE_ATOMIC_FA, rkey, remote_addr, 0, add, 0);
+}
+
+/* XRC send QPs */
+static void mlx5_send_wr_send_xrc(struct ibv_qp_ex *ibqp)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND, 0, MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_send_imm_xrc(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND_IMM, imm_data, MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_send_inv_xrc(struct ibv_qp_ex *ibqp,
+				      uint32_t invalidate_rkey)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND_INVAL, htobe32(invalidate_rkey),
+		 MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_rdma_write_xrc(struct ibv_qp_ex *ibqp, uint32_t rkey,
+					uint64_t remote_addr)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_WRITE, rkey, remote_addr, 0,
+		 MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_rdma_write_imm_xrc(struct ibv_qp_ex *ibqp,
+					    uint32_t rkey, uint64_t remote_addr,
+					    __be32 imm_data)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_WRITE_IMM, rkey, remote_addr,
+		 imm_data, MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_rdma_read_xrc(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				       uint64_t remote_addr)
+{
+	_wr_rdma(ibqp, MLX5_OPCODE_RDMA_READ, rkey, remote_addr, 0,
+		 MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_atomic_cmp_swp_xrc(struct ibv_qp_ex *ibqp,
+					    uint32_t rkey, uint64_t remote_addr,
+					    uint64_t compare, uint64_t swap)
+{
+	_wr_atomic(ibqp, MLX5_OPCODE_ATOMIC_CS, rkey, remote_addr, swap,
+		   compare, MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_atomic_fetch_add_xrc(struct ibv_qp_ex *ibqp,
+					      uint32_t rkey,
+					      uint64_t remote_addr,
+					      uint64_t add)
+{
+	_wr_atomic(ibqp, MLX5_OPCODE_ATOMIC_FA, rkey, remote_addr, 0, add,
+		   MLX5_WR_XRC_HDR_SIZE);
+}
+
+static void mlx5_send_wr_set_xrc_srqn(struct ibv_qp_ex *ibqp,
+				      uint32_t remote_srqn)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_xrc_seg *xrc;
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	xrc = (void *)(qp->cur_ctrl + 1);
+	xrc->xrc_srqn = htobe32(remote_srqn);
+	wr_setter_done(qp);
+}
+
+/* UD QPs */
+static void mlx5_send_wr_send_ud(struct ibv_qp_ex *ibqp)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND, 0, MLX5_WR_UD_HDR_SIZE);
+}
+
+static void mlx5_send_wr_send_imm_ud(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	_wr_send(ibqp, MLX5_OPCODE_SEND_IMM, imm_data, MLX5_WR_UD_HDR_SIZE);
+}
+
+static void mlx5_send_wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+				     uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_datagram_seg *dseg;
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	dseg = (void *)(qp->cur_ctrl + 1);
+	memcpy(&dseg->av, &to_mah(ah)->av, sizeof(dseg->av));
+	dseg->av.dqp_dct = htobe32(remote_qpn | MLX5_EXTENDED_UD_AV);
+	dseg->av.key.qkey.qkey = htobe32(remote_qkey);
+	wr_setter_done(qp);
+}
+
+/* Data setters */
+static void mlx5_send_wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey,
+				 uint64_t addr, uint32_t length)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_data_seg *dseg = qp->cur_data;
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	if (likely(length)) {
+		dseg->byte_count = htobe32(unlikely(qp->cur_atomic) ?
+					   MLX5_ATOMIC_SIZE : length);
+		dseg->lkey = htobe32(lkey);
+		dseg->addr = htobe64(addr);
+		qp->cur_size += sizeof(*dseg) / 16;
+	}
+
+	qp->inl_wqe = false;
+	wr_setter_done(qp);
+}
+
+static void mlx5_send_wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+				      const struct ibv_sge *sg_list)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	struct mlx5_wqe_data_seg *dseg = qp->cur_data;
+	size_t i;
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	if (unlikely(num_sge > qp->sq.max_gs)) {
+		mlx5_dbg(to_mctx(qp->ibv_qp->context)->dbg_fp,
+			 MLX5_DBG_QP_SEND, "max gs exceeded %zu (max = %d)\n",
+			 num_sge, qp->sq.max_gs);
+		qp->wr_err = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < num_sge; i++) {
+		if (unlikely(!sg_list[i].length))
+			continue;
+		if (unlikely((void *)dseg == qp->sq.qend))
+			dseg = mlx5_get_send_wqe(qp, 0);
+		dseg->byte_count = htobe32(unlikely(qp->cur_atomic) ?
+					   MLX5_ATOMIC_SIZE :
+					   sg_list[i].length);
+		dseg->lkey = htobe32(sg_list[i].lkey);
+		dseg->addr = htobe64(sg_list[i].addr);
+		dseg++;
+		qp->cur_size += sizeof(*dseg) / 16;
+	}
+
+	qp->inl_wqe = false;
+	wr_setter_done(qp);
+}
+
+static inline void *wr_copy_inl(struct mlx5_qp *qp, void *wqe,
+				const void *addr, size_t len)
+{
+	size_t copy;
+
+	if (unlikely(wqe + len > qp->sq.qend)) {
+		copy = qp->sq.qend - wqe;
+		memcpy(wqe, addr, copy);
+		addr += copy;
+		len -= copy;
+		wqe = mlx5_get_send_wqe(qp, 0);
+	}
+	memcpy(wqe, addr, len);
+	return wqe + len;
+}
+
+static inline void wr_finish_inl(struct mlx5_qp *qp, size_t inl)
+{
+	struct mlx5_wqe_inline_seg *seg = qp->cur_data;
+
+	if (likely(inl)) {
+		seg->byte_count = htobe32(inl | MLX5_INLINE_SEG);
+		qp->cur_size += align(inl + sizeof(seg->byte_count), 16) / 16;
+	}
+
+	qp->inl_wqe = true;
+	wr_setter_done(qp);
+}
+
+static void mlx5_send_wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+					 size_t length)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	if (unlikely(length > qp->max_inline_data)) {
+		qp->wr_err = ENOMEM;
+		return;
+	}
+
+	wr_copy_inl(qp, qp->cur_data + sizeof(struct mlx5_wqe_inline_seg),
+		    addr, length);
+	wr_finish_inl(qp, length);
+}
+
+static void mlx5_send_wr_set_inline_data_list(struct ibv_qp_ex *ibqp,
+					      size_t num_buf,
+					      const struct ibv_data_buf *buf_list)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	void *wqe = qp->cur_data + sizeof(struct mlx5_wqe_inline_seg);
+	size_t inl = 0;
+	size_t i;
+
+	if (unlikely(qp->wr_err))
+		return;
+
+	for (i = 0; i < num_buf; i++) {
+		inl += buf_list[i].length;
+		if (unlikely(inl > qp->max_inline_data)) {
+			qp->wr_err = ENOMEM;
+			return;
+		}
+		wqe = wr_copy_inl(qp, wqe, buf_list[i].addr,
+				  buf_list[i].length);
+	}
+
+	wr_finish_inl(qp, inl);
+}
+
+static void mlx5_send_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+
+	mlx5_spin_lock(&qp->sq.lock);
+
+	qp->cur_post_rb = qp->sq.cur_post;
+	qp->fm_cache_rb = qp->fm_cache;
+	qp->cur_setters = 0;
+	qp->inl_wqe = false;
+	qp->wr_err = 0;
+	qp->nreq = 0;
+}
+
+static void mlx5_send_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+
+	qp->sq.cur_post = qp->cur_post_rb;
+	qp->fm_cache = qp->fm_cache_rb;
+
+	mlx5_spin_unlock(&qp->sq.lock);
+}
+
+/* Nothing is posted unless all the work requests of the batch are valid */
+static int mlx5_send_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct mlx5_qp *qp = wr_to_mqp(ibqp);
+	int err = qp->wr_err;
+
+	if (unlikely(!err && qp->cur_setters))
+		err = EINVAL;
+
+	if (unlikely(err)) {
+		mlx5_send_wr_abort(ibqp);
+		return err;
+	}
+
+	post_send_db(qp, qp->bf, qp->nreq, qp->inl_wqe, qp->cur_size,
+		     qp->fm_cache, qp->cur_ctrl);
+
+	mlx5_spin_unlock(&qp->sq.lock);
+
+	return 0;
+}
+
+enum {
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_RC =
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM |
+		IBV_QP_EX_WITH_RDMA_READ |
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD |
+		IBV_QP_EX_WITH_LOCAL_INV |
+		IBV_QP_EX_WITH_BIND_MW |
+		IBV_QP_EX_WITH_SEND_WITH_INV,
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_XRC =
+		MLX5_SUPPORTED_SEND_OPS_FLAGS_RC,
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_UC =
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM |
+		IBV_QP_EX_WITH_LOCAL_INV |
+		IBV_QP_EX_WITH_BIND_MW,
+	MLX5_SUPPORTED_SEND_OPS_FLAGS_UD =
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM,
+	MLX5_ATOMIC_SEND_OPS_FLAGS =
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD,
+};
+
+/* Only the opcodes requested in send_ops_flags are installed */
+#define fill_op(flag, field, fn)					\
+	do {								\
+		if (ops & (flag))					\
+			ibqp->field = fn;				\
+	} while (0)
+
+int mlx5_qp_fill_wr_pfns(struct mlx5_context *ctx, struct mlx5_qp *qp,
+			 const struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_qp_ex *ibqp = &qp->verbs_qp.qp_ex;
+	uint64_t ops = attr->send_ops_flags;
+	uint64_t supported;
+
+	if (qp->flags & MLX5_QP_FLAGS_USE_UNDERLAY)
+		return EOPNOTSUPP;
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+		supported = MLX5_SUPPORTED_SEND_OPS_FLAGS_RC;
+		break;
+	case IBV_QPT_UC:
+		supported = MLX5_SUPPORTED_SEND_OPS_FLAGS_UC;
+		break;
+	case IBV_QPT_XRC_SEND:
+		supported = MLX5_SUPPORTED_SEND_OPS_FLAGS_XRC;
+		break;
+	case IBV_QPT_UD:
+		supported = MLX5_SUPPORTED_SEND_OPS_FLAGS_UD;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	if (ctx->atomic_cap != IBV_ATOMIC_HCA)
+		supported &= ~MLX5_ATOMIC_SEND_OPS_FLAGS;
+
+	if (ops & ~supported)
+		return EOPNOTSUPP;
+
+	ibqp->wr_start = mlx5_send_wr_start;
+	ibqp->wr_complete = mlx5_send_wr_complete;
+	ibqp->wr_abort = mlx5_send_wr_abort;
+	ibqp->wr_set_sge = mlx5_send_wr_set_sge;
+	ibqp->wr_set_sge_list = mlx5_send_wr_set_sge_list;
+	ibqp->wr_set_inline_data = mlx5_send_wr_set_inline_data;
+	ibqp->wr_set_inline_data_list = mlx5_send_wr_set_inline_data_list;
+
+	fill_op(IBV_QP_EX_WITH_LOCAL_INV, wr_local_inv,
+		mlx5_send_wr_local_inv);
+	fill_op(IBV_QP_EX_WITH_BIND_MW, wr_bind_mw, mlx5_send_wr_bind_mw);
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+	case IBV_QPT_UC:
+		fill_op(IBV_QP_EX_WITH_SEND, wr_send, mlx5_send_wr_send_rc);
+		fill_op(IBV_QP_EX_WITH_SEND_WITH_IMM, wr_send_imm,
+			mlx5_send_wr_send_imm_rc);
+		fill_op(IBV_QP_EX_WITH_SEND_WITH_INV, wr_send_inv,
+			mlx5_send_wr_send_inv_rc);
+		fill_op(IBV_QP_EX_WITH_RDMA_WRITE, wr_rdma_write,
+			mlx5_send_wr_rdma_write_rc);
+		fill_op(IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM, wr_rdma_write_imm,
+			mlx5_send_wr_rdma_write_imm_rc);
+		fill_op(IBV_QP_EX_WITH_RDMA_READ, wr_rdma_read,
+			mlx5_send_wr_rdma_read_rc);
+		fill_op(IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP, wr_atomic_cmp_swp,
+			mlx5_send_wr_atomic_cmp_swp_rc);
+		fill_op(IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD,
+			wr_atomic_fetch_add, mlx5_send_wr_atomic_fetch_add_rc);
+		break;
+	case IBV_QPT_XRC_SEND:
+		fill_op(IBV_QP_EX_WITH_SEND, wr_send, mlx5_send_wr_send_xrc);
+		fill_op(IBV_QP_EX_WITH_SEND_WITH_IMM, wr_send_imm,
+			mlx5_send_wr_send_imm_xrc);
+		fill_op(IBV_QP_EX_WITH_SEND_WITH_INV, wr_send_inv,
+			mlx5_send_wr_send_inv_xrc);
+		fill_op(IBV_QP_EX_WITH_RDMA_WRITE, wr_rdma_write,
+			mlx5_send_wr_rdma_write_xrc);
+		fill_op(IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM, wr_rdma_write_imm,
+			mlx5_send_wr_rdma_write_imm_xrc);
+		fill_op(IBV_QP_EX_WITH_RDMA_READ, wr_rdma_read,
+			mlx5_send_wr_rdma_read_xrc);
+		fill_op(IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP, wr_atomic_cmp_swp,
+			mlx5_send_wr_atomic_cmp_swp_xrc);
+		fill_op(IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD,
+			wr_atomic_fetch_add, mlx5_send_wr_atomic_fetch_add_xrc);
+		ibqp->wr_set_xrc_srqn = mlx5_send_wr_set_xrc_srqn;
+		break;
+	case IBV_QPT_UD:
+		fill_op(IBV_QP_EX_WITH_SEND, wr_send, mlx5_send_wr_send_ud);
+		fill_op(IBV_QP_EX_WITH_SEND_WITH_IMM, wr_send_imm,
+			mlx5_send_wr_send_imm_ud);
+		ibqp->wr_set_ud_addr = mlx5_send_wr_set_ud_addr;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
 static void set_sig_seg(struct mlx5_qp *qp, struct mlx5_rwqe_sig *sig,
 			int size, uint16_t idx)
 {
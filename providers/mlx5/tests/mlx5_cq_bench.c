@@ -0,0 +1,178 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/*
+ * Measures the cost per CQE of mlx5_poll_cq() without a device.
+ *
+ * A CQ ring is filled with responder CQEs, or with responder and requester
+ * CQEs alternating, spread over a number of QPs of a context that was never
+ * opened, and drained with a given batch size.  The ring is refilled between
+ * passes, outside of the timed part.  On x86 the time is reported in TSC
+ * cycles per CQE, elsewhere in nanoseconds.
+ *
+ * usage: mlx5_cq_bench [-b BATCH] [-q QPS] [-m] [-l PASSES]
+ */
+
+#include "../cq.c"
+
+#include <getopt.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define RING_SIZE	4096
+#define MAX_BATCH	64
+#define FIRST_QPN	0x100
+#define SRC_QPN		0x42
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct mlx5_cqe64 ring[RING_SIZE] __attribute__((aligned(4096)));
+static __be32 dbrec[2];
+static struct mlx5_buf buf;
+static struct mlx5_cq cq;
+
+static uint64_t now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void fake_qp(struct mlx5_context *mctx, uint32_t qpn)
+{
+	struct mlx5_qp *qp = calloc(1, sizeof(*qp));
+
+	CHECK(qp);
+	qp->rsc.type = MLX5_RSC_TYPE_QP;
+	qp->rsc.rsn = qpn;
+	qp->rq.wqe_cnt = RING_SIZE;
+	qp->rq.wrid = calloc(RING_SIZE, sizeof(uint64_t));
+	qp->sq.wqe_cnt = RING_SIZE;
+	qp->sq.wrid = calloc(RING_SIZE, sizeof(uint64_t));
+	qp->sq.wqe_head = calloc(RING_SIZE, sizeof(unsigned int));
+	CHECK(qp->rq.wrid && qp->sq.wrid && qp->sq.wqe_head);
+	CHECK(!mlx5_store_qp(mctx, qpn, qp));
+}
+
+/*
+ * Fill the ring for pass number pass, with the ownership bit that the pass
+ * expects.  Runs of four CQEs belong to the same QP.
+ */
+static void fill(unsigned int pass, int num_qps, int mix)
+{
+	unsigned int i;
+
+	for (i = 0; i < RING_SIZE; i++) {
+		struct mlx5_cqe64 *cqe = &ring[i];
+		uint32_t qpn = FIRST_QPN + (i / 4) % num_qps;
+
+		memset(cqe, 0, sizeof(*cqe));
+		cqe->byte_cnt = htobe32(64);
+		if (mix && (i & 1)) {
+			cqe->sop_drop_qpn = htobe32(MLX5_OPCODE_SEND << 24 |
+						    qpn);
+			cqe->wqe_counter = htobe16(i);
+			cqe->op_own = MLX5_CQE_REQ << 4 | (pass & 1);
+		} else {
+			cqe->sop_drop_qpn = htobe32(qpn);
+			cqe->flags_rqpn = htobe32(SRC_QPN);
+			cqe->op_own = MLX5_CQE_RESP_SEND << 4 | (pass & 1);
+		}
+	}
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [-b BATCH] [-q QPS] [-m] [-l PASSES]\n", argv0);
+	printf("  -b  CQEs polled by each mlx5_poll_cq() call, 1 to %d (default 32)\n",
+	       MAX_BATCH);
+	printf("  -q  number of QPs that the CQEs are spread over (default 1)\n");
+	printf("  -m  alternate responder and requester CQEs\n");
+	printf("  -l  passes over the ring of %d CQEs (default 400)\n",
+	       RING_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_wc wc[MAX_BATCH];
+	struct mlx5_context *mctx;
+	unsigned int pass, passes = 400;
+	int batch = 32, num_qps = 1, mix = 0;
+	uint64_t start, elapsed = 0;
+	int c, i, n, ne;
+
+	while ((c = getopt(argc, argv, "b:q:ml:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'q':
+			num_qps = atoi(optarg);
+			break;
+		case 'm':
+			mix = 1;
+			break;
+		case 'l':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (batch < 1 || batch > MAX_BATCH || num_qps < 1 || !passes) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	mctx = calloc(1, sizeof(*mctx));
+	CHECK(mctx);
+	for (i = 0; i < num_qps; i++)
+		fake_qp(mctx, FIRST_QPN + i);
+
+	buf.buf = ring;
+	cq.active_buf = &buf;
+	cq.cqe_sz = 64;
+	cq.ibv_cq.cqe = RING_SIZE - 1;
+	cq.ibv_cq.context = &mctx->ibv_ctx;
+	cq.dbrec = dbrec;
+	CHECK(!mlx5_spinlock_init(&cq.lock, 0));
+
+	for (pass = 0; pass < passes; pass++) {
+		fill(pass, num_qps, mix);
+		start = now();
+		for (n = 0; n < RING_SIZE; n += ne) {
+			ne = mlx5_poll_cq(ibv_cq_ex_to_cq(&cq.ibv_cq), batch,
+					  wc);
+			CHECK(ne > 0);
+		}
+		elapsed += now() - start;
+		CHECK(n == RING_SIZE);
+		CHECK(wc[ne - 1].status == IBV_WC_SUCCESS);
+	}
+
+	printf("batch %d, %d QPs%s: %.2f %s/CQE\n", batch, num_qps,
+	       mix ? ", mixed" : "",
+	       (double)elapsed / ((uint64_t)passes * RING_SIZE),
+#if defined(__x86_64__) || defined(__i386__)
+	       "cycles"
+#else
+	       "ns"
+#endif
+	       );
+	return 0;
+}
@@ -0,0 +1,364 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+/*
+ * Expands compressed CQE blocks through mlx5_poll_cq() without a device.
+ *
+ * The CQ ring is an array that the test fills the way the device would,
+ * with plain CQEs and compressed blocks, and the QPs are only entries of the
+ * QP table of a context that was never opened.  Each block is polled with
+ * several batch sizes, and every work completion is checked against the
+ * mini CQE it came from.  It also checks that QPs and SRQs whose receive
+ * WQEs may complete out of order cannot use the compressed CQ.
+ *
+ * usage: mlx5_cq_zip
+ */
+
+#include "../cq.c"
+
+#define RING_SIZE	64
+#define RECV_QPN	0x107
+#define SEND_QPN	0x105
+#define SRC_QPN		0x42
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed\n",		\
+				__FILE__, __LINE__, #cond);		\
+			exit(1);					\
+		}							\
+	} while (0)
+
+static struct mlx5_cqe64 ring[RING_SIZE] __attribute__((aligned(4096)));
+static __be32 dbrec[2];
+static struct mlx5_buf buf;
+static struct mlx5_context *mctx;
+static struct mlx5_qp *recv_qp, *send_qp;
+static struct mlx5_cq cq;
+
+/* The wr_id of WQE idx of a queue of qpn */
+static uint64_t wr_id(uint32_t qpn, unsigned int idx)
+{
+	return (uint64_t)qpn << 16 | idx;
+}
+
+static struct mlx5_qp *fake_qp(uint32_t qpn)
+{
+	struct mlx5_qp *qp = calloc(1, sizeof(*qp));
+	unsigned int i;
+
+	CHECK(qp);
+	qp->rsc.type = MLX5_RSC_TYPE_QP;
+	qp->rsc.rsn = qpn;
+	qp->rq.wqe_cnt = RING_SIZE;
+	qp->rq.wrid = calloc(RING_SIZE, sizeof(uint64_t));
+	qp->sq.wqe_cnt = RING_SIZE;
+	qp->sq.wrid = calloc(RING_SIZE, sizeof(uint64_t));
+	qp->sq.wqe_head = calloc(RING_SIZE, sizeof(unsigned int));
+	CHECK(qp->rq.wrid && qp->sq.wrid && qp->sq.wqe_head);
+	for (i = 0; i < RING_SIZE; i++) {
+		qp->rq.wrid[i] = wr_id(qpn, i);
+		qp->sq.wrid[i] = wr_id(qpn, i);
+		qp->sq.wqe_head[i] = i;
+	}
+	CHECK(!mlx5_store_qp(mctx, qpn, qp));
+	return qp;
+}
+
+static void reset(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < RING_SIZE; i++) {
+		memset(&ring[i], 0, sizeof(ring[i]));
+		ring[i].op_own = MLX5_CQE_INVALID << 4 | 1;
+	}
+	memset(&cq.zip, 0, sizeof(cq.zip));
+	cq.cons_index = 0;
+	cq.ready = 0;
+	recv_qp->rq.tail = 0;
+	send_qp->sq.tail = 0;
+}
+
+/*
+ * Write a plain CQE at the absolute index idx, with the ownership bit that
+ * the pass of the consumer index over the ring expects.
+ */
+static struct mlx5_cqe64 *put_cqe(unsigned int idx, uint8_t opcode,
+				  uint32_t qpn, uint32_t byte_cnt)
+{
+	struct mlx5_cqe64 *cqe = &ring[idx % RING_SIZE];
+
+	memset(cqe, 0, sizeof(*cqe));
+	cqe->sop_drop_qpn = htobe32(qpn);
+	cqe->byte_cnt = htobe32(byte_cnt);
+	cqe->flags_rqpn = htobe32(SRC_QPN);
+	cqe->op_own = opcode << 4 | ((idx / RING_SIZE) & 1);
+	return cqe;
+}
+
+/*
+ * Write a compressed block of n completions at idx.  The first array of mini
+ * CQEs follows the title, the next ones are every MLX5_MINI_CQE_ARRAY_SIZE
+ * entries from the title, and the entries that hold neither get garbage.
+ */
+static unsigned int mini_array_idx(unsigned int idx, unsigned int k)
+{
+	unsigned int array = k / MLX5_MINI_CQE_ARRAY_SIZE;
+
+	return idx + (array ? array * MLX5_MINI_CQE_ARRAY_SIZE : 1);
+}
+
+static void put_block(unsigned int idx, uint8_t opcode, uint32_t qpn,
+		      uint16_t wqe_counter, const struct mlx5_mini_cqe8 *mini,
+		      unsigned int n)
+{
+	struct mlx5_cqe64 *title = put_cqe(idx, opcode, qpn, n);
+	unsigned int i;
+
+	title->op_own |= MLX5_CQE_FORMAT_COMPRESSED << 2;
+	title->wqe_counter = htobe16(wqe_counter);
+
+	for (i = 1; i < n; i++)
+		memset(&ring[(idx + i) % RING_SIZE], 0xa5, sizeof(*title));
+	for (i = 0; i < n; i += MLX5_MINI_CQE_ARRAY_SIZE)
+		memset(&ring[mini_array_idx(idx, i) % RING_SIZE], 0,
+		       sizeof(*title));
+	for (i = 0; i < n; i++) {
+		struct mlx5_mini_cqe8 *array =
+			(void *)&ring[mini_array_idx(idx, i) % RING_SIZE];
+
+		array[i % MLX5_MINI_CQE_ARRAY_SIZE] = mini[i];
+	}
+}
+
+/* Poll exactly n completions, at most batch at a time */
+static void poll_n(struct ibv_wc *wc, int n, int batch)
+{
+	int got = 0, ne;
+
+	while (got < n) {
+		ne = mlx5_poll_cq(ibv_cq_ex_to_cq(&cq.ibv_cq),
+				  batch < n - got ? batch : n - got, wc + got);
+		CHECK(ne > 0);
+		got += ne;
+	}
+}
+
+static void check_empty(void)
+{
+	struct ibv_wc wc;
+
+	CHECK(mlx5_poll_cq(ibv_cq_ex_to_cq(&cq.ibv_cq), 1, &wc) == 0);
+}
+
+static void check_recv(const struct ibv_wc *wc, unsigned int rq_idx,
+		       uint32_t byte_len)
+{
+	CHECK(wc->status == IBV_WC_SUCCESS);
+	CHECK(wc->opcode == IBV_WC_RECV);
+	CHECK(wc->qp_num == RECV_QPN);
+	CHECK(wc->src_qp == SRC_QPN);
+	CHECK(wc->wr_id == wr_id(RECV_QPN, rq_idx));
+	CHECK(wc->byte_len == byte_len);
+}
+
+/*
+ * A receive block of 20 between plain CQEs.  Its mini CQE arrays are in
+ * three entries, the last one partly used.
+ */
+static void test_recv_block(int batch)
+{
+	struct mlx5_mini_cqe8 mini[20] = {};
+	struct ibv_wc wc[23];
+	unsigned int i;
+
+	reset();
+	for (i = 0; i < 20; i++) {
+		mini[i].byte_cnt = htobe32(1000 + i);
+		mini[i].rx_hash_result = htobe32(i);
+	}
+	put_cqe(0, MLX5_CQE_RESP_SEND, RECV_QPN, 10);
+	put_block(1, MLX5_CQE_RESP_SEND, RECV_QPN, 1, mini, 20);
+	put_cqe(21, MLX5_CQE_RESP_SEND, RECV_QPN, 21);
+	put_cqe(22, MLX5_CQE_REQ, MLX5_OPCODE_SEND << 24 | SEND_QPN, 0);
+
+	poll_n(wc, 23, batch);
+	check_empty();
+
+	check_recv(&wc[0], 0, 10);
+	for (i = 0; i < 20; i++)
+		check_recv(&wc[1 + i], 1 + i, 1000 + i);
+	check_recv(&wc[21], 21, 21);
+	CHECK(wc[22].status == IBV_WC_SUCCESS);
+	CHECK(wc[22].opcode == IBV_WC_SEND);
+	CHECK(wc[22].qp_num == SEND_QPN);
+	CHECK(wc[22].wr_id == wr_id(SEND_QPN, 0));
+
+	/* The entries of the block were all handed back to the device */
+	for (i = 1; i <= 20; i++)
+		CHECK(mlx5dv_get_cqe_opcode(&ring[i]) == MLX5_CQE_INVALID);
+	CHECK(cq.cons_index == 23);
+	CHECK(be32toh(dbrec[MLX5_CQ_SET_CI]) == 23);
+}
+
+/*
+ * A requester block that wraps around the end of the ring.  The opcode and
+ * WQE counter of each completion come from its mini CQE.
+ */
+static void test_send_block(int batch)
+{
+	struct mlx5_mini_cqe8 mini[12] = {};
+	struct ibv_wc wc[14];
+	unsigned int i, start = RING_SIZE - 5;
+
+	reset();
+	cq.cons_index = start - 1;
+	for (i = 0; i < 12; i++) {
+		mini[i].byte_cnt = htobe32(100 + i);
+		mini[i].s_wqe_info.wqe_counter = htobe16(2 * i);
+		mini[i].s_wqe_info.s_wqe_opcode = i & 1 ? MLX5_OPCODE_RDMA_READ :
+							  MLX5_OPCODE_RDMA_WRITE;
+	}
+	put_cqe(start - 1, MLX5_CQE_RESP_SEND, RECV_QPN, 7);
+	put_block(start, MLX5_CQE_REQ, SEND_QPN, 0, mini, 12);
+	put_cqe(start + 12, MLX5_CQE_RESP_SEND, RECV_QPN, 8);
+
+	poll_n(wc, 14, batch);
+	check_empty();
+
+	check_recv(&wc[0], 0, 7);
+	for (i = 0; i < 12; i++) {
+		struct ibv_wc *w = &wc[1 + i];
+
+		CHECK(w->status == IBV_WC_SUCCESS);
+		CHECK(w->qp_num == SEND_QPN);
+		CHECK(w->wr_id == wr_id(SEND_QPN, 2 * i));
+		if (i & 1) {
+			CHECK(w->opcode == IBV_WC_RDMA_READ);
+			CHECK(w->byte_len == 100 + i);
+		} else {
+			CHECK(w->opcode == IBV_WC_RDMA_WRITE);
+		}
+	}
+	CHECK(send_qp->sq.tail == 2 * 11 + 1);
+	check_recv(&wc[13], 1, 8);
+	CHECK(cq.cons_index == start + 13);
+}
+
+/*
+ * Destroying the QP of a block that is partly polled drops the rest of the
+ * block, and the CQEs after it move up.
+ */
+static void test_clean_block(void)
+{
+	struct mlx5_mini_cqe8 mini[20] = {};
+	struct mlx5_qp *qp;
+	struct ibv_wc wc[4];
+	unsigned int i;
+
+	reset();
+	qp = fake_qp(0x200);
+	for (i = 0; i < 20; i++)
+		mini[i].byte_cnt = htobe32(1000 + i);
+	put_block(0, MLX5_CQE_RESP_SEND, 0x200, 0, mini, 20);
+	put_cqe(20, MLX5_CQE_RESP_SEND, RECV_QPN, 20);
+
+	poll_n(wc, 3, 3);
+	for (i = 0; i < 3; i++) {
+		CHECK(wc[i].qp_num == 0x200);
+		CHECK(wc[i].byte_len == 1000 + i);
+	}
+
+	__mlx5_cq_clean(&cq, 0x200, NULL);
+	mlx5_clear_qp(mctx, 0x200);
+
+	poll_n(wc, 1, 4);
+	check_empty();
+	check_recv(&wc[0], 0, 20);
+	free(qp->rq.wrid);
+	free(qp->sq.wrid);
+	free(qp->sq.wqe_head);
+	free(qp);
+}
+
+/*
+ * SRQ and XRC target QPs, and XRC and tag matching SRQs, are refused a
+ * compressed CQ before anything is asked of the device.
+ */
+static void test_reject_srq(void)
+{
+	struct ibv_cq *ibcq = ibv_cq_ex_to_cq(&cq.ibv_cq);
+	struct ibv_pd pd = { .context = &mctx->ibv_ctx };
+	struct ibv_srq srq = {};
+	struct ibv_qp_init_attr qp_attr = {
+		.send_cq = ibcq,
+		.recv_cq = ibcq,
+		.srq	 = &srq,
+		.qp_type = IBV_QPT_RC,
+	};
+	struct ibv_qp_init_attr_ex qp_attr_ex = {
+		.qp_type   = IBV_QPT_XRC_RECV,
+		.recv_cq   = ibcq,
+		.comp_mask = IBV_QP_INIT_ATTR_XRCD,
+	};
+	struct ibv_srq_init_attr_ex srq_attr = {
+		.comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD |
+			     IBV_SRQ_INIT_ATTR_CQ,
+		.srq_type  = IBV_SRQT_XRC,
+		.pd	   = &pd,
+		.cq	   = ibcq,
+	};
+
+	errno = 0;
+	CHECK(!mlx5_create_qp(&pd, &qp_attr));
+	CHECK(errno == EINVAL);
+
+	errno = 0;
+	CHECK(!mlx5_create_qp_ex(&mctx->ibv_ctx, &qp_attr_ex));
+	CHECK(errno == EINVAL);
+
+	errno = 0;
+	CHECK(!mlx5_create_srq_ex(&mctx->ibv_ctx, &srq_attr));
+	CHECK(errno == EINVAL);
+
+	/* Tag matching needs an extended CQ, so this fails on compression */
+	cq.flags |= MLX5_CQ_FLAGS_EXTENDED;
+	srq_attr.srq_type = IBV_SRQT_TM;
+	errno = 0;
+	CHECK(!mlx5_create_srq_ex(&mctx->ibv_ctx, &srq_attr));
+	CHECK(errno == EINVAL);
+	cq.flags &= ~MLX5_CQ_FLAGS_EXTENDED;
+}
+
+int main(void)
+{
+	static const int batches[] = { 1, 3, 8, 64 };
+	unsigned int i;
+
+	mctx = calloc(1, sizeof(*mctx));
+	CHECK(mctx);
+	recv_qp = fake_qp(RECV_QPN);
+	send_qp = fake_qp(SEND_QPN);
+
+	buf.buf = ring;
+	cq.active_buf = &buf;
+	cq.cqe_sz = 64;
+	cq.ibv_cq.cqe = RING_SIZE - 1;
+	cq.ibv_cq.context = &mctx->ibv_ctx;
+	cq.dbrec = dbrec;
+	cq.flags = MLX5_CQ_FLAGS_COMPRESSED_CQE;
+	cq.mini_cqe_format = MLX5DV_CQE_RES_FORMAT_HASH;
+	CHECK(!mlx5_spinlock_init(&cq.lock, 0));
+
+	for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		test_recv_block(batches[i]);
+		test_send_block(batches[i]);
+	}
+	test_clean_block();
+	test_reject_srq();
+
+	printf("compressed CQE blocks expanded correctly\n");
+	return 0;
+}
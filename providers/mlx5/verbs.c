@@ -58,6 +58,15 @@ static inline int is_xrc_tgt(int type)
 	return type == IBV_QPT_XRC_RECV;
 }
 
+/*
+ * Mini CQEs carry no receive WQE index, so a compressed CQ cannot report
+ * the completions of receive WQEs that are not consumed in order.
+ */
+static inline int is_compressed_cq(struct ibv_cq *cq)
+{
+	return cq && (to_mcq(cq)->flags & MLX5_CQ_FLAGS_COMPRESSED_CQE);
+}
+
 int mlx5_query_device(struct ibv_context *context, struct ibv_device_attr *attr)
 {
 	struct ibv_query_device cmd;
@@ -149,19 +158,98 @@ struct ibv_pd *mlx5_alloc_pd(struct ibv_context *context)
 	}
 
 	pd->pdn = resp.pdn;
+	atomic_init(&pd->refcount, 1);
 
 	return &pd->ibv_pd;
 }
 
+struct ibv_td *mlx5_alloc_td(struct ibv_context *context,
+			     struct ibv_td_init_attr *init_attr)
+{
+	struct mlx5_td *td;
+
+	td = calloc(1, sizeof(*td));
+	if (!td) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	td->ibv_td.context = context;
+	atomic_init(&td->refcount, 1);
+
+	return &td->ibv_td;
+}
+
+int mlx5_dealloc_td(struct ibv_td *ib_td)
+{
+	struct mlx5_td *td = to_mtd(ib_td);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+	return 0;
+}
+
+struct ibv_pd *
+mlx5_alloc_parent_domain(struct ibv_context *context,
+			 struct ibv_parent_domain_init_attr *attr)
+{
+	struct mlx5_parent_domain *mparent_domain;
+
+	if (to_mparent_domain(attr->pd) ||
+	    (attr->td && attr->td->context != context)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mparent_domain = calloc(1, sizeof(*mparent_domain));
+	if (!mparent_domain) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (attr->td) {
+		mparent_domain->mtd = to_mtd(attr->td);
+		atomic_fetch_add(&mparent_domain->mtd->refcount, 1);
+	}
+
+	mparent_domain->mpd.mprotection_domain = to_mpd(attr->pd);
+	atomic_fetch_add(&mparent_domain->mpd.mprotection_domain->refcount, 1);
+
+	/* Commands taking a PD are issued on the protection domain */
+	mparent_domain->mpd.ibv_pd.handle = attr->pd->handle;
+
+	return &mparent_domain->mpd.ibv_pd;
+}
+
+static int mlx5_free_parent_domain(struct mlx5_parent_domain *mparent_domain)
+{
+	if (mparent_domain->mtd)
+		atomic_fetch_sub(&mparent_domain->mtd->refcount, 1);
+
+	atomic_fetch_sub(&mparent_domain->mpd.mprotection_domain->refcount, 1);
+	free(mparent_domain);
+	return 0;
+}
+
 int mlx5_free_pd(struct ibv_pd *pd)
 {
+	struct mlx5_parent_domain *mparent_domain = to_mparent_domain(pd);
+	struct mlx5_pd *mpd = to_mpd(pd);
 	int ret;
 
+	if (mparent_domain)
+		return mlx5_free_parent_domain(mparent_domain);
+
+	if (atomic_load(&mpd->refcount) > 1)
+		return EBUSY;
+
 	ret = ibv_cmd_dealloc_pd(pd);
 	if (ret)
 		return ret;
 
-	free(to_mpd(pd));
+	free(mpd);
 	return 0;
 }
 
@@ -335,7 +423,8 @@ enum {
 };
 
 enum {
-	CREATE_CQ_SUPPORTED_COMP_MASK = IBV_CQ_INIT_ATTR_MASK_FLAGS
+	CREATE_CQ_SUPPORTED_COMP_MASK = IBV_CQ_INIT_ATTR_MASK_FLAGS |
+					IBV_CQ_INIT_ATTR_MASK_PD
 };
 
 enum {
@@ -354,6 +443,7 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	int				ret;
 	int				ncqe;
 	struct mlx5_context *mctx = to_mctx(context);
+	struct mlx5_parent_domain *mparent_domain = NULL;
 	FILE *fp = to_mctx(context)->dbg_fp;
 
 	if (!cq_attr->cqe) {
@@ -383,6 +473,17 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 		return NULL;
 	}
 
+	if (cq_attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		mparent_domain = to_mparent_domain(cq_attr->parent_domain);
+		if (!mparent_domain ||
+		    cq_attr->parent_domain->context != context) {
+			mlx5_dbg(fp, MLX5_DBG_CQ,
+				 "CQ PD must be a parent domain\n");
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
 	cq =  calloc(1, sizeof *cq);
 	if (!cq) {
 		mlx5_dbg(fp, MLX5_DBG_CQ, "\n");
@@ -392,7 +493,8 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	memset(&cmd, 0, sizeof cmd);
 	cq->cons_index = 0;
 
-	if (mlx5_spinlock_init(&cq->lock))
+	if (mlx5_spinlock_init_pd(&cq->lock,
+				  mparent_domain ? cq_attr->parent_domain : NULL))
 		goto err;
 
 	ncqe = align_queue_size(cq_attr->cqe + 1);
@@ -426,8 +528,9 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	cq->cqe_sz			= cqe_sz;
 	cq->flags			= cq_alloc_flags;
 
-	if (cq_attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
-	    cq_attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED)
+	if ((cq_attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
+	     cq_attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED) ||
+	    (mparent_domain && mparent_domain->mtd))
 		cq->flags |= MLX5_CQ_FLAGS_SINGLE_THREADED;
 	cmd.buf_addr = (uintptr_t) cq->buf_a.buf;
 	cmd.db_addr  = (uintptr_t) cq->dbrec;
@@ -442,11 +545,17 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 		}
 
 		if (mlx5cq_attr->comp_mask & MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE) {
-			if (mctx->cqe_comp_caps.max_num &&
-			    (mlx5cq_attr->cqe_comp_res_format &
-			     mctx->cqe_comp_caps.supported_format)) {
+			uint8_t format = mlx5cq_attr->cqe_comp_res_format;
+
+			/* Mini CQEs are expanded from 64 bytes CQEs only */
+			if (mctx->cqe_comp_caps.max_num && cqe_sz == 64 &&
+			    (format == MLX5DV_CQE_RES_FORMAT_HASH ||
+			     format == MLX5DV_CQE_RES_FORMAT_CSUM) &&
+			    (format & mctx->cqe_comp_caps.supported_format)) {
 				cmd.cqe_comp_en = 1;
-				cmd.cqe_comp_res_format = mlx5cq_attr->cqe_comp_res_format;
+				cmd.cqe_comp_res_format = format;
+				cq->flags |= MLX5_CQ_FLAGS_COMPRESSED_CQE;
+				cq->mini_cqe_format = format;
 			} else {
 				mlx5_dbg(fp, MLX5_DBG_CQ, "CQE Compression is not supported\n");
 				errno = EINVAL;
@@ -633,7 +742,7 @@ struct ibv_srq *mlx5_create_srq(struct ibv_pd *pd,
 	ibsrq = &srq->vsrq.srq;
 
 	memset(&cmd, 0, sizeof cmd);
-	if (mlx5_spinlock_init(&srq->lock)) {
+	if (mlx5_spinlock_init(&srq->lock, !mlx5_single_threaded)) {
 		fprintf(stderr, "%s-%d:\n", __func__, __LINE__);
 		goto err;
 	}
@@ -1233,7 +1342,8 @@ enum {
 					IBV_QP_INIT_ATTR_CREATE_FLAGS |
 					IBV_QP_INIT_ATTR_MAX_TSO_HEADER |
 					IBV_QP_INIT_ATTR_IND_TABLE |
-					IBV_QP_INIT_ATTR_RX_HASH),
+					IBV_QP_INIT_ATTR_RX_HASH |
+					IBV_QP_INIT_ATTR_SEND_OPS_FLAGS),
 };
 
 enum {
@@ -1253,6 +1363,7 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 	int				ret;
 	struct mlx5_context	       *ctx = to_mctx(context);
 	struct ibv_qp		       *ibqp;
+	struct ibv_pd		       *qp_pd = NULL;
 	int32_t				usr_idx = 0;
 	uint32_t			uuar_index;
 	FILE *fp = ctx->dbg_fp;
@@ -1260,10 +1371,19 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 	if (attr->comp_mask & ~MLX5_CREATE_QP_SUP_COMP_MASK)
 		return NULL;
 
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_PD)
+		qp_pd = attr->pd;
+
 	if ((attr->comp_mask & IBV_QP_INIT_ATTR_MAX_TSO_HEADER) &&
 	    (attr->qp_type != IBV_QPT_RAW_PACKET))
 		return NULL;
 
+	if ((attr->srq || is_xrc_tgt(attr->qp_type)) &&
+	    is_compressed_cq(attr->recv_cq)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	qp = calloc(1, sizeof(*qp));
 	if (!qp) {
 		mlx5_dbg(fp, MLX5_DBG_QP, "\n");
@@ -1283,6 +1403,19 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 		qp->flags |= MLX5_QP_FLAGS_USE_UNDERLAY;
 	}
 
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		if (attr->comp_mask & IBV_QP_INIT_ATTR_RX_HASH) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		ret = mlx5_qp_fill_wr_pfns(ctx, qp, attr);
+		if (ret) {
+			errno = ret;
+			goto err;
+		}
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 	memset(&resp_ex, 0, sizeof(resp_ex));
@@ -1336,8 +1469,8 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 
 	mlx5_init_qp_indices(qp);
 
-	if (mlx5_spinlock_init(&qp->sq.lock) ||
-	    mlx5_spinlock_init(&qp->rq.lock))
+	if (mlx5_spinlock_init_pd(&qp->sq.lock, qp_pd) ||
+	    mlx5_spinlock_init_pd(&qp->rq.lock, qp_pd))
 		goto err_free_qp_buf;
 
 	qp->db = mlx5_alloc_dbrec(ctx);
@@ -1415,6 +1548,9 @@ static struct ibv_qp *create_qp(struct ibv_context *context,
 	qp->rsc.rsn = (ctx->cqe_version && !is_xrc_tgt(attr->qp_type)) ?
 		      usr_idx : ibqp->qp_num;
 
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)
+		qp->verbs_qp.comp_mask |= VERBS_QP_EX;
+
 	return ibqp;
 
 err_destroy:
@@ -1949,6 +2085,12 @@ struct ibv_srq *mlx5_create_srq_ex(struct ibv_context *context,
 		return NULL;
 	}
 
+	if ((attr->comp_mask & IBV_SRQ_INIT_ATTR_CQ) &&
+	    is_compressed_cq(attr->cq)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	msrq = calloc(1, sizeof(*msrq));
 	if (!msrq)
 		return NULL;
@@ -1958,7 +2100,7 @@ struct ibv_srq *mlx5_create_srq_ex(struct ibv_context *context,
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 
-	if (mlx5_spinlock_init(&msrq->lock)) {
+	if (mlx5_spinlock_init(&msrq->lock, !mlx5_single_threaded)) {
 		fprintf(stderr, "%s-%d:\n", __func__, __LINE__);
 		goto err;
 	}
@@ -2233,7 +2375,7 @@ struct ibv_wq *mlx5_create_wq(struct ibv_context *context,
 
 	mlx5_init_rwq_indices(rwq);
 
-	if (mlx5_spinlock_init(&rwq->rq.lock))
+	if (mlx5_spinlock_init_pd(&rwq->rq.lock, attr->pd))
 		goto err_free_rwq_buf;
 
 	rwq->db = mlx5_alloc_dbrec(ctx);
@@ -36,6 +36,7 @@
 #include <config.h>
 
 #include <endian.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -98,31 +99,98 @@ static struct ibv_pd *rxe_alloc_pd(struct ibv_context *context)
 {
 	struct ibv_alloc_pd cmd;
 	struct ibv_alloc_pd_resp resp;
-	struct ibv_pd *pd;
+	struct rxe_pd *pd;
 
-	pd = malloc(sizeof *pd);
+	pd = calloc(1, sizeof *pd);
 	if (!pd)
 		return NULL;
 
-	if (ibv_cmd_alloc_pd(context, pd, &cmd, sizeof cmd, &resp, sizeof resp)) {
+	if (ibv_cmd_alloc_pd(context, &pd->ibv_pd, &cmd, sizeof cmd,
+			     &resp, sizeof resp)) {
 		free(pd);
 		return NULL;
 	}
 
-	return pd;
+	atomic_init(&pd->refcount, 1);
+	return &pd->ibv_pd;
 }
 
-static int rxe_dealloc_pd(struct ibv_pd *pd)
+static int rxe_dealloc_pd(struct ibv_pd *ibpd)
 {
+	struct rxe_pd *pd = to_rpd(ibpd);
 	int ret;
 
-	ret = ibv_cmd_dealloc_pd(pd);
+	if (pd->protection_domain) {
+		if (pd->td)
+			atomic_fetch_sub(&pd->td->refcount, 1);
+		atomic_fetch_sub(&pd->protection_domain->refcount, 1);
+		free(pd);
+		return 0;
+	}
+
+	if (atomic_load(&pd->refcount) > 1)
+		return EBUSY;
+
+	ret = ibv_cmd_dealloc_pd(ibpd);
 	if (!ret)
 		free(pd);
 
 	return ret;
 }
 
+static struct ibv_td *rxe_alloc_td(struct ibv_context *context,
+				   struct ibv_td_init_attr *init_attr)
+{
+	struct rxe_td *td;
+
+	td = calloc(1, sizeof *td);
+	if (!td)
+		return NULL;
+
+	td->ibv_td.context = context;
+	atomic_init(&td->refcount, 1);
+	return &td->ibv_td;
+}
+
+static int rxe_dealloc_td(struct ibv_td *ibtd)
+{
+	struct rxe_td *td = to_rtd(ibtd);
+
+	if (atomic_load(&td->refcount) > 1)
+		return EBUSY;
+
+	free(td);
+	return 0;
+}
+
+static struct ibv_pd *
+rxe_alloc_parent_domain(struct ibv_context *context,
+			struct ibv_parent_domain_init_attr *attr)
+{
+	struct rxe_pd *pd;
+
+	if (to_rpd(attr->pd)->protection_domain ||
+	    (attr->td && attr->td->context != context)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pd = calloc(1, sizeof *pd);
+	if (!pd)
+		return NULL;
+
+	pd->protection_domain = to_rpd(attr->pd);
+	atomic_fetch_add(&pd->protection_domain->refcount, 1);
+	if (attr->td) {
+		pd->td = to_rtd(attr->td);
+		atomic_fetch_add(&pd->td->refcount, 1);
+	}
+
+	/* Commands taking a PD are issued on the protection domain */
+	pd->ibv_pd.handle = attr->pd->handle;
+	return &pd->ibv_pd;
+}
+
 static struct ibv_mr *rxe_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
 				 int access)
 {
@@ -158,16 +226,16 @@ static int rxe_dereg_mr(struct ibv_mr *mr)
 	return 0;
 }
 
-static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
-				    struct ibv_comp_channel *channel,
-				    int comp_vector)
+static struct rxe_cq *create_cq(struct ibv_context *context, int cqe,
+				struct ibv_comp_channel *channel,
+				int comp_vector, bool need_lock)
 {
 	struct rxe_cq *cq;
 	struct ibv_create_cq cmd;
 	struct rxe_create_cq_resp resp;
 	int ret;
 
-	cq = malloc(sizeof *cq);
+	cq = calloc(1, sizeof *cq);
 	if (!cq) {
 		return NULL;
 	}
@@ -189,11 +257,216 @@ static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
 	}
 
 	cq->mmap_info = resp.mi;
+	cq->need_lock = need_lock;
 	pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE);
 
+	return cq;
+}
+
+static struct ibv_cq *rxe_create_cq(struct ibv_context *context, int cqe,
+				    struct ibv_comp_channel *channel,
+				    int comp_vector)
+{
+	struct rxe_cq *cq;
+
+	cq = create_cq(context, cqe, channel, comp_vector, true);
+	if (!cq)
+		return NULL;
+
 	return &cq->ibv_cq;
 }
 
+/*
+ * The CQEs that the kernel writes have the layout of struct ibv_wc, so the
+ * extended poll functions read the fields of the current CQE in place.
+ * start_poll reads the producer index once, and the CQEs up to it are then
+ * consumed without touching the shared indices again; the consumer index is
+ * published once, by end_poll.
+ */
+static inline void cq_set_cur(struct rxe_cq *cq)
+{
+	cq->cur_wc = addr_from_index(cq->queue, cq->cur_index);
+	cq->ibv_cq_ex.wr_id = cq->cur_wc->wr_id;
+	cq->ibv_cq_ex.status = cq->cur_wc->status;
+}
+
+static inline bool cq_load_producer(struct rxe_cq *cq)
+{
+	cq->prod_index = atomic_load_explicit(&cq->queue->producer_index,
+					      memory_order_acquire);
+	return cq->prod_index != cq->cur_index;
+}
+
+static int rxe_start_poll(struct ibv_cq_ex *ibcq,
+			  struct ibv_poll_cq_attr *attr)
+{
+	struct rxe_cq *cq = to_rcq_ex(ibcq);
+
+	if (attr->comp_mask)
+		return EINVAL;
+
+	rxe_cq_lock(cq);
+
+	cq->cur_index = atomic_load_explicit(&cq->queue->consumer_index,
+					     memory_order_relaxed);
+	if (!cq_load_producer(cq)) {
+		cq->cur_wc = NULL;
+		rxe_cq_unlock(cq);
+		return ENOENT;
+	}
+
+	cq_set_cur(cq);
+	return 0;
+}
+
+static int rxe_next_poll(struct ibv_cq_ex *ibcq)
+{
+	struct rxe_cq *cq = to_rcq_ex(ibcq);
+
+	cq->cur_index = (cq->cur_index + 1) & cq->queue->index_mask;
+	if (cq->cur_index == cq->prod_index && !cq_load_producer(cq)) {
+		cq->cur_wc = NULL;
+		return ENOENT;
+	}
+
+	cq_set_cur(cq);
+	return 0;
+}
+
+static void rxe_end_poll(struct ibv_cq_ex *ibcq)
+{
+	struct rxe_cq *cq = to_rcq_ex(ibcq);
+	uint32_t index = cq->cur_index;
+
+	if (cq->cur_wc)
+		index = (index + 1) & cq->queue->index_mask;
+
+	atomic_store_explicit(&cq->queue->consumer_index, index,
+			      memory_order_release);
+	cq->cur_wc = NULL;
+	rxe_cq_unlock(cq);
+}
+
+static enum ibv_wc_opcode rxe_wc_read_opcode(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->opcode;
+}
+
+static uint32_t rxe_wc_read_vendor_err(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->vendor_err;
+}
+
+static uint32_t rxe_wc_read_byte_len(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->byte_len;
+}
+
+static __be32 rxe_wc_read_imm_data(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->imm_data;
+}
+
+static uint32_t rxe_wc_read_qp_num(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->qp_num;
+}
+
+static uint32_t rxe_wc_read_src_qp(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->src_qp;
+}
+
+static int rxe_wc_read_wc_flags(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->wc_flags;
+}
+
+static uint32_t rxe_wc_read_slid(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->slid;
+}
+
+static uint8_t rxe_wc_read_sl(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->sl;
+}
+
+static uint8_t rxe_wc_read_dlid_path_bits(struct ibv_cq_ex *ibcq)
+{
+	return to_rcq_ex(ibcq)->cur_wc->dlid_path_bits;
+}
+
+enum {
+	RXE_CQ_SUPPORTED_COMP_MASK = IBV_CQ_INIT_ATTR_MASK_FLAGS |
+				     IBV_CQ_INIT_ATTR_MASK_PD,
+	RXE_CQ_SUPPORTED_FLAGS = IBV_CREATE_CQ_ATTR_SINGLE_THREADED,
+	RXE_CQ_SUPPORTED_WC_FLAGS = IBV_WC_STANDARD_FLAGS,
+};
+
+static struct ibv_cq_ex *rxe_create_cq_ex(struct ibv_context *context,
+					  struct ibv_cq_init_attr_ex *attr)
+{
+	struct rxe_cq *cq;
+	bool need_lock = true;
+
+	if (attr->comp_mask & ~RXE_CQ_SUPPORTED_COMP_MASK ||
+	    (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
+	     attr->flags & ~RXE_CQ_SUPPORTED_FLAGS)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* The kernel does not report completion timestamps or tags */
+	if (attr->wc_flags & ~RXE_CQ_SUPPORTED_WC_FLAGS) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_PD) {
+		if (!attr->parent_domain ||
+		    !to_rpd(attr->parent_domain)->protection_domain ||
+		    attr->parent_domain->context != context) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (rxe_pd_has_td(attr->parent_domain))
+			need_lock = false;
+	}
+
+	if (attr->comp_mask & IBV_CQ_INIT_ATTR_MASK_FLAGS &&
+	    attr->flags & IBV_CREATE_CQ_ATTR_SINGLE_THREADED)
+		need_lock = false;
+
+	cq = create_cq(context, attr->cqe, attr->channel, attr->comp_vector,
+		       need_lock);
+	if (!cq)
+		return NULL;
+
+	cq->ibv_cq_ex.start_poll = rxe_start_poll;
+	cq->ibv_cq_ex.next_poll = rxe_next_poll;
+	cq->ibv_cq_ex.end_poll = rxe_end_poll;
+	cq->ibv_cq_ex.read_opcode = rxe_wc_read_opcode;
+	cq->ibv_cq_ex.read_vendor_err = rxe_wc_read_vendor_err;
+	cq->ibv_cq_ex.read_wc_flags = rxe_wc_read_wc_flags;
+	if (attr->wc_flags & IBV_WC_EX_WITH_BYTE_LEN)
+		cq->ibv_cq_ex.read_byte_len = rxe_wc_read_byte_len;
+	if (attr->wc_flags & IBV_WC_EX_WITH_IMM)
+		cq->ibv_cq_ex.read_imm_data = rxe_wc_read_imm_data;
+	if (attr->wc_flags & IBV_WC_EX_WITH_QP_NUM)
+		cq->ibv_cq_ex.read_qp_num = rxe_wc_read_qp_num;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SRC_QP)
+		cq->ibv_cq_ex.read_src_qp = rxe_wc_read_src_qp;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SLID)
+		cq->ibv_cq_ex.read_slid = rxe_wc_read_slid;
+	if (attr->wc_flags & IBV_WC_EX_WITH_SL)
+		cq->ibv_cq_ex.read_sl = rxe_wc_read_sl;
+	if (attr->wc_flags & IBV_WC_EX_WITH_DLID_PATH_BITS)
+		cq->ibv_cq_ex.read_dlid_path_bits = rxe_wc_read_dlid_path_bits;
+
+	return &cq->ibv_cq_ex;
+}
+
 static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
@@ -250,23 +523,29 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
 	struct rxe_queue *q;
-	int npolled;
-	uint8_t *src;
+	uint32_t cons;
+	int npolled, avail;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_cq_lock(cq);
 	q = cq->queue;
 
-	for (npolled = 0; npolled < ne; ++npolled, ++wc) {
-		if (queue_empty(q))
-			break;
+	/* Consume all the CQEs available up to ne with one index update */
+	cons = atomic_load_explicit(&q->consumer_index, memory_order_relaxed);
+	avail = (atomic_load_explicit(&q->producer_index,
+				      memory_order_acquire) - cons) &
+		q->index_mask;
+	if (avail < ne)
+		ne = avail;
 
-		atomic_thread_fence(memory_order_acquire);
-		src = consumer_addr(q);
-		memcpy(wc, src, sizeof(*wc));
-		advance_consumer(q);
-	}
+	for (npolled = 0; npolled < ne; ++npolled, ++wc)
+		memcpy(wc, addr_from_index(q, cons + npolled), sizeof(*wc));
 
-	pthread_spin_unlock(&cq->lock);
+	if (npolled)
+		atomic_store_explicit(&q->consumer_index,
+				      (cons + npolled) & q->index_mask,
+				      memory_order_release);
+
+	rxe_cq_unlock(cq);
 	return npolled;
 }
 
@@ -301,6 +580,7 @@ static struct ibv_srq *rxe_create_srq(struct ibv_pd *pd,
 
 	srq->mmap_info = resp.mi;
 	srq->rq.max_sge = attr->attr.max_sge;
+	srq->rq.need_lock = !rxe_pd_has_td(pd);
 	pthread_spin_init(&srq->rq.lock, PTHREAD_PROCESS_PRIVATE);
 
 	return &srq->ibv_srq;
@@ -371,25 +651,32 @@ static int rxe_destroy_srq(struct ibv_srq *ibvsrq)
 	return ret;
 }
 
-static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr)
+/*
+ * Whether the slot at index of a queue can be filled.  The consumer index
+ * that the kernel moves is only read again when the copy in *cons says
+ * that the queue is full.
+ */
+static inline bool wq_has_room(struct rxe_queue *q, uint32_t index,
+			       uint32_t *cons)
+{
+	if ((index + 1 - *cons) & q->index_mask)
+		return true;
+
+	*cons = atomic_load_explicit(&q->consumer_index, memory_order_acquire);
+	return (index + 1 - *cons) & q->index_mask;
+}
+
+static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr,
+			     uint32_t index)
 {
-	int i;
 	struct rxe_recv_wqe *wqe;
-	struct rxe_queue *q = rq->queue;
 	int length = 0;
-	int rc = 0;
-
-	if (queue_full(q)) {
-		rc  = -ENOMEM;
-		goto out;
-	}
+	int i;
 
-	if (recv_wr->num_sge > rq->max_sge) {
-		rc = -EINVAL;
-		goto out;
-	}
+	if (recv_wr->num_sge > rq->max_sge)
+		return -EINVAL;
 
-	wqe = (struct rxe_recv_wqe *)producer_addr(q);
+	wqe = addr_from_index(rq->queue, index);
 
 	wqe->wr_id = recv_wr->wr_id;
 	wqe->num_sge = recv_wr->num_sge;
@@ -407,53 +694,98 @@ static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr)
 	wqe->dma.num_sge = wqe->num_sge;
 	wqe->dma.sge_offset = 0;
 
-	advance_producer(q);
-
-out:
-	return rc;
+	return 0;
 }
 
-static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
-			     struct ibv_recv_wr *recv_wr,
-			     struct ibv_recv_wr **bad_recv_wr)
+/*
+ * The WQEs of a list are written after the producer index, which is then
+ * moved once over all of them.
+ */
+static int post_recv_list(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr,
+			  struct ibv_recv_wr **bad_wr)
 {
-	struct rxe_srq *srq = to_rsrq(ibvsrq);
+	struct rxe_queue *q = rq->queue;
+	struct ibv_recv_wr *first = recv_wr;
+	uint32_t index, cons;
 	int rc = 0;
 
-	pthread_spin_lock(&srq->rq.lock);
+	rxe_wq_lock(rq);
+
+	index = atomic_load_explicit(&q->producer_index, memory_order_relaxed);
+	cons = atomic_load_explicit(&q->consumer_index, memory_order_acquire);
 
 	while (recv_wr) {
-		rc = rxe_post_one_recv(&srq->rq, recv_wr);
+		if (!wq_has_room(q, index, &cons))
+			rc = -ENOMEM;
+		else
+			rc = rxe_post_one_recv(rq, recv_wr, index);
 		if (rc) {
-			*bad_recv_wr = recv_wr;
+			*bad_wr = recv_wr;
 			break;
 		}
 
+		index = next_index(q, index);
 		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&srq->rq.lock);
+	if (recv_wr != first)
+		atomic_store_explicit(&q->producer_index, index,
+				      memory_order_release);
+
+	rxe_wq_unlock(rq);
 
 	return rc;
 }
 
-static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
-				    struct ibv_qp_init_attr *attr)
+static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
+			     struct ibv_recv_wr *recv_wr,
+			     struct ibv_recv_wr **bad_recv_wr)
+{
+	struct rxe_srq *srq = to_rsrq(ibvsrq);
+
+	return post_recv_list(&srq->rq, recv_wr, bad_recv_wr);
+}
+
+static int rxe_qp_fill_wr_pfns(struct rxe_qp *qp,
+			       struct ibv_qp_init_attr_ex *attr);
+
+static struct ibv_qp *create_qp(struct ibv_context *context,
+				struct ibv_qp_init_attr_ex *attr)
 {
 	struct ibv_create_qp cmd;
 	struct rxe_create_qp_resp resp;
 	struct rxe_qp *qp;
+	bool in_td;
 	int ret;
 
-	qp = malloc(sizeof *qp);
+	if (attr->comp_mask & ~(IBV_QP_INIT_ATTR_PD |
+				IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	in_td = attr->comp_mask & IBV_QP_INIT_ATTR_PD && rxe_pd_has_td(attr->pd);
+
+	qp = calloc(1, sizeof *qp);
 	if (!qp) {
 		return NULL;
 	}
 
-	ret = ibv_cmd_create_qp(pd, &qp->ibv_qp, attr, &cmd, sizeof cmd,
-				&resp.ibv_resp, sizeof resp);
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS) {
+		ret = rxe_qp_fill_wr_pfns(qp, attr);
+		if (ret) {
+			free(qp);
+			errno = ret;
+			return NULL;
+		}
+	}
+
+	ret = ibv_cmd_create_qp_ex(context, &qp->vqp, sizeof(qp->vqp), attr,
+				   &cmd, sizeof cmd, &resp.ibv_resp,
+				   sizeof resp);
 	if (ret) {
 		free(qp);
+		errno = ret;
 		return NULL;
 	}
 
@@ -465,14 +797,15 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 		qp->rq.max_sge = attr->cap.max_recv_sge;
 		qp->rq.queue = mmap(NULL, resp.rq_mi.size, PROT_READ | PROT_WRITE,
 				    MAP_SHARED,
-				    pd->context->cmd_fd, resp.rq_mi.offset);
+				    context->cmd_fd, resp.rq_mi.offset);
 		if ((void *)qp->rq.queue == MAP_FAILED) {
-			ibv_cmd_destroy_qp(&qp->ibv_qp);
+			ibv_cmd_destroy_qp(&qp->vqp.qp);
 			free(qp);
 			return NULL;
 		}
 
 		qp->rq_mmap_info = resp.rq_mi;
+		qp->rq.need_lock = !in_td;
 		pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE);
 	}
 
@@ -480,19 +813,46 @@ static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
 	qp->sq.max_inline = attr->cap.max_inline_data;
 	qp->sq.queue = mmap(NULL, resp.sq_mi.size, PROT_READ | PROT_WRITE,
 			    MAP_SHARED,
-			    pd->context->cmd_fd, resp.sq_mi.offset);
+			    context->cmd_fd, resp.sq_mi.offset);
 	if ((void *)qp->sq.queue == MAP_FAILED) {
 		if (qp->rq_mmap_info.size)
 			munmap(qp->rq.queue, qp->rq_mmap_info.size);
-		ibv_cmd_destroy_qp(&qp->ibv_qp);
+		ibv_cmd_destroy_qp(&qp->vqp.qp);
 		free(qp);
 		return NULL;
 	}
 
 	qp->sq_mmap_info = resp.sq_mi;
+	qp->sq.need_lock = !in_td;
 	pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE);
 
-	return &qp->ibv_qp;
+	if (attr->comp_mask & IBV_QP_INIT_ATTR_SEND_OPS_FLAGS)
+		qp->vqp.comp_mask |= VERBS_QP_EX;
+
+	return &qp->vqp.qp;
+}
+
+static struct ibv_qp *rxe_create_qp(struct ibv_pd *pd,
+				    struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_init_attr_ex attr_ex = {};
+	struct ibv_qp *qp;
+
+	memcpy(&attr_ex, attr, sizeof(*attr));
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD;
+	attr_ex.pd = pd;
+
+	qp = create_qp(pd->context, &attr_ex);
+	if (qp)
+		memcpy(attr, &attr_ex, sizeof(*attr));
+
+	return qp;
+}
+
+static struct ibv_qp *rxe_create_qp_ex(struct ibv_context *context,
+				       struct ibv_qp_init_attr_ex *attr)
+{
+	return create_qp(context, attr);
 }
 
 static int rxe_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
@@ -532,98 +892,83 @@ static int rxe_destroy_qp(struct ibv_qp *ibv_qp)
 	return ret;
 }
 
-/* basic sanity checks for send work request */
-static int validate_send_wr(struct rxe_wq *sq, struct ibv_send_wr *ibwr,
-			    unsigned int length)
+/*
+ * Build the WQE of a work request in the slot at index.  Only the fields
+ * that the kernel reads for the opcode are written, the rest of the slot is
+ * left as it was.
+ */
+static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
+			 struct ibv_send_wr *ibwr, uint32_t index)
 {
-	enum ibv_wr_opcode opcode = ibwr->opcode;
-
-	if (ibwr->num_sge > sq->max_sge)
-		return -EINVAL;
-
-	if ((opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
-	    || (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD))
-		if (length < 8 || ibwr->wr.atomic.remote_addr & 0x7)
-			return -EINVAL;
+	struct rxe_send_wqe *wqe = addr_from_index(sq->queue, index);
+	int num_sge = ibwr->num_sge;
+	unsigned int length = 0;
+	int i;
 
-	if ((ibwr->send_flags & IBV_SEND_INLINE) && (length > sq->max_inline))
+	if (num_sge > sq->max_sge)
 		return -EINVAL;
 
-	return 0;
-}
+	if (ibwr->send_flags & IBV_SEND_INLINE) {
+		uint8_t *inline_data = wqe->dma.inline_data;
 
-static void convert_send_wr(struct rxe_send_wr *kwr, struct ibv_send_wr *uwr)
-{
-	memset(kwr, 0, sizeof(*kwr));
+		for (i = 0; i < num_sge; i++)
+			length += ibwr->sg_list[i].length;
+		if (length > sq->max_inline)
+			return -EINVAL;
 
-	kwr->wr_id		= uwr->wr_id;
-	kwr->num_sge		= uwr->num_sge;
-	kwr->opcode		= uwr->opcode;
-	kwr->send_flags		= uwr->send_flags;
-	kwr->ex.imm_data	= uwr->imm_data;
+		for (i = 0; i < num_sge; i++) {
+			memcpy(inline_data,
+			       (uint8_t *)(uintptr_t)ibwr->sg_list[i].addr,
+			       ibwr->sg_list[i].length);
+			inline_data += ibwr->sg_list[i].length;
+		}
+	} else {
+		memcpy(wqe->dma.sge, ibwr->sg_list,
+		       num_sge*sizeof(struct ibv_sge));
+		for (i = 0; i < num_sge; i++)
+			length += ibwr->sg_list[i].length;
+	}
 
-	switch(uwr->opcode) {
+	switch (ibwr->opcode) {
 	case IBV_WR_RDMA_WRITE:
 	case IBV_WR_RDMA_WRITE_WITH_IMM:
 	case IBV_WR_RDMA_READ:
-		kwr->wr.rdma.remote_addr	= uwr->wr.rdma.remote_addr;
-		kwr->wr.rdma.rkey		= uwr->wr.rdma.rkey;
-		break;
-
-	case IBV_WR_SEND:
-	case IBV_WR_SEND_WITH_IMM:
-		kwr->wr.ud.remote_qpn		= uwr->wr.ud.remote_qpn;
-		kwr->wr.ud.remote_qkey		= uwr->wr.ud.remote_qkey;
+		wqe->wr.wr.rdma.remote_addr	= ibwr->wr.rdma.remote_addr;
+		wqe->wr.wr.rdma.rkey		= ibwr->wr.rdma.rkey;
+		wqe->iova			= ibwr->wr.rdma.remote_addr;
 		break;
 
 	case IBV_WR_ATOMIC_CMP_AND_SWP:
 	case IBV_WR_ATOMIC_FETCH_AND_ADD:
-		kwr->wr.atomic.remote_addr	= uwr->wr.atomic.remote_addr;
-		kwr->wr.atomic.compare_add	= uwr->wr.atomic.compare_add;
-		kwr->wr.atomic.swap		= uwr->wr.atomic.swap;
-		kwr->wr.atomic.rkey		= uwr->wr.atomic.rkey;
-		break;
-
-	case IBV_WR_LOCAL_INV:
-	case IBV_WR_BIND_MW:
-	case IBV_WR_SEND_WITH_INV:
-	case IBV_WR_TSO:
+		if (length < 8 || ibwr->wr.atomic.remote_addr & 0x7)
+			return -EINVAL;
+		wqe->wr.wr.atomic.remote_addr	= ibwr->wr.atomic.remote_addr;
+		wqe->wr.wr.atomic.compare_add	= ibwr->wr.atomic.compare_add;
+		wqe->wr.wr.atomic.swap		= ibwr->wr.atomic.swap;
+		wqe->wr.wr.atomic.rkey		= ibwr->wr.atomic.rkey;
+		wqe->iova			= ibwr->wr.atomic.remote_addr;
 		break;
-	}
-}
-
-static int init_send_wqe(struct rxe_qp *qp, struct rxe_wq *sq,
-		  struct ibv_send_wr *ibwr, unsigned int length,
-		  struct rxe_send_wqe *wqe)
-{
-	int num_sge = ibwr->num_sge;
-	int i;
-	unsigned int opcode = ibwr->opcode;
 
-	convert_send_wr(&wqe->wr, ibwr);
-
-	if (qp_type(qp) == IBV_QPT_UD)
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		if (qp_type(qp) != IBV_QPT_UD)
+			break;
+		wqe->wr.wr.ud.remote_qpn	= ibwr->wr.ud.remote_qpn;
+		wqe->wr.wr.ud.remote_qkey	= ibwr->wr.ud.remote_qkey;
+		wqe->wr.wr.ud.pkey_index	= 0;
 		memcpy(&wqe->av, &to_rah(ibwr->wr.ud.ah)->av,
 		       sizeof(struct rxe_av));
+		break;
 
-	if (ibwr->send_flags & IBV_SEND_INLINE) {
-		uint8_t *inline_data = wqe->dma.inline_data;
-
-		for (i = 0; i < num_sge; i++) {
-			memcpy(inline_data,
-			       (uint8_t *)(long)ibwr->sg_list[i].addr,
-			       ibwr->sg_list[i].length);
-			inline_data += ibwr->sg_list[i].length;
-		}
-	} else
-		memcpy(wqe->dma.sge, ibwr->sg_list,
-		       num_sge*sizeof(struct ibv_sge));
+	default:
+		break;
+	}
 
-	if ((opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
-	    || (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD))
-		wqe->iova	= ibwr->wr.atomic.remote_addr;
-	else
-		wqe->iova	= ibwr->wr.rdma.remote_addr;
+	wqe->wr.wr_id		= ibwr->wr_id;
+	wqe->wr.num_sge		= num_sge;
+	wqe->wr.opcode		= ibwr->opcode;
+	wqe->wr.send_flags	= ibwr->send_flags;
+	wqe->wr.ex.imm_data	= ibwr->imm_data;
 	wqe->dma.length		= length;
 	wqe->dma.resid		= length;
 	wqe->dma.num_sge	= num_sge;
@@ -635,37 +980,6 @@ static int init_send_wqe(struct rxe_qp *qp, struct rxe_wq *sq,
 	return 0;
 }
 
-static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
-			 struct ibv_send_wr *ibwr)
-{
-	int err;
-	struct rxe_send_wqe *wqe;
-	unsigned int length = 0;
-	int i;
-
-	for (i = 0; i < ibwr->num_sge; i++)
-		length += ibwr->sg_list[i].length;
-
-	err = validate_send_wr(sq, ibwr, length);
-	if (err) {
-		printf("validate send failed\n");
-		return err;
-	}
-
-	wqe = (struct rxe_send_wqe *)producer_addr(sq->queue);
-
-	err = init_send_wqe(qp, sq, ibwr, length, wqe);
-	if (err)
-		return err;
-
-	if (queue_full(sq->queue))
-		return -ENOMEM;
-
-	advance_producer(sq->queue);
-
-	return 0;
-}
-
 /* send a null post send as a doorbell */
 static int post_send_db(struct ibv_qp *ibqp)
 {
@@ -687,6 +1001,53 @@ static int post_send_db(struct ibv_qp *ibqp)
 	return 0;
 }
 
+/*
+ * The kernel requester of a user QP runs in the write() that rings the
+ * doorbell, and sends every WQE that it finds in the send queue, including
+ * those posted while it runs.  So a thread that posts while another one is
+ * ringing the doorbell of the QP leaves the ringing to it: the ringing
+ * thread rings once more for all the posts made while it was in the
+ * kernel, instead of each of them making its own syscall.  A doorbell
+ * failure is then returned to the ringing thread only.
+ *
+ * So that a thread does not keep ringing for others under a steady stream
+ * of posts, it rings at most RXE_DB_PASSES times, then clears the count so
+ * that later posts ring for themselves, and rings a last time if posts
+ * came in during its last pass.
+ */
+#define RXE_DB_PASSES	4
+
+static int ring_send_db(struct rxe_qp *qp)
+{
+	unsigned int pending = 1, pass;
+	int err = 0, ret;
+
+	if (!qp->sq.need_lock)
+		return post_send_db(&qp->vqp.qp);
+
+	if (atomic_fetch_add(&qp->db_pending, 1))
+		return 0;
+
+	for (pass = 1; ; pass++) {
+		ret = post_send_db(&qp->vqp.qp);
+		if (ret)
+			err = ret;
+		if (pass == RXE_DB_PASSES)
+			break;
+		pending = atomic_fetch_sub(&qp->db_pending, pending) - pending;
+		if (!pending)
+			return err;
+	}
+
+	if (atomic_exchange(&qp->db_pending, 0) != pending) {
+		ret = post_send_db(&qp->vqp.qp);
+		if (ret)
+			err = ret;
+	}
+
+	return err;
+}
+
 /* this API does not make a distinction between
    restartable and non-restartable errors */
 static int rxe_post_send(struct ibv_qp *ibqp,
@@ -697,6 +1058,8 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	int err;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	struct ibv_send_wr *first = wr_list;
+	uint32_t index, cons;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -706,29 +1069,426 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	if (!sq || !wr_list || !sq->queue)
 	 	return EINVAL;
 
-	pthread_spin_lock(&sq->lock);
+	rxe_wq_lock(sq);
+
+	index = atomic_load_explicit(&sq->queue->producer_index,
+				     memory_order_relaxed);
+	cons = atomic_load_explicit(&sq->queue->consumer_index,
+				    memory_order_acquire);
 
 	while (wr_list) {
-		rc = post_one_send(qp, sq, wr_list);
+		if (!wq_has_room(sq->queue, index, &cons))
+			rc = -ENOMEM;
+		else
+			rc = post_one_send(qp, sq, wr_list, index);
 		if (rc) {
 			*bad_wr = wr_list;
 			break;
 		}
 
+		index = next_index(sq->queue, index);
 		wr_list = wr_list->next;
 	}
 
-	pthread_spin_unlock(&sq->lock);
+	/* Make the whole list visible to the kernel at once */
+	if (wr_list != first)
+		atomic_store_explicit(&sq->queue->producer_index, index,
+				      memory_order_release);
 
-	err =  post_send_db(ibqp);
+	rxe_wq_unlock(sq);
+
+	if (wr_list == first)
+		return rc;
+
+	err = ring_send_db(qp);
 	return err ? err : rc;
 }
 
+/*
+ * Work request builder.  The opcode call claims the next WQE of the send
+ * queue and the setters fill in its data and address.  The WQEs are only
+ * made visible to the kernel by wr_complete, which moves the producer index
+ * over the whole batch and rings the doorbell once.
+ */
+static inline struct rxe_qp *wr_to_rqp(struct ibv_qp_ex *ibqp)
+{
+	return to_rqp(&ibqp->qp_base);
+}
+
+static inline struct rxe_send_wqe *wr_begin(struct ibv_qp_ex *ibqp,
+					    enum ibv_wr_opcode opcode)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_queue *q = qp->sq.queue;
+	struct rxe_send_wqe *wqe;
+
+	if (qp->wr_err)
+		return NULL;
+
+	if (((qp->cur_index + 1 - atomic_load(&q->consumer_index)) &
+	     q->index_mask) == 0) {
+		qp->wr_err = ENOMEM;
+		return NULL;
+	}
+
+	wqe = addr_from_index(q, qp->cur_index);
+	memset(wqe, 0, sizeof(*wqe));
+
+	wqe->wr.wr_id = ibqp->wr_id;
+	wqe->wr.opcode = opcode;
+	wqe->wr.send_flags = ibqp->wr_flags & ~IBV_SEND_INLINE;
+	wqe->ssn = qp->ssn++;
+
+	qp->cur_wqe = wqe;
+	qp->cur_index = next_index(q, qp->cur_index);
+
+	return wqe;
+}
+
+static void rxe_wr_send(struct ibv_qp_ex *ibqp)
+{
+	wr_begin(ibqp, IBV_WR_SEND);
+}
+
+static void rxe_wr_send_imm(struct ibv_qp_ex *ibqp, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe = wr_begin(ibqp, IBV_WR_SEND_WITH_IMM);
+
+	if (wqe)
+		wqe->wr.ex.imm_data = imm_data;
+}
+
+static void rxe_wr_send_inv(struct ibv_qp_ex *ibqp, uint32_t invalidate_rkey)
+{
+	struct rxe_send_wqe *wqe = wr_begin(ibqp, IBV_WR_SEND_WITH_INV);
+
+	if (wqe)
+		wqe->wr.ex.invalidate_rkey = invalidate_rkey;
+}
+
+static void rxe_wr_local_inv(struct ibv_qp_ex *ibqp, uint32_t invalidate_rkey)
+{
+	struct rxe_send_wqe *wqe = wr_begin(ibqp, IBV_WR_LOCAL_INV);
+
+	if (wqe)
+		wqe->wr.ex.invalidate_rkey = invalidate_rkey;
+}
+
+static inline struct rxe_send_wqe *wr_rdma(struct ibv_qp_ex *ibqp,
+					   enum ibv_wr_opcode opcode,
+					   uint32_t rkey, uint64_t remote_addr)
+{
+	struct rxe_send_wqe *wqe = wr_begin(ibqp, opcode);
+
+	if (wqe) {
+		wqe->wr.wr.rdma.remote_addr = remote_addr;
+		wqe->wr.wr.rdma.rkey = rkey;
+		wqe->iova = remote_addr;
+	}
+
+	return wqe;
+}
+
+static void rxe_wr_rdma_write(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			      uint64_t remote_addr)
+{
+	wr_rdma(ibqp, IBV_WR_RDMA_WRITE, rkey, remote_addr);
+}
+
+static void rxe_wr_rdma_write_imm(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				  uint64_t remote_addr, __be32 imm_data)
+{
+	struct rxe_send_wqe *wqe;
+
+	wqe = wr_rdma(ibqp, IBV_WR_RDMA_WRITE_WITH_IMM, rkey, remote_addr);
+	if (wqe)
+		wqe->wr.ex.imm_data = imm_data;
+}
+
+static void rxe_wr_rdma_read(struct ibv_qp_ex *ibqp, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	wr_rdma(ibqp, IBV_WR_RDMA_READ, rkey, remote_addr);
+}
+
+static inline void wr_atomic(struct ibv_qp_ex *ibqp, enum ibv_wr_opcode opcode,
+			     uint32_t rkey, uint64_t remote_addr,
+			     uint64_t compare_add, uint64_t swap)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe;
+
+	if (!qp->wr_err && (remote_addr & 0x7)) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+
+	wqe = wr_begin(ibqp, opcode);
+	if (!wqe)
+		return;
+
+	wqe->wr.wr.atomic.remote_addr = remote_addr;
+	wqe->wr.wr.atomic.compare_add = compare_add;
+	wqe->wr.wr.atomic.swap = swap;
+	wqe->wr.wr.atomic.rkey = rkey;
+	wqe->iova = remote_addr;
+}
+
+static void rxe_wr_atomic_cmp_swp(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare,
+				  uint64_t swap)
+{
+	wr_atomic(ibqp, IBV_WR_ATOMIC_CMP_AND_SWP, rkey, remote_addr, compare,
+		  swap);
+}
+
+static void rxe_wr_atomic_fetch_add(struct ibv_qp_ex *ibqp, uint32_t rkey,
+				    uint64_t remote_addr, uint64_t add)
+{
+	wr_atomic(ibqp, IBV_WR_ATOMIC_FETCH_AND_ADD, rkey, remote_addr, add,
+		  0);
+}
+
+static void rxe_wr_set_ud_addr(struct ibv_qp_ex *ibqp, struct ibv_ah *ah,
+			       uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = qp->cur_wqe;
+
+	if (qp->wr_err)
+		return;
+
+	memcpy(&wqe->av, &to_rah(ah)->av, sizeof(wqe->av));
+	wqe->wr.wr.ud.remote_qpn = remote_qpn;
+	wqe->wr.wr.ud.remote_qkey = remote_qkey;
+}
+
+static inline bool wr_is_atomic(struct rxe_send_wqe *wqe)
+{
+	return wqe->wr.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+	       wqe->wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD;
+}
+
+static inline void wr_set_length(struct rxe_qp *qp, struct rxe_send_wqe *wqe,
+				 unsigned int num_sge, unsigned int length)
+{
+	if (wr_is_atomic(wqe) && length < 8) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+
+	wqe->wr.num_sge = num_sge;
+	wqe->dma.length = length;
+	wqe->dma.resid = length;
+	wqe->dma.num_sge = num_sge;
+}
+
+static void rxe_wr_set_sge(struct ibv_qp_ex *ibqp, uint32_t lkey,
+			   uint64_t addr, uint32_t length)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = qp->cur_wqe;
+
+	if (qp->wr_err)
+		return;
+
+	wqe->dma.sge[0].addr = addr;
+	wqe->dma.sge[0].length = length;
+	wqe->dma.sge[0].lkey = lkey;
+	wr_set_length(qp, wqe, 1, length);
+}
+
+static void rxe_wr_set_sge_list(struct ibv_qp_ex *ibqp, size_t num_sge,
+				const struct ibv_sge *sg_list)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = qp->cur_wqe;
+	unsigned int length = 0;
+	size_t i;
+
+	if (qp->wr_err)
+		return;
+
+	if (num_sge > qp->sq.max_sge) {
+		qp->wr_err = EINVAL;
+		return;
+	}
+
+	for (i = 0; i < num_sge; i++)
+		length += sg_list[i].length;
+
+	memcpy(wqe->dma.sge, sg_list, num_sge * sizeof(struct ibv_sge));
+	wr_set_length(qp, wqe, num_sge, length);
+}
+
+static void rxe_wr_set_inline_data(struct ibv_qp_ex *ibqp, void *addr,
+				   size_t length)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = qp->cur_wqe;
+
+	if (qp->wr_err)
+		return;
+
+	if (length > qp->sq.max_inline) {
+		qp->wr_err = ENOMEM;
+		return;
+	}
+
+	memcpy(wqe->dma.inline_data, addr, length);
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	wr_set_length(qp, wqe, 0, length);
+}
+
+static void rxe_wr_set_inline_data_list(struct ibv_qp_ex *ibqp, size_t num_buf,
+					const struct ibv_data_buf *buf_list)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_send_wqe *wqe = qp->cur_wqe;
+	uint8_t *inline_data = wqe->dma.inline_data;
+	size_t length = 0;
+	size_t i;
+
+	if (qp->wr_err)
+		return;
+
+	for (i = 0; i < num_buf; i++) {
+		length += buf_list[i].length;
+		if (length > qp->sq.max_inline) {
+			qp->wr_err = ENOMEM;
+			return;
+		}
+		memcpy(inline_data, buf_list[i].addr, buf_list[i].length);
+		inline_data += buf_list[i].length;
+	}
+
+	wqe->wr.send_flags |= IBV_SEND_INLINE;
+	wr_set_length(qp, wqe, 0, length);
+}
+
+static void rxe_wr_start(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+
+	rxe_wq_lock(&qp->sq);
+
+	qp->cur_index = atomic_load_explicit(&qp->sq.queue->producer_index,
+					     memory_order_relaxed);
+	qp->ssn_rb = qp->ssn;
+	qp->wr_err = 0;
+}
+
+static void rxe_wr_abort(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+
+	qp->ssn = qp->ssn_rb;
+	rxe_wq_unlock(&qp->sq);
+}
+
+static int rxe_wr_complete(struct ibv_qp_ex *ibqp)
+{
+	struct rxe_qp *qp = wr_to_rqp(ibqp);
+	struct rxe_queue *q = qp->sq.queue;
+	bool posted;
+	int err;
+
+	if (qp->wr_err) {
+		err = qp->wr_err;
+		rxe_wr_abort(ibqp);
+		return err;
+	}
+
+	posted = qp->cur_index != atomic_load_explicit(&q->producer_index,
+						       memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store(&q->producer_index, qp->cur_index);
+
+	rxe_wq_unlock(&qp->sq);
+
+	return posted ? ring_send_db(qp) : 0;
+}
+
+enum {
+	RXE_SUPPORTED_SEND_OPS_FLAGS_RC =
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM |
+		IBV_QP_EX_WITH_RDMA_READ |
+		IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP |
+		IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD |
+		IBV_QP_EX_WITH_LOCAL_INV |
+		IBV_QP_EX_WITH_SEND_WITH_INV,
+	RXE_SUPPORTED_SEND_OPS_FLAGS_UC =
+		IBV_QP_EX_WITH_RDMA_WRITE |
+		IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM,
+	RXE_SUPPORTED_SEND_OPS_FLAGS_UD =
+		IBV_QP_EX_WITH_SEND |
+		IBV_QP_EX_WITH_SEND_WITH_IMM,
+};
+
+static int rxe_qp_fill_wr_pfns(struct rxe_qp *qp,
+			       struct ibv_qp_init_attr_ex *attr)
+{
+	struct ibv_qp_ex *ibqp = &qp->vqp.qp_ex;
+	uint64_t ops = attr->send_ops_flags;
+	uint64_t supported;
+
+	switch (attr->qp_type) {
+	case IBV_QPT_RC:
+		supported = RXE_SUPPORTED_SEND_OPS_FLAGS_RC;
+		break;
+	case IBV_QPT_UC:
+		supported = RXE_SUPPORTED_SEND_OPS_FLAGS_UC;
+		break;
+	case IBV_QPT_UD:
+		supported = RXE_SUPPORTED_SEND_OPS_FLAGS_UD;
+		ibqp->wr_set_ud_addr = rxe_wr_set_ud_addr;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	if (ops & ~supported)
+		return EOPNOTSUPP;
+
+	ibqp->wr_start = rxe_wr_start;
+	ibqp->wr_complete = rxe_wr_complete;
+	ibqp->wr_abort = rxe_wr_abort;
+	ibqp->wr_set_sge = rxe_wr_set_sge;
+	ibqp->wr_set_sge_list = rxe_wr_set_sge_list;
+	ibqp->wr_set_inline_data = rxe_wr_set_inline_data;
+	ibqp->wr_set_inline_data_list = rxe_wr_set_inline_data_list;
+
+	if (ops & IBV_QP_EX_WITH_SEND)
+		ibqp->wr_send = rxe_wr_send;
+	if (ops & IBV_QP_EX_WITH_SEND_WITH_IMM)
+		ibqp->wr_send_imm = rxe_wr_send_imm;
+	if (ops & IBV_QP_EX_WITH_SEND_WITH_INV)
+		ibqp->wr_send_inv = rxe_wr_send_inv;
+	if (ops & IBV_QP_EX_WITH_LOCAL_INV)
+		ibqp->wr_local_inv = rxe_wr_local_inv;
+	if (ops & IBV_QP_EX_WITH_RDMA_WRITE)
+		ibqp->wr_rdma_write = rxe_wr_rdma_write;
+	if (ops & IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM)
+		ibqp->wr_rdma_write_imm = rxe_wr_rdma_write_imm;
+	if (ops & IBV_QP_EX_WITH_RDMA_READ)
+		ibqp->wr_rdma_read = rxe_wr_rdma_read;
+	if (ops & IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP)
+		ibqp->wr_atomic_cmp_swp = rxe_wr_atomic_cmp_swp;
+	if (ops & IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD)
+		ibqp->wr_atomic_fetch_add = rxe_wr_atomic_fetch_add;
+
+	return 0;
+}
+
 static int rxe_post_recv(struct ibv_qp *ibqp,
 			 struct ibv_recv_wr *recv_wr,
 			 struct ibv_recv_wr **bad_wr)
 {
-	int rc = 0;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *rq = &qp->rq;
 
@@ -740,21 +1500,7 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 	if (!rq || !recv_wr || !rq->queue)
 		return EINVAL;
 
-	pthread_spin_lock(&rq->lock);
-
-	while (recv_wr) {
-		rc = rxe_post_one_recv(rq, recv_wr);
-		if (rc) {
-			*bad_wr = recv_wr;
-			break;
-		}
-
-		recv_wr = recv_wr->next;
-	}
-
-	pthread_spin_unlock(&rq->lock);
-
-	return rc;
+	return post_recv_list(rq, recv_wr, bad_wr);
 }
 
 static inline int ipv6_addr_v4mapped(const struct in6_addr *a)
@@ -858,38 +1604,31 @@ static struct ibv_context_ops rxe_ctx_ops = {
 	.detach_mcast = ibv_cmd_detach_mcast
 };
 
-static struct ibv_context *rxe_alloc_context(struct ibv_device *ibdev,
-					     int cmd_fd)
+static int rxe_init_context(struct verbs_device *vdev,
+			    struct ibv_context *ibctx, int cmd_fd)
 {
-	struct rxe_context *context;
+	struct verbs_context *v_ctx = verbs_get_ctx(ibctx);
 	struct ibv_get_context cmd;
 	struct ibv_get_context_resp resp;
 
-	context = malloc(sizeof *context);
-	if (!context)
-		return NULL;
-
-	memset(context, 0, sizeof *context);
-	context->ibv_ctx.cmd_fd = cmd_fd;
+	ibctx->cmd_fd = cmd_fd;
 
-	if (ibv_cmd_get_context(&context->ibv_ctx, &cmd,
-				sizeof cmd, &resp, sizeof resp))
-		goto out;
-
-	context->ibv_ctx.ops = rxe_ctx_ops;
+	if (ibv_cmd_get_context(ibctx, &cmd, sizeof cmd, &resp, sizeof resp))
+		return errno;
 
-	return &context->ibv_ctx;
+	ibctx->ops = rxe_ctx_ops;
+	verbs_set_ctx_op(v_ctx, create_cq_ex, rxe_create_cq_ex);
+	verbs_set_ctx_op(v_ctx, create_qp_ex, rxe_create_qp_ex);
+	verbs_set_ctx_op(v_ctx, alloc_td, rxe_alloc_td);
+	verbs_set_ctx_op(v_ctx, dealloc_td, rxe_dealloc_td);
+	verbs_set_ctx_op(v_ctx, alloc_parent_domain, rxe_alloc_parent_domain);
 
-out:
-	free(context);
-	return NULL;
+	return 0;
 }
 
-static void rxe_free_context(struct ibv_context *ibctx)
+static void rxe_uninit_context(struct verbs_device *vdev,
+			       struct ibv_context *ibctx)
 {
-	struct rxe_context *context = to_rctx(ibctx);
-
-	free(context);
 }
 
 static void rxe_uninit_device(struct verbs_device *verbs_device)
@@ -907,6 +1646,9 @@ static struct verbs_device *rxe_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
 		return NULL;
 
 	dev->abi_version = sysfs_dev->abi_ver;
+	dev->ibv_dev.sz = sizeof(*dev);
+	dev->ibv_dev.size_of_context =
+		sizeof(struct rxe_context) - sizeof(struct ibv_context);
 
 	return &dev->ibv_dev;
 }
@@ -918,7 +1660,7 @@ static const struct verbs_device_ops rxe_dev_ops = {
 	.match_table = hca_table,
 	.alloc_device = rxe_device_alloc,
 	.uninit_device = rxe_uninit_device,
-	.alloc_context = rxe_alloc_context,
-	.free_context = rxe_free_context,
+	.init_context = rxe_init_context,
+	.uninit_context = rxe_uninit_context,
 };
 PROVIDER_DRIVER(rxe_dev_ops);
@@ -36,6 +36,8 @@
 #ifndef RXE_H
 #define RXE_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <infiniband/driver.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -57,11 +59,32 @@ struct rxe_context {
 	struct ibv_context	ibv_ctx;
 };
 
+struct rxe_td {
+	struct ibv_td		ibv_td;
+	atomic_int		refcount;
+};
+
+struct rxe_pd {
+	struct ibv_pd		ibv_pd;
+	atomic_int		refcount;
+	/* Set on parent domains only */
+	struct rxe_pd		*protection_domain;
+	struct rxe_td		*td;
+};
+
 struct rxe_cq {
-	struct ibv_cq		ibv_cq;
+	union {
+		struct ibv_cq		ibv_cq;
+		struct ibv_cq_ex	ibv_cq_ex;
+	};
 	struct mmap_info	mmap_info;
 	struct rxe_queue		*queue;
 	pthread_spinlock_t	lock;
+	bool			need_lock;
+	/* Extended polling, valid between start_poll and end_poll */
+	struct ibv_wc		*cur_wc;
+	uint32_t		cur_index;
+	uint32_t		prod_index;
 };
 
 struct rxe_ah {
@@ -72,20 +95,29 @@ struct rxe_ah {
 struct rxe_wq {
 	struct rxe_queue	*queue;
 	pthread_spinlock_t	lock;
+	bool			need_lock;	/* false in a thread domain */
 	unsigned int		max_sge;
 	unsigned int		max_inline;
 };
 
 struct rxe_qp {
-	struct ibv_qp		ibv_qp;
+	struct verbs_qp		vqp;
 	struct mmap_info	rq_mmap_info;
 	struct rxe_wq		rq;
 	struct mmap_info	sq_mmap_info;
 	struct rxe_wq		sq;
 	unsigned int		ssn;
+	/* Doorbells asked for while one is being rung */
+	atomic_uint		db_pending;
+
+	/* Work request builder state, under sq.lock */
+	struct rxe_send_wqe	*cur_wqe;
+	uint32_t		cur_index;
+	unsigned int		ssn_rb;
+	int			wr_err;
 };
 
-#define qp_type(qp)		((qp)->ibv_qp.qp_type)
+#define qp_type(qp)		((qp)->vqp.qp.qp_type)
 
 struct rxe_srq {
 	struct ibv_srq		ibv_srq;
@@ -108,14 +140,58 @@ static inline struct rxe_device *to_rdev(struct ibv_device *ibdev)
 	return to_rxxx(dev, device);
 }
 
+static inline struct rxe_td *to_rtd(struct ibv_td *ibtd)
+{
+	return to_rxxx(td, td);
+}
+
+static inline struct rxe_pd *to_rpd(struct ibv_pd *ibpd)
+{
+	return to_rxxx(pd, pd);
+}
+
+static inline bool rxe_pd_has_td(struct ibv_pd *ibpd)
+{
+	return ibpd && to_rpd(ibpd)->td;
+}
+
+static inline void rxe_wq_lock(struct rxe_wq *wq)
+{
+	if (wq->need_lock)
+		pthread_spin_lock(&wq->lock);
+}
+
+static inline void rxe_wq_unlock(struct rxe_wq *wq)
+{
+	if (wq->need_lock)
+		pthread_spin_unlock(&wq->lock);
+}
+
 static inline struct rxe_cq *to_rcq(struct ibv_cq *ibcq)
 {
 	return to_rxxx(cq, cq);
 }
 
+static inline struct rxe_cq *to_rcq_ex(struct ibv_cq_ex *ibcq)
+{
+	return container_of(ibcq, struct rxe_cq, ibv_cq_ex);
+}
+
+static inline void rxe_cq_lock(struct rxe_cq *cq)
+{
+	if (cq->need_lock)
+		pthread_spin_lock(&cq->lock);
+}
+
+static inline void rxe_cq_unlock(struct rxe_cq *cq)
+{
+	if (cq->need_lock)
+		pthread_spin_unlock(&cq->lock);
+}
+
 static inline struct rxe_qp *to_rqp(struct ibv_qp *ibqp)
 {
-	return to_rxxx(qp, qp);
+	return container_of(ibqp, struct rxe_qp, vqp.qp);
 }
 
 static inline struct rxe_srq *to_rsrq(struct ibv_srq *ibsrq)
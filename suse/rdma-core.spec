@@ -185,6 +185,7 @@ Device-specific plug-in ibverbs userspace drivers are included:
 - libhns: HiSilicon Hip06 SoC
 - libi40iw: Intel Ethernet Connection X722 RDMA
 - libipathverbs: QLogic InfiniPath HCA
+- libloopback: A userspace only loopback device for testing
 - libmlx4: Mellanox ConnectX-3 InfiniBand HCA
 - libmlx5: Mellanox Connect-IB/X-4+ InfiniBand HCA
 - libmthca: Mellanox InfiniBand HCA
@@ -557,7 +558,10 @@ rm -rf %{buildroot}/%{_sbindir}/srp_daemon.sh
 %doc %{_docdir}/%{name}-%{version}/rxe.md
 %doc %{_docdir}/%{name}-%{version}/udev.md
 %doc %{_docdir}/%{name}-%{version}/tag_matching.md
+%{_bindir}/loopback_sysfs
 %{_bindir}/rxe_cfg
+%{_mandir}/man1/loopback_sysfs*
+%{_mandir}/man7/loopback*
 %{_mandir}/man7/rxe*
 %{_mandir}/man8/rxe*
 